@@ -0,0 +1,41 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <cstdlib>
+#include <new>
+
+// Counts the heap allocations of a benchmark: the global operator new is
+// replaced, so include this in the benchmark's one translation unit only and
+// read allocations before and after the code measured.
+static unsigned long long allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    if (void *p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
@@ -0,0 +1,249 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "Face.h"
+
+#include "FaceRecord.hpp"
+
+using namespace affdex;
+
+//---------------------------------------------------------------------------
+// The overlay PlottingImageListener used to draw, kept to measure the
+// current one against:
+//  - drawBeforeSchema(): before the metric schema, with the metric names
+//    in std::vector<std::string> lists passed by value, the appearance
+//    names in std::maps and each Face copied;
+//  - drawPutText(): the schema-driven version that replaced it, which
+//    still rasterizes every line with cv::putText and every point with
+//    cv::circle, until OverlayRenderer.
+// Both draw every metric and appearance field, as the app did then.
+class LegacyOverlay {
+
+    const int spacing = 10;
+    const float font_size = 0.5f;
+    const int font = cv::FONT_HERSHEY_COMPLEX_SMALL;
+
+    std::vector<std::string> expressions;
+    std::vector<std::string> emotions;
+    std::vector<std::string> emojis;
+
+    std::map<affdex::Glasses, std::string> glassesMap;
+    std::map<affdex::Gender, std::string> genderMap;
+    std::map<affdex::Age, std::string> ageMap;
+    std::map<affdex::Ethnicity, std::string> ethnicityMap;
+
+public:
+
+    LegacyOverlay() {
+        for (int i = 0; i < NUM_METRICS; i++) {
+            if (METRICS[i].group == EMOTIONS) emotions.push_back(METRICS[i].name);
+            if (METRICS[i].group == EXPRESSIONS) expressions.push_back(METRICS[i].name);
+            if (METRICS[i].group == EMOJIS) emojis.push_back(METRICS[i].name);
+        }
+        genderMap = std::map<affdex::Gender, std::string> {
+                {affdex::Gender::Male,    "male"},
+                {affdex::Gender::Female,  "female"},
+                {affdex::Gender::Unknown, "unknown"}
+        };
+        glassesMap = std::map<affdex::Glasses, std::string> {
+                {affdex::Glasses::Yes, "yes"},
+                {affdex::Glasses::No,  "no"}
+        };
+        ageMap = std::map<affdex::Age, std::string> {
+                {affdex::Age::AGE_UNKNOWN,  "unknown"},
+                {affdex::Age::AGE_UNDER_18, "under 18"},
+                {affdex::Age::AGE_18_24,    "18-24"},
+                {affdex::Age::AGE_25_34,    "25-34"},
+                {affdex::Age::AGE_35_44,    "35-44"},
+                {affdex::Age::AGE_45_54,    "45-54"},
+                {affdex::Age::AGE_55_64,    "55-64"},
+                {affdex::Age::AGE_65_PLUS,  "65 plus"}
+        };
+        ethnicityMap = std::map<affdex::Ethnicity, std::string> {
+                {affdex::Ethnicity::UNKNOWN,       "unknown"},
+                {affdex::Ethnicity::CAUCASIAN,     "caucasian"},
+                {affdex::Ethnicity::BLACK_AFRICAN, "black african"},
+                {affdex::Ethnicity::SOUTH_ASIAN,   "south asian"},
+                {affdex::Ethnicity::EAST_ASIAN,    "east asian"},
+                {affdex::Ethnicity::HISPANIC,      "hispanic"}
+        };
+    }
+
+    void drawBeforeSchema(const std::map<FaceId, Face> &faces, cv::Mat img) {
+        cv::Scalar clr = cv::Scalar(0, 0, 255);
+        cv::Scalar header_clr = cv::Scalar(255, 0, 0);
+
+        for (auto &face_id_pair : faces) {
+            Face f = face_id_pair.second;
+            VecFeaturePoint points = f.featurePoints;
+            for (auto &point : points) {
+                cv::circle(img, cv::Point(point.x, point.y), 2.0f, cv::Scalar(0, 0, 255));
+            }
+            FeaturePoint tl = minPoint(points);
+            FeaturePoint br = maxPoint(points);
+
+            int padding = tl.y + 10;
+
+            cv::putText(img, "APPEARANCE", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
+            cv::putText(img, genderMap[f.appearance.gender], cv::Point(br.x, padding += spacing), font, font_size, clr);
+            cv::putText(img, glassesMap[f.appearance.glasses], cv::Point(br.x, padding += spacing), font, font_size,
+                        clr);
+            cv::putText(img, ageMap[f.appearance.age], cv::Point(br.x, padding += spacing), font, font_size, clr);
+            cv::putText(img, ethnicityMap[f.appearance.ethnicity], cv::Point(br.x, padding += spacing), font, font_size,
+                        clr);
+
+            Orientation headAngles = f.measurements.orientation;
+
+            char strAngles[100];
+            sprintf(strAngles, "Pitch: %3.2f Yaw: %3.2f Roll: %3.2f Interocular: %3.2f",
+                    headAngles.pitch, headAngles.yaw, headAngles.roll, f.measurements.interocularDistance);
+
+            char fId[10];
+            sprintf(fId, "ID: %i", f.id);
+            cv::putText(img, fId, cv::Point(br.x, padding += spacing), font, font_size, clr);
+            cv::putText(img, "MEASUREMENTS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
+            cv::putText(img, strAngles, cv::Point(br.x, padding += spacing), font, font_size, clr);
+            cv::putText(img, "EMOJIS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
+            cv::putText(img, "dominantEmoji: " + affdex::EmojiToString(f.emojis.dominantEmoji),
+                        cv::Point(br.x, padding += spacing), font, font_size, clr);
+            drawValues((float *) &f.emojis, emojis, br.x, padding, clr, img);
+            cv::putText(img, "EXPRESSIONS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
+            drawValues((float *) &f.expressions, expressions, br.x, padding, clr, img);
+            cv::putText(img, "EMOTIONS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
+            drawValues((float *) &f.emotions, emotions, br.x, padding, clr, img);
+        }
+        drawFps(img, clr);
+    }
+
+    void drawPutText(const std::map<FaceId, Face> &faces, cv::Mat img) {
+        cv::Scalar clr = cv::Scalar(0, 0, 255);
+        cv::Scalar header_clr = cv::Scalar(255, 0, 0);
+
+        for (auto &face_id_pair : faces) {
+            const Face &f = face_id_pair.second;
+            const VecFeaturePoint &points = f.featurePoints;
+            for (auto &point : points) {
+                cv::circle(img, cv::Point(point.x, point.y), 2.0f, cv::Scalar(0, 0, 255));
+            }
+            FeaturePoint tl = minPoint(points);
+            FeaturePoint br = maxPoint(points);
+
+            int padding = tl.y + 10;
+
+            cv::putText(img, "APPEARANCE", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
+            cv::putText(img, genderName(f.appearance.gender), cv::Point(br.x, padding += spacing), font, font_size,
+                        clr);
+            cv::putText(img, glassesName(f.appearance.glasses), cv::Point(br.x, padding += spacing), font, font_size,
+                        clr);
+            cv::putText(img, ageName(f.appearance.age), cv::Point(br.x, padding += spacing), font, font_size, clr);
+            cv::putText(img, ethnicityName(f.appearance.ethnicity), cv::Point(br.x, padding += spacing), font,
+                        font_size, clr);
+
+            const Orientation &headAngles = f.measurements.orientation;
+
+            char strAngles[100];
+            sprintf(strAngles, "Pitch: %3.2f Yaw: %3.2f Roll: %3.2f Interocular: %3.2f",
+                    headAngles.pitch, headAngles.yaw, headAngles.roll, f.measurements.interocularDistance);
+
+            char fId[10];
+            sprintf(fId, "ID: %i", f.id);
+            cv::putText(img, fId, cv::Point(br.x, padding += spacing), font, font_size, clr);
+            cv::putText(img, "MEASUREMENTS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
+            cv::putText(img, strAngles, cv::Point(br.x, padding += spacing), font, font_size, clr);
+            cv::putText(img, "EMOJIS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
+            const int emoji = dominantEmojiIndex(f.emojis.dominantEmoji);
+            char dominant[64];
+            snprintf(dominant, sizeof(dominant), "dominantEmoji: %s", emoji >= 0
+                     ? dominantEmojiName(emoji).c_str() : affdex::EmojiToString(f.emojis.dominantEmoji).c_str());
+            cv::putText(img, dominant, cv::Point(br.x, padding += spacing), font, font_size, clr);
+            float metrics[NUM_METRICS];
+            metricValues(f, metrics);
+            drawValues(metrics, EMOJIS, br.x, padding, clr, img);
+            cv::putText(img, "EXPRESSIONS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
+            drawValues(metrics, EXPRESSIONS, br.x, padding, clr, img);
+            cv::putText(img, "EMOTIONS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
+            drawValues(metrics, EMOTIONS, br.x, padding, clr, img);
+        }
+        drawFps(img, clr);
+    }
+
+private:
+
+    static FeaturePoint minPoint(const VecFeaturePoint &points) {
+        FeaturePoint ret = points.front();
+        for (const FeaturePoint &p : points) {
+            if (p.x < ret.x) ret.x = p.x;
+            if (p.y < ret.y) ret.y = p.y;
+        }
+        return ret;
+    }
+
+    static FeaturePoint maxPoint(const VecFeaturePoint &points) {
+        FeaturePoint ret = points.front();
+        for (const FeaturePoint &p : points) {
+            if (p.x > ret.x) ret.x = p.x;
+            if (p.y > ret.y) ret.y = p.y;
+        }
+        return ret;
+    }
+
+    void drawValues(const float *first, const std::vector<std::string> names,
+                    const int x, int &padding, const cv::Scalar clr,
+                    cv::Mat img) {
+        for (std::string name : names) {
+            if (std::abs(*first) > 5.0f) {
+                char m[50];
+                sprintf(m, "%s: %3.2f", name.c_str(), (*first));
+                cv::putText(img, m, cv::Point(x, padding += spacing), font, font_size, clr);
+            }
+            first++;
+        }
+    }
+
+    void drawValues(const float *metrics, const MetricGroup group,
+                    const int x, int &padding, const cv::Scalar &clr,
+                    cv::Mat &img) {
+        const MetricGroupInfo &g = METRIC_GROUPS[group];
+        for (int i = g.begin; i < g.begin + g.count; i++) {
+            if (std::abs(metrics[i]) > 5.0f) {
+                char m[50];
+                snprintf(m, sizeof(m), "%s: %3.2f", METRICS[i].name, metrics[i]);
+                cv::putText(img, m, cv::Point(x, padding += spacing), font, font_size, clr);
+            }
+        }
+    }
+
+    // The frame rates are not measured here; the lines are drawn all the same
+    void drawFps(cv::Mat &img, const cv::Scalar &clr) {
+        const int left_margin = 30;
+        char fps_str[50];
+        sprintf(fps_str, "capture fps: %2.0f", 30.0);
+        cv::putText(img, fps_str, cv::Point(img.cols - 110, img.rows - left_margin - spacing), font, font_size, clr);
+        sprintf(fps_str, "process fps: %2.0f", 30.0);
+        cv::putText(img, fps_str, cv::Point(img.cols - 110, img.rows - left_margin), font, font_size, clr);
+    }
+};
@@ -0,0 +1,96 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <random>
+
+#include "Face.h"
+
+#include "MetricSchema.hpp"
+
+using namespace affdex;
+
+// Faces for the benchmarks, spread over a 1080p frame four to a row, with
+// about half the metrics above the 5 the overlay draws from and 34 feature
+// points each, as the SDK reports them.
+namespace synthetic {
+
+    // Writes the NUM_METRICS values, in METRICS order, back into a face
+    inline void setMetricValues(Face &f, const float *values) {
+        std::memcpy(&f.measurements.orientation, values, sizeof(float) * NUM_HEAD_ANGLES);
+        std::memcpy(&f.emotions, values + METRIC_GROUPS[EMOTIONS].begin, sizeof(float) * NUM_EMOTIONS);
+        std::memcpy(&f.expressions, values + METRIC_GROUPS[EXPRESSIONS].begin, sizeof(float) * NUM_EXPRESSIONS);
+        std::memcpy(&f.emojis, values + METRIC_GROUPS[EMOJIS].begin, sizeof(float) * NUM_EMOJIS);
+    }
+
+    inline std::map<FaceId, Face> makeFaces(const int count, std::mt19937 &rng) {
+        std::uniform_real_distribution<float> percent(0, 100), angle(-40, 40);
+        std::map<FaceId, Face> faces;
+        for (int k = 0; k < count; k++) {
+            Face f;
+            f.id = k;
+            f.measurements.interocularDistance = 60 + percent(rng) / 10;
+            float values[NUM_METRICS];
+            for (int i = 0; i < NUM_METRICS; i++) {
+                values[i] = METRICS[i].group == HEAD_ANGLES ? angle(rng) : percent(rng) * (rng() % 2);
+            }
+            setMetricValues(f, values);
+            f.emojis.dominantEmoji = DOMINANT_EMOJIS[k % NUM_DOMINANT_EMOJIS];
+            f.appearance.gender = Gender::Female;
+            f.appearance.glasses = Glasses::Yes;
+            f.appearance.age = Age::AGE_25_34;
+            f.appearance.ethnicity = Ethnicity::BLACK_AFRICAN;
+            const float x = 150.0f + (k % 4) * 450, y = 120.0f + (k / 4) * 520;
+            for (int i = 0; i < 34; i++) {
+                FeaturePoint point;
+                point.id = i;
+                point.x = x + percent(rng) * 1.5f;
+                point.y = y + percent(rng) * 2.0f;
+                f.featurePoints.push_back(point);
+            }
+            faces[k] = f;
+        }
+        return faces;
+    }
+
+    // Moves to the next frame: the metrics drawn random-walk by sigma, the
+    // head angles and interocular distance too, and the points by 2 sigma
+    inline void step(std::map<FaceId, Face> &faces, std::mt19937 &rng, const float sigma) {
+        std::normal_distribution<float> noise(0, sigma);
+        for (auto &face_id_pair : faces) {
+            Face &f = face_id_pair.second;
+            float values[NUM_METRICS];
+            metricValues(f, values);
+            for (int i = 0; i < NUM_METRICS; i++) {
+                if (METRICS[i].group == HEAD_ANGLES) values[i] += noise(rng);
+                else if (values[i] > 0) values[i] = std::min(100.0f, std::max(0.0f, values[i] + noise(rng)));
+            }
+            setMetricValues(f, values);
+            f.measurements.interocularDistance += noise(rng);
+            for (FeaturePoint &point : f.featurePoints) {
+                point.x += 2 * noise(rng);
+                point.y += 2 * noise(rng);
+            }
+        }
+    }
+
+} // namespace synthetic
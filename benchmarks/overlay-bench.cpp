@@ -0,0 +1,87 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+// Draws the overlay of 1, 2, 4 and 8 faces on a 1080p frame, with their
+// values still, drifting slowly and noisy from frame to frame, and prints
+// the ms per frame of the cv::putText overlay (see LegacyOverlay) against
+// the one PlottingImageListener draws through OverlayRenderer, whose cached
+// glyphs and rows are redrawn only where a value changed.
+//
+//   overlay-bench [frames]
+
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <random>
+#include <opencv2/core/core.hpp>
+
+#include "Face.h"
+
+#include "LegacyOverlay.hpp"
+#include "PlottingImageListener.hpp"
+#include "SyntheticFaces.hpp"
+
+// ms per frame of draw(faces, img) over the frames, the faces stepped by sigma in between
+static double measure(const int count, const float sigma, const long frames, const std::function<void(
+        const std::map<FaceId, Face> &, cv::Mat &)> &draw) {
+    std::mt19937 rng(7);
+    std::map<FaceId, Face> faces = synthetic::makeFaces(count, rng);
+    cv::Mat img(1080, 1920, CV_8UC3, cv::Scalar(0, 0, 0));
+    double seconds = 0;
+    for (long i = 0; i < frames; i++) {
+        synthetic::step(faces, rng, sigma);
+        const auto start = std::chrono::steady_clock::now();
+        draw(faces, img);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return 1000 * seconds / frames;
+}
+
+int main(int argsc, char **argsv) {
+    const long frames = argsc > 1 ? std::atol(argsv[1]) : 400;
+    if (frames <= 0) {
+        std::cerr << "ERROR\tUsage: overlay-bench [frames]" << std::endl;
+        return 1;
+    }
+    const char *const scenarios[] = {"still", "slow", "noisy"};
+    const float sigmas[] = {0.0f, 0.02f, 0.5f};
+    const int counts[] = {1, 2, 4, 8};
+
+    printf("%ld frames of 1920x1080\n", frames);
+    printf("values  faces  ms putText  ms OverlayRenderer  speedup\n");
+    for (int s = 0; s < 3; s++) {
+        for (const int count : counts) {
+            LegacyOverlay legacy;
+            const double before = measure(count, sigmas[s], frames, [&legacy](
+                    const std::map<FaceId, Face> &faces, cv::Mat &img) {
+                legacy.drawPutText(faces, img);
+            });
+            PlottingImageListener listener(false, nullptr, 4);
+            const double after = measure(count, sigmas[s], frames, [&listener](
+                    const std::map<FaceId, Face> &faces, cv::Mat &img) {
+                listener.drawOverlay(faces, img);
+            });
+            printf("%-6s  %5d  %10.3f  %17.3f  %6.2fx\n", scenarios[s], count, before, after,
+                   after > 0 ? before / after : 0);
+        }
+    }
+    return 0;
+}
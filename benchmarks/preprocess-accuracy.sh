@@ -0,0 +1,103 @@
+#! /bin/sh
+# Processes one recording at full resolution, with --workWidth, with --roi
+# and with both, then prints the fps of each run and how far its --output
+# records are from the full resolution ones: the faces found in the same
+# frames, the mean absolute difference of the metrics (the worst metric
+# named) and how often the appearance fields and dominantEmoji agree.
+#
+#   preprocess-accuracy.sh <emotions-app> <data dir> <recording> [workWidth] [extra options...]
+#
+# The extra options are passed to every run, e.g. --roiRescan 15.
+
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 <emotions-app> <data dir> <recording> [workWidth] [extra options...]" >&2
+    exit 1
+fi
+
+app=$1
+data=$2
+input=$3
+width=${4:-960}
+[ $# -ge 4 ] && shift 4 || shift 3
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+# run <name> [options...]: the records go to $out/<name>.ndjson, the fps to $out/<name>.fps
+run() {
+    name=$1
+    shift
+    echo "INFO	Processing $input ($name)" >&2
+    if ! "$app" -d "$data" --input "$input" --output "$out/$name.ndjson" "$@" 2> "$out/$name.log"; then
+        echo "ERROR	$name run failed, see its output:" >&2
+        cat "$out/$name.log" >&2
+        exit 1
+    fi
+    # "INFO	Processed 900 frames in 12.5 s (72 fps)"
+    sed -n 's/.*Processed .* (\([0-9.e+-]*\) fps).*/\1/p' "$out/$name.log" | tail -n 1 > "$out/$name.fps"
+}
+
+# compare <name>: one line comparing $out/<name>.ndjson with the full resolution run
+compare() {
+    awk -v name="$1" -v fps="$(cat "$out/$1.fps")" -v basefps="$(cat "$out/full.fps")" '
+        # The records are flat JSON objects: split them into key and value fields
+        function parse(line,    n, i, kv) {
+            gsub(/^\{|\}$/, "", line)
+            n = split(line, fields, ",")
+            delete rec
+            for (i = 1; i <= n; i++) {
+                split(fields[i], kv, ":")
+                gsub(/"/, "", kv[1])
+                rec[kv[1]] = kv[2]
+            }
+        }
+        {
+            parse($0)
+            key = rec["timeStamp"] " " rec["faceId"] " " rec["streamId"]
+        }
+        FILENAME == ARGV[1] {
+            for (k in rec) base[key, k] = rec[k]
+            baseKeys[key] = 1
+            baseCount++
+            next
+        }
+        {
+            count++
+            if (!(key in baseKeys)) { extra++; next }
+            matched++
+            for (k in rec) {
+                if (k == "timeStamp" || k == "faceId" || k == "streamId") continue
+                if (rec[k] ~ /^"/) {
+                    classes[k]++
+                    if (rec[k] == base[key, k]) agree[k]++
+                } else if (k != "interocularDistance") {
+                    d = rec[k] - base[key, k]
+                    diff[k] += d < 0 ? -d : d
+                    values++
+                    total += d < 0 ? -d : d
+                }
+            }
+        }
+        END {
+            worst = ""
+            for (k in diff) if (worst == "" || diff[k] > diff[worst]) worst = k
+            appearance = ""
+            for (k in classes) appearance = appearance sprintf(" %s %.1f%%", k, 100 * agree[k] / classes[k])
+            printf "%-10s  %7.1f  %6.2fx  %8d  %7.1f%%  %6d  %9.3f  %s %.3f %s\n", name, fps,
+                   (basefps > 0 ? fps / basefps : 0), count, (baseCount > 0 ? 100 * matched / baseCount : 0),
+                   extra, (values > 0 ? total / values : 0), worst, (matched > 0 ? diff[worst] / matched : 0),
+                   appearance
+        }
+    ' "$out/full.ndjson" "$out/$1.ndjson"
+}
+
+run full "$@"
+run downscale --workWidth "$width" "$@"
+run roi --roi "$@"
+run both --roi --workWidth "$width" "$@"
+
+echo "run             fps  speedup   records  matched   extra  mean diff  worst metric (mean diff)  agreement"
+echo "full        $(printf '%7.1f' "$(cat "$out/full.fps")")    1.00x  $(wc -l < "$out/full.ndjson" | tr -d ' ')"
+for name in downscale roi both; do
+    compare $name
+done
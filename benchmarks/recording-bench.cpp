@@ -0,0 +1,122 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+// Records faces whose values drift like the detector's through FaceRecorder,
+// then scans the recording with RecordingReader, and prints:
+//  - the write cost per frame and per face, and the size of the file
+//    against the raw column data;
+//  - the rate a full scan of one metric decodes at, in GB/s;
+//  - the chunks a scan of a short time range of one face reads and skips.
+//
+//   recording-bench [frames] [faces per frame] [file]
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+
+#include "Face.h"
+
+#include "FaceRecorder.hpp"
+#include "RecordingReader.hpp"
+#include "SyntheticFaces.hpp"
+
+static double since(const std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argsc, char **argsv) {
+    const long frames = argsc > 1 ? std::atol(argsv[1]) : 200000;
+    const int facesPerFrame = argsc > 2 ? std::atoi(argsv[2]) : 2;
+    const std::string path = argsc > 3 ? argsv[3] : "recording-bench.emjr";
+    if (frames <= 0 || facesPerFrame <= 0) {
+        std::cerr << "ERROR\tUsage: recording-bench [frames] [faces per frame] [file]" << std::endl;
+        return 1;
+    }
+
+    // Metrics random-walk and feature points jitter, as from a face in view
+    std::mt19937 rng(1);
+    std::map<FaceId, Face> faces = synthetic::makeFaces(facesPerFrame, rng);
+
+    double writeSeconds = 0;
+    RecorderStats written;
+    {
+        FaceRecorder recorder(path);
+        if (!recorder.isOpened()) {
+            std::cerr << "ERROR\tUnable to write " << path << std::endl;
+            return 1;
+        }
+        for (long i = 0; i < frames; i++) {
+            synthetic::step(faces, rng, 0.5f);
+            const auto start = std::chrono::steady_clock::now();
+            recorder.write(faces, i / 30.0);
+            writeSeconds += since(start);
+        }
+        const auto start = std::chrono::steady_clock::now();
+        recorder.close();
+        writeSeconds += since(start);
+        written = recorder.getStats();
+    }
+
+    printf("%ld frames, %d faces each\n", frames, facesPerFrame);
+    printf("write           %8.2f us/frame  %8.2f us/face\n", 1e6 * writeSeconds / frames,
+           1e6 * writeSeconds / written.rows);
+    printf("size            %8.1f MB raw    %8.1f MB file  %5.2fx smaller  %llu chunks\n", written.rawBytes / 1e6,
+           written.fileBytes / 1e6, written.fileBytes > 0 ? (double) written.rawBytes / written.fileBytes : 0,
+           (unsigned long long) written.chunks);
+
+    RecordingReader reader;
+    if (!reader.open(path)) return 1;
+    const int joy = reader.findColumn("joy");
+    if (joy < 0) {
+        std::cerr << "ERROR\tThe recording has no joy column" << std::endl;
+        return 1;
+    }
+
+    // Best of three, so the first pass pays for the page faults of the mapping
+    double best = 0;
+    ScanStats full;
+    double sum = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        const auto start = std::chrono::steady_clock::now();
+        full = reader.scan(joy, -INFINITY, INFINITY, -1, -1, 0, [&sum](double, int, double value) {
+            sum += value;
+        });
+        const double seconds = since(start);
+        if (pass == 0 || seconds < best) best = seconds;
+    }
+    printf("full scan       %8.2f GB/s decoded  %8.2f GB/s read  %llu rows in %.1f ms (sum %.0f)\n",
+           full.bytesDecoded / best / 1e9, full.bytesRead / best / 1e9, (unsigned long long) full.rows,
+           1e3 * best, sum);
+
+    // 100 s of face 1 (or 0) from the middle of the recording
+    const double middle = frames / 30.0 / 2;
+    const ScanStats range = reader.scan(joy, middle, middle + 100, std::min(facesPerFrame - 1, 1), -1, 0,
+                                        [](double, int, double) {
+                                        });
+    printf("100 s of a face %8llu rows      %8llu chunks read  %llu skipped\n", (unsigned long long) range.rows,
+           (unsigned long long) range.chunksScanned, (unsigned long long) range.chunksSkipped);
+
+    std::remove(path.c_str());
+    return 0;
+}
@@ -0,0 +1,308 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+// Measures, per face, the paths the metric schema changed, against copies
+// of the code it replaced:
+//  - the urlencoded record (per-group key tables -> METRICS);
+//  - FaceRecord::fromFace plus its NDJSON line (per-group arrays and name
+//    lists -> one metrics array);
+//  - the overlay (name vectors and std::maps -> the schema tables), both
+//    drawn with cv::putText, see LegacyOverlay.
+// Both sides of the serialization paths are checked to give the same text.
+//
+//   schema-bench [frames] [faces per frame]
+
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+#include "Face.h"
+
+#include "AllocationCounter.hpp"
+#include "LegacyOverlay.hpp"
+#include "RecordSerializer.hpp"
+#include "SyntheticFaces.hpp"
+#include "TelemetryBatcher.hpp"
+
+// The record and serializers as they were before the metric schema
+namespace before {
+
+    struct FieldKey {
+        const char *text;
+        size_t size;
+    };
+
+#define EMOJ_URL_KEY(name) {"&" #name "=", sizeof("&" #name "=") - 1},
+#define EMOJ_NAME(name) #name,
+
+    static const FieldKey HEAD_ANGLE_KEYS[] = {EMOJ_HEAD_ANGLES(EMOJ_URL_KEY)};
+    static const FieldKey EMOTION_KEYS[] = {EMOJ_EMOTIONS(EMOJ_URL_KEY)};
+    static const FieldKey EXPRESSION_KEYS[] = {EMOJ_EXPRESSIONS(EMOJ_URL_KEY)};
+    static const FieldKey EMOJI_KEYS[] = {EMOJ_EMOJIS(EMOJ_URL_KEY)};
+
+    static const char *const HEAD_ANGLE_NAMES[] = {EMOJ_HEAD_ANGLES(EMOJ_NAME)};
+    static const char *const EMOTION_NAMES[] = {EMOJ_EMOTIONS(EMOJ_NAME)};
+    static const char *const EXPRESSION_NAMES[] = {EMOJ_EXPRESSIONS(EMOJ_NAME)};
+    static const char *const EMOJI_NAMES[] = {EMOJ_EMOJIS(EMOJ_NAME)};
+
+    struct FaceRecord {
+        double timeStamp;
+        FaceId faceId;
+        int streamId;
+        float interocularDistance;
+        Glasses glasses;
+        Age age;
+        Ethnicity ethnicity;
+        Gender gender;
+        Emoji dominantEmoji;
+        float headAngles[NUM_HEAD_ANGLES];
+        float emotions[NUM_EMOTIONS];
+        float expressions[NUM_EXPRESSIONS];
+        float emojis[NUM_EMOJIS];
+
+        static FaceRecord fromFace(const Face &f, const double timeStamp, const int streamId = -1) {
+            FaceRecord r;
+            r.timeStamp = timeStamp;
+            r.faceId = f.id;
+            r.streamId = streamId;
+            r.interocularDistance = f.measurements.interocularDistance;
+            r.glasses = f.appearance.glasses;
+            r.age = f.appearance.age;
+            r.ethnicity = f.appearance.ethnicity;
+            r.gender = f.appearance.gender;
+            r.dominantEmoji = f.emojis.dominantEmoji;
+            std::memcpy(r.headAngles, &f.measurements.orientation, sizeof(r.headAngles));
+            std::memcpy(r.emotions, &f.emotions, sizeof(r.emotions));
+            std::memcpy(r.expressions, &f.expressions, sizeof(r.expressions));
+            std::memcpy(r.emojis, &f.emojis, sizeof(r.emojis));
+            return r;
+        }
+    };
+
+    inline void appendNdjson(std::string &out, const std::vector<FaceRecord> &records) {
+        using batch::appendJsonNumber;
+        for (const FaceRecord &r : records) {
+            out.append("{\"timeStamp\":");
+            appendJsonNumber(out, r.timeStamp);
+            out.append(",\"faceId\":");
+            appendJsonNumber(out, r.faceId);
+            if (r.streamId >= 0) {
+                out.append(",\"streamId\":");
+                appendJsonNumber(out, r.streamId);
+            }
+            out.append(",\"interocularDistance\":");
+            appendJsonNumber(out, r.interocularDistance);
+            out.append(",\"glasses\":\"").append(glassesName(r.glasses));
+            out.append("\",\"age\":\"").append(ageName(r.age));
+            out.append("\",\"ethnicity\":\"").append(ethnicityName(r.ethnicity));
+            out.append("\",\"gender\":\"").append(genderName(r.gender));
+            out.append("\",\"dominantEmoji\":\"").append(affdex::EmojiToString(r.dominantEmoji)).append("\"");
+            auto values = [&](const char *const *names, const float *first, const int count) {
+                for (int j = 0; j < count; j++) {
+                    out.append(",\"").append(names[j]).append("\":");
+                    appendJsonNumber(out, first[j]);
+                }
+            };
+            values(HEAD_ANGLE_NAMES, r.headAngles, NUM_HEAD_ANGLES);
+            values(EMOTION_NAMES, r.emotions, NUM_EMOTIONS);
+            values(EXPRESSION_NAMES, r.expressions, NUM_EXPRESSIONS);
+            values(EMOJI_NAMES, r.emojis, NUM_EMOJIS);
+            out.append("}\n");
+        }
+    }
+
+    class RecordSerializer {
+
+        std::string mBuffer;
+        Emoji mEmojiKeys[13];
+        std::string mEmojiNames[13];
+
+    public:
+
+        RecordSerializer() {
+            mBuffer.reserve(4096);
+            const Emoji known[] = {
+                    Emoji::Relaxed, Emoji::Smiley, Emoji::Laughing, Emoji::Kissing, Emoji::Disappointed,
+                    Emoji::Rage, Emoji::Smirk, Emoji::Wink, Emoji::StuckOutTongueWinkingEye,
+                    Emoji::StuckOutTongue, Emoji::Flushed, Emoji::Scream, Emoji::Unknown
+            };
+            for (int i = 0; i < 13; i++) {
+                mEmojiKeys[i] = known[i];
+                mEmojiNames[i] = affdex::EmojiToString(known[i]);
+            }
+        }
+
+        const std::string &serialize(const Face &f, const double timeStamp) {
+            char buf[numfmt::MAX_CHARS];
+            mBuffer.clear();
+            mBuffer.append("timeStamp=", 10);
+            number(timeStamp);
+            mBuffer.append("&faceId=", 8);
+            mBuffer.append(buf, numfmt::formatInt(buf, f.id));
+            mBuffer.append("&interocularDistance=", 21);
+            number(f.measurements.interocularDistance);
+            mBuffer.append("&glasses=", 9).append(glassesName(f.appearance.glasses));
+            mBuffer.append("&age=", 5).append(ageName(f.appearance.age));
+            mBuffer.append("&ethnicity=", 11).append(ethnicityName(f.appearance.ethnicity));
+            mBuffer.append("&gender=", 8).append(genderName(f.appearance.gender));
+            mBuffer.append("&dominantEmoji=", 15);
+            emoji(f.emojis.dominantEmoji);
+            values(HEAD_ANGLE_KEYS, (const float *) &f.measurements.orientation, NUM_HEAD_ANGLES);
+            values(EMOTION_KEYS, (const float *) &f.emotions, NUM_EMOTIONS);
+            values(EXPRESSION_KEYS, (const float *) &f.expressions, NUM_EXPRESSIONS);
+            values(EMOJI_KEYS, (const float *) &f.emojis, NUM_EMOJIS);
+            return mBuffer;
+        }
+
+    private:
+
+        void number(const double value) {
+            char buf[numfmt::MAX_CHARS];
+            mBuffer.append(buf, numfmt::formatG(buf, value));
+        }
+
+        void values(const FieldKey *keys, const float *first, const int count) {
+            for (int i = 0; i < count; i++) {
+                mBuffer.append(keys[i].text, keys[i].size);
+                number(first[i]);
+            }
+        }
+
+        void emoji(const Emoji e) {
+            for (int i = 0; i < 13; i++) {
+                if (mEmojiKeys[i] == e) {
+                    mBuffer.append(mEmojiNames[i]);
+                    return;
+                }
+            }
+            mBuffer.append(affdex::EmojiToString(e));
+        }
+    };
+
+} // namespace before
+
+struct Cost {
+    double seconds;
+    unsigned long long allocations;
+};
+
+// Runs f(frame) for every frame, stepping the faces between calls
+static Cost measure(std::map<FaceId, Face> faces, const long frames, const std::function<void(
+        const std::map<FaceId, Face> &, const long)> &f) {
+    std::mt19937 rng(11);
+    Cost cost = {0, 0};
+    for (long i = 0; i < frames; i++) {
+        synthetic::step(faces, rng, 0.5f);
+        const unsigned long long before = allocations;
+        const auto start = std::chrono::steady_clock::now();
+        f(faces, i);
+        cost.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cost.allocations += allocations - before;
+    }
+    return cost;
+}
+
+static void report(const char *name, const Cost &before, const Cost &after, const double faces) {
+    printf("%-18s  %9.2f  %9.2f  %11.1f  %11.1f\n", name, 1e6 * before.seconds / faces,
+           1e6 * after.seconds / faces, before.allocations / faces, after.allocations / faces);
+}
+
+int main(int argsc, char **argsv) {
+    const long frames = argsc > 1 ? std::atol(argsv[1]) : 2000;
+    const int facesPerFrame = argsc > 2 ? std::atoi(argsv[2]) : 4;
+    if (frames <= 0 || facesPerFrame <= 0) {
+        std::cerr << "ERROR\tUsage: schema-bench [frames] [faces per frame]" << std::endl;
+        return 1;
+    }
+    std::mt19937 rng(7);
+    const std::map<FaceId, Face> faces = synthetic::makeFaces(facesPerFrame, rng);
+    const double faceCount = (double) frames * facesPerFrame;
+
+    before::RecordSerializer oldSerializer;
+    RecordSerializer serializer;
+    std::string oldNdjson, ndjson;
+    std::vector<before::FaceRecord> oldRecords;
+    std::vector<FaceRecord> records;
+
+    // The schema must not have changed what is sent
+    for (auto &face_id_pair : faces) {
+        const Face &f = face_id_pair.second;
+        oldRecords.assign(1, before::FaceRecord::fromFace(f, 1.5));
+        records.assign(1, FaceRecord::fromFace(f, 1.5));
+        oldNdjson.clear();
+        ndjson.clear();
+        before::appendNdjson(oldNdjson, oldRecords);
+        batch::appendNdjson(ndjson, records);
+        if (oldSerializer.serialize(f, 1.5) != serializer.serialize(f, 1.5) || oldNdjson != ndjson) {
+            std::cerr << "ERROR\tThe records of face " << f.id << " differ from the ones before the schema"
+                      << std::endl;
+            return 1;
+        }
+    }
+    oldNdjson.reserve(64 << 10);
+    ndjson.reserve(64 << 10);
+    oldRecords.reserve(facesPerFrame);
+    records.reserve(facesPerFrame);
+
+    size_t sink = 0;
+    const Cost oldSerialize = measure(faces, frames, [&](const std::map<FaceId, Face> &fs, const long i) {
+        for (auto &face_id_pair : fs) sink += oldSerializer.serialize(face_id_pair.second, i / 30.0).size();
+    });
+    const Cost newSerialize = measure(faces, frames, [&](const std::map<FaceId, Face> &fs, const long i) {
+        for (auto &face_id_pair : fs) sink += serializer.serialize(face_id_pair.second, i / 30.0).size();
+    });
+
+    const Cost oldRecord = measure(faces, frames, [&](const std::map<FaceId, Face> &fs, const long i) {
+        oldRecords.clear();
+        for (auto &face_id_pair : fs) oldRecords.push_back(before::FaceRecord::fromFace(face_id_pair.second, i / 30.0));
+        oldNdjson.clear();
+        before::appendNdjson(oldNdjson, oldRecords);
+        sink += oldNdjson.size();
+    });
+    const Cost newRecord = measure(faces, frames, [&](const std::map<FaceId, Face> &fs, const long i) {
+        records.clear();
+        for (auto &face_id_pair : fs) records.push_back(FaceRecord::fromFace(face_id_pair.second, i / 30.0));
+        ndjson.clear();
+        batch::appendNdjson(ndjson, records);
+        sink += ndjson.size();
+    });
+
+    LegacyOverlay overlay;
+    cv::Mat img(1080, 1920, CV_8UC3, cv::Scalar(0, 0, 0));
+    const Cost oldOverlay = measure(faces, frames, [&](const std::map<FaceId, Face> &fs, const long) {
+        overlay.drawBeforeSchema(fs, img);
+    });
+    const Cost newOverlay = measure(faces, frames, [&](const std::map<FaceId, Face> &fs, const long) {
+        overlay.drawPutText(fs, img);
+    });
+
+    printf("%ld frames, %d faces each (%zu)\n", frames, facesPerFrame, sink % 10);
+    printf("per face            us before   us after  allocs before  allocs after\n");
+    report("urlencoded record", oldSerialize, newSerialize, faceCount);
+    report("fromFace + NDJSON", oldRecord, newRecord, faceCount);
+    report("overlay", oldOverlay, newOverlay, faceCount);
+    return 0;
+}
@@ -0,0 +1,211 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+// Serializes the same faces through the ostringstream code that used to
+// build each post and through RecordSerializer, checks both give the same
+// text and prints the records/s and heap allocations per record of each.
+//
+//   serializer-bench [records]
+
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Face.h"
+
+#include "AllocationCounter.hpp"
+#include "RecordSerializer.hpp"
+#include "SyntheticFaces.hpp"
+
+//---------------------------------------------------------------------------
+// PlottingImageListener::outputToServer before RecordSerializer, one face at
+// a time: name lists copied per value and std::map lookups per record.
+class LegacySerializer {
+
+    std::ostringstream curlOutput;
+
+    std::vector<std::string> expressions;
+    std::vector<std::string> emotions;
+    std::vector<std::string> emojis;
+    std::vector<std::string> headAngles;
+
+    std::map<affdex::Glasses, std::string> glassesMap;
+    std::map<affdex::Gender, std::string> genderMap;
+    std::map<affdex::Age, std::string> ageMap;
+    std::map<affdex::Ethnicity, std::string> ethnicityMap;
+
+public:
+
+    LegacySerializer() {
+        for (int i = 0; i < NUM_METRICS; i++) {
+            switch (METRICS[i].group) {
+                case HEAD_ANGLES: headAngles.push_back(METRICS[i].name); break;
+                case EMOTIONS: emotions.push_back(METRICS[i].name); break;
+                case EXPRESSIONS: expressions.push_back(METRICS[i].name); break;
+                default: emojis.push_back(METRICS[i].name); break;
+            }
+        }
+        genderMap = std::map<affdex::Gender, std::string> {
+                {affdex::Gender::Male,    "male"},
+                {affdex::Gender::Female,  "female"},
+                {affdex::Gender::Unknown, "unknown"}
+        };
+        glassesMap = std::map<affdex::Glasses, std::string> {
+                {affdex::Glasses::Yes, "yes"},
+                {affdex::Glasses::No,  "no"}
+        };
+        ageMap = std::map<affdex::Age, std::string> {
+                {affdex::Age::AGE_UNKNOWN,  "unknown"},
+                {affdex::Age::AGE_UNDER_18, "under 18"},
+                {affdex::Age::AGE_18_24,    "18-24"},
+                {affdex::Age::AGE_25_34,    "25-34"},
+                {affdex::Age::AGE_35_44,    "35-44"},
+                {affdex::Age::AGE_45_54,    "45-54"},
+                {affdex::Age::AGE_55_64,    "55-64"},
+                {affdex::Age::AGE_65_PLUS,  "65 plus"}
+        };
+        ethnicityMap = std::map<affdex::Ethnicity, std::string> {
+                {affdex::Ethnicity::UNKNOWN,       "unknown"},
+                {affdex::Ethnicity::CAUCASIAN,     "caucasian"},
+                {affdex::Ethnicity::BLACK_AFRICAN, "black african"},
+                {affdex::Ethnicity::SOUTH_ASIAN,   "south asian"},
+                {affdex::Ethnicity::EAST_ASIAN,    "east asian"},
+                {affdex::Ethnicity::HISPANIC,      "hispanic"}
+        };
+    }
+
+    std::string serialize(Face f, const double timeStamp) {
+        curlOutput.str("");
+        curlOutput << "timeStamp=" << timeStamp << "&"
+                << "faceId" << "=" << f.id << "&"
+                << "interocularDistance" << "=" << f.measurements.interocularDistance << "&"
+                << "glasses" << "=" << glassesMap[f.appearance.glasses] << "&"
+                << "age" << "=" << ageMap[f.appearance.age] << "&"
+                << "ethnicity" << "=" << ethnicityMap[f.appearance.ethnicity] << "&"
+                << "gender" << "=" << genderMap[f.appearance.gender] << "&"
+                << "dominantEmoji" << "=" << affdex::EmojiToString(f.emojis.dominantEmoji) << "&";
+
+        auto *values = (float *) &f.measurements.orientation;
+        for (std::string angle : headAngles) {
+            curlOutput << angle << "=" << (*values++) << "&";
+        }
+        values = (float *) &f.emotions;
+        for (std::string emotion : emotions) {
+            curlOutput << emotion << "=" << (*values++) << "&";
+        }
+        values = (float *) &f.expressions;
+        for (std::string expression : expressions) {
+            curlOutput << expression << "=" << (*values++) << "&";
+        }
+        values = (float *) &f.emojis;
+        for (std::string emoji : emojis) {
+            curlOutput << emoji << "=" << (*values++) << "&";
+        }
+
+        // delete last character "&"
+        std::string msg = curlOutput.str();
+        msg.pop_back();
+        return msg;
+    }
+};
+
+// Faces from SyntheticFaces, copied at every step of their random walk
+static std::vector<Face> makeFaces(const int count) {
+    std::mt19937 rng(3);
+    std::map<FaceId, Face> walking = synthetic::makeFaces(4, rng);
+    std::vector<Face> faces;
+    faces.reserve(count);
+    while ((int) faces.size() < count) {
+        synthetic::step(walking, rng, 0.5f);
+        for (auto &face_id_pair : walking) {
+            if ((int) faces.size() < count) faces.push_back(face_id_pair.second);
+        }
+    }
+    return faces;
+}
+
+struct Result {
+    double seconds;
+    unsigned long long allocations;
+    size_t bytes;
+};
+
+template<typename Serialize>
+static Result run(const std::vector<Face> &faces, const long records, Serialize serialize) {
+    Result r = {0, allocations, 0};
+    const auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < records; i++) {
+        r.bytes += serialize(faces[i % faces.size()], i / 30.0).size();
+    }
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    r.allocations = allocations - r.allocations;
+    return r;
+}
+
+static void report(const char *name, const Result &r, const long records) {
+    printf("%-16s  %12.0f  %12.2f  %10.1f\n", name, records / r.seconds, (double) r.allocations / records,
+           (double) r.bytes / records);
+}
+
+int main(int argsc, char **argsv) {
+    const long records = argsc > 1 ? std::atol(argsv[1]) : 200000;
+    if (records <= 0) {
+        std::cerr << "ERROR\tUsage: serializer-bench [records]" << std::endl;
+        return 1;
+    }
+
+    const std::vector<Face> faces = makeFaces(1000);
+    LegacySerializer legacy;
+    RecordSerializer serializer;
+
+    // Both must post the same text, or the comparison means nothing
+    int mismatches = 0;
+    for (size_t i = 0; i < faces.size(); i++) {
+        const double timeStamp = i / 30.0;
+        if (legacy.serialize(faces[i], timeStamp) != serializer.serialize(faces[i], timeStamp)) {
+            if (mismatches++ == 0) {
+                std::cerr << "ERROR\tThe serializers disagree:\n" << legacy.serialize(faces[i], timeStamp) << "\n"
+                          << serializer.serialize(faces[i], timeStamp) << std::endl;
+            }
+        }
+    }
+    if (mismatches > 0) {
+        std::cerr << "ERROR\t" << mismatches << " of " << faces.size() << " records differ" << std::endl;
+        return 1;
+    }
+
+    const Result before = run(faces, records, [&legacy](const Face &f, const double timeStamp) {
+        return legacy.serialize(f, timeStamp);
+    });
+    const Result after = run(faces, records,
+                             [&serializer](const Face &f, const double timeStamp) -> const std::string & {
+                                 return serializer.serialize(f, timeStamp);
+                             });
+
+    printf("%ld records\n", records);
+    printf("serializer             records/s  allocs/record  bytes/record\n");
+    report("ostringstream", before, records);
+    report("RecordSerializer", after, records);
+    return 0;
+}
@@ -18,16 +18,79 @@
 
 #pragma once
 
+#include <iostream>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
 #include "FaceListener.h"
 
+#include "FaceAggregator.hpp"
+#include "FaceTrackStore.hpp"
+#include "VideoOutput.hpp"
+
 using namespace affdex;
 
 class AFaceListener : public FaceListener {
+
+    // Written on the SDK thread, read by the metrics endpoint
+    std::atomic<uint64_t> mFound;
+    std::atomic<uint64_t> mLost;
+
+    std::shared_ptr<FaceAggregator> mAggregator;
+    int mStreamId;
+    std::shared_ptr<VideoOutput> mVideo;
+    std::shared_ptr<FaceTrackStore> mTracks;
+
+public:
+
+    AFaceListener() : mFound(0), mLost(0), mStreamId(-1) {
+    }
+
+    // Set before the detector starts: lost faces close their summary windows
+    void setAggregator(std::shared_ptr<FaceAggregator> aggregator, const int streamId = -1) {
+        mAggregator = aggregator;
+        mStreamId = streamId;
+    }
+
+    // Set before the detector starts: faces found and lost start video clips
+    void setVideoOutput(std::shared_ptr<VideoOutput> video) {
+        mVideo = video;
+    }
+
+    // Set before the detector starts, after setAggregator() for a stream
+    void setTrackStore(std::shared_ptr<FaceTrackStore> tracks) {
+        mTracks = tracks;
+    }
+
+    uint64_t getFacesFound() const {
+        return mFound.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getFacesLost() const {
+        return mLost.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getFacesTracked() const {
+        const uint64_t lost = getFacesLost();
+        const uint64_t found = getFacesFound();
+        return found > lost ? found - lost : 0;
+    }
+
+private:
+
     void onFaceFound(float timestamp, FaceId faceId) {
+        mFound.fetch_add(1, std::memory_order_relaxed);
+        if (mVideo) mVideo->faceEvent(timestamp);
+        if (mTracks) mTracks->faceFound(timestamp, faceId, mStreamId);
         std::cout << "INFO\tFace ID:\t" << faceId << "\tfound at timestamp:\t" << timestamp << std::endl;
     }
 
     void onFaceLost(float timestamp, FaceId faceId) {
+        mLost.fetch_add(1, std::memory_order_relaxed);
+        if (mAggregator) mAggregator->faceLost(timestamp, faceId, mStreamId);
+        if (mVideo) mVideo->faceEvent(timestamp);
+        if (mTracks) mTracks->faceLost(timestamp, faceId, mStreamId);
         std::cout << "INFO\tFace ID:\t" << faceId << "\tlost at timestamp:\t" << timestamp << std::endl;
     }
 };
@@ -0,0 +1,181 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+
+struct AdmissionOptions {
+    double targetMs;       // end-to-end latency to stay under
+    double maxFps;         // never submit faster than this (PFPS)
+    float minScale;        // smallest downscale factor allowed
+    size_t maxInFlight;    // frames the detector and result queue can hold
+};
+
+struct AdmissionStats {
+    uint64_t captured;
+    uint64_t submitted;
+    uint64_t skipped;
+    uint64_t downscaled;       // frames submitted at a scale below 1
+    uint64_t scaleChanges;
+    float scale;
+    double captureFps;
+    double processFps;
+    double latencyMs;          // measured, capture to result, smoothed
+    double serviceMs;          // detector time per frame, smoothed
+    size_t inFlight;
+};
+
+//---------------------------------------------------------------------------
+// Decides, for each captured frame, whether to hand it to the detector and
+// at what scale, so that capture-to-result latency stays under a target.
+//
+// Each result tells how long its frame took and how many frames were ahead
+// of it, which gives the detector's time per frame. A new frame is admitted
+// only if the frames already in flight plus itself fit in the target at
+// that rate; otherwise it is skipped. If even a lone frame takes most of
+// the target, frames are downscaled (the detector cost follows the pixel
+// count) and scaled back up once there is room again.
+//
+// The detector must produce a result for every frame it is given, i.e. run
+// with an unlimited process rate: pacing to PFPS is done here.
+class AdmissionController {
+
+    struct Pending {
+        float timestamp;
+        size_t position;    // frames in flight when submitted, itself included
+        float scale;
+    };
+
+    const AdmissionOptions mOptions;
+    const double ALPHA = 0.2;                  // smoothing of the measured rates
+    const double ADJUST_INTERVAL = 1.0;        // seconds between scale changes
+    const float SCALE_STEP = 0.8f;
+    const double REPORT_INTERVAL = 5.0;        // seconds between skip reports
+
+    std::deque<Pending> mPending;
+    AdmissionStats mStats;
+    double mLastCapture;
+    double mLastResult;
+    double mLastSubmit;
+    double mLastAdjust;
+    double mLastReport;
+    uint64_t mOverloadSkips;
+
+public:
+
+    explicit AdmissionController(const AdmissionOptions &options)
+            : mOptions(options), mLastCapture(-1), mLastResult(-1), mLastSubmit(-1), mLastAdjust(0),
+              mLastReport(0), mOverloadSkips(0) {
+        mStats = AdmissionStats();
+        mStats.scale = 1.0f;
+    }
+
+    // Called for every captured frame; returns false if it should be skipped,
+    // else the scale to submit it at.
+    bool admit(const double now, float &scale) {
+        mStats.captured++;
+        if (mLastCapture >= 0 && now > mLastCapture) {
+            smooth(mStats.captureFps, 1.0 / (now - mLastCapture));
+        }
+        mLastCapture = now;
+        adjustScale(now);
+
+        const size_t inFlight = mPending.size();
+        const double estimateMs = (inFlight + 1) * mStats.serviceMs;
+        const bool paced = mOptions.maxFps <= 0 || mLastSubmit < 0 ||
+                           now - mLastSubmit >= 1.0 / mOptions.maxFps - 0.002;
+        const bool admitted = paced && inFlight < mOptions.maxInFlight &&
+                              (inFlight == 0 || (mStats.serviceMs > 0 && estimateMs <= mOptions.targetMs));
+
+        if (!admitted) {
+            mStats.skipped++;
+            // Skipping because of the detector, not the PFPS pacing, is worth telling
+            if (paced) mOverloadSkips++;
+            if (paced && now - mLastReport >= REPORT_INTERVAL) {
+                std::cerr << "INFO\tAdmission: skipped " << mOverloadSkips << " frames to keep latency under "
+                        << mOptions.targetMs << " ms; " << inFlight << " in flight, estimated "
+                        << estimateMs << " ms" << std::endl;
+                mOverloadSkips = 0;
+                mLastReport = now;
+            }
+            return false;
+        }
+        scale = mStats.scale;
+        return true;
+    }
+
+    void submitted(const float timestamp, const float scale) {
+        Pending p;
+        p.timestamp = timestamp;
+        p.position = mPending.size() + 1;
+        p.scale = scale;
+        mPending.push_back(p);
+        mStats.submitted++;
+        if (scale < 1.0f) mStats.downscaled++;
+        mLastSubmit = mLastCapture;
+        mStats.inFlight = mPending.size();
+    }
+
+    // Called for every result; returns the scale its frame was submitted at.
+    float completed(const float timestamp, const double now) {
+        while (!mPending.empty() && mPending.front().timestamp < timestamp) mPending.pop_front();
+        if (mPending.empty() || mPending.front().timestamp != timestamp) return 1.0f;
+        const Pending p = mPending.front();
+        mPending.pop_front();
+        mStats.inFlight = mPending.size();
+
+        const double latencyMs = (now - p.timestamp) * 1000.0;
+        smooth(mStats.latencyMs, latencyMs);
+        smooth(mStats.serviceMs, latencyMs / p.position);
+        if (mLastResult >= 0 && now > mLastResult) smooth(mStats.processFps, 1.0 / (now - mLastResult));
+        mLastResult = now;
+        return p.scale;
+    }
+
+    const AdmissionStats &getStats() const {
+        return mStats;
+    }
+
+private:
+
+    void smooth(double &average, const double sample) const {
+        average = average > 0 ? average + ALPHA * (sample - average) : sample;
+    }
+
+    void adjustScale(const double now) {
+        if (now - mLastAdjust < ADJUST_INTERVAL || mStats.serviceMs <= 0) return;
+        float scale = mStats.scale;
+        if (mStats.serviceMs > 0.8 * mOptions.targetMs && scale > mOptions.minScale) {
+            scale = std::max(scale * SCALE_STEP, mOptions.minScale);
+        } else if (mStats.serviceMs < 0.4 * mOptions.targetMs && scale < 1.0f) {
+            scale = std::min(scale / SCALE_STEP, 1.0f);
+        }
+        if (scale == mStats.scale) return;
+        std::cerr << "INFO\tAdmission: scale " << mStats.scale << " -> " << scale << ", " << mStats.serviceMs
+                << " ms per frame, latency " << mStats.latencyMs << " ms (target " << mOptions.targetMs
+                << " ms), capture " << mStats.captureFps << " fps, process " << mStats.processFps << " fps"
+                << std::endl;
+        mStats.scale = scale;
+        mStats.scaleChanges++;
+        mLastAdjust = now;
+    }
+};
@@ -0,0 +1,293 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "Frame.h"
+#include "Face.h"
+#include "FrameDetector.h"
+
+#include "AFaceListener.hpp"
+#include "ConfigStore.hpp"
+#include "FaceAggregator.hpp"
+#include "FaceRecorder.hpp"
+#include "FaceTrackStore.hpp"
+#include "FrameSource.hpp"
+#include "HttpPublisher.hpp"
+#include "PlottingImageListener.hpp"
+#include "ResultWriter.hpp"
+#include "StatusListener.hpp"
+#include "StreamScheduler.hpp"
+#include "TelemetryBatcher.hpp"
+#include "TriggerEngine.hpp"
+#include "Wakeup.hpp"
+
+using namespace affdex;
+
+// What the streams of one process share
+struct StreamContext {
+    ConfigStore *configStore;
+    StreamScheduler *scheduler;
+    std::shared_ptr<HttpPublisher> publisher;
+    std::shared_ptr<TelemetryBatcher> batcher;    // null when batching is off
+    ResultWriter *resultWriter;                   // null without --output
+    FaceRecorder *recorder;                       // null without --record
+    std::shared_ptr<FaceAggregator> aggregator;   // null without --aggregate
+    std::shared_ptr<TriggerEngine> triggers;      // null without --rule
+    std::shared_ptr<FaceTrackStore> tracks;       // null with --trackMemoryMB 0
+    size_t resultQueueLength;
+    std::function<std::shared_ptr<FrameDetector>(const AppConfig &)> newDetector;
+    FrameSourceOptions sourceOptions;
+    std::shared_ptr<Wakeup> wakeup;               // notified when a stream ends
+};
+
+//---------------------------------------------------------------------------
+// One camera of a multi-stream run: its capture thread, FrameDetector and
+// listeners. The capture thread paces submissions to PFPS, asks the shared
+// scheduler for a slot before each one, and publishes the results of its own
+// detector tagged with the stream ID.
+//
+// The detector is created with an unlimited process rate, so every frame it
+// is given produces a result and hands its slot back. A source that is not
+// live (a file, synthetic frames) is read at its own frame rate, as if it
+// were a camera; results are handled as they come in while it waits.
+class CameraStream {
+
+    const unsigned int mId;
+    const std::string mSource;
+    StreamContext mContext;
+
+    std::unique_ptr<FrameSource> mCapture;
+    std::shared_ptr<PlottingImageListener> mListener;
+    std::shared_ptr<StatusListener> mStatus;
+    AFaceListener mFaceListener;
+    std::shared_ptr<FrameDetector> mDetector;
+    unsigned int mBufferLength;
+    std::shared_ptr<Wakeup> mWakeup;    // results, the end of processing, stop()
+
+    std::atomic<bool> mStopping;
+    std::thread mThread;
+
+    std::chrono::steady_clock::time_point mStart;
+    std::atomic<double> mRunTime;    // seconds, set when the capture thread ends
+    std::atomic<uint64_t> mCaptured;
+    std::atomic<uint64_t> mSubmitted;
+    std::atomic<uint64_t> mProcessed;
+
+public:
+
+    // source is a camera index or anything openFrameSource opens (file, URL, synthetic, ...)
+    CameraStream(const unsigned int id, const std::string &source, const StreamContext &context)
+            : mId(id), mSource(source), mContext(context), mBufferLength(1), mStopping(false),
+              mRunTime(0), mCaptured(0), mSubmitted(0), mProcessed(0) {
+        if (!source.empty() && source.find_first_not_of("0123456789") == std::string::npos) {
+            mCapture = openFrameSource("camera:" + source, context.sourceOptions);
+        } else {
+            mCapture = openFrameSource(source, context.sourceOptions);
+        }
+        mWakeup = std::make_shared<Wakeup>();
+        mListener = std::make_shared<PlottingImageListener>(false, context.publisher, context.resultQueueLength,
+                                                            (int) id);
+        mListener->setWakeup(mWakeup);
+        mListener->setTrackStore(context.tracks);
+        mFaceListener.setAggregator(context.aggregator, (int) id);
+        mFaceListener.setTrackStore(context.tracks);
+    }
+
+    ~CameraStream() {
+        stop();
+    }
+
+    CameraStream(const CameraStream &) = delete;
+
+    CameraStream &operator=(const CameraStream &) = delete;
+
+    bool isOpened() const {
+        return mCapture->isOpened();
+    }
+
+    void start() {
+        const AppConfig *config = mContext.configStore->current();
+        // Never more frames in flight than the detector buffer or the result queue holds
+        mBufferLength = std::max<size_t>(std::min<size_t>(std::max(config->bufferLength, 1),
+                                                          mContext.resultQueueLength), 1);
+        mStatus = std::make_shared<StatusListener>(mWakeup);
+        mDetector = mContext.newDetector(*config);
+        mDetector->setImageListener(mListener.get());
+        mDetector->setFaceListener(&mFaceListener);
+        mDetector->setProcessStatusListener(mStatus.get());
+        mDetector->start();
+        mStart = std::chrono::steady_clock::now();
+        mThread = std::thread(&CameraStream::run, this);
+    }
+
+    void stop() {
+        mStopping = true;
+        mWakeup->notify();
+        if (mThread.joinable()) mThread.join();
+    }
+
+    bool isRunning() const {
+        return mThread.joinable() && !mStopping;
+    }
+
+    unsigned int getId() const {
+        return mId;
+    }
+
+    const std::string &getSource() const {
+        return mSource;
+    }
+
+    uint64_t getCaptured() const {
+        return mCaptured;
+    }
+
+    uint64_t getProcessed() const {
+        return mProcessed;
+    }
+
+    // Average rates since start(); the listener holds the instantaneous ones
+    double getCaptureFrameRate() const {
+        return mCaptured / elapsed();
+    }
+
+    double getProcessingFrameRate() const {
+        return mProcessed / elapsed();
+    }
+
+    uint64_t getDroppedResults() const {
+        return mListener->getDroppedResults();
+    }
+
+    PlottingImageListener &getListener() {
+        return *mListener;
+    }
+
+    const AFaceListener &getFaceListener() const {
+        return mFaceListener;
+    }
+
+private:
+
+    double elapsed() const {
+        double seconds = mRunTime;
+        if (seconds == 0) seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mStart).count();
+        return seconds > 0 ? seconds : 1;
+    }
+
+    void run() {
+        double next_due = 0;
+        double first_timestamp = -1.0;
+        cv::Mat img;    // reused: the detector keeps its own copy of the pixels
+        while (!mStopping && mStatus->isRunning()) {
+            double timestamp;
+            if (!mCapture->read(img, timestamp)) {
+                if (mCapture->isLive()) {
+                    std::cerr << "ERROR\tFailed to read frame from stream " << mId << " (" << mSource << ")"
+                            << std::endl;
+                } else {
+                    std::cerr << "INFO\tEnd of stream " << mId << " (" << mSource << ")" << std::endl;
+                }
+                break;
+            }
+            if (!mCapture->isLive()) {
+                if (first_timestamp < 0) first_timestamp = timestamp;
+                handleResultsUntil(mStart + std::chrono::microseconds(
+                        (int64_t) ((timestamp - first_timestamp) * 1e6)));
+            }
+            mCaptured++;
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mStart).count();
+
+            // Pace to PFPS, then wait for a fair share of the detector work
+            const AppConfig *config = mContext.configStore->current();
+            const double interval = 1.0 / std::max(config->processFramerate, 1);
+            if (seconds >= next_due && mSubmitted - mProcessed < mBufferLength &&
+                mContext.scheduler->tryAcquire(mId)) {
+                next_due = std::max(next_due + interval, seconds - interval / 2);
+                Frame f(img.size().width, img.size().height, img.data, Frame::COLOR_FORMAT::BGR, (float) seconds);
+                mDetector->process(f);
+                mSubmitted++;
+            }
+
+            while (mListener->tryGetData([&](std::pair<Frame, std::map<FaceId, Face> > &dataPoint) {
+                handleResult(dataPoint.first, dataPoint.second, config->urlBase);
+            }));
+        }
+
+        // Collect what is still in the detector so every slot is handed back
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (mProcessed < mSubmitted && mStatus->isRunning()) {
+            const uint64_t ticket = mWakeup->ticket();
+            const std::string urlBase = mContext.configStore->current()->urlBase;
+            if (!mListener->tryGetData([&](std::pair<Frame, std::map<FaceId, Face> > &dataPoint) {
+                handleResult(dataPoint.first, dataPoint.second, urlBase);
+            }) && !mWakeup->waitUntil(ticket, deadline)) {
+                break;
+            }
+        }
+        mDetector->stop();
+        for (uint64_t i = mProcessed; i < mSubmitted; i++) mContext.scheduler->release(mId);
+        mRunTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - mStart).count();
+        mStopping = true;
+        if (mContext.wakeup) mContext.wakeup->notify();
+    }
+
+    // Handles results as they come in until the deadline, or until stop()
+    void handleResultsUntil(const std::chrono::steady_clock::time_point deadline) {
+        for (;;) {
+            const uint64_t ticket = mWakeup->ticket();
+            const std::string urlBase = mContext.configStore->current()->urlBase;
+            while (mListener->tryGetData([&](std::pair<Frame, std::map<FaceId, Face> > &dataPoint) {
+                handleResult(dataPoint.first, dataPoint.second, urlBase);
+            }));
+            if (mStopping || !mStatus->isRunning() || !mWakeup->waitUntil(ticket, deadline)) break;
+        }
+    }
+
+    void handleResult(const Frame &frame, const std::map<FaceId, Face> &faces, const std::string &urlBase) {
+        mProcessed++;
+        mContext.scheduler->release(mId);
+        if (mContext.resultWriter) {
+            mContext.resultWriter->write(faces, frame.getTimestamp(), mId);
+        }
+        if (mContext.recorder) {
+            mContext.recorder->write(faces, frame.getTimestamp(), mId);
+        }
+        if (mContext.aggregator || mContext.triggers) {
+            if (mContext.aggregator) mContext.aggregator->add(faces, frame.getTimestamp(), mId);
+            if (mContext.triggers) mContext.triggers->add(faces, frame.getTimestamp(), mId);
+        } else if (mContext.batcher) {
+            mContext.batcher->add(faces, frame.getTimestamp(), urlBase, mId);
+        } else {
+            mListener->outputToServer(faces, frame.getTimestamp(), urlBase);
+        }
+    }
+};
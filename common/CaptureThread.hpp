@@ -0,0 +1,120 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "FramePool.hpp"
+#include "FrameSource.hpp"
+#include "Wakeup.hpp"
+
+//---------------------------------------------------------------------------
+// Reads a live source on a thread of its own, so the main loop waits for the
+// next frame and for detector results alike instead of blocking in the camera
+// read. Only the latest frame is kept: one the loop has not taken by the time
+// the next one is read is dropped and counted, as the camera itself would.
+class CaptureThread {
+
+    FrameSource &mSource;
+    FramePool &mPool;
+    std::shared_ptr<Wakeup> mWakeup;    // notified for every frame and at the end
+
+    std::mutex mMutex;
+    std::shared_ptr<cv::Mat> mLatest;
+    double mTimestamp;
+    std::chrono::steady_clock::time_point mCapturedAt;
+    bool mEnded;
+
+    std::atomic<bool> mStopping;
+    std::atomic<uint64_t> mDropped;
+    std::thread mThread;
+
+public:
+
+    CaptureThread(FrameSource &source, FramePool &pool, std::shared_ptr<Wakeup> wakeup)
+            : mSource(source), mPool(pool), mWakeup(wakeup), mTimestamp(0), mEnded(false), mStopping(false),
+              mDropped(0) {
+        mThread = std::thread(&CaptureThread::run, this);
+    }
+
+    ~CaptureThread() {
+        stop();
+    }
+
+    CaptureThread(const CaptureThread &) = delete;
+
+    CaptureThread &operator=(const CaptureThread &) = delete;
+
+    // Takes the frame read since the last call, if there is one
+    bool take(std::shared_ptr<cv::Mat> &frame, double &timestamp, std::chrono::steady_clock::time_point &capturedAt) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        if (!mLatest) return false;
+        frame.swap(mLatest);
+        mLatest.reset();
+        timestamp = mTimestamp;
+        capturedAt = mCapturedAt;
+        return true;
+    }
+
+    // True once the source failed to give a frame
+    bool ended() {
+        std::lock_guard<std::mutex> lg(mMutex);
+        return mEnded;
+    }
+
+    // Returns once the read in progress, if any, is done
+    void stop() {
+        mStopping = true;
+        if (mThread.joinable()) mThread.join();
+    }
+
+    // Frames replaced by a newer one before they were taken
+    uint64_t getDropped() const {
+        return mDropped;
+    }
+
+private:
+
+    void run() {
+        while (!mStopping) {
+            std::shared_ptr<cv::Mat> buffer = mPool.acquire();
+            double timestamp;
+            const bool ok = mSource.read(*buffer, timestamp);
+            const auto capturedAt = std::chrono::steady_clock::now();
+            {
+                std::lock_guard<std::mutex> lg(mMutex);
+                if (ok) {
+                    if (mLatest) mDropped++;
+                    mLatest.swap(buffer);    // the dropped frame goes back to the pool outside the lock
+                    mTimestamp = timestamp;
+                    mCapturedAt = capturedAt;
+                } else {
+                    mEnded = true;
+                }
+            }
+            mWakeup->notify();
+            if (!ok) break;
+        }
+    }
+};
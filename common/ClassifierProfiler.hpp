@@ -0,0 +1,344 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/time.h>
+#endif
+
+#include "Frame.h"
+#include "Face.h"
+#include "FrameDetector.h"
+#include "ImageListener.h"
+#include "ProcessStatusListener.h"
+
+#include "FrameSource.hpp"
+#include "MetricSchema.hpp"
+
+using namespace affdex;
+
+typedef void (FrameDetector::*ClassifierSetter)(bool);
+
+// The SDK classifier behind a metric or appearance field
+struct Classifier {
+    const char *name;
+    ClassifierSetter enable;
+};
+
+// In METRICS order
+constexpr Classifier EMOTION_CLASSIFIERS[NUM_EMOTIONS] = {
+        {"joy",        &FrameDetector::setDetectJoy},
+        {"fear",       &FrameDetector::setDetectFear},
+        {"disgust",    &FrameDetector::setDetectDisgust},
+        {"sadness",    &FrameDetector::setDetectSadness},
+        {"anger",      &FrameDetector::setDetectAnger},
+        {"surprise",   &FrameDetector::setDetectSurprise},
+        {"contempt",   &FrameDetector::setDetectContempt},
+        {"valence",    &FrameDetector::setDetectValence},
+        {"engagement", &FrameDetector::setDetectEngagement}
+};
+
+constexpr Classifier EXPRESSION_CLASSIFIERS[NUM_EXPRESSIONS] = {
+        {"smile",              &FrameDetector::setDetectSmile},
+        {"innerBrowRaise",     &FrameDetector::setDetectInnerBrowRaise},
+        {"browRaise",          &FrameDetector::setDetectBrowRaise},
+        {"browFurrow",         &FrameDetector::setDetectBrowFurrow},
+        {"noseWrinkle",        &FrameDetector::setDetectNoseWrinkle},
+        {"upperLipRaise",      &FrameDetector::setDetectUpperLipRaise},
+        {"lipCornerDepressor", &FrameDetector::setDetectLipCornerDepressor},
+        {"chinRaise",          &FrameDetector::setDetectChinRaise},
+        {"lipPucker",          &FrameDetector::setDetectLipPucker},
+        {"lipPress",           &FrameDetector::setDetectLipPress},
+        {"lipSuck",            &FrameDetector::setDetectLipSuck},
+        {"mouthOpen",          &FrameDetector::setDetectMouthOpen},
+        {"smirk",              &FrameDetector::setDetectSmirk},
+        {"eyeClosure",         &FrameDetector::setDetectEyeClosure},
+        {"attention",          &FrameDetector::setDetectAttention},
+        {"eyeWiden",           &FrameDetector::setDetectEyeWiden},
+        {"cheekRaise",         &FrameDetector::setDetectCheekRaise},
+        {"lidTighten",         &FrameDetector::setDetectLidTighten},
+        {"dimpler",            &FrameDetector::setDetectDimpler},
+        {"lipStretch",         &FrameDetector::setDetectLipStretch},
+        {"jawDrop",            &FrameDetector::setDetectJawDrop}
+};
+
+// In AppearanceField order
+constexpr Classifier APPEARANCE_CLASSIFIERS[NUM_APPEARANCE_FIELDS] = {
+        {"gender",    &FrameDetector::setDetectGender},
+        {"age",       &FrameDetector::setDetectAge},
+        {"ethnicity", &FrameDetector::setDetectEthnicity},
+        {"glasses",   &FrameDetector::setDetectGlasses}
+};
+
+constexpr bool sameName(const char *a, const char *b) {
+    return *a == *b && (*a == '\0' || sameName(a + 1, b + 1));
+}
+
+// True when the classifiers from i on are named like the metrics of the group
+constexpr bool classifiersMatch(const Classifier *classifiers, const MetricGroup group, const int i = 0) {
+    return i == METRIC_GROUPS[group].count ||
+           (sameName(classifiers[i].name, METRICS[METRIC_GROUPS[group].begin + i].name) &&
+            classifiersMatch(classifiers, group, i + 1));
+}
+
+constexpr bool appearanceClassifiersMatch(const int i = 0) {
+    return i == NUM_APPEARANCE_FIELDS ||
+           (sameName(APPEARANCE_CLASSIFIERS[i].name, APPEARANCE_FIELDS[i]) && appearanceClassifiersMatch(i + 1));
+}
+
+static_assert(classifiersMatch(EMOTION_CLASSIFIERS, EMOTIONS), "EMOTION_CLASSIFIERS does not follow METRICS");
+static_assert(classifiersMatch(EXPRESSION_CLASSIFIERS, EXPRESSIONS), "EXPRESSION_CLASSIFIERS does not follow METRICS");
+static_assert(appearanceClassifiersMatch(), "APPEARANCE_CLASSIFIERS does not follow APPEARANCE_FIELDS");
+
+// Turns on the classifiers of the selected metrics and turns off the others.
+// Head angles come with face tracking and need none. The SDK only enables
+// emojis all together, so any selected emoji enables them all.
+inline void enableClassifiers(FrameDetector &detector, const MetricSelection &selection) {
+    for (int i = 0; i < NUM_EMOTIONS; i++) {
+        (detector.*EMOTION_CLASSIFIERS[i].enable)(selection.has(METRIC_GROUPS[EMOTIONS].begin + i));
+    }
+    for (int i = 0; i < NUM_EXPRESSIONS; i++) {
+        (detector.*EXPRESSION_CLASSIFIERS[i].enable)(selection.has(METRIC_GROUPS[EXPRESSIONS].begin + i));
+    }
+    detector.setDetectAllEmojis(selection.hasGroup(EMOJIS));
+    for (int i = 0; i < NUM_APPEARANCE_FIELDS; i++) {
+        (detector.*APPEARANCE_CLASSIFIERS[i].enable)(selection.has((AppearanceField) i));
+    }
+}
+
+// User and system CPU time of the process so far, NaN where it is not known
+inline double processCpuSeconds() {
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+#endif
+    return NAN;
+}
+
+struct ClassifierProfile {
+    std::string name;       // "baseline", "emotions", ...
+    std::string metrics;    // as --metrics takes it
+    uint64_t frames;
+    double seconds;         // from the first frame submitted to the last result
+    double cpuSeconds;      // used by the process over the same time
+    bool ok;
+};
+
+//---------------------------------------------------------------------------
+// Measures what each classifier group costs. The same frames are processed
+// once per configuration: face tracking alone (the baseline), each group
+// alone, everything, and the selection the run was given. Every
+// configuration gets a new detector, created and started before the clock
+// starts, so loading the classifiers is not counted; frames are fed as fast
+// as the detector takes them, at most inFlight at a time, so none is
+// skipped.
+//
+// Time and CPU include reading the frames, the same for every
+// configuration: the cost of a group is its difference to the baseline. A
+// replay: source keeps decoding out of the measurement. Nothing else should
+// run in the process meanwhile, as the CPU time is the whole process's.
+class ClassifierProfiler : public ImageListener, public ProcessStatusListener {
+public:
+
+    typedef std::function<std::unique_ptr<FrameSource>()> SourceFactory;
+    // A detector with its classifier path set and no classifier enabled
+    typedef std::function<std::shared_ptr<FrameDetector>()> DetectorFactory;
+
+private:
+
+    const SourceFactory mOpenSource;
+    const DetectorFactory mNewDetector;
+    const size_t mInFlight;
+    const uint64_t mMaxFrames;
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    uint64_t mResults;
+    bool mFailed;
+
+    std::vector<ClassifierProfile> mProfiles;
+
+public:
+
+    // maxFrames 0 processes the whole source
+    ClassifierProfiler(SourceFactory openSource, DetectorFactory newDetector, const size_t inFlight,
+                       const uint64_t maxFrames)
+            : mOpenSource(openSource), mNewDetector(newDetector), mInFlight(std::max<size_t>(inFlight, 1)),
+              mMaxFrames(maxFrames), mResults(0), mFailed(false) {
+    }
+
+    ClassifierProfiler(const ClassifierProfiler &) = delete;
+
+    ClassifierProfiler &operator=(const ClassifierProfiler &) = delete;
+
+    // Profiles every configuration in turn; false if one of them failed
+    bool run(const MetricSelection &selected) {
+        std::vector<std::pair<std::string, std::string> > configurations{
+                {"baseline", "none"}
+        };
+        for (int g = EMOTIONS; g < NUM_METRIC_GROUPS; g++) {
+            configurations.push_back(std::make_pair(METRIC_GROUPS[g].name, METRIC_GROUPS[g].name));
+        }
+        configurations.push_back(std::make_pair("appearance", "appearance"));
+        configurations.push_back(std::make_pair("all", "all"));
+        if (!selected.isAll()) configurations.push_back(std::make_pair("selected", selected.str()));
+
+        bool ok = true;
+        for (auto &name_spec_pair : configurations) {
+            MetricSelection selection;
+            std::string error;
+            selection.parse(name_spec_pair.second, error);
+            std::cerr << "INFO\tProfiling " << name_spec_pair.first;
+            if (name_spec_pair.first != name_spec_pair.second) std::cerr << " (" << name_spec_pair.second << ")";
+            std::cerr << std::endl;
+            mProfiles.push_back(profile(name_spec_pair.first, selection));
+            ok = ok && mProfiles.back().ok;
+        }
+        return ok;
+    }
+
+    // One line per configuration: fps, CPU per frame, its difference to the
+    // baseline and the cores kept busy
+    void report() const {
+        const ClassifierProfile *baseline = mProfiles.empty() || !mProfiles[0].ok ? nullptr : &mProfiles[0];
+        std::cerr << "INFO\tconfiguration      frames      fps  cpu ms/frame  over baseline  cores" << std::endl;
+        for (const ClassifierProfile &p : mProfiles) {
+            char line[160];
+            if (!p.ok) {
+                snprintf(line, sizeof(line), "%-14s  failed", p.name.c_str());
+            } else {
+                const double fps = p.seconds > 0 ? p.frames / p.seconds : 0;
+                const double cpuMs = p.frames > 0 ? 1000 * p.cpuSeconds / p.frames : 0;
+                const double baseMs = baseline && baseline->frames > 0 ?
+                                      1000 * baseline->cpuSeconds / baseline->frames : NAN;
+                snprintf(line, sizeof(line), "%-14s  %10llu  %7.1f  %12.2f  %+13.2f  %5.2f", p.name.c_str(),
+                         (unsigned long long) p.frames, fps, cpuMs, cpuMs - baseMs,
+                         p.seconds > 0 ? p.cpuSeconds / p.seconds : 0);
+            }
+            std::cerr << "INFO\t" << line << std::endl;
+        }
+    }
+
+    const std::vector<ClassifierProfile> &getProfiles() const {
+        return mProfiles;
+    }
+
+    void onImageResults(std::map<FaceId, Face>, Frame) override {
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            mResults++;
+        }
+        mCond.notify_all();
+    }
+
+    void onImageCapture(Frame) override {
+    }
+
+    void onProcessingException(AffdexException ex) override {
+        std::cerr << "ERROR\tThe detector encountered an exception while profiling: " << ex.what() << std::endl;
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            mFailed = true;
+        }
+        mCond.notify_all();
+    }
+
+    void onProcessingFinished() override {
+    }
+
+private:
+
+    ClassifierProfile profile(const std::string &name, const MetricSelection &selection) {
+        ClassifierProfile p;
+        p.name = name;
+        p.metrics = selection.str();
+        p.frames = 0;
+        p.seconds = 0;
+        p.cpuSeconds = 0;
+        p.ok = false;
+
+        std::unique_ptr<FrameSource> source = mOpenSource();
+        if (!source->isOpened()) {
+            std::cerr << "ERROR\tUnable to open the input to profile" << std::endl;
+            return p;
+        }
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            mResults = 0;
+            mFailed = false;
+        }
+        std::shared_ptr<FrameDetector> detector = mNewDetector();
+        enableClassifiers(*detector, selection);
+        detector->setImageListener(this);
+        detector->setProcessStatusListener(this);
+        detector->start();
+
+        const auto start = std::chrono::steady_clock::now();
+        const double cpuStart = processCpuSeconds();
+        cv::Mat img;
+        double timestamp;
+        bool ok = true;
+        while (ok && (mMaxFrames == 0 || p.frames < mMaxFrames) && source->read(img, timestamp)) {
+            ok = waitForResults(p.frames, mInFlight - 1);
+            if (!ok) break;
+            Frame f(img.size().width, img.size().height, img.data, Frame::COLOR_FORMAT::BGR, (float) timestamp);
+            detector->process(f);
+            p.frames++;
+        }
+        ok = ok && waitForResults(p.frames, 0);
+        p.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        p.cpuSeconds = processCpuSeconds() - cpuStart;
+        detector->stop();
+
+        if (ok && p.frames == 0) std::cerr << "ERROR\tThe input to profile has no frames" << std::endl;
+        p.ok = ok && p.frames > 0;
+        return p;
+    }
+
+    // Keeps at most `limit` frames in the detector, so none is dropped
+    bool waitForResults(const uint64_t submitted, const uint64_t limit) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        const bool progress = mCond.wait_for(lk, std::chrono::seconds(5), [&] {
+            return mFailed || submitted - mResults <= limit;
+        });
+        if (!progress) {
+            std::cerr << "ERROR\tGot no detector results for 5 seconds while profiling" << std::endl;
+        }
+        return progress && !mFailed;
+    }
+};
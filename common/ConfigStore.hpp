@@ -0,0 +1,311 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#include "TelemetryBatcher.hpp"
+
+namespace configuration {
+    //---------------------------------------------------------------------------
+    // The configuration::data is a simple map string (key, value) pairs.
+    // The file is stored as a simple listing of those pairs, one per line.
+    // The key is separated from the value by an equal sign '='.
+    // Commentary begins with the first non-space character on the line a hash or
+    // semi-colon ('#' or ';').
+    struct data : std::map<std::string, std::string> {
+        // Here is a little convenience method...
+        bool iskey(const std::string &s) const {
+            return count(s) != 0;
+        }
+    };
+
+    //---------------------------------------------------------------------------
+    // The extraction operator reads configuration::data until EOF.
+    // Invalid data is ignored.
+    //
+    inline std::istream &operator>>(std::istream &ins, data &d) {
+        std::string s, key, value;
+
+        // For each (key, value) pair in the file
+        while (std::getline(ins, s)) {
+            std::string::size_type begin = s.find_first_not_of(" \f\t\v");
+
+            // Skip blank lines
+            if (begin == std::string::npos) continue;
+
+            // Skip commentary
+            if (std::string("#;").find(s[begin]) != std::string::npos) continue;
+
+            // Extract the key value (a line without '=' is not a pair)
+            std::string::size_type end = s.find('=', begin);
+            if (end == std::string::npos) continue;
+            key = s.substr(begin, end - begin);
+
+            // (No leading or trailing whitespace allowed)
+            key.erase(key.find_last_not_of(" \f\t\v") + 1);
+
+            // No blank keys allowed
+            if (key.empty()) continue;
+
+            // Extract the value (no leading or trailing whitespace allowed);
+            // "KEY=" gives an empty value
+            begin = s.find_first_not_of(" \f\n\r\t\v", end + 1);
+            if (begin == std::string::npos) {
+                value.clear();
+            } else {
+                end = s.find_last_not_of(" \f\n\r\t\v") + 1;
+                value = s.substr(begin, end - begin);
+            }
+
+            // Insert the properly extracted (key, value) pair into the map
+            d[key] = value;
+        }
+
+        return ins;
+    }
+
+    //---------------------------------------------------------------------------
+    // The insertion operator writes all configuration::data to stream.
+    //
+    inline std::ostream &operator<<(std::ostream &outs, const data &d) {
+        data::const_iterator iter;
+        for (iter = d.begin(); iter != d.end(); iter++)
+            outs << iter->first << " = " << iter->second << std::endl;
+        return outs;
+    }
+
+} // namespace configuration
+
+
+//---------------------------------------------------------------------------
+// Typed view of the settings that can come from emoj.conf.
+// Snapshots are immutable once published.
+struct AppConfig {
+    uint64_t generation;        // bumped every time a changed snapshot is published
+
+    std::string urlBase;        // URLBASE
+    int processFramerate;       // PFPS
+    int bufferLength;           // BUFFER_LEN
+    int faceDetectorMode;       // FACE_MODE
+
+    // Read at startup only
+    BatchOptions batch;         // BATCH_FRAMES, BATCH_LINGER_MS, BATCH_FORMAT, COMPRESSION
+    std::string metrics;        // METRICS, as MetricSelection::parse takes it
+
+    bool sameDetectorSettings(const AppConfig &other) const {
+        return processFramerate == other.processFramerate && bufferLength == other.bufferLength &&
+               faceDetectorMode == other.faceDetectorMode;
+    }
+
+    bool operator==(const AppConfig &other) const {
+        return urlBase == other.urlBase && sameDetectorSettings(other) &&
+               batch.frames == other.batch.frames && batch.lingerMs == other.batch.lingerMs &&
+               batch.format == other.batch.format && batch.compression == other.batch.compression &&
+               metrics == other.metrics;
+    }
+};
+
+//---------------------------------------------------------------------------
+// Parses emoj.conf into an AppConfig snapshot and keeps it current.
+// Readers get the snapshot with a single atomic pointer load. A watcher
+// thread polls the file modification time and publishes a new snapshot
+// when the contents change. Replaced snapshots are kept alive for the life
+// of the store, so a pointer obtained from current() never dangles; there is
+// one per actual change of the file, which keeps the cost negligible.
+class ConfigStore {
+
+    const std::string mPath;
+    const AppConfig mDefaults;
+    const std::set<std::string> mPinned;    // keys given on the command line
+
+    std::atomic<const AppConfig *> mCurrent;
+    std::vector<std::unique_ptr<const AppConfig> > mSnapshots;
+
+    std::mutex mReloadMutex;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    bool mStopping;
+    std::thread mWatcher;
+    std::time_t mLastWrite;
+    uintmax_t mLastSize;
+
+public:
+
+    // defaults holds the built-in and command line values; keys listed in
+    // pinned keep their command line value whatever the file says.
+    ConfigStore(const std::string &path, const AppConfig &defaults, const std::set<std::string> &pinned)
+            : mPath(path), mDefaults(defaults), mPinned(pinned), mCurrent(nullptr),
+              mStopping(false), mLastWrite(0), mLastSize(0) {
+        AppConfig first;
+        if (!tryParse(first)) {
+            first = mDefaults;
+            first.generation = 0;
+        }
+        mSnapshots.push_back(std::unique_ptr<const AppConfig>(new AppConfig(first)));
+        mCurrent.store(mSnapshots.back().get(), std::memory_order_release);
+        if (mPath.empty()) {
+            std::cerr << "INFO\tHOME is not set, running without a configuration file" << std::endl;
+        }
+    }
+
+    ~ConfigStore() {
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            mStopping = true;
+        }
+        mCond.notify_all();
+        if (mWatcher.joinable()) mWatcher.join();
+    }
+
+    ConfigStore(const ConfigStore &) = delete;
+
+    ConfigStore &operator=(const ConfigStore &) = delete;
+
+    // $HOME/.emoj/emoj.conf, or an empty path when HOME is not set
+    static std::string defaultPath() {
+        const char *home = getenv("HOME");
+        return home ? std::string(home) + "/.emoj/emoj.conf" : std::string();
+    }
+
+    const AppConfig *current() const {
+        return mCurrent.load(std::memory_order_acquire);
+    }
+
+    // Start polling the file every pollMs milliseconds.
+    void watch(const unsigned int pollMs) {
+        if (mPath.empty() || mWatcher.joinable()) return;
+        fileChanged();    // remember the state the first snapshot was read from
+        mWatcher = std::thread(&ConfigStore::watchLoop, this, pollMs);
+    }
+
+    // Re-read the file; returns true if a changed snapshot was published.
+    // A file that cannot be read keeps the current snapshot.
+    bool reload() {
+        std::lock_guard<std::mutex> lg(mReloadMutex);
+        std::unique_ptr<AppConfig> next(new AppConfig());
+        if (!tryParse(*next)) return false;
+        const AppConfig *prev = current();
+        if (*next == *prev) return false;
+        next->generation = prev->generation + 1;
+        mCurrent.store(next.get(), std::memory_order_release);
+        mSnapshots.push_back(std::unique_ptr<const AppConfig>(next.release()));
+        std::cerr << "INFO\tConfiguration reloaded from " << mPath << std::endl;
+        return true;
+    }
+
+private:
+
+    AppConfig parse() const {
+        AppConfig config = mDefaults;
+        config.generation = 0;
+        if (mPath.empty()) return config;
+
+        configuration::data d;
+        std::ifstream f(mPath);
+        f >> d;
+        f.close();
+
+        if (d.iskey("URLBASE")) config.urlBase = d["URLBASE"];
+        readInt(d, "PFPS", 1, config.processFramerate);
+        readInt(d, "BUFFER_LEN", 1, config.bufferLength);
+        readInt(d, "FACE_MODE", 0, config.faceDetectorMode);
+        int value;
+        if (readInt(d, "BATCH_FRAMES", 0, value)) config.batch.frames = value;
+        if (readInt(d, "BATCH_LINGER_MS", 0, value)) config.batch.lingerMs = value;
+        if (use(d, "BATCH_FORMAT") && !parseBatchFormat(d["BATCH_FORMAT"], config.batch.format)) {
+            std::cerr << "WARN\tIgnoring invalid BATCH_FORMAT: " << d["BATCH_FORMAT"] << std::endl;
+        }
+        if (use(d, "COMPRESSION") && !parseCompression(d["COMPRESSION"], config.batch.compression)) {
+            std::cerr << "WARN\tIgnoring invalid COMPRESSION: " << d["COMPRESSION"] << std::endl;
+        }
+        if (use(d, "METRICS")) {
+            MetricSelection selection;
+            std::string error;
+            if (selection.parse(d["METRICS"], error)) config.metrics = d["METRICS"];
+            else std::cerr << "WARN\tIgnoring invalid METRICS: " << error << std::endl;
+        }
+        return config;
+    }
+
+    // parse() without letting an exception out: reload() runs on the watcher
+    // thread, where one would terminate the process
+    bool tryParse(AppConfig &out) const {
+        try {
+            out = parse();
+            return true;
+        } catch (std::exception &ex) {
+            std::cerr << "WARN\tUnable to read the configuration from " << mPath << ": " << ex.what() << std::endl;
+            return false;
+        }
+    }
+
+    bool use(const configuration::data &d, const std::string &key) const {
+        return d.iskey(key) && !mPinned.count(key);
+    }
+
+    // A bad value is ignored with a warning (the command line or built-in value
+    // applies), so an edit in progress cannot take the app down.
+    bool readInt(configuration::data &d, const std::string &key, const int min, int &out) const {
+        if (!use(d, key)) return false;
+        try {
+            size_t end;
+            const int value = std::stoi(d[key], &end);
+            if (end != d[key].size() || value < min) throw std::invalid_argument(key);
+            out = value;
+            return true;
+        } catch (std::exception &) {
+            std::cerr << "WARN\tIgnoring invalid " << key << ": " << d[key] << std::endl;
+            return false;
+        }
+    }
+
+    bool fileChanged() {
+        boost::system::error_code ec;
+        const std::time_t lastWrite = boost::filesystem::last_write_time(mPath, ec);
+        const uintmax_t size = ec ? 0 : boost::filesystem::file_size(mPath, ec);
+        if (ec || (lastWrite == mLastWrite && size == mLastSize)) return false;
+        mLastWrite = lastWrite;
+        mLastSize = size;
+        return true;
+    }
+
+    void watchLoop(const unsigned int pollMs) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        while (!mCond.wait_for(lk, std::chrono::milliseconds(pollMs), [this] { return mStopping; })) {
+            if (fileChanged()) reload();
+        }
+    }
+};
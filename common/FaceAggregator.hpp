@@ -0,0 +1,385 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Face.h"
+
+#include "FaceRecord.hpp"
+#include "NumberFormat.hpp"
+
+using namespace affdex;
+
+// The accumulators are padded to a whole number of 8-float vectors
+const int METRIC_STRIDE = (NUM_METRICS + 7) / 8 * 8;
+// Dominant emoji counts, in DOMINANT_EMOJIS order
+const int NUM_EMOJI_BINS = NUM_DOMINANT_EMOJIS;
+
+// Per-metric statistics of one face over one window. Metrics are in
+// METRICS order, as in FaceRecord.
+struct FaceSummary {
+    FaceId faceId;
+    int streamId;
+    double window;          // seconds
+    double start;           // window start, a multiple of the window length
+    double end;             // timestamp of the last sample
+    uint32_t samples;
+    bool partial;           // the face was lost, or the run ended, before the window did
+    float mean[METRIC_STRIDE];
+    float min[METRIC_STRIDE];
+    float max[METRIC_STRIDE];
+    float peakTime[METRIC_STRIDE];    // seconds after start at which max was first reached
+    uint32_t dominantEmoji[NUM_EMOJI_BINS];
+};
+
+//---------------------------------------------------------------------------
+// Rolls the per-frame values of every face up into per-window summaries, so
+// that a few summaries per face replace the 30 samples a second. Each window
+// length is a tumbling window aligned to multiples of its length, e.g. with
+// 1, 10 and 60 s a face seen from 0 to 65 s yields 65 one-second summaries,
+// 6 ten-second ones and 1 of 60 s as the windows close, then a partial
+// summary of each window still open when the face is lost.
+//
+// The accumulators of a face are struct-of-arrays: one padded float array
+// per statistic, so the update of all 45 metrics of a sample is a handful of
+// branch-free loops the compiler vectorizes. Faces live in a small vector
+// with their accumulators reused across faces, so tracking a new face does
+// not allocate once the vector has grown.
+//
+// add() is called with the results of a stream in timestamp order;
+// faceLost() may be called from the SDK thread. A lost face is only closed
+// once add() has moved past the results up to the loss, which may still be
+// queued when the SDK reports it. Streams share one aggregator, so faces are
+// told apart by stream and face ID.
+class FaceAggregator {
+
+    struct Window {
+        double start;
+        double end;
+        uint32_t samples;
+        float sum[METRIC_STRIDE];
+        float min[METRIC_STRIDE];
+        float max[METRIC_STRIDE];
+        float peakTime[METRIC_STRIDE];
+        uint32_t dominantEmoji[NUM_EMOJI_BINS];
+    };
+
+    struct Track {
+        bool used;
+        FaceId faceId;
+        int streamId;
+        std::vector<Window> windows;    // one per window length
+    };
+
+    struct Lost {
+        double timeStamp;
+        FaceId faceId;
+        int streamId;
+    };
+
+    const std::vector<double> mLengths;
+    const std::function<void(const FaceSummary &)> mEmit;
+
+    std::mutex mMutex;
+    std::vector<Track> mTracks;
+    std::vector<Lost> mLost;
+    std::vector<FaceSummary> mPending;    // closed under mMutex, not yet emitted
+
+    // Held instead of mMutex while emitting, so that faceLost() and the
+    // other streams do not wait for the publisher
+    std::mutex mEmitMutex;
+
+    std::atomic<uint64_t> mSamples;
+    std::atomic<uint64_t> mSummaries;
+
+public:
+
+    // emit is called from add() or flush(), one call at a time, after the
+    // summaries have been closed and the aggregator lock released
+    FaceAggregator(const std::vector<double> &windowSeconds, std::function<void(const FaceSummary &)> emit)
+            : mLengths(windowSeconds), mEmit(emit), mSamples(0), mSummaries(0) {
+    }
+
+    void add(const std::map<FaceId, Face> &faces, const double timeStamp, const int streamId = -1) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        closeLost(streamId, timeStamp);
+        float values[METRIC_STRIDE];
+        for (auto &face_id_pair : faces) {
+            const Face &f = face_id_pair.second;
+            metricValues(f, values);
+            std::fill(values + NUM_METRICS, values + METRIC_STRIDE, 0.0f);
+            addSample(f.id, streamId, timeStamp, values, f.emojis.dominantEmoji);
+        }
+        deliver(lk);
+    }
+
+    // Records of the sharded runner, whose faces are never reported lost:
+    // their last windows are closed by flush()
+    void add(const std::vector<FaceRecord> &records) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        float values[METRIC_STRIDE];
+        for (const FaceRecord &r : records) {
+            closeLost(r.streamId, r.timeStamp);
+            std::memcpy(values, r.metrics, sizeof(r.metrics));
+            std::fill(values + NUM_METRICS, values + METRIC_STRIDE, 0.0f);
+            addSample(r.faceId, r.streamId, r.timeStamp, values, r.dominantEmoji);
+        }
+        deliver(lk);
+    }
+
+    void faceLost(const float timeStamp, const FaceId faceId, const int streamId = -1) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        Lost lost;
+        lost.timeStamp = timeStamp;
+        lost.faceId = faceId;
+        lost.streamId = streamId;
+        mLost.push_back(lost);
+    }
+
+    // Emits the windows still open as partial summaries and forgets every face
+    void flush() {
+        std::unique_lock<std::mutex> lk(mMutex);
+        mLost.clear();
+        for (Track &t : mTracks) {
+            if (t.used) close(t);
+        }
+        deliver(lk);
+    }
+
+    const std::vector<double> &getWindows() const {
+        return mLengths;
+    }
+
+    uint64_t getSamples() const {
+        return mSamples;
+    }
+
+    uint64_t getSummaries() const {
+        return mSummaries;
+    }
+
+private:
+
+    static int emojiBin(const Emoji emoji) {
+        const int i = dominantEmojiIndex(emoji);
+        return i >= 0 ? i : NUM_EMOJI_BINS - 1;
+    }
+
+    // Passes the summaries closed so far to mEmit; called with mMutex held
+    // through lk, which is released while emitting. The summaries of a
+    // stream come from one thread, so they are still emitted in order.
+    void deliver(std::unique_lock<std::mutex> &lk) {
+        if (mPending.empty()) return;
+        std::vector<FaceSummary> ready;
+        ready.swap(mPending);
+        lk.unlock();
+        {
+            std::lock_guard<std::mutex> lg(mEmitMutex);
+            for (const FaceSummary &s : ready) mEmit(s);
+        }
+        ready.clear();
+        lk.lock();
+        // Keep the capacity for the next summaries
+        if (mPending.empty()) mPending.swap(ready);
+    }
+
+    // Called with mMutex held
+    void closeLost(const int streamId, const double timeStamp) {
+        for (size_t i = 0; i < mLost.size();) {
+            const Lost &lost = mLost[i];
+            if (lost.streamId != streamId || lost.timeStamp >= timeStamp) {
+                i++;
+                continue;
+            }
+            for (Track &t : mTracks) {
+                if (t.used && t.faceId == lost.faceId && t.streamId == streamId) close(t);
+            }
+            mLost[i] = mLost.back();
+            mLost.pop_back();
+        }
+    }
+
+    Track &track(const FaceId faceId, const int streamId) {
+        Track *free = nullptr;
+        for (Track &t : mTracks) {
+            if (t.used && t.faceId == faceId && t.streamId == streamId) return t;
+            if (!t.used && !free) free = &t;
+        }
+        if (!free) {
+            mTracks.push_back(Track());
+            mTracks.back().windows.resize(mLengths.size());
+            free = &mTracks.back();
+        }
+        free->used = true;
+        free->faceId = faceId;
+        free->streamId = streamId;
+        for (Window &w : free->windows) w.samples = 0;
+        return *free;
+    }
+
+    void addSample(const FaceId faceId, const int streamId, const double timeStamp, const float *values,
+                   const Emoji dominantEmoji) {
+        Track &t = track(faceId, streamId);
+        const int bin = emojiBin(dominantEmoji);
+        for (size_t k = 0; k < mLengths.size(); k++) {
+            Window &w = t.windows[k];
+            const double length = mLengths[k];
+            if (w.samples > 0 && timeStamp >= w.start + length) {
+                emit(t, k, false);
+                w.samples = 0;
+            }
+            if (w.samples == 0) {
+                w.start = std::floor(timeStamp / length) * length;
+                std::copy(values, values + METRIC_STRIDE, w.sum);
+                std::copy(values, values + METRIC_STRIDE, w.min);
+                std::copy(values, values + METRIC_STRIDE, w.max);
+                std::fill(w.peakTime, w.peakTime + METRIC_STRIDE, (float) (timeStamp - w.start));
+                std::fill(w.dominantEmoji, w.dominantEmoji + NUM_EMOJI_BINS, 0);
+            } else {
+                const float offset = (float) (timeStamp - w.start);
+                float *sum = w.sum, *min = w.min, *max = w.max, *peakTime = w.peakTime;
+                for (int j = 0; j < METRIC_STRIDE; j++) sum[j] += values[j];
+                for (int j = 0; j < METRIC_STRIDE; j++) min[j] = values[j] < min[j] ? values[j] : min[j];
+                for (int j = 0; j < METRIC_STRIDE; j++) peakTime[j] = values[j] > max[j] ? offset : peakTime[j];
+                for (int j = 0; j < METRIC_STRIDE; j++) max[j] = values[j] > max[j] ? values[j] : max[j];
+            }
+            w.end = timeStamp;
+            w.samples++;
+            w.dominantEmoji[bin]++;
+        }
+        mSamples++;
+    }
+
+    void close(Track &t) {
+        for (size_t k = 0; k < mLengths.size(); k++) {
+            if (t.windows[k].samples > 0) emit(t, k, true);
+            t.windows[k].samples = 0;
+        }
+        t.used = false;
+    }
+
+    // Queues the summary of window k of t for deliver()
+    void emit(const Track &t, const size_t k, const bool partial) {
+        const Window &w = t.windows[k];
+        mPending.push_back(FaceSummary());
+        FaceSummary &s = mPending.back();
+        s.faceId = t.faceId;
+        s.streamId = t.streamId;
+        s.window = mLengths[k];
+        s.start = w.start;
+        s.end = w.end;
+        s.samples = w.samples;
+        s.partial = partial;
+        const float scale = 1.0f / w.samples;
+        for (int j = 0; j < METRIC_STRIDE; j++) s.mean[j] = w.sum[j] * scale;
+        std::copy(w.min, w.min + METRIC_STRIDE, s.min);
+        std::copy(w.max, w.max + METRIC_STRIDE, s.max);
+        std::copy(w.peakTime, w.peakTime + METRIC_STRIDE, s.peakTime);
+        std::copy(w.dominantEmoji, w.dominantEmoji + NUM_EMOJI_BINS, s.dominantEmoji);
+        mSummaries++;
+    }
+};
+
+//---------------------------------------------------------------------------
+// Writes a summary as a JSON object on one line:
+//   {"faceId":0,"window":10,"start":20,"end":29.97,"samples":300,"partial":false,
+//    "headAngles":{"pitch":{"mean":..,"min":..,"max":..,"peakTime":..},...},
+//    "emotions":{...},"expressions":{...},"emojis":{...},"dominantEmoji":{..:12,...}}
+// Metrics are grouped like the SDK structs, as "smirk" is both an expression
+// and an emoji. The dominant emoji counts are keyed like dominantEmoji in the
+// per-frame records; emojis that were never dominant are left out. Metrics
+// MetricSelection::active() leaves out are not written, nor are groups with
+// none selected.
+class SummarySerializer {
+
+    std::string mBuffer;
+
+public:
+
+    SummarySerializer() {
+        mBuffer.reserve(8192);
+    }
+
+    // The returned reference is valid until the next call
+    const std::string &serialize(const FaceSummary &s) {
+        mBuffer.clear();
+        append(s.faceId, "{\"faceId\":");
+        if (s.streamId >= 0) append(s.streamId, ",\"streamId\":");
+        append(s.window, ",\"window\":");
+        append(s.start, ",\"start\":");
+        append(s.end, ",\"end\":");
+        append(s.samples, ",\"samples\":");
+        mBuffer.append(s.partial ? ",\"partial\":true" : ",\"partial\":false");
+        const MetricSelection &selection = MetricSelection::active();
+        for (int g = 0; g < NUM_METRIC_GROUPS; g++) {
+            if (selection.hasGroup((MetricGroup) g)) group(s, METRIC_GROUPS[g], selection);
+        }
+        if (selection.hasGroup(EMOJIS)) {
+            mBuffer.append(",\"dominantEmoji\":{");
+            bool first = true;
+            for (int i = 0; i < NUM_EMOJI_BINS; i++) {
+                if (s.dominantEmoji[i] == 0) continue;
+                mBuffer.append(first ? "\"" : ",\"").append(dominantEmojiName(i)).append("\":");
+                append(s.dominantEmoji[i], "");
+                first = false;
+            }
+            mBuffer.push_back('}');
+        }
+        mBuffer.append("}\n");
+        return mBuffer;
+    }
+
+private:
+
+    void append(const double value, const char *key) {
+        mBuffer.append(key);
+        if (std::isfinite(value)) {
+            char buf[numfmt::MAX_CHARS];
+            mBuffer.append(buf, numfmt::formatG(buf, value));
+        } else {
+            mBuffer.append("null");
+        }
+    }
+
+    void group(const FaceSummary &s, const MetricGroupInfo &g, const MetricSelection &selection) {
+        mBuffer.append(",\"").append(g.name).append("\":{");
+        bool first = true;
+        for (int j = g.begin; j < g.begin + g.count; j++) {
+            if (!selection.has(j)) continue;
+            mBuffer.append(first ? "\"" : ",\"").append(METRICS[j].name).append("\":{");
+            first = false;
+            append(s.mean[j], "\"mean\":");
+            append(s.min[j], ",\"min\":");
+            append(s.max[j], ",\"max\":");
+            append(s.peakTime[j], ",\"peakTime\":");
+            mBuffer.push_back('}');
+        }
+        mBuffer.push_back('}');
+    }
+};
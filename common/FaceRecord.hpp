@@ -0,0 +1,59 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <cstring>
+#include <string>
+
+#include "Face.h"
+
+#include "MetricSchema.hpp"
+
+using namespace affdex;
+
+//---------------------------------------------------------------------------
+// The values of one Face that are published, without the feature points.
+// Fixed size, so records can be queued and batched without touching the heap.
+struct FaceRecord {
+    double timeStamp;
+    FaceId faceId;
+    int streamId;    // camera stream in multi-stream mode, -1 otherwise
+    float interocularDistance;
+    Glasses glasses;
+    Age age;
+    Ethnicity ethnicity;
+    Gender gender;
+    Emoji dominantEmoji;
+    float metrics[NUM_METRICS];    // in METRICS order: headAngles, emotions, expressions, emojis
+
+    static FaceRecord fromFace(const Face &f, const double timeStamp, const int streamId = -1) {
+        FaceRecord r;
+        r.timeStamp = timeStamp;
+        r.faceId = f.id;
+        r.streamId = streamId;
+        r.interocularDistance = f.measurements.interocularDistance;
+        r.glasses = f.appearance.glasses;
+        r.age = f.appearance.age;
+        r.ethnicity = f.appearance.ethnicity;
+        r.gender = f.appearance.gender;
+        r.dominantEmoji = f.emojis.dominantEmoji;
+        metricValues(f, r.metrics);
+        return r;
+    }
+};
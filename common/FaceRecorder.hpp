@@ -0,0 +1,258 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Face.h"
+
+#include "FaceRecord.hpp"
+#include "RecordingFormat.hpp"
+
+using namespace affdex;
+
+struct RecorderStats {
+    uint64_t rows;          // faces recorded
+    uint64_t chunks;
+    uint64_t rawBytes;      // column data before encoding
+    uint64_t fileBytes;
+};
+
+//---------------------------------------------------------------------------
+// Records every face into a chunked columnar file (see RecordingFormat.hpp).
+// Faces are appended to in-memory columns; every rowsPerChunk faces the
+// columns are encoded and written as one chunk, and close() writes the time
+// index. Thread-safe: the streams of a multi-stream run share one recorder.
+//
+// Columns are named after the FaceRecord fields, the metrics by their
+// qualified name in METRICS ("emotions.joy", "expressions.smirk", ...), plus "points.x" and
+// "points.y" holding pointsPerFace feature point coordinates per face (NaN
+// where a face has fewer). Only the metrics MetricSelection::active() selects
+// get a column.
+class FaceRecorder {
+
+    struct Column {
+        recording::ColumnInfo info;
+        std::string data;
+    };
+
+    const uint32_t mRowsPerChunk;
+    const uint16_t mPointsPerFace;
+
+    std::mutex mMutex;
+    std::ofstream mOut;
+    std::vector<Column> mColumns;
+    uint32_t mRows;
+    double mMinTime;
+    double mMaxTime;
+    std::string mIndex;
+    uint32_t mChunkCount;
+    recording::ColumnEncoder mEncoder;
+    std::string mEncoded;
+
+    std::atomic<uint64_t> mRowCount;
+    std::atomic<uint64_t> mChunks;
+    std::atomic<uint64_t> mRawBytes;
+    std::atomic<uint64_t> mFileBytes;
+
+public:
+
+    // The SDK reports 34 feature points per face
+    explicit FaceRecorder(const std::string &path, const uint32_t rowsPerChunk = 4096,
+                          const uint16_t pointsPerFace = 34)
+            : mRowsPerChunk(std::max(rowsPerChunk, 1u)), mPointsPerFace(pointsPerFace),
+              mOut(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc), mRows(0), mChunkCount(0),
+              mRowCount(0), mChunks(0), mRawBytes(0), mFileBytes(0) {
+        addColumn("timeStamp", recording::F64);
+        addColumn("faceId", recording::I32);
+        addColumn("streamId", recording::I32);
+        addColumn("interocularDistance", recording::F32);
+        addColumn("glasses", recording::U8);
+        addColumn("age", recording::U8);
+        addColumn("ethnicity", recording::U8);
+        addColumn("gender", recording::U8);
+        addColumn("dominantEmoji", recording::U32);
+        for (const int j : MetricSelection::active()) addColumn(METRICS[j].qualifiedName);
+        addColumn("points.x", recording::F32, mPointsPerFace);
+        addColumn("points.y", recording::F32, mPointsPerFace);
+        resetChunk();
+        writeHeader();
+    }
+
+    ~FaceRecorder() {
+        close();
+    }
+
+    FaceRecorder(const FaceRecorder &) = delete;
+
+    FaceRecorder &operator=(const FaceRecorder &) = delete;
+
+    bool isOpened() const {
+        return mOut.is_open();
+    }
+
+    void write(const std::map<FaceId, Face> &faces, const double timeStamp, const int streamId = -1) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        if (!mOut.is_open()) return;
+        for (auto &face_id_pair : faces) {
+            const Face &face = face_id_pair.second;
+            appendRecord(FaceRecord::fromFace(face, timeStamp, streamId), &face.featurePoints);
+        }
+    }
+
+    // Records without feature points, e.g. from the sharded runner
+    void write(const std::vector<FaceRecord> &records) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        if (!mOut.is_open()) return;
+        for (const FaceRecord &r : records) appendRecord(r, nullptr);
+    }
+
+    // Writes the last chunk and the index
+    void close() {
+        std::lock_guard<std::mutex> lg(mMutex);
+        if (!mOut.is_open()) return;
+        if (mRows > 0) writeChunk();
+        const uint64_t indexOffset = (uint64_t) mOut.tellp();
+        std::string footer("EMJI", 4);
+        recording::appendRaw(footer, mChunkCount);
+        footer.append(mIndex);
+        recording::appendRaw(footer, indexOffset);
+        footer.append("EMJE", 4);
+        mOut.write(footer.data(), footer.size());
+        mFileBytes += footer.size();
+        mOut.close();
+    }
+
+    RecorderStats getStats() const {
+        RecorderStats stats;
+        stats.rows = mRowCount;
+        stats.chunks = mChunks;
+        stats.rawBytes = mRawBytes;
+        stats.fileBytes = mFileBytes;
+        return stats;
+    }
+
+private:
+
+    void addColumn(const std::string &name, const uint8_t type = recording::F32, const uint16_t width = 1) {
+        Column c;
+        c.info.name = name;
+        c.info.type = type;
+        c.info.width = width;
+        mColumns.push_back(c);
+    }
+
+    void writeHeader() {
+        std::string header("EMJR", 4);
+        recording::appendRaw(header, recording::VERSION);
+        recording::appendRaw(header, (uint16_t) mColumns.size());
+        for (const Column &c : mColumns) {
+            recording::appendRaw(header, c.info.type);
+            recording::appendRaw(header, (uint8_t) 0);
+            recording::appendRaw(header, c.info.width);
+            recording::appendRaw(header, (uint16_t) c.info.name.size());
+            header.append(c.info.name);
+        }
+        mOut.write(header.data(), header.size());
+        mFileBytes += header.size();
+    }
+
+    void resetChunk() {
+        mRows = 0;
+        mMinTime = std::numeric_limits<double>::infinity();
+        mMaxTime = -std::numeric_limits<double>::infinity();
+        for (Column &c : mColumns) {
+            c.data.clear();
+            c.data.reserve((size_t) mRowsPerChunk * c.info.width * recording::typeSize(c.info.type));
+        }
+    }
+
+    // Called with mMutex held. Columns are filled in constructor order.
+    void appendRecord(const FaceRecord &r, const VecFeaturePoint *points) {
+        Column *c = &mColumns[0];
+        recording::appendRaw((c++)->data, r.timeStamp);
+        recording::appendRaw((c++)->data, (int32_t) r.faceId);
+        recording::appendRaw((c++)->data, (int32_t) r.streamId);
+        recording::appendRaw((c++)->data, r.interocularDistance);
+        recording::appendRaw((c++)->data, (uint8_t) r.glasses);
+        recording::appendRaw((c++)->data, (uint8_t) r.age);
+        recording::appendRaw((c++)->data, (uint8_t) r.ethnicity);
+        recording::appendRaw((c++)->data, (uint8_t) r.gender);
+        recording::appendRaw((c++)->data, (uint32_t) r.dominantEmoji);
+        for (const int j : MetricSelection::active()) recording::appendRaw((c++)->data, r.metrics[j]);
+        std::string &xs = (c++)->data;
+        std::string &ys = c->data;
+        const size_t known = points ? std::min(points->size(), (size_t) mPointsPerFace) : 0;
+        for (size_t i = 0; i < mPointsPerFace; i++) {
+            const float x = i < known ? (*points)[i].x : NAN;
+            const float y = i < known ? (*points)[i].y : NAN;
+            recording::appendRaw(xs, x);
+            recording::appendRaw(ys, y);
+        }
+
+        mMinTime = std::min(mMinTime, r.timeStamp);
+        mMaxTime = std::max(mMaxTime, r.timeStamp);
+        mRowCount++;
+        if (++mRows >= mRowsPerChunk) writeChunk();
+    }
+
+    void writeChunk() {
+        const uint64_t offset = (uint64_t) mOut.tellp();
+        std::string chunk("EMJK", 4);
+        recording::appendRaw(chunk, mRows);
+        recording::appendRaw(chunk, mMinTime);
+        recording::appendRaw(chunk, mMaxTime);
+        const size_t directory = chunk.size();
+        chunk.resize(directory + mColumns.size() * 8);
+        for (size_t i = 0; i < mColumns.size(); i++) {
+            const Column &c = mColumns[i];
+            const size_t valueSize = recording::typeSize(c.info.type);
+            const uint8_t codec = mEncoder.encode(c.data.data(), c.data.size() / valueSize, valueSize,
+                                                  c.info.width, mEncoded);
+            const uint32_t size = (uint32_t) mEncoded.size();
+            char *entry = &chunk[directory + i * 8];
+            memset(entry, 0, 8);
+            entry[0] = (char) codec;
+            memcpy(entry + 4, &size, sizeof(size));
+            chunk.append(mEncoded);
+            mRawBytes += c.data.size();
+        }
+        mOut.write(chunk.data(), chunk.size());
+        mFileBytes += chunk.size();
+
+        recording::appendRaw(mIndex, offset);
+        recording::appendRaw(mIndex, mRows);
+        recording::appendRaw(mIndex, (uint32_t) 0);
+        recording::appendRaw(mIndex, mMinTime);
+        recording::appendRaw(mIndex, mMaxTime);
+        mChunkCount++;
+        mChunks++;
+        resetChunk();
+    }
+};
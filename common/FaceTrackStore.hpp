@@ -0,0 +1,394 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "Face.h"
+
+#include "MetricSchema.hpp"
+
+using namespace affdex;
+
+// Shortest time between two snapshots the writers publish
+const int TRACK_SNAPSHOT_INTERVAL_MS = 100;
+
+// The values of the appearance classifiers votes are counted for, unknown last
+const int NUM_GENDERS = 3;
+const int NUM_AGES = 8;
+const int NUM_ETHNICITIES = 6;
+
+constexpr Gender GENDERS[NUM_GENDERS] = {Gender::Male, Gender::Female, Gender::Unknown};
+
+constexpr Age AGES[NUM_AGES] = {
+        Age::AGE_UNDER_18, Age::AGE_18_24, Age::AGE_25_34, Age::AGE_35_44, Age::AGE_45_54,
+        Age::AGE_55_64, Age::AGE_65_PLUS, Age::AGE_UNKNOWN
+};
+
+constexpr Ethnicity ETHNICITIES[NUM_ETHNICITIES] = {
+        Ethnicity::CAUCASIAN, Ethnicity::BLACK_AFRICAN, Ethnicity::SOUTH_ASIAN, Ethnicity::EAST_ASIAN,
+        Ethnicity::HISPANIC, Ethnicity::UNKNOWN
+};
+
+// Index of value in values, the last one (unknown) for a value the SDK added since
+template<typename T, int N>
+inline int voteIndex(const T (&values)[N], const T value) {
+    for (int i = 0; i < N - 1; i++) {
+        if (values[i] == value) return i;
+    }
+    return N - 1;
+}
+
+template<int N>
+inline int mostVoted(const uint32_t (&votes)[N]) {
+    return (int) (std::max_element(votes, votes + N) - votes);
+}
+
+// What is known about one face, as of the snapshot
+struct FaceTrackSummary {
+    FaceId faceId;
+    int streamId;
+    double firstSeen;       // timestamp the face was found at, or of its first result
+    double lastSeen;        // timestamp of its latest result, or of when it was lost
+    uint64_t samples;       // results it was in
+    bool lost;
+    uint32_t genderVotes[NUM_GENDERS];    // results per value, in GENDERS order
+    uint32_t ageVotes[NUM_AGES];
+    uint32_t ethnicityVotes[NUM_ETHNICITIES];
+    float latest[NUM_METRICS];            // in METRICS order
+    float recentMean[NUM_METRICS];        // over the results still in the history
+
+    double dwell() const {
+        return lastSeen - firstSeen;
+    }
+
+    Gender gender() const {
+        return GENDERS[mostVoted(genderVotes)];
+    }
+
+    Age age() const {
+        return AGES[mostVoted(ageVotes)];
+    }
+
+    Ethnicity ethnicity() const {
+        return ETHNICITIES[mostVoted(ethnicityVotes)];
+    }
+};
+
+// The tracks of the store at one point; never changes once published
+struct FaceTrackSnapshot {
+    double timestamp;    // of the latest result
+    std::vector<FaceTrackSummary> tracks;    // the latest updated first
+
+    const FaceTrackSummary *find(const FaceId faceId, const int streamId = -1) const {
+        for (const FaceTrackSummary &track : tracks) {
+            if (track.faceId == faceId && track.streamId == streamId) return &track;
+        }
+        return nullptr;
+    }
+};
+
+//---------------------------------------------------------------------------
+// Per-face state over the life of a track: first and last seen, dwell time,
+// cumulative appearance votes and a ring of the latest historyLength metric
+// vectors, updated from the face listener and the detector results.
+//
+// Tracks live in a fixed number of slots, as many as fit in maxBytes, so the
+// store never grows past its cap. A face the store has no room for takes the
+// slot of the track updated least recently, which is usually a face lost long
+// ago. Slots are found through a hash map and kept in LRU order in a linked
+// list threaded through them, so an update is O(1) per face and allocates
+// nothing once every slot has been used.
+//
+// The history is struct-of-arrays: one row of historyLength values per metric,
+// with the running sums the recent means are taken from.
+//
+// The writers are the SDK callbacks. When a track changed they publish a
+// snapshot of the SNAPSHOT_TRACKS tracks updated last (the faces in view and
+// those lost most recently), at most once per TRACK_SNAPSHOT_INTERVAL_MS, so
+// the copy is not made after every result. Readers (overlay, metrics,
+// publisher) get it without waiting for the writers, and publish the changes
+// held back themselves when the writers' lock is free. Snapshot buffers come
+// from a free list they return to when the last holder lets go of them, as
+// the capture buffers of FramePool do.
+class FaceTrackStore {
+
+    struct Track {
+        uint64_t key;
+        FaceTrackSummary summary;
+        std::vector<float> history;     // NUM_METRICS rows of historyLength
+        double sum[NUM_METRICS];        // of the values in history
+        size_t head;                    // next slot of the ring
+        size_t count;
+        int newer;                      // LRU list, -1 at the ends
+        int older;
+    };
+
+    struct Buffers {
+        std::mutex mutex;
+        std::vector<FaceTrackSnapshot *> free;
+        std::vector<std::unique_ptr<FaceTrackSnapshot> > owned;
+    };
+
+    static const size_t SNAPSHOT_BUFFERS = 4;
+    static const size_t SNAPSHOT_TRACKS = 64;
+
+    const size_t mHistoryLength;
+    const size_t mMaxTracks;
+
+    std::mutex mMutex;    // writers only
+    std::vector<Track> mTracks;
+    std::unordered_map<uint64_t, int> mIndex;
+    int mNewest;
+    int mOldest;
+    double mTimestamp;
+
+    std::shared_ptr<Buffers> mBuffers;    // shared with the snapshots handed out
+    std::shared_ptr<const FaceTrackSnapshot> mPublished;    // std::atomic_load/store only
+    std::atomic<bool> mChanged;    // since the last snapshot
+    std::chrono::steady_clock::time_point mPublishedAt;
+
+    std::atomic<size_t> mHeld;
+    std::atomic<uint64_t> mEvicted;
+
+public:
+
+    FaceTrackStore(const size_t historyLength, const size_t maxBytes)
+            : mHistoryLength(std::max<size_t>(historyLength, 1)),
+              mMaxTracks(std::max<size_t>(maxBytes / bytesPerTrack(std::max<size_t>(historyLength, 1)), 1)),
+              mNewest(-1), mOldest(-1), mTimestamp(0), mBuffers(std::make_shared<Buffers>()),
+              mPublished(std::make_shared<FaceTrackSnapshot>()), mChanged(false), mHeld(0), mEvicted(0) {
+        mTracks.reserve(mMaxTracks);
+        mIndex.reserve(mMaxTracks);
+        mBuffers->free.reserve(SNAPSHOT_BUFFERS);
+        mBuffers->owned.reserve(SNAPSHOT_BUFFERS);
+    }
+
+    FaceTrackStore(const FaceTrackStore &) = delete;
+
+    FaceTrackStore &operator=(const FaceTrackStore &) = delete;
+
+    void faceFound(const float timestamp, const FaceId faceId, const int streamId = -1) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        Track &track = touch(faceId, streamId, timestamp);
+        track.summary.lost = false;
+        changed();
+    }
+
+    void faceLost(const float timestamp, const FaceId faceId, const int streamId = -1) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        auto it = mIndex.find(key(faceId, streamId));
+        if (it == mIndex.end()) return;
+        FaceTrackSummary &s = mTracks[it->second].summary;
+        s.lost = true;
+        s.lastSeen = std::max(s.lastSeen, (double) timestamp);    // dwell ends when the SDK lost the face
+        changed();
+    }
+
+    // The faces of one result
+    void update(const std::map<FaceId, Face> &faces, const double timestamp, const int streamId = -1) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        mTimestamp = timestamp;
+        for (auto &face_id_pair : faces) {
+            const Face &f = face_id_pair.second;
+            Track &track = touch(f.id, streamId, timestamp);
+            FaceTrackSummary &s = track.summary;
+            s.lastSeen = std::max(s.lastSeen, timestamp);
+            s.samples++;
+            s.lost = false;
+            s.genderVotes[voteIndex(GENDERS, f.appearance.gender)]++;
+            s.ageVotes[voteIndex(AGES, f.appearance.age)]++;
+            s.ethnicityVotes[voteIndex(ETHNICITIES, f.appearance.ethnicity)]++;
+
+            metricValues(f, s.latest);
+            const bool full = track.count == mHistoryLength;
+            float *slot = &track.history[track.head];
+            for (int i = 0; i < NUM_METRICS; i++, slot += mHistoryLength) {
+                if (full) track.sum[i] -= *slot;
+                *slot = s.latest[i];
+                track.sum[i] += s.latest[i];
+            }
+            if (!full) track.count++;
+            track.head = (track.head + 1) % mHistoryLength;
+            for (int i = 0; i < NUM_METRICS; i++) s.recentMean[i] = (float) (track.sum[i] / track.count);
+        }
+        if (!faces.empty()) changed();
+    }
+
+    // The latest snapshot; never blocks on the writers. Changes they have not
+    // published yet are, unless a writer holds the lock.
+    std::shared_ptr<const FaceTrackSnapshot> snapshot() {
+        if (mChanged) {
+            std::unique_lock<std::mutex> lk(mMutex, std::try_to_lock);
+            if (lk.owns_lock() && mChanged) publish();
+        }
+        return std::atomic_load(&mPublished);
+    }
+
+    // Up to historyLength values of one metric of a face, oldest first. Takes
+    // the writers' lock for the copy; prefer snapshot() on hot paths.
+    bool history(const FaceId faceId, const int streamId, const int metric, std::vector<float> &out) {
+        out.clear();
+        if (metric < 0 || metric >= NUM_METRICS) return false;
+        std::lock_guard<std::mutex> lg(mMutex);
+        auto it = mIndex.find(key(faceId, streamId));
+        if (it == mIndex.end()) return false;
+        const Track &track = mTracks[it->second];
+        const float *row = &track.history[(size_t) metric * mHistoryLength];
+        const size_t first = (track.head + mHistoryLength - track.count) % mHistoryLength;
+        for (size_t i = 0; i < track.count; i++) out.push_back(row[(first + i) % mHistoryLength]);
+        return true;
+    }
+
+    size_t getMaxTracks() const {
+        return mMaxTracks;
+    }
+
+    // Tracks in the store, lost ones included
+    size_t getTracks() const {
+        return mHeld;
+    }
+
+    // Tracks dropped to make room for new faces
+    uint64_t getEvicted() const {
+        return mEvicted;
+    }
+
+    // The slot, its history and its index entry, about
+    static size_t bytesPerTrack(const size_t historyLength) {
+        return sizeof(Track) + sizeof(float) * NUM_METRICS * historyLength + 4 * sizeof(uint64_t);
+    }
+
+private:
+
+    static uint64_t key(const FaceId faceId, const int streamId) {
+        return ((uint64_t) (uint32_t) streamId << 32) | (uint32_t) faceId;
+    }
+
+    // The track of a face, created (or taken over from the oldest) if there is
+    // none, moved to the front of the LRU list
+    Track &touch(const FaceId faceId, const int streamId, const double timestamp) {
+        const uint64_t k = key(faceId, streamId);
+        auto it = mIndex.find(k);
+        int index;
+        if (it != mIndex.end()) {
+            index = it->second;
+            unlink(index);
+        } else {
+            if (mTracks.size() < mMaxTracks) {
+                index = (int) mTracks.size();
+                mTracks.push_back(Track());
+                mTracks.back().history.resize((size_t) NUM_METRICS * mHistoryLength);
+                mHeld = mTracks.size();
+            } else {
+                index = mOldest;
+                unlink(index);
+                mIndex.erase(mTracks[index].key);
+                mEvicted++;
+            }
+            Track &track = mTracks[index];
+            track.key = k;
+            FaceTrackSummary &s = track.summary;
+            memset(&s, 0, sizeof(s));
+            s.faceId = faceId;
+            s.streamId = streamId;
+            s.firstSeen = timestamp;
+            s.lastSeen = timestamp;
+            std::fill(track.sum, track.sum + NUM_METRICS, 0.0);
+            track.head = 0;
+            track.count = 0;
+            mIndex[k] = index;
+        }
+        Track &track = mTracks[index];
+        track.older = mNewest;
+        track.newer = -1;
+        if (mNewest >= 0) mTracks[mNewest].newer = index;
+        mNewest = index;
+        if (mOldest < 0) mOldest = index;
+        return track;
+    }
+
+    void unlink(const int index) {
+        Track &track = mTracks[index];
+        if (track.newer >= 0) mTracks[track.newer].older = track.older;
+        else mNewest = track.older;
+        if (track.older >= 0) mTracks[track.older].newer = track.newer;
+        else mOldest = track.newer;
+        track.newer = track.older = -1;
+    }
+
+    // Publishes the change now, or leaves it for a later write or snapshot()
+    // when the last snapshot is more recent than TRACK_SNAPSHOT_INTERVAL_MS.
+    // With the lock held.
+    void changed() {
+        mChanged = true;
+        const auto now = std::chrono::steady_clock::now();
+        if (now - mPublishedAt >= std::chrono::milliseconds(TRACK_SNAPSHOT_INTERVAL_MS)) publish();
+    }
+
+    // A buffer no reader holds, which returns to the free list when the last
+    // holder lets go of it. When all SNAPSHOT_BUFFERS are held, a one-off one.
+    std::shared_ptr<FaceTrackSnapshot> acquire() {
+        std::shared_ptr<Buffers> buffers = mBuffers;
+        FaceTrackSnapshot *buffer = nullptr;
+        {
+            std::lock_guard<std::mutex> lg(buffers->mutex);
+            if (!buffers->free.empty()) {
+                buffer = buffers->free.back();
+                buffers->free.pop_back();
+            } else if (buffers->owned.size() < SNAPSHOT_BUFFERS) {
+                buffers->owned.push_back(std::unique_ptr<FaceTrackSnapshot>(new FaceTrackSnapshot()));
+                buffer = buffers->owned.back().get();
+                buffer->tracks.reserve(SNAPSHOT_TRACKS);
+            }
+        }
+        if (!buffer) {
+            std::shared_ptr<FaceTrackSnapshot> oneOff = std::make_shared<FaceTrackSnapshot>();
+            oneOff->tracks.reserve(SNAPSHOT_TRACKS);
+            return oneOff;
+        }
+        return std::shared_ptr<FaceTrackSnapshot>(buffer, [buffers](FaceTrackSnapshot *b) {
+            std::lock_guard<std::mutex> lg(buffers->mutex);
+            buffers->free.push_back(b);
+        });
+    }
+
+    // Copies the summaries to a free buffer and makes it the latest snapshot.
+    // With the lock held.
+    void publish() {
+        std::shared_ptr<FaceTrackSnapshot> buffer = acquire();
+        buffer->timestamp = mTimestamp;
+        buffer->tracks.clear();
+        for (int i = mNewest; i >= 0 && buffer->tracks.size() < SNAPSHOT_TRACKS; i = mTracks[i].older) {
+            buffer->tracks.push_back(mTracks[i].summary);
+        }
+        std::atomic_store(&mPublished, std::shared_ptr<const FaceTrackSnapshot>(buffer));
+        mChanged = false;
+        mPublishedAt = std::chrono::steady_clock::now();
+    }
+};
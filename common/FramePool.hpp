@@ -0,0 +1,141 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+struct FramePoolStats {
+    uint64_t frames;            // buffers handed out
+    uint64_t buffers;           // buffers owned by the pool
+    uint64_t overflows;         // buffers handed out while the pool was exhausted
+    uint64_t bytesAllocated;    // pixel memory allocated, overflows included
+    uint64_t bytesCopied;       // pixel memory copied, as reported with addCopied()
+};
+
+//---------------------------------------------------------------------------
+// Recycled capture buffers.
+// acquire() hands out a cv::Mat by shared_ptr; the Mat returns to the pool
+// when the last holder (capture loop, render stage, ...) lets go of it. Read
+// into with cv::VideoCapture::read(), a recycled Mat keeps its pixel memory,
+// so once every buffer has seen a frame of the stream size the capture
+// allocates nothing. Stages pass the shared_ptr or cv::Mat headers around,
+// never copies of the pixels.
+//
+// The pool notices when a reader replaced the pixel memory of a buffer and
+// counts it as an allocation; copies it cannot see are reported with addCopied().
+class FramePool {
+
+    struct Slot {
+        cv::Mat mat;
+        const uchar *data;    // pixel memory when the slot was last returned
+        size_t bytes;
+    };
+
+    struct State {
+        std::mutex mutex;
+        std::vector<Slot *> free;
+        std::vector<std::unique_ptr<Slot> > slots;
+        std::atomic<uint64_t> frames;
+        std::atomic<uint64_t> overflows;
+        std::atomic<uint64_t> bytesAllocated;
+        std::atomic<uint64_t> bytesCopied;
+
+        State() : frames(0), overflows(0), bytesAllocated(0), bytesCopied(0) {
+        }
+
+        void recycle(Slot *slot) {
+            noteAllocation(slot);
+            std::lock_guard<std::mutex> lg(mutex);
+            free.push_back(slot);
+        }
+
+        void noteAllocation(Slot *slot) {
+            if (slot->mat.data != slot->data) {
+                slot->data = slot->mat.data;
+                slot->bytes = slot->mat.total() * slot->mat.elemSize();
+                bytesAllocated += slot->bytes;
+            }
+        }
+    };
+
+    const size_t mCapacity;
+    std::shared_ptr<State> mState;
+
+public:
+
+    explicit FramePool(const size_t capacity)
+            : mCapacity(capacity > 0 ? capacity : 1), mState(std::make_shared<State>()) {
+        mState->free.reserve(mCapacity);
+        mState->slots.reserve(mCapacity);
+    }
+
+    FramePool(const FramePool &) = delete;
+
+    FramePool &operator=(const FramePool &) = delete;
+
+    // A buffer to read the next frame into. Never blocks: when every pooled
+    // buffer is in use, a one-off buffer is handed out and counted.
+    std::shared_ptr<cv::Mat> acquire() {
+        std::shared_ptr<State> state = mState;
+        state->frames++;
+        Slot *slot = nullptr;
+        {
+            std::lock_guard<std::mutex> lg(state->mutex);
+            if (!state->free.empty()) {
+                slot = state->free.back();
+                state->free.pop_back();
+            } else if (state->slots.size() < mCapacity) {
+                state->slots.push_back(std::unique_ptr<Slot>(new Slot()));
+                slot = state->slots.back().get();
+                slot->data = nullptr;
+                slot->bytes = 0;
+            }
+        }
+        if (!slot) {
+            state->overflows++;
+            return std::shared_ptr<cv::Mat>(new cv::Mat(), [state](cv::Mat *mat) {
+                state->bytesAllocated += mat->total() * mat->elemSize();
+                delete mat;
+            });
+        }
+        return std::shared_ptr<cv::Mat>(&slot->mat, [state, slot](cv::Mat *) {
+            state->recycle(slot);
+        });
+    }
+
+    void addCopied(const uint64_t bytes) {
+        mState->bytesCopied += bytes;
+    }
+
+    FramePoolStats getStats() const {
+        FramePoolStats stats;
+        stats.frames = mState->frames;
+        stats.overflows = mState->overflows;
+        stats.bytesAllocated = mState->bytesAllocated;
+        stats.bytesCopied = mState->bytesCopied;
+        std::lock_guard<std::mutex> lg(mState->mutex);
+        stats.buffers = mState->slots.size();
+        return stats;
+    }
+};
@@ -0,0 +1,192 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "Face.h"
+
+using namespace affdex;
+
+// How a submitted image relates to the captured frame:
+// captured = offset + submitted / scale
+struct FrameTransform {
+    float x0;
+    float y0;
+    float scale;
+
+    FrameTransform() : x0(0), y0(0), scale(1.0f) {
+    }
+
+    bool identity() const {
+        return x0 == 0 && y0 == 0 && scale == 1.0f;
+    }
+
+    // Maps the feature points and measurements back to captured-frame coordinates
+    void toCaptured(std::map<FaceId, Face> &faces) const {
+        if (identity()) return;
+        for (auto &face_id_pair : faces) {
+            Face &face = face_id_pair.second;
+            for (FeaturePoint &point : face.featurePoints) {
+                point.x = x0 + point.x / scale;
+                point.y = y0 + point.y / scale;
+            }
+            face.measurements.interocularDistance /= scale;
+        }
+    }
+};
+
+struct PreprocessOptions {
+    int workWidth;                 // downscale wider images to this width (0: keep)
+    bool roi;                      // crop to the faces found so far
+    float roiMargin;               // added around the faces, as a fraction of their size
+    unsigned int rescanInterval;   // frames between full-frame scans for new faces
+};
+
+struct PreprocessStats {
+    uint64_t frames;
+    uint64_t cropped;
+    uint64_t rescans;
+    uint64_t pixelsIn;
+    uint64_t pixelsOut;
+};
+
+//---------------------------------------------------------------------------
+// Shrinks what the detector has to look at: crops to a region around the
+// faces of earlier results and/or downscales to a working width. Every
+// frame comes with the FrameTransform to map its results back, so overlay
+// and output stay in captured-frame coordinates.
+//
+// The region only moves when the faces get close to its border, to keep the
+// coordinates the tracker sees stable. It is dropped as soon as a result has
+// no face, and every rescanInterval frames the full frame is scanned anyway
+// so faces entering elsewhere are picked up.
+//
+// The crop is a view into the captured image; the only copy is the one
+// cv::resize (vectorized by OpenCV) or, for a crop without resize, a copy to
+// make the pixels contiguous for Frame. Both go into reused buffers.
+class FramePreprocessor {
+
+    const PreprocessOptions mOptions;
+    cv::Mat mOut;
+    cv::Rect mRoi;             // empty: scan the full frame
+    cv::Size mFrameSize;
+    unsigned int mSinceScan;
+    PreprocessStats mStats;
+
+public:
+
+    explicit FramePreprocessor(const PreprocessOptions &options)
+            : mOptions(options), mSinceScan(0) {
+        mStats = PreprocessStats();
+    }
+
+    bool enabled() const {
+        return mOptions.workWidth > 0 || mOptions.roi;
+    }
+
+    // Returns the image to hand to the detector: img itself or a buffer owned
+    // by the preprocessor, valid until the next call. extraScale is applied on
+    // top of the working width (e.g. by the admission controller).
+    const cv::Mat &prepare(const cv::Mat &img, FrameTransform &transform, const float extraScale = 1.0f) {
+        mStats.frames++;
+        mStats.pixelsIn += img.total();
+        mFrameSize = img.size();
+        transform = FrameTransform();
+
+        cv::Rect region(0, 0, img.cols, img.rows);
+        if (mOptions.roi && mRoi.area() > 0) {
+            if (++mSinceScan >= mOptions.rescanInterval) {
+                mSinceScan = 0;
+                mStats.rescans++;
+            } else {
+                region = mRoi & region;
+                mStats.cropped++;
+            }
+        }
+
+        float scale = extraScale;
+        if (mOptions.workWidth > 0 && region.width > mOptions.workWidth) {
+            scale *= (float) mOptions.workWidth / region.width;
+        }
+        transform.x0 = region.x;
+        transform.y0 = region.y;
+        transform.scale = scale;
+
+        const bool cropped = region.width != img.cols || region.height != img.rows;
+        if (!cropped && scale == 1.0f) {
+            mStats.pixelsOut += img.total();
+            return img;
+        }
+        const cv::Mat view = cropped ? img(region) : img;
+        if (scale == 1.0f) {
+            view.copyTo(mOut);
+        } else {
+            const cv::Size size(std::max(1, (int) (region.width * scale + 0.5f)),
+                                std::max(1, (int) (region.height * scale + 0.5f)));
+            cv::resize(view, mOut, size, 0, 0, scale < 1.0f ? cv::INTER_AREA : cv::INTER_LINEAR);
+            // Rounding the size changes the effective scale slightly
+            transform.scale = (float) size.width / region.width;
+        }
+        mStats.pixelsOut += mOut.total();
+        return mOut;
+    }
+
+    // Feeds the results of a frame, already in captured coordinates, back
+    // into the choice of region.
+    void observe(const std::map<FaceId, Face> &faces) {
+        if (!mOptions.roi) return;
+        if (faces.empty()) {
+            mRoi = cv::Rect();
+            return;
+        }
+
+        float x0 = mFrameSize.width, y0 = mFrameSize.height, x1 = 0, y1 = 0;
+        for (auto &face_id_pair : faces) {
+            for (const FeaturePoint &point : face_id_pair.second.featurePoints) {
+                x0 = std::min(x0, point.x);
+                y0 = std::min(y0, point.y);
+                x1 = std::max(x1, point.x);
+                y1 = std::max(y1, point.y);
+            }
+        }
+        if (x1 <= x0 || y1 <= y0) return;
+
+        // Keep the region while the faces stay clear of its border
+        const float size = std::max(x1 - x0, y1 - y0);
+        if (mRoi.area() > 0 && mRoi.contains(cv::Point((int) (x0 - size * mOptions.roiMargin / 2),
+                                                       (int) (y0 - size * mOptions.roiMargin / 2))) &&
+            mRoi.contains(cv::Point((int) (x1 + size * mOptions.roiMargin / 2),
+                                    (int) (y1 + size * mOptions.roiMargin / 2)))) {
+            return;
+        }
+        const float margin = size * mOptions.roiMargin;
+        const cv::Rect frame(0, 0, mFrameSize.width, mFrameSize.height);
+        mRoi = cv::Rect((int) (x0 - margin), (int) (y0 - margin),
+                        (int) (x1 - x0 + 2 * margin), (int) (y1 - y0 + 2 * margin)) & frame;
+    }
+
+    const PreprocessStats &getStats() const {
+        return mStats;
+    }
+};
@@ -0,0 +1,317 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "OfflineInput.hpp"
+
+struct FrameSourceOptions {
+    int width;             // requested from cameras; size of raw and synthetic frames
+    int height;
+    double cameraFps;      // requested from cameras
+    double fps;            // frame rate of image sequences, raw and synthetic frames
+    uint64_t frames;       // synthetic and replayed frames to produce (0: until stopped)
+    std::chrono::steady_clock::time_point epoch;    // live frames are stamped with the seconds since
+};
+
+//---------------------------------------------------------------------------
+// Where frames come from. A live source (a camera) produces frames at its own
+// pace and its timestamps are the capture times; the other sources produce
+// the next frame when asked, stamped with its position in the stream, so they
+// can be read as fast as the detector takes them and always give the same
+// frames with the same timestamps.
+class FrameSource {
+public:
+
+    virtual ~FrameSource() {
+    }
+
+    virtual bool isOpened() const = 0;
+
+    virtual bool isLive() const {
+        return false;
+    }
+
+    virtual double getFrameRate() const = 0;
+
+    // Number of frames, 0 when unknown or endless
+    virtual uint64_t getFrameCount() const {
+        return 0;
+    }
+
+    // Reads the next frame and its timestamp in seconds. Returns false at the end.
+    virtual bool read(cv::Mat &img, double &timestamp) = 0;
+};
+
+// A camera, or a network stream read like one
+class CameraSource : public FrameSource {
+
+    cv::VideoCapture mCapture;
+    const double mFps;
+    const std::chrono::steady_clock::time_point mEpoch;
+
+public:
+
+    CameraSource(const int id, const FrameSourceOptions &options)
+            : mFps(options.cameraFps), mEpoch(options.epoch) {
+        mCapture.open(id);
+        mCapture.set(CV_CAP_PROP_FPS, options.cameraFps);
+        mCapture.set(CV_CAP_PROP_FRAME_WIDTH, options.width);
+        mCapture.set(CV_CAP_PROP_FRAME_HEIGHT, options.height);
+    }
+
+    CameraSource(const std::string &url, const FrameSourceOptions &options)
+            : mFps(options.cameraFps), mEpoch(options.epoch) {
+        mCapture.open(url);
+    }
+
+    bool isOpened() const override {
+        return mCapture.isOpened();
+    }
+
+    bool isLive() const override {
+        return true;
+    }
+
+    double getFrameRate() const override {
+        return mFps;
+    }
+
+    bool read(cv::Mat &img, double &timestamp) override {
+        if (!mCapture.read(img)) return false;
+        timestamp = std::chrono::duration<double>(std::chrono::steady_clock::now() - mEpoch).count();
+        return true;
+    }
+};
+
+// A video file, a directory of images or a glob
+class FileSource : public FrameSource {
+
+    OfflineInput mInput;
+
+public:
+
+    FileSource(const std::string &spec, const double imageFps) : mInput(spec, imageFps) {
+    }
+
+    bool isOpened() const override {
+        return mInput.isOpened();
+    }
+
+    double getFrameRate() const override {
+        return mInput.getFrameRate();
+    }
+
+    uint64_t getFrameCount() const override {
+        return mInput.getFrameCount();
+    }
+
+    bool read(cv::Mat &img, double &timestamp) override {
+        return mInput.read(img, timestamp);
+    }
+};
+
+// Raw I420 (yuv420p) frames of a fixed size back to back, e.g. from
+// ffmpeg -i in.mp4 -f rawvideo -pix_fmt yuv420p -
+class RawYuvSource : public FrameSource {
+
+    std::FILE *mFile;
+    const bool mOwned;
+    const double mFps;
+    uint64_t mNext;
+    cv::Mat mYuv;    // reused: one frame of the three planes
+
+public:
+
+    // "-" reads stdin
+    RawYuvSource(const std::string &path, const int width, const int height, const double fps)
+            : mFile(nullptr), mOwned(path != "-"), mFps(fps > 0 ? fps : 30.0), mNext(0) {
+        if (width <= 0 || height <= 0 || width % 2 || height % 2) {
+            std::cerr << "ERROR\tRaw YUV frames need an even width and height, not " << width << "x" << height
+                    << std::endl;
+            return;
+        }
+        if (mOwned) {
+            mFile = std::fopen(path.c_str(), "rb");
+        } else {
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            mFile = stdin;
+        }
+        mYuv.create(height * 3 / 2, width, CV_8UC1);
+    }
+
+    ~RawYuvSource() {
+        if (mFile && mOwned) std::fclose(mFile);
+    }
+
+    RawYuvSource(const RawYuvSource &) = delete;
+
+    RawYuvSource &operator=(const RawYuvSource &) = delete;
+
+    bool isOpened() const override {
+        return mFile != nullptr;
+    }
+
+    double getFrameRate() const override {
+        return mFps;
+    }
+
+    bool read(cv::Mat &img, double &timestamp) override {
+        const size_t bytes = mYuv.total();
+        if (!mFile || std::fread(mYuv.data, 1, bytes, mFile) != bytes) return false;
+        cv::cvtColor(mYuv, img, cv::COLOR_YUV2BGR_I420);
+        timestamp = mNext++ / mFps;
+        return true;
+    }
+};
+
+// Frames made up in memory, for load tests without a camera: either a test
+// pattern that moves from frame to frame, or the frames of a recording
+// loaded once and looped. Reading a frame is one copy into the caller's
+// buffer, so the source can keep the detector saturated.
+class SyntheticSource : public FrameSource {
+
+    // The pattern repeats every PERIOD columns; frame k shows it shifted by k * STEP
+    static const int PERIOD = 256;
+    static const int STEP = 4;
+
+    std::vector<cv::Mat> mFrames;    // recorded frames, or one pattern PERIOD columns wider than a frame
+    const bool mPattern;
+    int mWidth;
+    const double mFps;
+    const uint64_t mCount;
+    uint64_t mNext;
+
+public:
+
+    // A test pattern of width x height
+    SyntheticSource(const int width, const int height, const double fps, const uint64_t count)
+            : mPattern(true), mWidth(width), mFps(fps > 0 ? fps : 30.0), mCount(count), mNext(0) {
+        if (width <= 0 || height <= 0) return;
+        cv::Mat pattern(height, width + PERIOD, CV_8UC3);
+        for (int y = 0; y < height; y++) {
+            unsigned char *row = pattern.ptr(y);
+            for (int x = 0; x < width + PERIOD; x++) {
+                row[3 * x] = (unsigned char) x;
+                row[3 * x + 1] = (unsigned char) y;
+                row[3 * x + 2] = (unsigned char) (x ^ y);
+            }
+        }
+        mFrames.push_back(pattern);
+    }
+
+    // Replays frames, looping over them
+    SyntheticSource(const std::vector<cv::Mat> &frames, const double fps, const uint64_t count)
+            : mFrames(frames), mPattern(false), mWidth(0), mFps(fps > 0 ? fps : 30.0), mCount(count), mNext(0) {
+    }
+
+    bool isOpened() const override {
+        return !mFrames.empty();
+    }
+
+    double getFrameRate() const override {
+        return mFps;
+    }
+
+    uint64_t getFrameCount() const override {
+        return mCount;
+    }
+
+    bool read(cv::Mat &img, double &timestamp) override {
+        if (mFrames.empty() || (mCount > 0 && mNext >= mCount)) return false;
+        if (mPattern) {
+            const cv::Mat &pattern = mFrames.front();
+            pattern(cv::Rect((int) (mNext * STEP % PERIOD), 0, mWidth, pattern.rows)).copyTo(img);
+        } else {
+            mFrames[mNext % mFrames.size()].copyTo(img);
+        }
+        timestamp = mNext++ / mFps;
+        return true;
+    }
+};
+
+// Splits "yuv:-" into "yuv" and "-". Empty when the spec starts with no
+// known scheme, i.e. names a recording.
+inline std::string frameSourceScheme(const std::string &spec, std::string &rest) {
+    static const char *const schemes[] = {"camera", "synthetic", "replay", "yuv"};
+    const size_t colon = spec.find(':');
+    const std::string scheme = spec.substr(0, colon);
+    for (const char *s : schemes) {
+        if (scheme == s) {
+            rest = colon == std::string::npos ? std::string() : spec.substr(colon + 1);
+            return scheme;
+        }
+    }
+    rest = spec;
+    return std::string();
+}
+
+// Opens the source named on the command line:
+//   camera[:<id>]     a camera, 0 by default
+//   <proto>://...     a network stream, read like a camera
+//   synthetic         a test pattern of options.width x options.height
+//   replay:<input>    the frames of a recording, loaded into memory and looped
+//   yuv:<path>        raw I420 frames of options.width x options.height, "-" for stdin
+//   anything else     a video file, a directory of images or a glob
+// The caller checks isOpened().
+inline std::unique_ptr<FrameSource> openFrameSource(const std::string &spec, const FrameSourceOptions &options) {
+    std::string rest;
+    const std::string scheme = frameSourceScheme(spec, rest);
+    if (scheme == "camera") {
+        return std::unique_ptr<FrameSource>(new CameraSource(rest.empty() ? 0 : std::atoi(rest.c_str()), options));
+    } else if (scheme == "synthetic") {
+        return std::unique_ptr<FrameSource>(
+                new SyntheticSource(options.width, options.height, options.fps, options.frames));
+    } else if (scheme == "yuv") {
+        return std::unique_ptr<FrameSource>(new RawYuvSource(rest, options.width, options.height, options.fps));
+    } else if (scheme == "replay") {
+        FileSource input(rest, options.fps);
+        std::vector<cv::Mat> frames;
+        size_t bytes = 0;
+        cv::Mat img;
+        double timestamp;
+        while (input.isOpened() && input.read(img, timestamp)) {
+            bytes += img.total() * img.elemSize();
+            frames.push_back(img);
+            img = cv::Mat();    // the next frame gets a buffer of its own
+        }
+        std::cerr << "INFO\tLoaded " << frames.size() << " frames (" << (bytes >> 20) << " MB) of " << rest
+                << " to replay" << std::endl;
+        return std::unique_ptr<FrameSource>(new SyntheticSource(frames, input.getFrameRate(), options.frames));
+    } else if (spec.find("://") != std::string::npos) {
+        return std::unique_ptr<FrameSource>(new CameraSource(spec, options));
+    }
+    return std::unique_ptr<FrameSource>(new FileSource(spec, options.fps));
+}
@@ -0,0 +1,300 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+
+
+// Points in the life of a frame, in pipeline order
+enum TraceStage {
+    TRACE_CAPTURE,        // read from the camera or the recording
+    TRACE_SUBMIT,         // handed to FrameDetector::process()
+    TRACE_SDK_CAPTURE,    // ImageListener::onImageCapture()
+    TRACE_SDK_RESULT,     // ImageListener::onImageResults()
+    TRACE_DEQUEUE,        // result taken off the queue by the main loop
+    TRACE_DRAWN,          // overlay shown
+    TRACE_POSTED,         // first HTTP POST carrying its faces completed
+    TRACE_STAGES
+};
+
+static const char *const TRACE_STAGE_NAMES[TRACE_STAGES] = {
+        "capture", "submit", "sdk capture", "sdk result", "dequeue", "drawn", "posted"
+};
+
+//---------------------------------------------------------------------------
+// Lock-free latency histogram with logarithmic buckets of 32 linear
+// sub-buckets each, in the manner of HdrHistogram: any value is stored with
+// an error below 1/32 (3%), from a microsecond up to hours, in a few KB.
+class LatencyHistogram {
+
+    static const unsigned int SUB_BITS = 5;
+    static const uint64_t SUB_COUNT = 1u << SUB_BITS;
+    static const unsigned int MAX_SHIFT = 32;
+    static const size_t BUCKETS = (MAX_SHIFT + 2) * SUB_COUNT;
+
+    std::atomic<uint64_t> mCounts[BUCKETS];
+    std::atomic<uint64_t> mTotal;
+    std::atomic<uint64_t> mMax;
+
+public:
+
+    LatencyHistogram() : mTotal(0), mMax(0) {
+        for (auto &count : mCounts) count.store(0, std::memory_order_relaxed);
+    }
+
+    void record(const uint64_t us) {
+        mCounts[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+        mTotal.fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = mMax.load(std::memory_order_relaxed);
+        while (us > max && !mMax.compare_exchange_weak(max, us, std::memory_order_relaxed));
+    }
+
+    uint64_t count() const {
+        return mTotal.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const {
+        return mMax.load(std::memory_order_relaxed);
+    }
+
+    // Smallest value at or above the given fraction of the samples, in us
+    uint64_t percentile(const double fraction) const {
+        const uint64_t total = count();
+        if (total == 0) return 0;
+        const uint64_t rank = std::max<uint64_t>(1, (uint64_t) (fraction * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            seen += mCounts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) return std::min(highestOf(i), max());
+        }
+        return max();
+    }
+
+private:
+
+    // Values below 2 * SUB_COUNT are exact; above, each doubling of the value
+    // gets SUB_COUNT buckets.
+    static size_t bucketOf(const uint64_t value) {
+        uint64_t top = value;
+        unsigned int shift = 0;
+        while (top >= 2 * SUB_COUNT && shift < MAX_SHIFT) {
+            top >>= 1;
+            shift++;
+        }
+        if (top >= 2 * SUB_COUNT) top = 2 * SUB_COUNT - 1;
+        return shift * SUB_COUNT + top;
+    }
+
+    static uint64_t highestOf(const size_t bucket) {
+        if (bucket < 2 * SUB_COUNT) return bucket;
+        const unsigned int shift = bucket / SUB_COUNT - 1;
+        const uint64_t top = bucket - shift * SUB_COUNT;
+        return ((top + 1) << shift) - 1;
+    }
+};
+
+//---------------------------------------------------------------------------
+// Per-frame latency tracing from capture to publication.
+// The capture loop opens a record with begin(); every later stage stamps it
+// with mark(), from whichever thread it runs on, finding the record by the
+// frame timestamp. Stamps are steady_clock microseconds kept in a ring of
+// the last `capacity` frames, so a Chrome trace of recent frames can be
+// written at any time (chrome://tracing or ui.perfetto.dev open it).
+//
+// Each stamp also feeds the histograms of the span it ends and of the time
+// since capture. A stamp is a clock read, a short scan back from the newest
+// record and a few relaxed atomic operations: cheap enough to stay on.
+class FrameTracer {
+
+    struct Entry {
+        std::atomic<float> timestamp;
+        std::atomic<int64_t> stamps[TRACE_STAGES];    // us since mOrigin, 0: not reached
+    };
+
+    struct Span {
+        TraceStage from;
+        TraceStage to;
+        const char *name;
+    };
+
+    static const size_t SPAN_COUNT = 6;
+
+    const Span *spans() const {
+        static const Span SPANS[SPAN_COUNT] = {
+                {TRACE_CAPTURE,     TRACE_SUBMIT,      "prepare"},
+                {TRACE_SUBMIT,      TRACE_SDK_CAPTURE, "sdk queue"},
+                {TRACE_SDK_CAPTURE, TRACE_SDK_RESULT,  "detect"},
+                {TRACE_SDK_RESULT,  TRACE_DEQUEUE,     "result queue"},
+                {TRACE_DEQUEUE,     TRACE_DRAWN,       "render"},
+                {TRACE_DEQUEUE,     TRACE_POSTED,      "publish"}
+        };
+        return SPANS;
+    }
+
+    const std::chrono::steady_clock::time_point mOrigin;
+    const size_t mCapacity;
+    std::unique_ptr<Entry[]> mEntries;
+    std::atomic<uint64_t> mBegun;
+    std::atomic<uint64_t> mUnmatched;
+
+    LatencyHistogram mSpans[SPAN_COUNT];
+    LatencyHistogram mSinceCapture[TRACE_STAGES];
+
+public:
+
+    explicit FrameTracer(const size_t capacity)
+            : mOrigin(std::chrono::steady_clock::now()), mCapacity(std::max<size_t>(capacity, 1)),
+              mEntries(new Entry[mCapacity]), mBegun(0), mUnmatched(0) {
+        for (size_t i = 0; i < mCapacity; i++) {
+            mEntries[i].timestamp.store(-1.0f, std::memory_order_relaxed);
+            for (auto &stamp : mEntries[i].stamps) stamp.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    FrameTracer(const FrameTracer &) = delete;
+
+    FrameTracer &operator=(const FrameTracer &) = delete;
+
+    // Opens the record of a frame that was captured at `captured`. Called by
+    // the capture loop only, with increasing timestamps.
+    void begin(const float timestamp, const std::chrono::steady_clock::time_point captured) {
+        Entry &e = mEntries[mBegun.load(std::memory_order_relaxed) % mCapacity];
+        e.timestamp.store(-1.0f, std::memory_order_relaxed);
+        for (auto &stamp : e.stamps) stamp.store(0, std::memory_order_relaxed);
+        e.stamps[TRACE_CAPTURE].store(toUs(captured), std::memory_order_relaxed);
+        e.timestamp.store(timestamp, std::memory_order_release);
+        mBegun.fetch_add(1, std::memory_order_release);
+    }
+
+    // Stamps a stage of the frame now. The first stamp of a stage counts.
+    void mark(const float timestamp, const TraceStage stage) {
+        markRange(timestamp, timestamp, stage);
+    }
+
+    // Stamps a stage of every frame with a timestamp in [first, last], e.g.
+    // the frames of one telemetry batch.
+    void markRange(const float first, const float last, const TraceStage stage) {
+        const int64_t now = toUs(std::chrono::steady_clock::now());
+        const uint64_t begun = mBegun.load(std::memory_order_acquire);
+        const uint64_t oldest = begun > mCapacity ? begun - mCapacity : 0;
+        bool found = false;
+        // Newest first: most stages concern the frames captured last
+        for (uint64_t i = begun; i > oldest; i--) {
+            Entry &e = mEntries[(i - 1) % mCapacity];
+            const float ts = e.timestamp.load(std::memory_order_acquire);
+            if (ts < 0 || ts > last) continue;    // being reset, or newer
+            if (ts < first) break;
+            found = true;
+            record(e, stage, now);
+        }
+        if (!found) mUnmatched.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Stamps that found no record: frames not traced or already overwritten
+    uint64_t getUnmatched() const {
+        return mUnmatched.load(std::memory_order_relaxed);
+    }
+
+    void report() const {
+        std::cerr << "INFO\tLatency ms (p50/p99/max) by stage:";
+        for (size_t i = 0; i < SPAN_COUNT; i++) {
+            reportHistogram(spans()[i].name, mSpans[i]);
+        }
+        std::cerr << std::endl << "INFO\tLatency ms (p50/p99/max) since capture:";
+        for (int stage = TRACE_SUBMIT; stage < TRACE_STAGES; stage++) {
+            reportHistogram(TRACE_STAGE_NAMES[stage], mSinceCapture[stage]);
+        }
+        std::cerr << std::endl;
+    }
+
+    // Writes the recorded frames as Chrome trace events: one lane per span,
+    // one complete ("X") event per span of every frame.
+    bool writeChromeTrace(const std::string &path) const {
+        std::ofstream out(path.c_str(), std::ios::out | std::ios::trunc);
+        if (!out.is_open()) return false;
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool firstEvent = true;
+        auto separator = [&]() {
+            if (!firstEvent) out << ",";
+            firstEvent = false;
+            out << "\n";
+        };
+        for (size_t i = 0; i < SPAN_COUNT; i++) {
+            separator();
+            out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << i
+                << ",\"args\":{\"name\":\"" << spans()[i].name << "\"}}";
+        }
+
+        const uint64_t begun = mBegun.load(std::memory_order_acquire);
+        const uint64_t oldest = begun > mCapacity ? begun - mCapacity : 0;
+        int64_t stamps[TRACE_STAGES];
+        for (uint64_t n = oldest; n < begun; n++) {
+            const Entry &e = mEntries[n % mCapacity];
+            const float ts = e.timestamp.load(std::memory_order_acquire);
+            if (ts < 0) continue;
+            for (int stage = 0; stage < TRACE_STAGES; stage++) {
+                stamps[stage] = e.stamps[stage].load(std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < SPAN_COUNT; i++) {
+                const int64_t from = stamps[spans()[i].from];
+                const int64_t to = stamps[spans()[i].to];
+                if (from == 0 || to == 0) continue;
+                separator();
+                out << "{\"ph\":\"X\",\"name\":\"" << spans()[i].name << "\",\"pid\":1,\"tid\":" << i
+                    << ",\"ts\":" << from << ",\"dur\":" << std::max<int64_t>(to - from, 0)
+                    << ",\"args\":{\"frame\":" << ts << "}}";
+            }
+        }
+        out << "\n]}\n";
+        return out.good();
+    }
+
+private:
+
+    int64_t toUs(const std::chrono::steady_clock::time_point t) const {
+        // +1 so that no stamp is 0, which means "not reached"
+        return std::chrono::duration_cast<std::chrono::microseconds>(t - mOrigin).count() + 1;
+    }
+
+    void record(Entry &e, const TraceStage stage, const int64_t now) {
+        int64_t expected = 0;
+        if (!e.stamps[stage].compare_exchange_strong(expected, now, std::memory_order_relaxed)) return;
+
+        const int64_t captured = e.stamps[TRACE_CAPTURE].load(std::memory_order_relaxed);
+        if (captured > 0) mSinceCapture[stage].record((uint64_t) std::max<int64_t>(now - captured, 0));
+        for (size_t i = 0; i < SPAN_COUNT; i++) {
+            if (spans()[i].to != stage) continue;
+            const int64_t from = e.stamps[spans()[i].from].load(std::memory_order_relaxed);
+            if (from > 0) mSpans[i].record((uint64_t) std::max<int64_t>(now - from, 0));
+        }
+    }
+
+    static void reportHistogram(const char *name, const LatencyHistogram &h) {
+        if (h.count() == 0) return;
+        std::cerr << "\t" << name << ": " << h.percentile(0.5) / 1000.0 << "/" << h.percentile(0.99) / 1000.0
+                << "/" << h.max() / 1000.0;
+    }
+};
@@ -0,0 +1,376 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <curl/curl.h>
+
+#include "FrameTracer.hpp"
+#include "TelemetrySpool.hpp"
+
+
+//---------------------------------------------------------------------------
+// libcurl must be initialised once per process, before any other thread uses
+// it, and cleaned up once at exit. The first HttpPublisher does the init.
+class CurlGlobal {
+public:
+    static void ensure() {
+        static CurlGlobal instance;
+        (void) instance;
+    }
+
+private:
+    CurlGlobal() { curl_global_init(CURL_GLOBAL_ALL); }
+
+    ~CurlGlobal() { curl_global_cleanup(); }
+};
+
+// What publish() does when the queue is full.
+enum class OverflowPolicy {
+    DROP_OLDEST,    // discard the oldest queued post to make room
+    DROP_NEWEST,    // discard the post being published
+    BLOCK           // wait for a worker to free a slot
+};
+
+inline bool parseOverflowPolicy(const std::string &name, OverflowPolicy &policy) {
+    if (name == "drop-oldest") policy = OverflowPolicy::DROP_OLDEST;
+    else if (name == "drop-newest") policy = OverflowPolicy::DROP_NEWEST;
+    else if (name == "block") policy = OverflowPolicy::BLOCK;
+    else return false;
+    return true;
+}
+
+// Defaults of the time a post may take to connect and, in all, to be answered
+const long PUBLISH_CONNECT_TIMEOUT_MS = 2000;
+const long PUBLISH_TIMEOUT_MS = 5000;
+
+struct PublisherStats {
+    uint64_t sent;              // posts acknowledged by the server
+    uint64_t failed;            // transport errors and HTTP status >= 400
+    uint64_t dropped;           // posts discarded by the overflow policy
+    uint64_t latencyTotalUs;    // sum of request latencies (sent + failed)
+    uint64_t latencyMaxUs;
+    size_t queueDepth;
+};
+
+//---------------------------------------------------------------------------
+// Long-lived HTTP POST publisher.
+// A fixed pool of workers drains a bounded queue. Every worker owns one curl
+// easy handle for its whole life, so libcurl keeps the connection to the
+// server alive between posts instead of paying a handshake per data point.
+// A post that takes longer than the timeouts fails, so a server that stops
+// answering cannot hold a worker, or stop(), for longer than that.
+//
+// With a TelemetrySpool, posts go to the spool instead of the queue and a
+// single worker sends them in order, retrying until the server accepts them.
+class HttpPublisher {
+
+    struct Message {
+        std::string url;
+        std::string body;
+        std::string contentType;        // empty: curl's form-urlencoded default
+        std::string contentEncoding;    // empty: identity
+        float firstFrame;               // timestamps of the frames it carries, -1: none
+        float lastFrame;
+    };
+
+    std::mutex mMutex;
+    std::condition_variable mNotEmpty;
+    std::condition_variable mNotFull;
+    std::deque<Message> mQueue;
+    std::vector<std::thread> mWorkers;
+    bool mStopping;
+
+    const size_t mCapacity;
+    const OverflowPolicy mPolicy;
+    const long mConnectTimeoutMs;
+    const long mTimeoutMs;
+    std::shared_ptr<FrameTracer> mTracer;    // stamps TRACE_POSTED, may be null
+    std::shared_ptr<TelemetrySpool> mSpool;  // opened; null: posts are only queued in memory
+
+    std::atomic<uint64_t> mSent;
+    std::atomic<uint64_t> mFailed;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<uint64_t> mLatencyTotalUs;
+    std::atomic<uint64_t> mLatencyMaxUs;
+    std::atomic<size_t> mQueueDepth;    // mirrors mQueue.size(), so stats need no lock
+
+public:
+
+    HttpPublisher(const unsigned int workers, const size_t capacity, const OverflowPolicy policy,
+                  std::shared_ptr<FrameTracer> tracer = std::shared_ptr<FrameTracer>(),
+                  std::shared_ptr<TelemetrySpool> spool = std::shared_ptr<TelemetrySpool>(),
+                  const long connectTimeoutMs = PUBLISH_CONNECT_TIMEOUT_MS, const long timeoutMs = PUBLISH_TIMEOUT_MS)
+            : mStopping(false), mCapacity(capacity > 0 ? capacity : 1), mPolicy(policy),
+              mConnectTimeoutMs(std::max(connectTimeoutMs, 1L)), mTimeoutMs(std::max(timeoutMs, 1L)), mTracer(tracer),
+              mSpool(spool), mSent(0), mFailed(0), mDropped(0), mLatencyTotalUs(0), mLatencyMaxUs(0),
+              mQueueDepth(0) {
+        CurlGlobal::ensure();
+        if (mSpool) {
+            mWorkers.push_back(std::thread(&HttpPublisher::drain, this));
+            return;
+        }
+        for (unsigned int i = 0; i < std::max(workers, 1u); i++) {
+            mWorkers.push_back(std::thread(&HttpPublisher::run, this));
+        }
+    }
+
+    ~HttpPublisher() {
+        stop();
+    }
+
+    HttpPublisher(const HttpPublisher &) = delete;
+
+    HttpPublisher &operator=(const HttpPublisher &) = delete;
+
+    // Queue a POST of body to url. Returns false if the post was dropped.
+    // firstFrame and lastFrame tell the tracer which frames the post carries.
+    bool publish(std::string url, std::string body,
+                 std::string contentType = std::string(), std::string contentEncoding = std::string(),
+                 const float firstFrame = -1.0f, const float lastFrame = -1.0f) {
+        if (mSpool) {
+            if (mSpool->append(url, body, contentType, contentEncoding, firstFrame, lastFrame)) return true;
+            mDropped++;
+            return false;
+        }
+        std::unique_lock<std::mutex> lk(mMutex);
+        if (mStopping) {
+            mDropped++;
+            return false;
+        }
+        if (mQueue.size() >= mCapacity) {
+            switch (mPolicy) {
+                case OverflowPolicy::DROP_NEWEST:
+                    mDropped++;
+                    return false;
+                case OverflowPolicy::DROP_OLDEST:
+                    mQueue.pop_front();
+                    mQueueDepth--;
+                    mDropped++;
+                    break;
+                case OverflowPolicy::BLOCK:
+                    mNotFull.wait(lk, [this] { return mStopping || mQueue.size() < mCapacity; });
+                    if (mStopping) {
+                        mDropped++;
+                        return false;
+                    }
+                    break;
+            }
+        }
+        Message msg;
+        msg.url = std::move(url);
+        msg.body = std::move(body);
+        msg.contentType = std::move(contentType);
+        msg.contentEncoding = std::move(contentEncoding);
+        msg.firstFrame = firstFrame;
+        msg.lastFrame = lastFrame;
+        mQueue.push_back(std::move(msg));
+        mQueueDepth++;
+        lk.unlock();
+        mNotEmpty.notify_one();
+        return true;
+    }
+
+    // Send everything still queued, then join the workers. Spooled posts are
+    // sent while the server accepts them, for a few seconds at most.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            if (mStopping && mWorkers.empty()) return;
+            mStopping = true;
+        }
+        mNotEmpty.notify_all();
+        mNotFull.notify_all();
+        if (mSpool) mSpool->interrupt();
+        for (auto &worker : mWorkers) {
+            if (worker.joinable()) worker.join();
+        }
+        mWorkers.clear();
+    }
+
+    // Lock-free, so it can be polled without slowing publish() down
+    PublisherStats getStats() const {
+        PublisherStats stats;
+        stats.sent = mSent;
+        stats.failed = mFailed;
+        stats.dropped = mDropped;
+        stats.latencyTotalUs = mLatencyTotalUs;
+        stats.latencyMaxUs = mLatencyMaxUs;
+        stats.queueDepth = mSpool ? mSpool->getStats().pending : mQueueDepth.load();
+        return stats;
+    }
+
+private:
+
+    static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+        ((std::string *) userp)->append((char *) contents, size * nmemb);
+        return size * nmemb;
+    }
+
+    void run() {
+        CURL *curl = curl_easy_init();
+        std::string readBuffer;
+
+        for (;;) {
+            Message msg;
+            {
+                std::unique_lock<std::mutex> lk(mMutex);
+                mNotEmpty.wait(lk, [this] { return mStopping || !mQueue.empty(); });
+                if (mQueue.empty()) break;    // stopping and drained
+                msg = std::move(mQueue.front());
+                mQueue.pop_front();
+                mQueueDepth--;
+            }
+            mNotFull.notify_one();
+
+            post(curl, msg, std::string(), readBuffer);
+        }
+
+        if (curl) curl_easy_cleanup(curl);
+    }
+
+    // With a spool: one worker sends the spooled posts in order and acks each
+    // one the server accepted. A failed post is retried after a growing pause;
+    // once stopping, the worker gives up at the first failure or after
+    // STOP_GRACE, and what is left is sent by the next run.
+    void drain() {
+        CURL *curl = curl_easy_init();
+        std::string readBuffer;
+        SpoolRecord record;
+        std::chrono::milliseconds backoff(0);
+        const std::chrono::seconds STOP_GRACE(5);
+        std::chrono::steady_clock::time_point giveUp = std::chrono::steady_clock::time_point::max();
+
+        for (;;) {
+            bool stopping;
+            {
+                std::lock_guard<std::mutex> lg(mMutex);
+                stopping = mStopping;
+            }
+            if (stopping && giveUp == std::chrono::steady_clock::time_point::max()) {
+                giveUp = std::chrono::steady_clock::now() + STOP_GRACE;
+            }
+            if (stopping && std::chrono::steady_clock::now() >= giveUp) break;
+            if (!mSpool->next(record, std::chrono::milliseconds(200))) {
+                if (stopping) break;    // drained
+                continue;
+            }
+
+            Message msg;
+            msg.url.swap(record.url);
+            msg.body.swap(record.body);
+            msg.contentType.swap(record.contentType);
+            msg.contentEncoding.swap(record.contentEncoding);
+            msg.firstFrame = record.firstFrame;
+            msg.lastFrame = record.lastFrame;
+            const std::string sequence = "X-Spool-Id: " + mSpool->getId() + "\nX-Spool-Sequence: " +
+                                         std::to_string(record.sequence);
+            if (post(curl, msg, sequence, readBuffer)) {
+                mSpool->ack(record.sequence);
+                backoff = std::chrono::milliseconds(0);
+                continue;
+            }
+            if (stopping) break;
+            backoff = std::min<std::chrono::milliseconds>(std::max<std::chrono::milliseconds>(
+                    backoff * 2, std::chrono::milliseconds(100)), std::chrono::seconds(30));
+            std::unique_lock<std::mutex> lk(mMutex);
+            mNotEmpty.wait_for(lk, backoff, [this] { return mStopping; });
+        }
+
+        if (curl) curl_easy_cleanup(curl);
+    }
+
+    // Sends one post and counts the outcome; returns true if the server accepted it
+    // within the timeouts.
+    // extraHeaders holds header lines separated by '\n'.
+    bool post(CURL *curl, const Message &msg, const std::string &extraHeaders, std::string &readBuffer) {
+        if (!curl) {
+            std::cout << "ERROR\tUnable to create a curl handle" << std::endl;
+            mFailed++;
+            return false;
+        }
+
+        struct curl_slist *headers = NULL;
+        if (!msg.contentType.empty()) {
+            headers = curl_slist_append(headers, ("Content-Type: " + msg.contentType).c_str());
+        }
+        if (!msg.contentEncoding.empty()) {
+            headers = curl_slist_append(headers, ("Content-Encoding: " + msg.contentEncoding).c_str());
+        }
+        for (size_t start = 0; start < extraHeaders.size();) {
+            size_t end = extraHeaders.find('\n', start);
+            if (end == std::string::npos) end = extraHeaders.size();
+            headers = curl_slist_append(headers, extraHeaders.substr(start, end - start).c_str());
+            start = end + 1;
+        }
+
+        readBuffer.clear();
+        curl_easy_setopt(curl, CURLOPT_URL, msg.url.c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, msg.body.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) msg.body.size());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, mConnectTimeoutMs);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, mTimeoutMs);
+
+        const auto start = std::chrono::steady_clock::now();
+        CURLcode res = curl_easy_perform(curl);
+        const uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        long status = 0;
+        if (res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, (struct curl_slist *) NULL);
+        curl_slist_free_all(headers);
+        recordLatency(latency);
+
+        if (res != CURLE_OK) {
+            std::cout << "ERROR\t" << curl_easy_strerror(res) << readBuffer << std::endl;
+            mFailed++;
+            return false;
+        }
+        if (status >= 400) {
+            std::cout << "ERROR\tHTTP " << status << " " << readBuffer << std::endl;
+            mFailed++;
+            return false;
+        }
+        mSent++;
+        if (mTracer && msg.firstFrame >= 0) mTracer->markRange(msg.firstFrame, msg.lastFrame, TRACE_POSTED);
+        return true;
+    }
+
+    void recordLatency(const uint64_t latency) {
+        mLatencyTotalUs += latency;
+        uint64_t max = mLatencyMaxUs;
+        while (latency > max && !mLatencyMaxUs.compare_exchange_weak(max, latency));
+    }
+};
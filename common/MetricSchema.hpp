@@ -0,0 +1,410 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "Face.h"
+
+using namespace affdex;
+
+// Metric names, in the order the SDK lays the floats out in each struct.
+// Every table below is generated from these lists at compile time.
+#define EMOJ_HEAD_ANGLES(X) X(pitch) X(yaw) X(roll)
+
+#define EMOJ_EMOTIONS(X) \
+        X(joy) X(fear) X(disgust) X(sadness) X(anger) \
+        X(surprise) X(contempt) X(valence) X(engagement)
+
+#define EMOJ_EXPRESSIONS(X) \
+        X(smile) X(innerBrowRaise) X(browRaise) X(browFurrow) X(noseWrinkle) \
+        X(upperLipRaise) X(lipCornerDepressor) X(chinRaise) X(lipPucker) X(lipPress) \
+        X(lipSuck) X(mouthOpen) X(smirk) X(eyeClosure) X(attention) X(eyeWiden) X(cheekRaise) \
+        X(lidTighten) X(dimpler) X(lipStretch) X(jawDrop)
+
+#define EMOJ_EMOJIS(X) \
+        X(relaxed) X(smiley) X(laughing) \
+        X(kissing) X(disappointed) \
+        X(rage) X(smirk) X(wink) \
+        X(stuckOutTongueWinkingEye) X(stuckOutTongue) \
+        X(flushed) X(scream)
+
+#define EMOJ_COUNT(name) + 1
+
+const int NUM_HEAD_ANGLES = 0 EMOJ_HEAD_ANGLES(EMOJ_COUNT);
+const int NUM_EMOTIONS = 0 EMOJ_EMOTIONS(EMOJ_COUNT);
+const int NUM_EXPRESSIONS = 0 EMOJ_EXPRESSIONS(EMOJ_COUNT);
+const int NUM_EMOJIS = 0 EMOJ_EMOJIS(EMOJ_COUNT);
+const int NUM_METRICS = NUM_HEAD_ANGLES + NUM_EMOTIONS + NUM_EXPRESSIONS + NUM_EMOJIS;
+
+// One per SDK struct the metrics are read from, in FaceRecord order
+enum MetricGroup {
+    HEAD_ANGLES,    // Measurements::orientation
+    EMOTIONS,
+    EXPRESSIONS,
+    EMOJIS,
+    NUM_METRIC_GROUPS
+};
+
+struct MetricGroupInfo {
+    const char *name;
+    int begin;      // first metric of the group in METRICS
+    int count;
+};
+
+constexpr MetricGroupInfo METRIC_GROUPS[NUM_METRIC_GROUPS] = {
+        {"headAngles",  0,                                                NUM_HEAD_ANGLES},
+        {"emotions",    NUM_HEAD_ANGLES,                                  NUM_EMOTIONS},
+        {"expressions", NUM_HEAD_ANGLES + NUM_EMOTIONS,                   NUM_EXPRESSIONS},
+        {"emojis",      NUM_HEAD_ANGLES + NUM_EMOTIONS + NUM_EXPRESSIONS, NUM_EMOJIS}
+};
+
+struct MetricInfo {
+    const char *name;           // "joy"
+    const char *qualifiedName;  // "emotions.joy", unique across groups
+    const char *urlKey;         // "&joy=", as RecordSerializer writes it
+    uint8_t urlKeySize;
+    MetricGroup group;
+    uint16_t offset;            // of the float in the SDK struct of the group
+};
+
+#define EMOJ_METRIC(group, type, prefix, name) \
+        {#name, prefix "." #name, "&" #name "=", sizeof("&" #name "=") - 1, group, offsetof(type, name)},
+#define EMOJ_HEAD_ANGLE_METRIC(name) EMOJ_METRIC(HEAD_ANGLES, Orientation, "headAngles", name)
+#define EMOJ_EMOTION_METRIC(name) EMOJ_METRIC(EMOTIONS, Emotions, "emotions", name)
+#define EMOJ_EXPRESSION_METRIC(name) EMOJ_METRIC(EXPRESSIONS, Expressions, "expressions", name)
+#define EMOJ_EMOJI_METRIC(name) EMOJ_METRIC(EMOJIS, Emojis, "emojis", name)
+
+// Every metric a face carries, indexed like FaceRecord::metrics
+constexpr MetricInfo METRICS[NUM_METRICS] = {
+        EMOJ_HEAD_ANGLES(EMOJ_HEAD_ANGLE_METRIC)
+        EMOJ_EMOTIONS(EMOJ_EMOTION_METRIC)
+        EMOJ_EXPRESSIONS(EMOJ_EXPRESSION_METRIC)
+        EMOJ_EMOJIS(EMOJ_EMOJI_METRIC)
+};
+
+// True when metric i and the ones after it sit in their group's range and
+// are the group's i-th float in the SDK struct. Naming a member the SDK does
+// not have already fails in offsetof; this catches reordered or padded ones.
+constexpr bool metricLayoutMatches(const int i = 0) {
+    return i == NUM_METRICS ||
+           (i >= METRIC_GROUPS[METRICS[i].group].begin &&
+            i < METRIC_GROUPS[METRICS[i].group].begin + METRIC_GROUPS[METRICS[i].group].count &&
+            METRICS[i].offset == (i - METRIC_GROUPS[METRICS[i].group].begin) * sizeof(float) &&
+            metricLayoutMatches(i + 1));
+}
+
+static_assert(metricLayoutMatches(), "METRICS does not match the SDK struct layout");
+static_assert(sizeof(Orientation) == sizeof(float) * NUM_HEAD_ANGLES, "Orientation layout changed");
+static_assert(sizeof(Emotions) == sizeof(float) * NUM_EMOTIONS, "Emotions layout changed");
+static_assert(sizeof(Expressions) == sizeof(float) * NUM_EXPRESSIONS, "Expressions layout changed");
+static_assert(offsetof(Emojis, dominantEmoji) >= sizeof(float) * NUM_EMOJIS, "Emojis layout changed");
+
+// Copies the NUM_METRICS values of a face to out, in METRICS order. The
+// checks above make each group one contiguous run of floats.
+inline void metricValues(const Face &f, float *out) {
+    std::memcpy(out, &f.measurements.orientation, sizeof(float) * NUM_HEAD_ANGLES);
+    std::memcpy(out + METRIC_GROUPS[EMOTIONS].begin, &f.emotions, sizeof(float) * NUM_EMOTIONS);
+    std::memcpy(out + METRIC_GROUPS[EXPRESSIONS].begin, &f.expressions, sizeof(float) * NUM_EXPRESSIONS);
+    std::memcpy(out + METRIC_GROUPS[EMOJIS].begin, &f.emojis, sizeof(float) * NUM_EMOJIS);
+}
+
+// Index in METRICS of "emotions.joy", or of "joy" when only one group has
+// it ("smirk" is both an expression and an emoji). -1 if there is no such
+// metric, -2 if the bare name is ambiguous.
+inline int findMetric(const char *name) {
+    int found = -1;
+    for (int i = 0; i < NUM_METRICS; i++) {
+        if (std::strcmp(name, METRICS[i].qualifiedName) == 0) return i;
+        if (std::strcmp(name, METRICS[i].name) == 0) {
+            if (found >= 0) found = -2;
+            else if (found == -1) found = i;
+        }
+    }
+    return found;
+}
+
+// The appearance classifiers, which report a class each instead of a metric
+enum AppearanceField {
+    APPEARANCE_GENDER,
+    APPEARANCE_AGE,
+    APPEARANCE_ETHNICITY,
+    APPEARANCE_GLASSES,
+    NUM_APPEARANCE_FIELDS
+};
+
+constexpr const char *APPEARANCE_FIELDS[NUM_APPEARANCE_FIELDS] = {"gender", "age", "ethnicity", "glasses"};
+
+//---------------------------------------------------------------------------
+// The metrics and appearance fields a run reports. Only their classifiers
+// are enabled, and the serializers and the overlay leave the others out.
+// A spec such as "valence,engagement,joy" lists metric names as findMetric
+// takes them, group names ("emotions", "emojis", ...), "appearance" or one
+// of its fields, "all" or "none"; an empty spec selects everything.
+//
+// A process has a single selection, active(), which main sets once with
+// init() at startup, before any thread that reads it starts; it cannot be
+// changed after that.
+class MetricSelection {
+
+    bool mMetrics[NUM_METRICS];
+    bool mAppearance[NUM_APPEARANCE_FIELDS];
+    int mIndices[NUM_METRICS];    // of the selected metrics, in METRICS order
+    int mCount;
+
+public:
+
+    MetricSelection() {
+        select(true);
+    }
+
+    // The selection of the process: everything until init() sets it
+    static const MetricSelection &active() {
+        return instance();
+    }
+
+    // Sets active() from a spec, once; false, with the reason in error, if
+    // the spec is not valid or the selection was already set.
+    static bool init(const std::string &spec, std::string &error) {
+        static bool initialized = false;
+        if (initialized) {
+            error = "the metric selection is already set";
+            return false;
+        }
+        if (!instance().parse(spec, error)) return false;
+        initialized = true;
+        return true;
+    }
+
+    // False, with the reason in error, if a name is not known; the
+    // selection is left as it was.
+    bool parse(const std::string &spec, std::string &error) {
+        MetricSelection next;
+        next.select(false);
+        bool any = false;
+        size_t begin = 0;
+        while ((begin = spec.find_first_not_of(", \t", begin)) != std::string::npos) {
+            const size_t end = std::min(spec.find_first_of(", \t", begin), spec.size());
+            const std::string name = spec.substr(begin, end - begin);
+            begin = end;
+            any = true;
+            if (!next.add(name, error)) return false;
+        }
+        if (!any) next.select(true);
+        next.index();
+        *this = next;
+        return true;
+    }
+
+    bool has(const int metric) const {
+        return mMetrics[metric];
+    }
+
+    bool has(const AppearanceField field) const {
+        return mAppearance[field];
+    }
+
+    // True if any metric of the group is selected
+    bool hasGroup(const MetricGroup group) const {
+        const MetricGroupInfo &g = METRIC_GROUPS[group];
+        for (int i = g.begin; i < g.begin + g.count; i++) {
+            if (mMetrics[i]) return true;
+        }
+        return false;
+    }
+
+    bool hasAppearance() const {
+        for (const bool selected : mAppearance) {
+            if (selected) return true;
+        }
+        return false;
+    }
+
+    bool isAll() const {
+        for (const bool selected : mAppearance) {
+            if (!selected) return false;
+        }
+        return mCount == NUM_METRICS;
+    }
+
+    // The indices in METRICS of the selected metrics
+    const int *begin() const {
+        return mIndices;
+    }
+
+    const int *end() const {
+        return mIndices + mCount;
+    }
+
+    int size() const {
+        return mCount;
+    }
+
+    // "all", or the selected names as parse takes them back
+    std::string str() const {
+        if (isAll()) return "all";
+        std::string out;
+        for (const int i : *this) {
+            out.append(out.empty() ? "" : ",").append(METRICS[i].qualifiedName);
+        }
+        for (int i = 0; i < NUM_APPEARANCE_FIELDS; i++) {
+            if (mAppearance[i]) out.append(out.empty() ? "" : ",").append(APPEARANCE_FIELDS[i]);
+        }
+        return out.empty() ? "none" : out;
+    }
+
+private:
+
+    static MetricSelection &instance() {
+        static MetricSelection selection;
+        return selection;
+    }
+
+    void select(const bool selected) {
+        std::fill(mMetrics, mMetrics + NUM_METRICS, selected);
+        std::fill(mAppearance, mAppearance + NUM_APPEARANCE_FIELDS, selected);
+        index();
+    }
+
+    void index() {
+        mCount = 0;
+        for (int i = 0; i < NUM_METRICS; i++) {
+            if (mMetrics[i]) mIndices[mCount++] = i;
+        }
+    }
+
+    bool add(const std::string &name, std::string &error) {
+        if (name == "all" || name == "none") {
+            select(name == "all");
+            return true;
+        }
+        if (name == "appearance") {
+            std::fill(mAppearance, mAppearance + NUM_APPEARANCE_FIELDS, true);
+            return true;
+        }
+        for (int i = 0; i < NUM_APPEARANCE_FIELDS; i++) {
+            if (name == APPEARANCE_FIELDS[i]) {
+                mAppearance[i] = true;
+                return true;
+            }
+        }
+        for (const MetricGroupInfo &g : METRIC_GROUPS) {
+            if (name == g.name) {
+                std::fill(mMetrics + g.begin, mMetrics + g.begin + g.count, true);
+                return true;
+            }
+        }
+        const int metric = findMetric(name.c_str());
+        if (metric >= 0) {
+            mMetrics[metric] = true;
+            return true;
+        }
+        error = metric == -2 ? "\"" + name + "\" is in several groups, qualify it (e.g. emojis." + name + ")"
+                             : "unknown metric \"" + name + "\"";
+        return false;
+    }
+};
+
+// The values dominantEmoji takes: the emojis in METRICS order, then Unknown.
+// Their names come from dominantEmojiName, the one table of them in the
+// process, indexed by dominantEmojiIndex.
+const int NUM_DOMINANT_EMOJIS = NUM_EMOJIS + 1;
+
+constexpr Emoji DOMINANT_EMOJIS[NUM_DOMINANT_EMOJIS] = {
+        Emoji::Relaxed, Emoji::Smiley, Emoji::Laughing, Emoji::Kissing, Emoji::Disappointed,
+        Emoji::Rage, Emoji::Smirk, Emoji::Wink, Emoji::StuckOutTongueWinkingEye,
+        Emoji::StuckOutTongue, Emoji::Flushed, Emoji::Scream, Emoji::Unknown
+};
+
+// Index in DOMINANT_EMOJIS, -1 for a value the SDK added since
+inline int dominantEmojiIndex(const Emoji emoji) {
+    for (int i = 0; i < NUM_DOMINANT_EMOJIS; i++) {
+        if (DOMINANT_EMOJIS[i] == emoji) return i;
+    }
+    return -1;
+}
+
+// EmojiToString(DOMINANT_EMOJIS[i]), which allocates, looked up once for the whole process
+inline const std::string &dominantEmojiName(const int i) {
+    static const struct Names {
+        std::string names[NUM_DOMINANT_EMOJIS];
+
+        Names() {
+            for (int j = 0; j < NUM_DOMINANT_EMOJIS; j++) names[j] = affdex::EmojiToString(DOMINANT_EMOJIS[j]);
+        }
+    } cache;
+    return cache.names[i];
+}
+
+inline const char *glassesName(const Glasses glasses) {
+    return glasses == Glasses::Yes ? "yes" : "no";
+}
+
+inline const char *genderName(const Gender gender) {
+    switch (gender) {
+        case Gender::Male:
+            return "male";
+        case Gender::Female:
+            return "female";
+        default:
+            return "unknown";
+    }
+}
+
+inline const char *ageName(const Age age) {
+    switch (age) {
+        case Age::AGE_UNDER_18:
+            return "under 18";
+        case Age::AGE_18_24:
+            return "18-24";
+        case Age::AGE_25_34:
+            return "25-34";
+        case Age::AGE_35_44:
+            return "35-44";
+        case Age::AGE_45_54:
+            return "45-54";
+        case Age::AGE_55_64:
+            return "55-64";
+        case Age::AGE_65_PLUS:
+            return "65 plus";
+        default:
+            return "unknown";
+    }
+}
+
+inline const char *ethnicityName(const Ethnicity ethnicity) {
+    switch (ethnicity) {
+        case Ethnicity::CAUCASIAN:
+            return "caucasian";
+        case Ethnicity::BLACK_AFRICAN:
+            return "black african";
+        case Ethnicity::SOUTH_ASIAN:
+            return "south asian";
+        case Ethnicity::EAST_ASIAN:
+            return "east asian";
+        case Ethnicity::HISPANIC:
+            return "hispanic";
+        default:
+            return "unknown";
+    }
+}
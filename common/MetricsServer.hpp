@@ -0,0 +1,305 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "NumberFormat.hpp"
+
+
+//---------------------------------------------------------------------------
+// Builds a page in the Prometheus text exposition format. Samples are
+// grouped by metric in the order the metrics were first written, so the
+// samples of one metric with different labels may come in any order.
+class MetricsWriter {
+
+    struct Family {
+        std::string name;
+        std::string text;    // HELP, TYPE and samples
+    };
+
+    std::vector<Family> mFamilies;
+
+public:
+
+    void counter(const char *name, const char *help, const double value, const std::string &labels = std::string()) {
+        sample(family(name, "counter", help), name, value, labels);
+    }
+
+    void gauge(const char *name, const char *help, const double value, const std::string &labels = std::string()) {
+        sample(family(name, "gauge", help), name, value, labels);
+    }
+
+    // A summary without quantiles: the sum and count of the observations
+    void summary(const char *name, const char *help, const double sum, const uint64_t count,
+                 const std::string &labels = std::string()) {
+        std::string &text = family(name, "summary", help);
+        sample(text, std::string(name) + "_sum", sum, labels);
+        sample(text, std::string(name) + "_count", (double) count, labels);
+    }
+
+    // Resident memory and CPU time of this process, under their usual names
+    void process() {
+#ifndef _WIN32
+        long pages = 0, resident = 0;
+        FILE *statm = fopen("/proc/self/statm", "r");
+        if (statm) {
+            if (fscanf(statm, "%ld %ld", &pages, &resident) == 2) {
+                gauge("process_resident_memory_bytes", "Resident memory size in bytes.",
+                      (double) resident * sysconf(_SC_PAGESIZE));
+            }
+            fclose(statm);
+        }
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            const double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+            counter("process_cpu_seconds_total", "Total user and system CPU time spent in seconds.", cpu);
+        }
+#endif
+    }
+
+    std::string str() const {
+        std::string out;
+        for (const Family &f : mFamilies) out.append(f.text);
+        return out;
+    }
+
+private:
+
+    std::string &family(const char *name, const char *type, const char *help) {
+        for (Family &f : mFamilies) {
+            if (f.name == name) return f.text;
+        }
+        Family f;
+        f.name = name;
+        f.text.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        f.text.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+        mFamilies.push_back(std::move(f));
+        return mFamilies.back().text;
+    }
+
+    static void sample(std::string &out, const std::string &name, const double value, const std::string &labels) {
+        out.append(name);
+        if (!labels.empty()) out.append("{").append(labels).append("}");
+        out.push_back(' ');
+        // Counters outgrow the six digits of "%g": integers are written in full
+        char buf[32];
+        if (std::fabs(value) < 9e15 && value == (double) (long long) value) {
+            out.append(buf, numfmt::formatInt(buf, (long long) value));
+        } else {
+            out.append(buf, snprintf(buf, sizeof(buf), "%.9g", value));
+        }
+        out.push_back('\n');
+    }
+};
+
+// Time MetricsServer gives a request, from accept to the last byte sent
+const int METRICS_REQUEST_TIMEOUT_MS = 1000;
+
+//---------------------------------------------------------------------------
+// Minimal HTTP endpoint serving GET /metrics for Prometheus to scrape.
+// Requests are answered one at a time on a thread of its own, each within
+// METRICS_REQUEST_TIMEOUT_MS: a client that sends or reads slowly is cut
+// off then, so it holds the next scrape up by at most that long. The page
+// is built by the collector at every scrape from counters the pipeline keeps
+// as atomics anyway, so a scrape takes no lock the capture or SDK threads
+// use. Not available on Windows.
+class MetricsServer {
+
+    const std::string mAddress;
+    const unsigned int mPort;
+    std::function<void(MetricsWriter &)> mCollector;
+
+    int mSocket;
+    std::atomic<bool> mStopping;
+    std::thread mThread;
+    std::atomic<uint64_t> mScrapes;
+
+public:
+
+    MetricsServer(const std::string &address, const unsigned int port)
+            : mAddress(address), mPort(port), mSocket(-1), mStopping(false), mScrapes(0) {
+    }
+
+    ~MetricsServer() {
+        stop();
+    }
+
+    MetricsServer(const MetricsServer &) = delete;
+
+    MetricsServer &operator=(const MetricsServer &) = delete;
+
+    // Starts serving; the collector must stay valid until stop()
+    bool start(std::function<void(MetricsWriter &)> collector) {
+        stop();
+        mCollector = collector;
+#ifdef _WIN32
+        std::cerr << "WARN\tThe metrics endpoint is not available on Windows" << std::endl;
+        return false;
+#else
+        mSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (mSocket < 0) {
+            std::cerr << "ERROR\tUnable to create the metrics socket: " << strerror(errno) << std::endl;
+            return false;
+        }
+        const int yes = 1;
+        setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t) mPort);
+        if (inet_pton(AF_INET, mAddress.c_str(), &addr.sin_addr) != 1 ||
+            bind(mSocket, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(mSocket, 8) != 0) {
+            std::cerr << "ERROR\tUnable to serve metrics on " << mAddress << ":" << mPort << ": "
+                    << strerror(errno) << std::endl;
+            close(mSocket);
+            mSocket = -1;
+            return false;
+        }
+        mStopping = false;
+        mThread = std::thread(&MetricsServer::run, this);
+        std::cerr << "INFO\tServing metrics on http://" << mAddress << ":" << mPort << "/metrics" << std::endl;
+        return true;
+#endif
+    }
+
+    void stop() {
+        mStopping = true;
+        if (mThread.joinable()) mThread.join();
+#ifndef _WIN32
+        if (mSocket >= 0) close(mSocket);
+#endif
+        mSocket = -1;
+    }
+
+    uint64_t getScrapes() const {
+        return mScrapes;
+    }
+
+private:
+
+#ifndef _WIN32
+    void run() {
+        while (!mStopping) {
+            pollfd pfd;
+            pfd.fd = mSocket;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            // Wake up now and then to notice stop()
+            if (poll(&pfd, 1, 200) <= 0) continue;
+            const int client = accept(mSocket, nullptr, nullptr);
+            if (client < 0) continue;
+            serve(client);
+            close(client);
+        }
+    }
+
+    // Milliseconds left until deadline, 0 once it has passed
+    static int remainingMs(const std::chrono::steady_clock::time_point deadline) {
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+        return left > 0 ? (int) left : 0;
+    }
+
+    // Waits until the client is ready for events or the deadline passes
+    static bool waitFor(const int client, const short events, const std::chrono::steady_clock::time_point deadline) {
+        pollfd pfd;
+        pfd.fd = client;
+        pfd.events = events;
+        pfd.revents = 0;
+        const int timeout = remainingMs(deadline);
+        return timeout > 0 && poll(&pfd, 1, timeout) > 0 && (pfd.revents & (events | POLLHUP | POLLERR));
+    }
+
+    // "/metrics" for "GET /metrics?name[]=x HTTP/1.1", empty if the request
+    // line is not a GET
+    static std::string requestPath(const std::string &request) {
+        if (request.compare(0, 4, "GET ") != 0) return std::string();
+        const size_t end = request.find_first_of("? \r\n", 4);
+        return request.substr(4, end == std::string::npos ? std::string::npos : end - 4);
+    }
+
+    void serve(const int client) {
+        const auto deadline = std::chrono::steady_clock::now() +
+                              std::chrono::milliseconds(METRICS_REQUEST_TIMEOUT_MS);
+
+        // Only the request line matters; the rest of the request is ignored
+        std::string request;
+        char buf[1024];
+        while (request.find("\r\n") == std::string::npos && request.size() < 8192) {
+            if (!waitFor(client, POLLIN, deadline)) return;
+            const ssize_t n = recv(client, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) break;
+            if (n > 0) request.append(buf, n);
+        }
+
+        std::string status = "200 OK";
+        std::string body;
+        if (requestPath(request) == "/metrics") {
+            MetricsWriter writer;
+            mCollector(writer);
+            writer.process();
+            body = writer.str();
+            mScrapes++;
+        } else {
+            status = "404 Not Found";
+            body = "Try /metrics\n";
+        }
+
+        std::string response = "HTTP/1.1 " + status + "\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                "Connection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            if (!waitFor(client, POLLOUT, deadline)) return;
+            const ssize_t n = send(client, response.data() + sent, response.size() - sent,
+                                   MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+            if (n <= 0) break;
+            sent += n;
+        }
+    }
+#else
+    void run() {
+    }
+#endif
+};
@@ -0,0 +1,106 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+
+// Locale-free number to text conversions producing exactly what a default
+// std::ostream (precision 6, "%g" style) writes, without iostreams.
+namespace numfmt {
+
+    // Longest "%g" output: "-1.23457e-308"
+    const int MAX_CHARS = 16;
+
+    // Writes value to out and returns the number of characters written.
+    inline int formatInt(char *out, const long long value) {
+        char tmp[24];
+        int len = 0;
+        unsigned long long v = value < 0 ? 0ULL - (unsigned long long) value : (unsigned long long) value;
+        do {
+            tmp[len++] = (char) ('0' + v % 10);
+            v /= 10;
+        } while (v);
+        int n = 0;
+        if (value < 0) out[n++] = '-';
+        while (len) out[n++] = tmp[--len];
+        return n;
+    }
+
+    // Writes value as "%g" would and returns the number of characters written.
+    //
+    // Values that are exact floats and print in fixed notation (the usual case
+    // for the SDK metrics) go through an integer fast path: scaling a 24-bit
+    // float mantissa by 10^k, k <= 9, is exact in a double, so rounding to six
+    // significant digits can be done exactly (ties to even, like printf).
+    // Anything else falls back to snprintf.
+    inline int formatG(char *out, const double value) {
+        static const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+
+        const double a = std::fabs(value);
+        if (value == 0.0) {
+            int n = 0;
+            if (std::signbit(value)) out[n++] = '-';
+            out[n++] = '0';
+            return n;
+        }
+        if (!(a >= 1e-4 && a < 999999.5) || (double) (float) value != value) {
+            return snprintf(out, MAX_CHARS, "%g", value);
+        }
+
+        // Decimal exponent e of a, so that 10^e <= a < 10^(e+1), e in [-4, 5]
+        int e = 5;
+        while (a < (e >= 0 ? POW10[e] : 1.0 / POW10[-e])) e--;
+
+        const double scaled = a * POW10[5 - e];
+        uint32_t digits = (uint32_t) scaled;
+        const double frac = scaled - digits;
+        if (frac > 0.5 || (frac == 0.5 && (digits & 1))) digits++;
+        if (digits == 1000000) {
+            digits = 100000;
+            e++;
+        }
+
+        char d[6];
+        for (int i = 5; i >= 0; i--) {
+            d[i] = (char) ('0' + digits % 10);
+            digits /= 10;
+        }
+        int last = 5;    // last significant digit, trailing zeros are dropped
+        while (last > 0 && d[last] == '0') last--;
+
+        int n = 0;
+        if (value < 0) out[n++] = '-';
+        if (e >= 0) {
+            for (int i = 0; i <= e; i++) out[n++] = d[i];
+            if (last > e) {
+                out[n++] = '.';
+                for (int i = e + 1; i <= last; i++) out[n++] = d[i];
+            }
+        } else {
+            out[n++] = '0';
+            out[n++] = '.';
+            for (int i = -1; i > e; i--) out[n++] = '0';
+            for (int i = 0; i <= last; i++) out[n++] = d[i];
+        }
+        return n;
+    }
+
+} // namespace numfmt
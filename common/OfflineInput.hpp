@@ -0,0 +1,170 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <opencv2/highgui/highgui.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/regex.hpp>
+
+
+//---------------------------------------------------------------------------
+// Frames of a stored recording: a video file, a directory of images, or a
+// glob pattern matching image files (e.g. "recordings/cam0/*.png").
+// Images are read in file name order.
+//
+// Timestamps come from the recording, never from the wall clock: the
+// presentation timestamp of each video frame, or index / imageFps for image
+// sequences. The same input therefore always yields the same frames with
+// the same timestamps.
+class OfflineInput {
+
+    cv::VideoCapture mVideo;
+    std::vector<std::string> mFiles;
+    bool mIsVideo;
+    double mFps;
+    size_t mNext;
+    double mLastTimestamp;
+
+public:
+
+    OfflineInput(const std::string &spec, const double imageFps)
+            : mIsVideo(false), mFps(imageFps > 0 ? imageFps : 30.0), mNext(0), mLastTimestamp(-1.0) {
+        namespace fs = boost::filesystem;
+        if (spec.find_first_of("*?[") != std::string::npos) {
+            mFiles = glob(spec);
+        } else if (fs::is_directory(spec)) {
+            for (fs::directory_iterator it(spec), end; it != end; ++it) {
+                if (fs::is_regular_file(it->status()) && isImage(it->path())) {
+                    mFiles.push_back(it->path().string());
+                }
+            }
+            std::sort(mFiles.begin(), mFiles.end());
+        } else {
+            mIsVideo = mVideo.open(spec);
+            if (mIsVideo) {
+                const double fps = mVideo.get(CV_CAP_PROP_FPS);
+                if (fps > 0) mFps = fps;
+            }
+        }
+    }
+
+    bool isOpened() const {
+        return mIsVideo || !mFiles.empty();
+    }
+
+    // Native frame rate: the container's for videos, imageFps for images
+    double getFrameRate() const {
+        return mFps;
+    }
+
+    // Number of frames, when the container tells; 0 when unknown
+    size_t getFrameCount() const {
+        if (!mIsVideo) return mFiles.size();
+        const double count = mVideo.get(CV_CAP_PROP_FRAME_COUNT);
+        return count > 0 ? (size_t) count : 0;
+    }
+
+    // Length in seconds, 0 when unknown
+    double getDuration() const {
+        return getFrameCount() / mFps;
+    }
+
+    // Continues reading at the given frame index. Seeking in a video is only as
+    // exact as the backend, but timestamps always come from the frames read.
+    bool seek(const size_t frame) {
+        if (mIsVideo && !mVideo.set(CV_CAP_PROP_POS_FRAMES, (double) frame)) return false;
+        mNext = frame;
+        mLastTimestamp = -1.0;
+        return true;
+    }
+
+    // Reads the next frame and its timestamp in seconds. Returns false at the end.
+    bool read(cv::Mat &img, double &timestamp) {
+        if (mIsVideo) {
+            if (!mVideo.read(img)) return false;
+            timestamp = mVideo.get(CV_CAP_PROP_POS_MSEC) / 1000.0;
+            // Some backends do not report timestamps; fall back to the frame index
+            if (!(timestamp > mLastTimestamp)) timestamp = mNext / mFps;
+        } else {
+            if (mNext >= mFiles.size()) return false;
+            img = cv::imread(mFiles[mNext]);
+            if (img.empty()) {
+                std::cerr << "ERROR\tUnable to read image: " << mFiles[mNext] << std::endl;
+                return false;
+            }
+            timestamp = mNext / mFps;
+        }
+        mNext++;
+        mLastTimestamp = timestamp;
+        return true;
+    }
+
+private:
+
+    static bool isImage(const boost::filesystem::path &p) {
+        static const char *const extensions[] = {".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff", ".ppm", ".pgm"};
+        const std::string ext = boost::algorithm::to_lower_copy(p.extension().string());
+        for (const char *e : extensions) {
+            if (ext == e) return true;
+        }
+        return false;
+    }
+
+    // Wildcards are supported in the file name part only.
+    static std::vector<std::string> glob(const std::string &pattern) {
+        namespace fs = boost::filesystem;
+        std::vector<std::string> files;
+        const fs::path p(pattern);
+        const fs::path dir = p.has_parent_path() ? p.parent_path() : fs::path(".");
+        if (!fs::is_directory(dir)) return files;
+
+        std::string expr;
+        for (const char c : p.filename().string()) {
+            switch (c) {
+                case '*':
+                    expr += ".*";
+                    break;
+                case '?':
+                    expr += '.';
+                    break;
+                case '[':
+                case ']':
+                    expr += c;
+                    break;
+                default:
+                    if (std::string("\\^$.|+(){}").find(c) != std::string::npos) expr += '\\';
+                    expr += c;
+            }
+        }
+        const boost::regex re(expr);
+        for (fs::directory_iterator it(dir), end; it != end; ++it) {
+            if (fs::is_regular_file(it->status()) &&
+                boost::regex_match(it->path().filename().string(), re)) {
+                files.push_back(it->path().string());
+            }
+        }
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+};
@@ -0,0 +1,210 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+//---------------------------------------------------------------------------
+// Draws the overlay text and face points without rasterizing them again on
+// every frame. Every printable ASCII glyph is drawn once with cv::putText and
+// kept as the list of pixels it sets. A line of text is assembled from those
+// lists the first time it is drawn and kept while it is still in use, so
+// headers and labels are never laid out again and a value line, printed with
+// two decimals, only when its value changes at that precision. Drawing a
+// line writes its pixels and nothing else: no strokes, no masks, no
+// allocation. The overlay is drawn without anti-aliasing, so there is
+// nothing to blend. Glyphs sit at whole pixels, so a line may differ from
+// cv::putText by a pixel where the font scale puts a glyph between two.
+//
+// Face points are drawn in one pass: the pixels cv::circle sets for a marker
+// are listed once and written directly for every point.
+//
+// Not thread safe: the caches belong to the thread that draws.
+class OverlayRenderer {
+
+    static const int FIRST_GLYPH = 32;    // ' '
+    static const int NUM_GLYPHS = 95;     // up to '~'
+    static const size_t MAX_LINES = 1024;    // stale lines are dropped beyond this
+
+    // Pixels relative to an origin, and their bounding box
+    struct Sprite {
+        std::vector<cv::Point> pixels;
+        cv::Rect bounds;
+
+        void add(const Sprite &other, const cv::Point offset) {
+            for (const cv::Point &p : other.pixels) pixels.push_back(p + offset);
+            if (other.pixels.empty()) return;
+            const cv::Rect moved = other.bounds + offset;
+            bounds = bounds.area() ? bounds | moved : moved;
+        }
+    };
+
+    struct Glyph {
+        Sprite sprite;    // relative to the pen position on the baseline; empty for a space
+        int advance;      // in font units
+    };
+
+    struct Line {
+        Sprite sprite;    // relative to the text origin
+        uint64_t frame;   // last frame it was drawn in
+    };
+
+    const int mFont;
+    const double mScale;
+    const int mThickness;
+    Glyph mGlyphs[NUM_GLYPHS];
+    Sprite mMarker;    // relative to the point
+
+    std::unordered_map<std::string, Line> mLines;
+    std::string mKey;    // reused for lookups
+    uint64_t mFrame;
+
+public:
+
+    OverlayRenderer(const int font, const double scale, const int thickness, const int markerRadius)
+            : mFont(font), mScale(scale), mThickness(thickness), mFrame(0) {
+        for (int i = 0; i < NUM_GLYPHS; i++) {
+            const std::string c(1, (char) (FIRST_GLYPH + i));
+            int baseline = 0;
+            const cv::Size size = cv::getTextSize(c, mFont, mScale, mThickness, &baseline);
+            // Margins for glyphs that reach past their advance or below the baseline
+            const int pad = size.height + mThickness;
+            cv::Mat canvas = cv::Mat::zeros(size.height + baseline + 2 * pad, size.width + 2 * pad, CV_8UC1);
+            const cv::Point pen(pad, pad + size.height);
+            cv::putText(canvas, c, pen, mFont, mScale, cv::Scalar(255), mThickness);
+            mGlyphs[i].sprite = trace(canvas, pen);
+            mGlyphs[i].advance = cv::getTextSize(c, mFont, 1.0, 0, nullptr).width;
+        }
+
+        const int side = 2 * (markerRadius + 1) + 1;
+        cv::Mat canvas = cv::Mat::zeros(side, side, CV_8UC1);
+        const cv::Point center(markerRadius + 1, markerRadius + 1);
+        cv::circle(canvas, center, markerRadius, cv::Scalar(255));
+        mMarker = trace(canvas, center);
+    }
+
+    OverlayRenderer(const OverlayRenderer &) = delete;
+
+    OverlayRenderer &operator=(const OverlayRenderer &) = delete;
+
+    // Like cv::putText: origin is the bottom-left corner of the text; img is BGR
+    void text(cv::Mat &img, const char *text, const cv::Point origin, const cv::Scalar &color) {
+        mKey.assign(text);
+        auto it = mLines.find(mKey);
+        if (it == mLines.end()) {
+            Line line;
+            if (!layout(mKey, line.sprite)) {
+                cv::putText(img, mKey, origin, mFont, mScale, color, mThickness);
+                return;
+            }
+            it = mLines.insert(std::make_pair(mKey, std::move(line))).first;
+        }
+        it->second.frame = mFrame;
+        draw(img, it->second.sprite, origin, color);
+    }
+
+    void text(cv::Mat &img, const std::string &text, const cv::Point origin, const cv::Scalar &color) {
+        this->text(img, text.c_str(), origin, color);
+    }
+
+    // The markers of all points at once. Points are truncated to whole
+    // pixels, as cv::Point(x, y) does.
+    template<typename Points>
+    void points(cv::Mat &img, const Points &points, const cv::Scalar &color) {
+        for (const auto &point : points) {
+            draw(img, mMarker, cv::Point((int) point.x, (int) point.y), color);
+        }
+    }
+
+    // Call once per drawn frame. Once there are many lines, the ones not drawn
+    // in this frame are dropped.
+    void endFrame() {
+        if (mLines.size() > MAX_LINES) {
+            for (auto it = mLines.begin(); it != mLines.end();) {
+                if (it->second.frame != mFrame) it = mLines.erase(it);
+                else ++it;
+            }
+        }
+        mFrame++;
+    }
+
+    size_t getCachedLines() const {
+        return mLines.size();
+    }
+
+private:
+
+    // The pixels set in a CV_8UC1 canvas, relative to origin
+    static Sprite trace(const cv::Mat &canvas, const cv::Point origin) {
+        Sprite sprite;
+        for (int y = 0; y < canvas.rows; y++) {
+            const uchar *row = canvas.ptr<uchar>(y);
+            for (int x = 0; x < canvas.cols; x++) {
+                if (row[x]) sprite.pixels.push_back(cv::Point(x, y) - origin);
+            }
+        }
+        for (const cv::Point &p : sprite.pixels) {
+            sprite.bounds = sprite.bounds.area() ? sprite.bounds | cv::Rect(p.x, p.y, 1, 1) : cv::Rect(p.x, p.y, 1, 1);
+        }
+        return sprite;
+    }
+
+    // False if the text has a character without a glyph
+    bool layout(const std::string &text, Sprite &sprite) const {
+        size_t pixels = 0;
+        for (const char ch : text) {
+            const int i = (unsigned char) ch - FIRST_GLYPH;
+            if (i < 0 || i >= NUM_GLYPHS) return false;
+            pixels += mGlyphs[i].sprite.pixels.size();
+        }
+        sprite.pixels.reserve(pixels);
+        // Pen positions follow cv::putText: the advances add up in font units
+        int units = 0;
+        for (const char ch : text) {
+            const Glyph &glyph = mGlyphs[(unsigned char) ch - FIRST_GLYPH];
+            sprite.add(glyph.sprite, cv::Point(cvRound(units * mScale), 0));
+            units += glyph.advance;
+        }
+        return true;
+    }
+
+    static void draw(cv::Mat &img, const Sprite &sprite, const cv::Point origin, const cv::Scalar &color) {
+        const uchar b = cv::saturate_cast<uchar>(color[0]);
+        const uchar g = cv::saturate_cast<uchar>(color[1]);
+        const uchar r = cv::saturate_cast<uchar>(color[2]);
+        const cv::Rect frame(0, 0, img.cols, img.rows);
+        const cv::Rect placed = sprite.bounds + origin;
+        if ((placed & frame).area() == 0) return;
+        const bool clip = (placed & frame).area() != placed.area();
+        for (const cv::Point &p : sprite.pixels) {
+            const int x = origin.x + p.x;
+            const int y = origin.y + p.y;
+            if (clip && ((unsigned) x >= (unsigned) img.cols || (unsigned) y >= (unsigned) img.rows)) continue;
+            uchar *pixel = img.ptr<uchar>(y) + 3 * x;
+            pixel[0] = b;
+            pixel[1] = g;
+            pixel[2] = r;
+        }
+    }
+};
@@ -23,33 +23,50 @@
 #include <memory>
 #include <chrono>
 #include <thread>
-#include <mutex>
+#include <atomic>
 #include <fstream>
 #include <map>
+#include <utility>
+#include <iterator>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/timer/timer.hpp>
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
-#include <curl/curl.h>
 
 #include "ImageListener.h"
 
+#include "FaceRecord.hpp"
+#include "FaceTrackStore.hpp"
+#include "FrameTracer.hpp"
+#include "HttpPublisher.hpp"
+#include "OverlayRenderer.hpp"
+#include "RecordSerializer.hpp"
+#include "SpscRing.hpp"
+#include "Wakeup.hpp"
+
 
 using namespace affdex;
 
 class PlottingImageListener : public ImageListener {
 
-    std::mutex mMutex;
-    std::deque<std::pair<Frame, std::map<FaceId, Face> > > mDataArray;
+    SpscRing<std::pair<Frame, std::map<FaceId, Face> > > mResults;
 
+    // Written on the SDK thread only; the rates are read from the render thread.
     double mCaptureLastTS;
-    double mCaptureFPS;
+    std::atomic<double> mCaptureFPS;
     double mProcessLastTS;
-    double mProcessFPS;
+    std::atomic<double> mProcessFPS;
+    std::atomic<uint64_t> mCaptured;
+    std::atomic<uint64_t> mProcessed;
 
-    std::ostringstream curlOutput;
+    RecordSerializer mSerializer;
+    std::shared_ptr<HttpPublisher> mPublisher;
+    const int mStreamId;    // tags the records of a multi-stream run, -1 otherwise
+    std::shared_ptr<FrameTracer> mTracer;
+    std::shared_ptr<Wakeup> mWakeup;    // notified when a result is queued, may be null
+    std::shared_ptr<FaceTrackStore> mTracks;    // updated with every result, may be null
 
     std::chrono::time_point<std::chrono::system_clock> mStartT;
     const bool mDrawDisplay;
@@ -57,80 +74,22 @@ class PlottingImageListener : public ImageListener {
     const float font_size = 0.5f;
     const int font = cv::FONT_HERSHEY_COMPLEX_SMALL;
 
-    std::vector<std::string> expressions;
-    std::vector<std::string> emotions;
-    std::vector<std::string> emojis;
-    std::vector<std::string> headAngles;
-
-    std::map<affdex::Glasses, std::string> glassesMap;
-    std::map<affdex::Gender, std::string> genderMap;
-    std::map<affdex::Age, std::string> ageMap;
-    std::map<affdex::Ethnicity, std::string> ethnicityMap;
+    OverlayRenderer mOverlay;    // used by the drawing thread only
 
 public:
 
-    PlottingImageListener(const bool draw_display)
-            : mDrawDisplay(draw_display), mStartT(std::chrono::system_clock::now()),
+    PlottingImageListener(const bool draw_display, std::shared_ptr<HttpPublisher> publisher,
+                          const size_t result_queue_length, const int stream_id = -1)
+            : mResults(result_queue_length),
               mCaptureLastTS(-1.0f), mCaptureFPS(-1.0f),
-              mProcessLastTS(-1.0f), mProcessFPS(-1.0f) {
-        expressions = {
-                "smile", "innerBrowRaise", "browRaise", "browFurrow", "noseWrinkle",
-                "upperLipRaise", "lipCornerDepressor", "chinRaise", "lipPucker", "lipPress",
-                "lipSuck", "mouthOpen", "smirk", "eyeClosure", "attention", "eyeWiden", "cheekRaise",
-                "lidTighten", "dimpler", "lipStretch", "jawDrop"
-        };
-
-        emotions = {
-                "joy", "fear", "disgust", "sadness", "anger",
-                "surprise", "contempt", "valence", "engagement"
-        };
-
-        headAngles = {"pitch", "yaw", "roll"};
-
-
-        emojis = std::vector<std::string> {
-                "relaxed", "smiley", "laughing",
-                "kissing", "disappointed",
-                "rage", "smirk", "wink",
-                "stuckOutTongueWinkingEye", "stuckOutTongue",
-                "flushed", "scream"
-        };
-
-        genderMap = std::map<affdex::Gender, std::string> {
-                {affdex::Gender::Male,    "male"},
-                {affdex::Gender::Female,  "female"},
-                {affdex::Gender::Unknown, "unknown"},
-
-        };
-
-        glassesMap = std::map<affdex::Glasses, std::string> {
-                {affdex::Glasses::Yes, "yes"},
-                {affdex::Glasses::No,  "no"}
-        };
-
-        ageMap = std::map<affdex::Age, std::string> {
-                {affdex::Age::AGE_UNKNOWN,  "unknown"},
-                {affdex::Age::AGE_UNDER_18, "under 18"},
-                {affdex::Age::AGE_18_24,    "18-24"},
-                {affdex::Age::AGE_25_34,    "25-34"},
-                {affdex::Age::AGE_35_44,    "35-44"},
-                {affdex::Age::AGE_45_54,    "45-54"},
-                {affdex::Age::AGE_55_64,    "55-64"},
-                {affdex::Age::AGE_65_PLUS,  "65 plus"}
-        };
-
-        ethnicityMap = std::map<affdex::Ethnicity, std::string> {
-                {affdex::Ethnicity::UNKNOWN,       "unknown"},
-                {affdex::Ethnicity::CAUCASIAN,     "caucasian"},
-                {affdex::Ethnicity::BLACK_AFRICAN, "black african"},
-                {affdex::Ethnicity::SOUTH_ASIAN,   "south asian"},
-                {affdex::Ethnicity::EAST_ASIAN,    "east asian"},
-                {affdex::Ethnicity::HISPANIC,      "hispanic"}
-        };
+              mProcessLastTS(-1.0f), mProcessFPS(-1.0f), mCaptured(0), mProcessed(0),
+              mPublisher(publisher), mStreamId(stream_id),
+              mStartT(std::chrono::system_clock::now()), mDrawDisplay(draw_display),
+              mOverlay(font, font_size, 1, 2) {
     }
 
-    FeaturePoint minPoint(VecFeaturePoint points) {
-        VecFeaturePoint::iterator it = points.begin();
+    FeaturePoint minPoint(const VecFeaturePoint &points) {
+        VecFeaturePoint::const_iterator it = points.begin();
         FeaturePoint ret = *it;
         for (; it != points.end(); it++) {
             if (it->x < ret.x) ret.x = it->x;
@@ -139,8 +98,8 @@ public:
         return ret;
     };
 
-    FeaturePoint maxPoint(VecFeaturePoint points) {
-        VecFeaturePoint::iterator it = points.begin();
+    FeaturePoint maxPoint(const VecFeaturePoint &points) {
+        VecFeaturePoint::const_iterator it = points.begin();
         FeaturePoint ret = *it;
         for (; it != points.end(); it++) {
             if (it->x > ret.x) ret.x = it->x;
@@ -150,31 +109,69 @@ public:
     };
 
 
-    double getProcessingFrameRate() {
-        std::lock_guard<std::mutex> lg(mMutex);
+    // The overlay renderer used by draw(), for a thread other than the render thread
+    std::unique_ptr<OverlayRenderer> newOverlayRenderer() const {
+        return std::unique_ptr<OverlayRenderer>(new OverlayRenderer(font, font_size, 1, 2));
+    }
+
+    // Set before the detector starts
+    void setTracer(std::shared_ptr<FrameTracer> tracer) {
+        mTracer = tracer;
+    }
+
+    // Set before the detector starts: lets the consumer sleep until a result comes in
+    void setWakeup(std::shared_ptr<Wakeup> wakeup) {
+        mWakeup = wakeup;
+    }
+
+    // Set before the detector starts
+    void setTrackStore(std::shared_ptr<FaceTrackStore> tracks) {
+        mTracks = tracks;
+    }
+
+    double getProcessingFrameRate() const {
         return mProcessFPS;
     }
 
-    double getCaptureFrameRate() {
-        std::lock_guard<std::mutex> lg(mMutex);
+    double getCaptureFrameRate() const {
         return mCaptureFPS;
     }
 
+    // Frames seen by the onImageCapture and onImageResults callbacks
+    uint64_t getCapturedFrames() const {
+        return mCaptured.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getProcessedFrames() const {
+        return mProcessed.load(std::memory_order_relaxed);
+    }
+
     int getDataSize() {
-        std::lock_guard<std::mutex> lg(mMutex);
-        return mDataArray.size();
+        return mResults.size();
     }
 
-    std::pair<Frame, std::map<FaceId, Face>> getData() {
-        std::lock_guard<std::mutex> lg(mMutex);
-        std::pair<Frame, std::map<FaceId, Face>> dpoint = mDataArray.front();
-        mDataArray.pop_front();
-        return dpoint;
+    // Calls f with the oldest pending result, if there is one.
+    // Must only be called from one consumer thread.
+    template<typename F>
+    bool tryGetData(F &&f) {
+        return mResults.consume(std::forward<F>(f));
     }
 
+    // Results refused because the consumer fell behind
+    uint64_t getDroppedResults() const {
+        return mResults.dropped();
+    }
+
+    size_t getResultHighWaterMark() const {
+        return mResults.highWaterMark();
+    }
+
+    // Called on the SDK thread: hands the result over without waiting for the consumer.
     void onImageResults(std::map<FaceId, Face> faces, Frame image) override {
-        std::lock_guard<std::mutex> lg(mMutex);
-        mDataArray.push_back(std::pair<Frame, std::map<FaceId, Face>>(image, faces));
+        if (mTracer) mTracer->mark(image.getTimestamp(), TRACE_SDK_RESULT);
+        mProcessed.fetch_add(1, std::memory_order_relaxed);
+        if (mTracks) mTracks->update(faces, image.getTimestamp(), mStreamId);
+        if (mResults.tryPush(std::make_pair(std::move(image), std::move(faces))) && mWakeup) mWakeup->notify();
         std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
         std::chrono::milliseconds milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(now - mStartT);
         double seconds = milliseconds.count() / 1000.f;
@@ -183,163 +180,144 @@ public:
     };
 
     void onImageCapture(Frame image) override {
-        std::lock_guard<std::mutex> lg(mMutex);
+        if (mTracer) mTracer->mark(image.getTimestamp(), TRACE_SDK_CAPTURE);
+        mCaptured.fetch_add(1, std::memory_order_relaxed);
         mCaptureFPS = 1.0f / (image.getTimestamp() - mCaptureLastTS);
         mCaptureLastTS = image.getTimestamp();
     };
 
 
-    static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
-        ((std::string *) userp)->append((char *) contents, size * nmemb);
-        return size * nmemb;
-    }
-
-    void send(std::string urlBase, std::string message) {
-        CURL *curl;
-        CURLcode res;
-        std::string readBuffer;
-
-        curl_global_init(CURL_GLOBAL_ALL);
-
-        // get a curl handle
-        curl = curl_easy_init();
-        if (curl) {
-            curl_easy_setopt(curl, CURLOPT_URL, urlBase.c_str());
-            // Now specify the POST data
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, message.c_str());
-
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
-
-            res = curl_easy_perform(curl);
-            if (res != CURLE_OK) {
-                std::cout << "ERROR\t" << curl_easy_strerror(res) << readBuffer << std::endl;
-            }
-            curl_easy_cleanup(curl);
+    void outputToServer(const std::map<FaceId, Face> &faces, const double timeStamp, const std::string &urlBase) {
+        for (auto &face_id_pair : faces) {
+            mPublisher->publish(urlBase, mSerializer.serialize(face_id_pair.second, timeStamp, mStreamId),
+                                std::string(), std::string(), (float) timeStamp, (float) timeStamp);
         }
-        curl_global_cleanup();
     }
 
-    void outputToServer(const std::map<FaceId, Face> faces, const double timeStamp, std::string urlBase) {
-        for (auto &face_id_pair : faces) {
-            Face f = face_id_pair.second;
-
-            curlOutput << "timeStamp=" << timeStamp << "&"
-                    << "faceId" << "=" << f.id << "&"
-                    << "interocularDistance" << "=" << f.measurements.interocularDistance << "&"
-                    << "glasses" << "=" << glassesMap[f.appearance.glasses] << "&"
-                    << "age" << "=" << ageMap[f.appearance.age] << "&"
-                    << "ethnicity" << "=" << ethnicityMap[f.appearance.ethnicity] << "&"
-                    << "gender" << "=" << genderMap[f.appearance.gender] << "&"
-                    << "dominantEmoji" << "=" << affdex::EmojiToString(f.emojis.dominantEmoji) << "&";
-
-            // headAngles
-            auto *values = (float *) &f.measurements.orientation;
-            for (std::string angle : headAngles) {
-                curlOutput << angle << "=" << (*values++) << "&";
-            }
-
-            // emotions
-            values = (float *) &f.emotions;
-            for (std::string emotion : emotions) {
-                curlOutput << emotion << "=" << (*values++) << "&";
-            }
-
-            // expressions
-            values = (float *) &f.expressions;
-            for (std::string expression : expressions) {
-                curlOutput << expression << "=" << (*values++) << "&";
-            }
-
-            //emojis
-            values = (float *) &f.emojis;
-            for (std::string emoji : emojis) {
-                curlOutput << emoji << "=" << (*values++) << "&";
-            }
-
-            // delete last character "&"
-            curlOutput.seekp(-1, curlOutput.cur);
-
-            std::string msg = curlOutput.str();
-
-            std::thread t(&PlottingImageListener::send, this, urlBase, msg);
-            t.detach();
+    void outputToServer(const std::vector<FaceRecord> &records, const std::string &urlBase) {
+        for (const FaceRecord &record : records) {
+            mPublisher->publish(urlBase, mSerializer.serialize(record));
         }
     }
 
-    void drawValues(const float *first, const std::vector<std::string> names,
-                    const int x, int &padding, const cv::Scalar clr,
-                    cv::Mat img) {
-        for (std::string name : names) {
-            if (std::abs(*first) > 5.0f) {
+    // Draws the metrics of one group, metrics holding a face's values in METRICS order
+    void drawValues(const float *metrics, const MetricGroup group,
+                    const int x, int &padding, const cv::Scalar &clr,
+                    cv::Mat &img, OverlayRenderer &overlay) {
+        const MetricGroupInfo &g = METRIC_GROUPS[group];
+        const MetricSelection &selection = MetricSelection::active();
+        for (int i = g.begin; i < g.begin + g.count; i++) {
+            if (selection.has(i) && std::abs(metrics[i]) > 5.0f) {
                 char m[50];
-                sprintf(m, "%s: %3.2f", name.c_str(), (*first));
-                cv::putText(img, m, cv::Point(x, padding += spacing), font, font_size, clr);
+                snprintf(m, sizeof(m), "%s: %3.2f", METRICS[i].name, metrics[i]);
+                overlay.text(img, m, cv::Point(x, padding += spacing), clr);
             }
-            first++;
         }
     }
 
-    void draw(const std::map<FaceId, Face> faces, Frame image) {
+    // Shows the frame with the metrics drawn over it. Runs on the render thread and
+    // takes no lock the detector callbacks use; the caller pumps HighGUI events.
+    void draw(const std::map<FaceId, Face> &faces, Frame &image) {
         std::shared_ptr<byte> imgdata = image.getBGRByteArray();
         cv::Mat img = cv::Mat(image.getHeight(), image.getWidth(), CV_8UC3, imgdata.get());
 
+        draw(faces, img);
+    }
+
+    // Same, drawing on a BGR image the caller owns
+    void draw(const std::map<FaceId, Face> &faces, cv::Mat img) {
+        drawOverlay(faces, img);
+        cv::imshow("emotions-app", img);
+    }
+
+    void drawOverlay(const std::map<FaceId, Face> &faces, cv::Mat img) {
+        drawOverlay(faces, img, mOverlay);
+    }
+
+    // Same, for another drawing thread: each one draws with a renderer of its own
+    void drawOverlay(const std::map<FaceId, Face> &faces, cv::Mat img, OverlayRenderer &overlay) {
         const int left_margin = 30;
 
         cv::Scalar clr = cv::Scalar(0, 0, 255);
         cv::Scalar header_clr = cv::Scalar(255, 0, 0);
+        const std::shared_ptr<const FaceTrackSnapshot> tracks = mTracks ? mTracks->snapshot() : nullptr;
+        // Groups and fields the run does not report are not drawn
+        const MetricSelection &selection = MetricSelection::active();
 
         for (auto &face_id_pair : faces) {
-            Face f = face_id_pair.second;
-            VecFeaturePoint points = f.featurePoints;
-            for (auto &point : points)    //Draw face feature points.
-            {
-                cv::circle(img, cv::Point(point.x, point.y), 2.0f, cv::Scalar(0, 0, 255));
-            }
+            const Face &f = face_id_pair.second;
+            const VecFeaturePoint &points = f.featurePoints;
+            overlay.points(img, points, cv::Scalar(0, 0, 255));    //Draw face feature points.
             FeaturePoint tl = minPoint(points);
             FeaturePoint br = maxPoint(points);
 
             //Output the results of the different classifiers.
             int padding = tl.y + 10;
 
-            cv::putText(img, "APPEARANCE", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
-            cv::putText(img, genderMap[f.appearance.gender], cv::Point(br.x, padding += spacing), font, font_size, clr);
-            cv::putText(img, glassesMap[f.appearance.glasses], cv::Point(br.x, padding += spacing), font, font_size,
-                        clr);
-            cv::putText(img, ageMap[f.appearance.age], cv::Point(br.x, padding += spacing), font, font_size, clr);
-            cv::putText(img, ethnicityMap[f.appearance.ethnicity], cv::Point(br.x, padding += spacing), font, font_size,
-                        clr);
+            if (selection.hasAppearance()) {
+                overlay.text(img, "APPEARANCE", cv::Point(br.x, padding += (spacing * 2)), header_clr);
+            }
+            if (selection.has(APPEARANCE_GENDER)) {
+                overlay.text(img, genderName(f.appearance.gender), cv::Point(br.x, padding += spacing), clr);
+            }
+            if (selection.has(APPEARANCE_GLASSES)) {
+                overlay.text(img, glassesName(f.appearance.glasses), cv::Point(br.x, padding += spacing), clr);
+            }
+            if (selection.has(APPEARANCE_AGE)) {
+                overlay.text(img, ageName(f.appearance.age), cv::Point(br.x, padding += spacing), clr);
+            }
+            if (selection.has(APPEARANCE_ETHNICITY)) {
+                overlay.text(img, ethnicityName(f.appearance.ethnicity), cv::Point(br.x, padding += spacing), clr);
+            }
 
-            Orientation headAngles = f.measurements.orientation;
+            const Orientation &headAngles = f.measurements.orientation;
 
             char strAngles[100];
-            sprintf(strAngles, "Pitch: %3.2f Yaw: %3.2f Roll: %3.2f Interocular: %3.2f",
-                    headAngles.pitch, headAngles.yaw, headAngles.roll, f.measurements.interocularDistance);
+            if (selection.hasGroup(HEAD_ANGLES)) {
+                sprintf(strAngles, "Pitch: %3.2f Yaw: %3.2f Roll: %3.2f Interocular: %3.2f",
+                        headAngles.pitch, headAngles.yaw, headAngles.roll, f.measurements.interocularDistance);
+            } else {
+                sprintf(strAngles, "Interocular: %3.2f", f.measurements.interocularDistance);
+            }
 
 
             char fId[10];
             sprintf(fId, "ID: %i", f.id);
-            cv::putText(img, fId, cv::Point(br.x, padding += spacing), font, font_size, clr);
-            cv::putText(img, "MEASUREMENTS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
-            cv::putText(img, strAngles, cv::Point(br.x, padding += spacing), font, font_size, clr);
-            cv::putText(img, "EMOJIS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
-            cv::putText(img, "dominantEmoji: " + affdex::EmojiToString(f.emojis.dominantEmoji),
-                        cv::Point(br.x, padding += spacing), font, font_size, clr);
-            drawValues((float *) &f.emojis, emojis, br.x, padding, clr, img);
-            cv::putText(img, "EXPRESSIONS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
-            drawValues((float *) &f.expressions, expressions, br.x, padding, clr, img);
-            cv::putText(img, "EMOTIONS", cv::Point(br.x, padding += (spacing * 2)), font, font_size, header_clr);
-            drawValues((float *) &f.emotions, emotions, br.x, padding, clr, img);
+            overlay.text(img, fId, cv::Point(br.x, padding += spacing), clr);
+            const FaceTrackSummary *track = tracks ? tracks->find(f.id, mStreamId) : nullptr;
+            if (track) {
+                char dwell[32];
+                snprintf(dwell, sizeof(dwell), "dwell: %.0f s", track->dwell());
+                overlay.text(img, dwell, cv::Point(br.x, padding += spacing), clr);
+            }
+            overlay.text(img, "MEASUREMENTS", cv::Point(br.x, padding += (spacing * 2)), header_clr);
+            overlay.text(img, strAngles, cv::Point(br.x, padding += spacing), clr);
+            float metrics[NUM_METRICS];
+            metricValues(f, metrics);
+            if (selection.hasGroup(EMOJIS)) {
+                overlay.text(img, "EMOJIS", cv::Point(br.x, padding += (spacing * 2)), header_clr);
+                const int emoji = dominantEmojiIndex(f.emojis.dominantEmoji);
+                char dominant[64];
+                snprintf(dominant, sizeof(dominant), "dominantEmoji: %s", emoji >= 0
+                         ? dominantEmojiName(emoji).c_str() : affdex::EmojiToString(f.emojis.dominantEmoji).c_str());
+                overlay.text(img, dominant, cv::Point(br.x, padding += spacing), clr);
+                drawValues(metrics, EMOJIS, br.x, padding, clr, img, overlay);
+            }
+            if (selection.hasGroup(EXPRESSIONS)) {
+                overlay.text(img, "EXPRESSIONS", cv::Point(br.x, padding += (spacing * 2)), header_clr);
+                drawValues(metrics, EXPRESSIONS, br.x, padding, clr, img, overlay);
+            }
+            if (selection.hasGroup(EMOTIONS)) {
+                overlay.text(img, "EMOTIONS", cv::Point(br.x, padding += (spacing * 2)), header_clr);
+                drawValues(metrics, EMOTIONS, br.x, padding, clr, img, overlay);
+            }
         }
         char fps_str[50];
-        sprintf(fps_str, "capture fps: %2.0f", mCaptureFPS);
-        cv::putText(img, fps_str, cv::Point(img.cols - 110, img.rows - left_margin - spacing), font, font_size, clr);
-        sprintf(fps_str, "process fps: %2.0f", mProcessFPS);
-        cv::putText(img, fps_str, cv::Point(img.cols - 110, img.rows - left_margin), font, font_size, clr);
-
-        cv::imshow("emotions-app", img);
-        std::lock_guard<std::mutex> lg(mMutex);
-        cv::waitKey(30);
+        sprintf(fps_str, "capture fps: %2.0f", getCaptureFrameRate());
+        overlay.text(img, fps_str, cv::Point(img.cols - 110, img.rows - left_margin - spacing), clr);
+        sprintf(fps_str, "process fps: %2.0f", getProcessingFrameRate());
+        overlay.text(img, fps_str, cv::Point(img.cols - 110, img.rows - left_margin), clr);
+        overlay.endFrame();
     }
 
 };
\ No newline at end of file
@@ -0,0 +1,133 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <cstring>
+#include <string>
+
+#include "Face.h"
+
+#include "FaceRecord.hpp"
+#include "NumberFormat.hpp"
+
+using namespace affdex;
+
+//---------------------------------------------------------------------------
+// Writes one face as the urlencoded record posted to the server:
+//   timeStamp=..&faceId=..&interocularDistance=..&glasses=..&age=..&
+//   ethnicity=..&gender=..&dominantEmoji=..&pitch=..& ... &scream=..
+// Records of a multi-stream run carry "&streamId=.." after the faceId.
+// Metrics and appearance fields left out of MetricSelection::active() are
+// not written, nor dominantEmoji without the emojis.
+// The output buffer is reserved once and reused, so serializing a record
+// does not allocate. The returned reference is valid until the next call.
+class RecordSerializer {
+
+    static const size_t CAPACITY = 4096;
+
+    std::string mBuffer;
+
+public:
+
+    RecordSerializer() {
+        mBuffer.reserve(CAPACITY);
+    }
+
+    const std::string &serialize(const Face &f, const double timeStamp, const int streamId = -1) {
+        float metrics[NUM_METRICS];
+        metricValues(f, metrics);
+        return write(timeStamp, f.id, streamId, f.measurements.interocularDistance, f.appearance,
+                     f.emojis.dominantEmoji, metrics);
+    }
+
+    const std::string &serialize(const FaceRecord &r) {
+        Appearance appearance;
+        appearance.glasses = r.glasses;
+        appearance.age = r.age;
+        appearance.ethnicity = r.ethnicity;
+        appearance.gender = r.gender;
+        return write(r.timeStamp, r.faceId, r.streamId, r.interocularDistance, appearance, r.dominantEmoji,
+                     r.metrics);
+    }
+
+private:
+
+    void literal(const char *text, const size_t size) {
+        mBuffer.append(text, size);
+    }
+
+    void literal(const char *text) {
+        mBuffer.append(text, std::strlen(text));
+    }
+
+    void number(const double value) {
+        char buf[numfmt::MAX_CHARS];
+        mBuffer.append(buf, numfmt::formatG(buf, value));
+    }
+
+    void emoji(const Emoji e) {
+        const int i = dominantEmojiIndex(e);
+        if (i >= 0) mBuffer.append(dominantEmojiName(i));
+        else mBuffer.append(affdex::EmojiToString(e));
+    }
+
+    const std::string &write(const double timeStamp, const FaceId id, const int streamId,
+                             const float interocularDistance,
+                             const Appearance &appearance, const Emoji dominantEmoji,
+                             const float *metrics) {
+        char buf[numfmt::MAX_CHARS];
+        mBuffer.clear();
+        literal("timeStamp=", 10);
+        number(timeStamp);
+        literal("&faceId=", 8);
+        mBuffer.append(buf, numfmt::formatInt(buf, id));
+        if (streamId >= 0) {
+            literal("&streamId=", 10);
+            mBuffer.append(buf, numfmt::formatInt(buf, streamId));
+        }
+        literal("&interocularDistance=", 21);
+        number(interocularDistance);
+        const MetricSelection &selection = MetricSelection::active();
+        if (selection.has(APPEARANCE_GLASSES)) {
+            literal("&glasses=", 9);
+            literal(glassesName(appearance.glasses));
+        }
+        if (selection.has(APPEARANCE_AGE)) {
+            literal("&age=", 5);
+            literal(ageName(appearance.age));
+        }
+        if (selection.has(APPEARANCE_ETHNICITY)) {
+            literal("&ethnicity=", 11);
+            literal(ethnicityName(appearance.ethnicity));
+        }
+        if (selection.has(APPEARANCE_GENDER)) {
+            literal("&gender=", 8);
+            literal(genderName(appearance.gender));
+        }
+        if (selection.hasGroup(EMOJIS)) {
+            literal("&dominantEmoji=", 15);
+            emoji(dominantEmoji);
+        }
+        for (const int i : selection) {
+            literal(METRICS[i].urlKey, METRICS[i].urlKeySize);
+            number(metrics[i]);
+        }
+        return mBuffer;
+    }
+};
@@ -0,0 +1,265 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+//---------------------------------------------------------------------------
+// Chunked columnar face recording (.emjr), written by FaceRecorder and read
+// by RecordingReader. Numbers are written in the byte order of the host, as
+// they are in memory, and read back the same way: a file is read on hosts of
+// the byte order of the one that wrote it (little endian for every platform
+// the SDK runs on).
+//
+//   header:  "EMJR" u16 version u16 columns
+//            per column: u8 type u8 0 u16 width u16 nameLength name
+//   chunks:  "EMJK" u32 rows f64 tMin f64 tMax
+//            per column: u8 codec u8[3] 0 u32 size
+//            per column: size bytes of data
+//   index:   "EMJI" u32 chunks
+//            per chunk: u64 offset u32 rows u32 0 f64 tMin f64 tMax
+//   trailer: u64 index offset "EMJE"
+//
+// A column holds `width` values of its type per row (e.g. the x coordinates
+// of every feature point of a face), row after row. The header names the
+// columns, so reading a file needs no knowledge of the SDK. A file whose
+// writer did not get to write the index can still be read chunk by chunk.
+namespace recording {
+
+    const uint16_t VERSION = 1;
+
+    enum ColumnType {
+        F32 = 1,
+        F64 = 2,
+        I32 = 3,
+        U8 = 4,
+        U32 = 5
+    };
+
+    // How a column is stored in a chunk
+    enum Codec {
+        RAW = 0,
+        // Each value is XORed with the same value of the previous row and the
+        // bytes are grouped by significance (byte shuffle): slowly changing
+        // floats leave planes of mostly zero sign and exponent bytes. Then a
+        // u32 size per plane, and the planes, each deflated unless that does
+        // not save an eighth of it. The low mantissa bytes are noise that
+        // deflate would not shrink and would only slow down to inflate. A
+        // plane of zeros (a value that did not change) has size 0.
+        XOR_SHUFFLE_DEFLATE = 1
+    };
+
+    struct ColumnInfo {
+        std::string name;
+        uint8_t type;
+        uint16_t width;    // values per row
+    };
+
+    inline size_t typeSize(const uint8_t type) {
+        switch (type) {
+            case F64:
+                return 8;
+            case U8:
+                return 1;
+            default:
+                return 4;
+        }
+    }
+
+    inline double valueAt(const uint8_t type, const char *data, const size_t index) {
+        switch (type) {
+            case F32: {
+                float v;
+                memcpy(&v, data + index * 4, 4);
+                return v;
+            }
+            case F64: {
+                double v;
+                memcpy(&v, data + index * 8, 8);
+                return v;
+            }
+            case I32: {
+                int32_t v;
+                memcpy(&v, data + index * 4, 4);
+                return v;
+            }
+            case U32: {
+                uint32_t v;
+                memcpy(&v, data + index * 4, 4);
+                return v;
+            }
+            case U8:
+                return (uint8_t) data[index];
+            default:
+                return 0;
+        }
+    }
+
+    // Encodes columns. The deflate stream is set up once and reset for every
+    // plane: setting it up costs more than deflating a plane of a few KB.
+    class ColumnEncoder {
+
+        z_stream mStream;
+        std::string mShuffled;
+
+    public:
+
+        ColumnEncoder() {
+            memset(&mStream, 0, sizeof(mStream));
+            deflateInit(&mStream, Z_BEST_SPEED);
+        }
+
+        ~ColumnEncoder() {
+            deflateEnd(&mStream);
+        }
+
+        ColumnEncoder(const ColumnEncoder &) = delete;
+
+        ColumnEncoder &operator=(const ColumnEncoder &) = delete;
+
+        // Encodes count values of valueSize bytes, where a row is `stride`
+        // values. Returns the codec used: RAW when compressing does not pay off.
+        uint8_t encode(const char *data, const size_t count, const size_t valueSize, const size_t stride,
+                       std::string &out) {
+            const size_t bytes = count * valueSize;
+            mShuffled.resize(bytes);
+            char *shuffled = &mShuffled[0];
+            const size_t back = stride * valueSize;
+            for (size_t i = 0; i < count; i++) {
+                const char *v = data + i * valueSize;
+                for (size_t b = 0; b < valueSize; b++) {
+                    shuffled[b * count + i] = i >= stride ? (char) (v[b] ^ v[b - back]) : v[b];
+                }
+            }
+            out.resize(valueSize * 4 + valueSize * deflateBound(&mStream, count));
+            size_t pos = valueSize * 4;
+            for (size_t b = 0; b < valueSize; b++) {
+                const char *plane = shuffled + b * count;
+                size_t size = 0;
+                while (size < count && plane[size] == 0) size++;
+                if (size == count) {
+                    memset(&out[b * 4], 0, 4);
+                    continue;
+                }
+                deflateReset(&mStream);
+                mStream.next_in = (Bytef *) plane;
+                mStream.avail_in = (uInt) count;
+                mStream.next_out = (Bytef *) &out[pos];
+                mStream.avail_out = (uInt) (out.size() - pos);
+                size = count;
+                if (deflate(&mStream, Z_FINISH) == Z_STREAM_END && mStream.total_out < count - count / 8) {
+                    size = mStream.total_out;
+                } else {
+                    memcpy(&out[pos], plane, count);
+                }
+                const uint32_t planeSize = (uint32_t) size;
+                memcpy(&out[b * 4], &planeSize, 4);
+                pos += size;
+            }
+            if (pos >= bytes) {
+                out.assign(data, bytes);
+                return RAW;
+            }
+            out.resize(pos);
+            return XOR_SHUFFLE_DEFLATE;
+        }
+    };
+
+    class ColumnDecoder {
+
+        z_stream mStream;
+        std::vector<char> mPlanes;
+
+    public:
+
+        ColumnDecoder() {
+            memset(&mStream, 0, sizeof(mStream));
+            inflateInit(&mStream);
+        }
+
+        ~ColumnDecoder() {
+            inflateEnd(&mStream);
+        }
+
+        ColumnDecoder(const ColumnDecoder &) = delete;
+
+        ColumnDecoder &operator=(const ColumnDecoder &) = delete;
+
+        // Decodes what encode() produced into out, which holds count * valueSize bytes
+        bool decode(const uint8_t codec, const char *in, const size_t inBytes, const size_t count,
+                    const size_t valueSize, const size_t stride, char *out) {
+            const size_t bytes = count * valueSize;
+            if (codec == RAW) {
+                if (inBytes != bytes) return false;
+                memcpy(out, in, bytes);
+                return true;
+            }
+            if (codec != XOR_SHUFFLE_DEFLATE || inBytes < valueSize * 4) return false;
+            mPlanes.resize(bytes);
+            size_t pos = valueSize * 4;
+            for (size_t b = 0; b < valueSize; b++) {
+                uint32_t planeSize;
+                memcpy(&planeSize, in + b * 4, 4);
+                if (planeSize > inBytes - pos) return false;
+                char *plane = mPlanes.data() + b * count;
+                if (planeSize == 0) {
+                    memset(plane, 0, count);
+                } else if (planeSize == count) {
+                    memcpy(plane, in + pos, count);
+                } else {
+                    inflateReset(&mStream);
+                    mStream.next_in = (Bytef *) (in + pos);
+                    mStream.avail_in = planeSize;
+                    mStream.next_out = (Bytef *) plane;
+                    mStream.avail_out = (uInt) count;
+                    if (inflate(&mStream, Z_FINISH) != Z_STREAM_END || mStream.total_out != count) return false;
+                }
+                pos += planeSize;
+            }
+            // Undo the XOR within each plane, where a row back is `stride`
+            // bytes back, then scatter the plane. With a single value per row
+            // every byte depends on the one before: keep it in a register.
+            for (size_t b = 0; b < valueSize; b++) {
+                char *plane = mPlanes.data() + b * count;
+                char *v = out + b;
+                if (stride == 1) {
+                    char previous = 0;
+                    for (size_t i = 0; i < count; i++) {
+                        previous ^= plane[i];
+                        v[i * valueSize] = previous;
+                    }
+                } else {
+                    for (size_t i = stride; i < count; i++) plane[i] ^= plane[i - stride];
+                    for (size_t i = 0; i < count; i++) v[i * valueSize] = plane[i];
+                }
+            }
+            return true;
+        }
+    };
+
+    template<typename T>
+    inline void appendRaw(std::string &out, const T &value) {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+} // namespace recording
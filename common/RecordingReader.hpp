@@ -0,0 +1,311 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "RecordingFormat.hpp"
+
+struct RecordingChunk {
+    uint64_t offset;
+    uint32_t rows;
+    double minTime;
+    double maxTime;
+};
+
+struct ScanStats {
+    uint64_t chunksScanned;
+    uint64_t chunksSkipped;
+    uint64_t rows;           // rows that matched
+    uint64_t bytesRead;      // encoded column data touched
+    uint64_t bytesDecoded;
+};
+
+//---------------------------------------------------------------------------
+// Reads a recording written by FaceRecorder. The file is memory mapped (read
+// into memory on Windows) and only the columns asked for are decoded: a scan
+// of one metric over a time range touches the index, then the timeStamp,
+// faceId and metric columns of the chunks overlapping the range.
+class RecordingReader {
+
+    const char *mData;
+    size_t mSize;
+    std::vector<char> mBuffer;
+#ifndef _WIN32
+    void *mMapping;
+#endif
+
+    std::vector<recording::ColumnInfo> mColumns;
+    size_t mHeaderSize;
+    std::vector<RecordingChunk> mChunks;
+    bool mIndexed;
+    recording::ColumnDecoder mDecoder;
+
+public:
+
+    RecordingReader() : mData(nullptr), mSize(0),
+#ifndef _WIN32
+                        mMapping(nullptr),
+#endif
+                        mHeaderSize(0), mIndexed(false) {
+    }
+
+    ~RecordingReader() {
+#ifndef _WIN32
+        if (mMapping) munmap(mMapping, mSize);
+#endif
+    }
+
+    RecordingReader(const RecordingReader &) = delete;
+
+    RecordingReader &operator=(const RecordingReader &) = delete;
+
+    bool open(const std::string &path) {
+#ifndef _WIN32
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "ERROR\tUnable to open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            mSize = (size_t) st.st_size;
+            mMapping = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mMapping == MAP_FAILED) mMapping = nullptr;
+        }
+        ::close(fd);
+        if (!mMapping) {
+            std::cerr << "ERROR\tUnable to map " << path << std::endl;
+            mSize = 0;
+            return false;
+        }
+        // Chunks are mostly read front to back
+        madvise(mMapping, mSize, MADV_SEQUENTIAL);
+        mData = (const char *) mMapping;
+#else
+        std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+        if (!in) {
+            std::cerr << "ERROR\tUnable to open " << path << std::endl;
+            return false;
+        }
+        mBuffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        mData = mBuffer.data();
+        mSize = mBuffer.size();
+#endif
+        if (!readHeader()) {
+            std::cerr << "ERROR\t" << path << " is not a face recording" << std::endl;
+            return false;
+        }
+        mIndexed = readIndex();
+        if (!mIndexed) {
+            std::cerr << "WARN\t" << path << " has no index, the recording was not closed" << std::endl;
+            scanChunks();
+        }
+        return true;
+    }
+
+    const std::vector<recording::ColumnInfo> &getColumns() const {
+        return mColumns;
+    }
+
+    const std::vector<RecordingChunk> &getChunks() const {
+        return mChunks;
+    }
+
+    bool isIndexed() const {
+        return mIndexed;
+    }
+
+    // By full name ("emotions.joy") or by the part after the group when
+    // that is unambiguous ("joy", but not "smirk"). -1 if there is none.
+    int findColumn(const std::string &name) const {
+        int found = -1;
+        for (size_t i = 0; i < mColumns.size(); i++) {
+            const std::string &column = mColumns[i].name;
+            if (column == name) return (int) i;
+            const size_t dot = column.find('.');
+            if (dot != std::string::npos && column.compare(dot + 1, std::string::npos, name) == 0) {
+                if (found >= 0) return -1;
+                found = (int) i;
+            }
+        }
+        return found;
+    }
+
+    // Decodes one column of one chunk into out; false if the chunk is damaged
+    bool readColumn(const size_t chunk, const size_t column, std::vector<char> &out, ScanStats *stats = nullptr) {
+        const RecordingChunk &c = mChunks[chunk];
+        const recording::ColumnInfo &info = mColumns[column];
+        const size_t directory = c.offset + 24;
+        if (directory + mColumns.size() * 8 > mSize) return false;
+        uint64_t dataOffset = directory + mColumns.size() * 8;
+        for (size_t i = 0; i < column; i++) dataOffset += read<uint32_t>(directory + i * 8 + 4);
+        const uint8_t codec = (uint8_t) mData[directory + column * 8];
+        const uint32_t size = read<uint32_t>(directory + column * 8 + 4);
+        if (dataOffset + size > mSize) return false;
+
+        const size_t valueSize = recording::typeSize(info.type);
+        const size_t count = (size_t) c.rows * info.width;
+        out.resize(count * valueSize);
+        if (!mDecoder.decode(codec, mData + dataOffset, size, count, valueSize, info.width, out.data())) {
+            return false;
+        }
+        if (stats) {
+            stats->bytesRead += size;
+            stats->bytesDecoded += out.size();
+        }
+        return true;
+    }
+
+    // Calls f(timeStamp, faceId, value) for every row in [from, to] of the
+    // given face (any face when faceId < 0) and stream (any when < 0).
+    // `element` picks the value of a multi-value column such as "points.x".
+    template<typename F>
+    ScanStats scan(const int column, const double from, const double to, const int faceId, const int streamId,
+                   const size_t element, F f) {
+        ScanStats stats;
+        memset(&stats, 0, sizeof(stats));
+        const int timeColumn = findColumn("timeStamp");
+        const int faceColumn = findColumn("faceId");
+        const int streamColumn = findColumn("streamId");
+        if (column < 0 || timeColumn < 0 || faceColumn < 0 || streamColumn < 0) return stats;
+        const recording::ColumnInfo &info = mColumns[column];
+        if (element >= info.width) return stats;
+
+        std::vector<char> times, faces, streams, values;
+        for (size_t k = 0; k < mChunks.size(); k++) {
+            const RecordingChunk &c = mChunks[k];
+            if (c.maxTime < from || c.minTime > to) {
+                stats.chunksSkipped++;
+                continue;
+            }
+            stats.chunksScanned++;
+            if (!readColumn(k, timeColumn, times, &stats) || !readColumn(k, faceColumn, faces, &stats) ||
+                (streamId >= 0 && !readColumn(k, streamColumn, streams, &stats)) ||
+                !readColumn(k, column, values, &stats)) {
+                std::cerr << "WARN\tSkipping damaged chunk " << k << std::endl;
+                continue;
+            }
+            for (size_t row = 0; row < c.rows; row++) {
+                const double ts = recording::valueAt(recording::F64, times.data(), row);
+                if (ts < from || ts > to) continue;
+                const int face = (int) recording::valueAt(recording::I32, faces.data(), row);
+                if (faceId >= 0 && face != faceId) continue;
+                if (streamId >= 0 && (int) recording::valueAt(recording::I32, streams.data(), row) != streamId) {
+                    continue;
+                }
+                f(ts, face, recording::valueAt(info.type, values.data(), row * info.width + element));
+                stats.rows++;
+            }
+        }
+        return stats;
+    }
+
+private:
+
+    template<typename T>
+    T read(const size_t offset) const {
+        T v;
+        memcpy(&v, mData + offset, sizeof(T));
+        return v;
+    }
+
+    bool readHeader() {
+        if (mSize < 8 || memcmp(mData, "EMJR", 4) != 0 || read<uint16_t>(4) != recording::VERSION) return false;
+        const uint16_t columns = read<uint16_t>(6);
+        size_t pos = 8;
+        for (uint16_t i = 0; i < columns; i++) {
+            if (pos + 6 > mSize) return false;
+            recording::ColumnInfo info;
+            info.type = (uint8_t) mData[pos];
+            info.width = read<uint16_t>(pos + 2);
+            const uint16_t nameLength = read<uint16_t>(pos + 4);
+            pos += 6;
+            if (pos + nameLength > mSize) return false;
+            info.name.assign(mData + pos, nameLength);
+            pos += nameLength;
+            mColumns.push_back(info);
+        }
+        mChunks.clear();
+        mHeaderSize = pos;
+        return true;
+    }
+
+    bool readIndex() {
+        if (mSize < mHeaderSize + 12 || memcmp(mData + mSize - 4, "EMJE", 4) != 0) return false;
+        const uint64_t indexOffset = read<uint64_t>(mSize - 12);
+        if (indexOffset < mHeaderSize || indexOffset + 8 > mSize - 12 ||
+            memcmp(mData + indexOffset, "EMJI", 4) != 0) {
+            return false;
+        }
+        const uint32_t chunks = read<uint32_t>(indexOffset + 4);
+        if (indexOffset + 8 + (uint64_t) chunks * 32 > mSize - 12) return false;
+        for (uint32_t i = 0; i < chunks; i++) {
+            const size_t entry = indexOffset + 8 + (size_t) i * 32;
+            RecordingChunk c;
+            c.offset = read<uint64_t>(entry);
+            c.rows = read<uint32_t>(entry + 8);
+            c.minTime = read<double>(entry + 16);
+            c.maxTime = read<double>(entry + 24);
+            if (!validChunk(c.offset, indexOffset)) return false;
+            mChunks.push_back(c);
+        }
+        return true;
+    }
+
+    // Walks the chunks one after the other, stopping at the first incomplete one
+    void scanChunks() {
+        mChunks.clear();
+        uint64_t pos = mHeaderSize;
+        while (validChunk(pos, mSize)) {
+            RecordingChunk c;
+            c.offset = pos;
+            c.rows = read<uint32_t>(pos + 4);
+            c.minTime = read<double>(pos + 8);
+            c.maxTime = read<double>(pos + 16);
+            mChunks.push_back(c);
+            pos = chunkEnd(pos);
+        }
+    }
+
+    bool validChunk(const uint64_t offset, const uint64_t limit) const {
+        return offset + 24 + mColumns.size() * 8 <= limit && memcmp(mData + offset, "EMJK", 4) == 0 &&
+               chunkEnd(offset) <= limit;
+    }
+
+    uint64_t chunkEnd(const uint64_t offset) const {
+        uint64_t end = offset + 24 + mColumns.size() * 8;
+        for (size_t i = 0; i < mColumns.size(); i++) end += read<uint32_t>(offset + 24 + i * 8 + 4);
+        return end;
+    }
+};
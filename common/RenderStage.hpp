@@ -0,0 +1,152 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "Frame.h"
+#include "Face.h"
+
+#include "FrameTracer.hpp"
+#include "PlottingImageListener.hpp"
+
+using namespace affdex;
+
+//---------------------------------------------------------------------------
+// Shows detector results on a thread of its own.
+// The capture loop hands over each result with submit(), which only swaps a
+// pointer under a lock private to this stage. The render thread always shows
+// the latest result: one that is replaced before it was drawn is dropped, not
+// queued. Drawing is paced at most renderFps, independently of capture.
+class RenderStage {
+
+    struct Result {
+        Frame frame;
+        std::map<FaceId, Face> faces;
+        std::shared_ptr<cv::Mat> pixels;    // capture buffer of the frame, when the caller has it
+    };
+
+    std::shared_ptr<PlottingImageListener> mListener;
+    const std::chrono::microseconds mInterval;
+    std::shared_ptr<FrameTracer> mTracer;    // stamps TRACE_DRAWN, may be null
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::unique_ptr<Result> mLatest;
+    bool mStopping;
+    std::thread mThread;
+
+    std::atomic<uint64_t> mRendered;
+    std::atomic<uint64_t> mSkipped;
+
+public:
+
+    RenderStage(std::shared_ptr<PlottingImageListener> listener, const unsigned int renderFps,
+                std::shared_ptr<FrameTracer> tracer = std::shared_ptr<FrameTracer>())
+            : mListener(listener), mInterval(1000000 / std::max(renderFps, 1u)), mTracer(tracer), mStopping(false),
+              mRendered(0), mSkipped(0) {
+        mThread = std::thread(&RenderStage::run, this);
+    }
+
+    ~RenderStage() {
+        stop();
+    }
+
+    RenderStage(const RenderStage &) = delete;
+
+    RenderStage &operator=(const RenderStage &) = delete;
+
+    // With pixels, the overlay is drawn straight onto the capture buffer, which
+    // is held until then; without, the frame's own copy is drawn on.
+    void submit(const Frame &frame, const std::map<FaceId, Face> &faces,
+                std::shared_ptr<cv::Mat> pixels = std::shared_ptr<cv::Mat>()) {
+        std::unique_ptr<Result> result(new Result());
+        result->frame = frame;
+        result->faces = faces;
+        result->pixels = std::move(pixels);
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            if (mLatest) mSkipped++;
+            mLatest.swap(result);
+        }
+        mCond.notify_one();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            mStopping = true;
+        }
+        mCond.notify_one();
+        if (mThread.joinable()) mThread.join();
+    }
+
+    uint64_t getRendered() const {
+        return mRendered;
+    }
+
+    // Results replaced by a newer one before they could be drawn
+    uint64_t getSkipped() const {
+        return mSkipped;
+    }
+
+private:
+
+    void run() {
+        auto next = std::chrono::steady_clock::now();
+        for (;;) {
+            std::unique_ptr<Result> result;
+            {
+                std::unique_lock<std::mutex> lk(mMutex);
+                // Wake up now and then even when idle, so the window keeps responding
+                mCond.wait_for(lk, std::chrono::milliseconds(100), [this] { return mStopping || mLatest; });
+                if (mStopping) break;
+                result.swap(mLatest);
+            }
+
+            if (result) {
+                if (result->pixels) {
+                    mListener->draw(result->faces, *result->pixels);
+                } else {
+                    mListener->draw(result->faces, result->frame);
+                }
+                mRendered++;
+                if (mTracer) mTracer->mark(result->frame.getTimestamp(), TRACE_DRAWN);
+            }
+            cv::waitKey(1);    // let HighGUI process its events
+
+            // Frame pacing: results arriving before the next slot wait in mLatest
+            // and are replaced if a newer one comes in.
+            next += mInterval;
+            const auto now = std::chrono::steady_clock::now();
+            if (next < now) next = now;
+            else std::this_thread::sleep_until(next);
+        }
+    }
+};
@@ -0,0 +1,87 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Face.h"
+
+#include "FaceRecord.hpp"
+#include "TelemetryBatcher.hpp"
+
+using namespace affdex;
+
+//---------------------------------------------------------------------------
+// Writes every face of every result to a file, one JSON object per line,
+// in the same layout as the ndjson batch format. Safe to share between streams.
+class ResultWriter {
+
+    std::mutex mMutex;
+    std::ofstream mOut;
+    std::vector<FaceRecord> mRecords;
+    std::string mBuffer;
+    std::atomic<uint64_t> mRecordCount;
+
+public:
+
+    explicit ResultWriter(const std::string &path)
+            : mOut(path.c_str(), std::ios::out | std::ios::trunc | std::ios::binary), mRecordCount(0) {
+    }
+
+    bool isOpened() const {
+        return mOut.is_open();
+    }
+
+    void write(const std::map<FaceId, Face> &faces, const double timeStamp, const int streamId = -1) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        mRecords.clear();
+        for (auto &face_id_pair : faces) {
+            mRecords.push_back(FaceRecord::fromFace(face_id_pair.second, timeStamp, streamId));
+        }
+        writeLocked(mRecords);
+    }
+
+    void write(const std::vector<FaceRecord> &records) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        writeLocked(records);
+    }
+
+    uint64_t getRecordCount() const {
+        return mRecordCount;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lg(mMutex);
+        mOut.close();
+    }
+
+private:
+
+    void writeLocked(const std::vector<FaceRecord> &records) {
+        mBuffer.clear();
+        batch::appendNdjson(mBuffer, records);
+        mOut.write(mBuffer.data(), mBuffer.size());
+        mRecordCount += records.size();
+    }
+};
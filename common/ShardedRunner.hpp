@@ -0,0 +1,398 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "Frame.h"
+#include "Face.h"
+#include "FrameDetector.h"
+#include "ImageListener.h"
+#include "ProcessStatusListener.h"
+
+#include "FaceRecord.hpp"
+#include "OfflineInput.hpp"
+
+using namespace affdex;
+
+// A face found by a shard, with the bounding box of its feature points
+struct ShardFace {
+    FaceRecord record;
+    float box[4];    // left, top, right, bottom
+};
+
+struct ShardFrame {
+    double timeStamp;
+    std::vector<ShardFace> faces;
+};
+
+struct ShardStats {
+    unsigned int worker;
+    double begin;       // owned time range, in seconds of the recording
+    double end;
+    uint64_t frames;    // frames processed, warm-up included
+    double seconds;     // wall time
+};
+
+//---------------------------------------------------------------------------
+// Processes one time segment of a recording with a FrameDetector of its own,
+// on a thread of its own. It starts `warmup` seconds before the segment so
+// the tracker has settled when it reaches the frames the shard owns; the
+// warm-up results are only used to match face IDs with the previous shard.
+class ShardWorker : public ImageListener, public ProcessStatusListener {
+public:
+
+    typedef std::function<std::shared_ptr<FrameDetector>()> DetectorFactory;
+
+private:
+
+    const unsigned int mId;
+    const double mBegin;
+    const double mEnd;
+    const double mWarmup;
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::vector<ShardFrame> mFrames;
+    uint64_t mResults;
+    bool mFailed;
+    bool mDone;
+    ShardStats mStats;
+    std::thread mThread;
+
+public:
+
+    ShardWorker(const unsigned int id, const double begin, const double end, const double warmup)
+            : mId(id), mBegin(begin), mEnd(end), mWarmup(warmup), mResults(0), mFailed(false), mDone(false) {
+    }
+
+    ~ShardWorker() {
+        if (mThread.joinable()) mThread.join();
+    }
+
+    ShardWorker(const ShardWorker &) = delete;
+
+    ShardWorker &operator=(const ShardWorker &) = delete;
+
+    void start(const std::string &spec, const double imageFps, const unsigned int processFps,
+               const size_t inFlight, DetectorFactory factory) {
+        mThread = std::thread(&ShardWorker::run, this, spec, imageFps, processFps, std::max<size_t>(inFlight, 1),
+                              factory);
+    }
+
+    // Blocks until the shard is processed; returns false if it failed.
+    bool wait() {
+        std::unique_lock<std::mutex> lk(mMutex);
+        mCond.wait(lk, [this] { return mDone; });
+        return !mFailed;
+    }
+
+    // Valid once wait() returned
+    std::vector<ShardFrame> &getFrames() {
+        return mFrames;
+    }
+
+    const ShardStats &getStats() const {
+        return mStats;
+    }
+
+    double getBegin() const {
+        return mBegin;
+    }
+
+    void onImageResults(std::map<FaceId, Face> faces, Frame image) override {
+        ShardFrame frame;
+        frame.timeStamp = image.getTimestamp();
+        for (auto &face_id_pair : faces) {
+            const Face &f = face_id_pair.second;
+            ShardFace face;
+            face.record = FaceRecord::fromFace(f, frame.timeStamp);
+            face.box[0] = face.box[1] = std::numeric_limits<float>::max();
+            face.box[2] = face.box[3] = std::numeric_limits<float>::lowest();
+            for (const FeaturePoint &p : f.featurePoints) {
+                face.box[0] = std::min(face.box[0], p.x);
+                face.box[1] = std::min(face.box[1], p.y);
+                face.box[2] = std::max(face.box[2], p.x);
+                face.box[3] = std::max(face.box[3], p.y);
+            }
+            frame.faces.push_back(face);
+        }
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            mFrames.push_back(std::move(frame));
+            mResults++;
+        }
+        mCond.notify_all();
+    }
+
+    void onImageCapture(Frame) override {
+    }
+
+    void onProcessingException(AffdexException ex) override {
+        std::cerr << "ERROR\tShard " << mId << " encountered an exception while processing: " << ex.what()
+                << std::endl;
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            mFailed = true;
+        }
+        mCond.notify_all();
+    }
+
+    void onProcessingFinished() override {
+    }
+
+private:
+
+    void run(const std::string spec, const double imageFps, const unsigned int processFps, const size_t inFlight,
+             DetectorFactory factory) {
+        const auto start = std::chrono::steady_clock::now();
+        const double from = std::max(0.0, mBegin - mWarmup);
+        uint64_t submitted = 0;
+
+        OfflineInput input(spec, imageFps);
+        if (!input.isOpened() || !input.seek((size_t) (from * input.getFrameRate()))) {
+            std::cerr << "ERROR\tShard " << mId << " is unable to open " << spec << std::endl;
+            finish(false, start, submitted);
+            return;
+        }
+
+        std::shared_ptr<FrameDetector> detector = factory();
+        detector->setImageListener(this);
+        detector->setProcessStatusListener(this);
+        detector->start();
+
+        // Frames are decimated on a grid of the recording's timestamps, so that
+        // overlapping shards pick the same frames.
+        long long last_slot = std::numeric_limits<long long>::min();
+        cv::Mat img;
+        double pts;
+        bool ok = true;
+        while (ok && input.read(img, pts)) {
+            // Frame timestamps are floats; compare at that precision so that
+            // adjacent shards agree on which one owns a frame.
+            const double timestamp = (float) pts;
+            if (timestamp >= mEnd) break;
+            if (timestamp < from) continue;    // the backend seeked short of the segment
+            const long long slot = std::llround(timestamp * processFps);
+            if (slot == last_slot) continue;
+            last_slot = slot;
+
+            ok = waitForResults(submitted, inFlight - 1);
+            if (!ok) break;
+            Frame f(img.size().width, img.size().height, img.data, Frame::COLOR_FORMAT::BGR, (float) timestamp);
+            detector->process(f);
+            submitted++;
+        }
+        ok = ok && waitForResults(submitted, 0);
+        detector->stop();
+        finish(ok, start, submitted);
+    }
+
+    // Keeps at most `limit` frames in the detector, so none is dropped.
+    bool waitForResults(const uint64_t submitted, const uint64_t limit) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        const bool progress = mCond.wait_for(lk, std::chrono::seconds(5), [&] {
+            return mFailed || submitted - mResults <= limit;
+        });
+        if (!progress) {
+            std::cerr << "WARN\tShard " << mId << " got no detector results for 5 seconds, "
+                    << submitted - mResults << " frames still in flight" << std::endl;
+        }
+        return progress && !mFailed;
+    }
+
+    void finish(const bool ok, const std::chrono::steady_clock::time_point start, const uint64_t frames) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        mStats.worker = mId;
+        mStats.begin = mBegin;
+        mStats.end = mEnd;
+        mStats.frames = frames;
+        mStats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!ok) mFailed = true;
+        mDone = true;
+        mCond.notify_all();
+    }
+};
+
+//---------------------------------------------------------------------------
+// Splits a recording into time segments processed in parallel, one
+// FrameDetector per segment, and merges the results back into a single
+// timeline in timestamp order.
+//
+// Face IDs are only meaningful within a shard. At each segment boundary the
+// warm-up frames of a shard are the last frames of the previous one, so both
+// saw the same faces: they are paired by the overlap of their bounding boxes
+// and the later shard takes over the IDs of the earlier one. Faces with no
+// match get a new ID.
+class ShardedRunner {
+public:
+
+    typedef std::function<void(const std::vector<FaceRecord> &, double)> ResultCallback;
+
+private:
+
+    // Minimum mean IoU over the overlap for two faces to be the same
+    const float MIN_MATCH_IOU = 0.3f;
+
+    std::vector<std::unique_ptr<ShardWorker> > mWorkers;
+    FaceId mNextFaceId;
+
+public:
+
+    // `overlap` seconds of warm-up are processed before each segment but the first.
+    ShardedRunner(const std::string &spec, const double imageFps, unsigned int shards, const double overlap,
+                  const unsigned int processFps, const size_t inFlight, ShardWorker::DetectorFactory factory)
+            : mNextFaceId(0) {
+        const double duration = OfflineInput(spec, imageFps).getDuration();
+        if (duration <= 0 && shards > 1) {
+            std::cerr << "WARN\tThe length of " << spec << " is unknown, processing it in a single shard" << std::endl;
+            shards = 1;
+        }
+        const double infinity = std::numeric_limits<double>::infinity();
+        for (unsigned int i = 0; i < shards; i++) {
+            const double begin = i == 0 ? -infinity : duration * i / shards;
+            const double end = i + 1 == shards ? infinity : duration * (i + 1) / shards;
+            mWorkers.push_back(std::unique_ptr<ShardWorker>(new ShardWorker(i, begin, end, overlap)));
+        }
+        for (auto &worker : mWorkers) {
+            worker->start(spec, imageFps, std::max(processFps, 1u), inFlight, factory);
+        }
+    }
+
+    // Delivers the results of every owned frame, in timestamp order, as the
+    // shards complete. Returns false if a shard failed.
+    bool run(ResultCallback callback) {
+        bool ok = true;
+        std::map<FaceId, FaceId> prevIds;
+        std::vector<ShardFrame> prevFrames;
+        std::vector<FaceRecord> records;
+        for (auto &worker : mWorkers) {
+            ok = worker->wait() && ok;
+            std::vector<ShardFrame> &frames = worker->getFrames();
+            std::map<FaceId, FaceId> ids = reconcile(prevFrames, prevIds, frames);
+
+            for (const ShardFrame &frame : frames) {
+                if (frame.timeStamp < worker->getBegin()) continue;    // warm-up
+                records.clear();
+                for (const ShardFace &face : frame.faces) {
+                    records.push_back(face.record);
+                    auto id = ids.find(face.record.faceId);
+                    if (id == ids.end()) id = ids.insert(std::make_pair(face.record.faceId, mNextFaceId++)).first;
+                    records.back().faceId = id->second;
+                }
+                callback(records, frame.timeStamp);
+            }
+            prevIds.swap(ids);
+            prevFrames.swap(frames);
+            frames = std::vector<ShardFrame>();
+        }
+        return ok;
+    }
+
+    void report() const {
+        uint64_t frames = 0;
+        double seconds = 0;
+        for (auto &worker : mWorkers) {
+            const ShardStats &s = worker->getStats();
+            std::cerr << "INFO\tShard " << s.worker << " [" << std::max(s.begin, 0.0) << " s, ";
+            if (std::isinf(s.end)) std::cerr << "end): ";
+            else std::cerr << s.end << " s): ";
+            std::cerr << s.frames << " frames in " << s.seconds << " s ("
+                    << (s.seconds > 0 ? s.frames / s.seconds : 0) << " fps)" << std::endl;
+            frames += s.frames;
+            seconds = std::max(seconds, s.seconds);
+        }
+        std::cerr << "INFO\tAll " << mWorkers.size() << " shards: " << frames << " frames in " << seconds << " s ("
+                << (seconds > 0 ? frames / seconds : 0) << " fps)" << std::endl;
+    }
+
+private:
+
+    static float iou(const float *a, const float *b) {
+        const float w = std::min(a[2], b[2]) - std::max(a[0], b[0]);
+        const float h = std::min(a[3], b[3]) - std::max(a[1], b[1]);
+        if (w <= 0 || h <= 0) return 0;
+        const float inter = w * h;
+        return inter / ((a[2] - a[0]) * (a[3] - a[1]) + (b[2] - b[0]) * (b[3] - b[1]) - inter);
+    }
+
+    // Maps the shard's own face IDs to the IDs given by the previous shard,
+    // using the frames both processed.
+    std::map<FaceId, FaceId> reconcile(const std::vector<ShardFrame> &prevFrames,
+                                       const std::map<FaceId, FaceId> &prevIds,
+                                       const std::vector<ShardFrame> &frames) const {
+        std::map<FaceId, FaceId> ids;
+        if (prevFrames.empty() || frames.empty()) return ids;
+
+        std::map<std::pair<FaceId, FaceId>, float> overlap;    // (previous, own) -> summed IoU
+        std::map<FaceId, unsigned int> prevSeen;
+        std::map<FaceId, unsigned int> seen;
+        auto prev = std::lower_bound(prevFrames.begin(), prevFrames.end(), frames.front().timeStamp,
+                                     [](const ShardFrame &f, const double ts) { return f.timeStamp < ts; });
+        for (auto frame = frames.begin(); frame != frames.end() && prev != prevFrames.end(); ++frame) {
+            while (prev != prevFrames.end() && prev->timeStamp < frame->timeStamp) ++prev;
+            if (prev == prevFrames.end() || prev->timeStamp != frame->timeStamp) continue;
+            for (const ShardFace &a : prev->faces) prevSeen[a.record.faceId]++;
+            for (const ShardFace &b : frame->faces) {
+                seen[b.record.faceId]++;
+                for (const ShardFace &a : prev->faces) {
+                    overlap[std::make_pair(a.record.faceId, b.record.faceId)] += iou(a.box, b.box);
+                }
+            }
+        }
+
+        // Greedy assignment, best mean overlap first
+        std::vector<std::tuple<float, FaceId, FaceId> > candidates;
+        for (auto &pair_iou : overlap) {
+            const FaceId a = pair_iou.first.first;
+            const FaceId b = pair_iou.first.second;
+            const float mean = pair_iou.second / std::max(prevSeen[a], seen[b]);
+            if (mean >= MIN_MATCH_IOU) candidates.push_back(std::make_tuple(mean, a, b));
+        }
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const std::tuple<float, FaceId, FaceId> &x, const std::tuple<float, FaceId, FaceId> &y) {
+                      return std::get<0>(x) > std::get<0>(y);
+                  });
+        std::map<FaceId, bool> taken;
+        for (auto &c : candidates) {
+            const FaceId a = std::get<1>(c);
+            const FaceId b = std::get<2>(c);
+            auto global = prevIds.find(a);
+            if (taken[a] || ids.count(b) || global == prevIds.end()) continue;
+            taken[a] = true;
+            ids[b] = global->second;
+        }
+        return ids;
+    }
+};
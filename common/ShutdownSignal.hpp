@@ -0,0 +1,120 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <functional>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <thread>
+#endif
+
+//---------------------------------------------------------------------------
+// Turns SIGINT and SIGTERM (Ctrl-C on Windows) into a request to finish:
+// requested() becomes true and onSignal is called, from a thread of its own,
+// so it may take locks. A second signal quits at once.
+//
+// On POSIX systems the signals are blocked and waited for with sigwait(), so
+// the object must be created before any other thread is started: threads
+// inherit the blocked set, and the signals must not go to one that has them
+// unblocked.
+class ShutdownSignal {
+
+    const std::function<void()> mOnSignal;
+    std::atomic<bool> mRequested;
+#ifdef _WIN32
+    static ShutdownSignal *&instance() {
+        static ShutdownSignal *current = nullptr;
+        return current;
+    }
+
+    static void handler(int signal) {
+        std::signal(SIGINT, &ShutdownSignal::handler);    // reset to the default when it fires
+        if (instance()) instance()->received(signal);
+    }
+#else
+    sigset_t mSignals;
+    std::atomic<bool> mExiting;
+    std::thread mThread;
+#endif
+
+public:
+
+    explicit ShutdownSignal(std::function<void()> onSignal) : mOnSignal(onSignal), mRequested(false) {
+#ifdef _WIN32
+        instance() = this;
+        std::signal(SIGINT, &ShutdownSignal::handler);
+#else
+        mExiting = false;
+        sigemptyset(&mSignals);
+        sigaddset(&mSignals, SIGINT);
+        sigaddset(&mSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &mSignals, nullptr);
+        mThread = std::thread(&ShutdownSignal::run, this);
+#endif
+    }
+
+    ~ShutdownSignal() {
+#ifdef _WIN32
+        std::signal(SIGINT, SIG_DFL);
+        instance() = nullptr;
+#else
+        mExiting = true;
+        pthread_kill(mThread.native_handle(), SIGTERM);
+        mThread.join();
+        pthread_sigmask(SIG_UNBLOCK, &mSignals, nullptr);
+#endif
+    }
+
+    ShutdownSignal(const ShutdownSignal &) = delete;
+
+    ShutdownSignal &operator=(const ShutdownSignal &) = delete;
+
+    bool requested() const {
+        return mRequested;
+    }
+
+private:
+
+#ifndef _WIN32
+    void run() {
+        for (;;) {
+            int signal;
+            if (sigwait(&mSignals, &signal) != 0) continue;
+            if (mExiting) return;
+            received(signal);
+        }
+    }
+#endif
+
+    void received(const int signal) {
+        const char *name = signal == SIGINT ? "SIGINT" : "SIGTERM";
+        if (mRequested.exchange(true)) {
+            std::cerr << "WARN\tSecond " << name << ", quitting without finishing" << std::endl;
+            std::_Exit(128 + signal);
+        }
+        std::cerr << "INFO\tCaught " << name << ", finishing the frames in flight (again to quit at once)"
+                << std::endl;
+        mOnSignal();
+    }
+};
@@ -0,0 +1,125 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//---------------------------------------------------------------------------
+// Bounded, lock-free, single-producer/single-consumer ring buffer.
+// Entries are moved in and out, never copied.
+//
+// Overflow policy: the producer never waits for the consumer. When the ring
+// is full, tryPush() refuses the new entry and counts it as dropped, so the
+// entries already queued are delivered in order. dropped() and
+// highWaterMark() tell how close the consumer is to falling behind.
+template<typename T>
+class SpscRing {
+
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+
+    const size_t mCapacity;
+    std::unique_ptr<Storage[]> mSlots;
+
+    // Head and tail are written by different threads; keep them on separate cache lines.
+    std::atomic<size_t> mHead;    // next slot to read, written by the consumer
+    char mPadHead[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> mTail;    // next slot to write, written by the producer
+    char mPadTail[64 - sizeof(std::atomic<size_t>)];
+
+    std::atomic<uint64_t> mDropped;
+    std::atomic<size_t> mHighWater;
+
+public:
+
+    explicit SpscRing(const size_t capacity)
+            : mCapacity(capacity > 0 ? capacity : 1), mSlots(new Storage[mCapacity + 1]),
+              mHead(0), mTail(0), mDropped(0), mHighWater(0) {
+    }
+
+    ~SpscRing() {
+        while (consume([](T &) {}));
+    }
+
+    SpscRing(const SpscRing &) = delete;
+
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    // Producer side. Returns false, and counts a drop, if the ring is full.
+    bool tryPush(T &&value) {
+        const size_t tail = mTail.load(std::memory_order_relaxed);
+        const size_t next = increment(tail);
+        const size_t head = mHead.load(std::memory_order_acquire);
+        if (next == head) {
+            mDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        new(&mSlots[tail]) T(std::move(value));
+        mTail.store(next, std::memory_order_release);
+
+        const size_t depth = next >= head ? next - head : next + mCapacity + 1 - head;
+        if (depth > mHighWater.load(std::memory_order_relaxed)) {
+            mHighWater.store(depth, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Consumer side. Calls f with the oldest entry, then releases its slot.
+    // Returns false without calling f if the ring is empty.
+    template<typename F>
+    bool consume(F &&f) {
+        const size_t head = mHead.load(std::memory_order_relaxed);
+        if (head == mTail.load(std::memory_order_acquire)) return false;
+        T *entry = reinterpret_cast<T *>(&mSlots[head]);
+        f(*entry);
+        entry->~T();
+        mHead.store(increment(head), std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        const size_t head = mHead.load(std::memory_order_acquire);
+        const size_t tail = mTail.load(std::memory_order_acquire);
+        return tail >= head ? tail - head : tail + mCapacity + 1 - head;
+    }
+
+    size_t capacity() const {
+        return mCapacity;
+    }
+
+    uint64_t dropped() const {
+        return mDropped.load(std::memory_order_relaxed);
+    }
+
+    size_t highWaterMark() const {
+        return mHighWater.load(std::memory_order_relaxed);
+    }
+
+private:
+
+    // One slot is always left empty to tell a full ring from an empty one.
+    size_t increment(const size_t index) const {
+        return index == mCapacity ? 0 : index + 1;
+    }
+};
@@ -23,7 +23,7 @@
 #include <memory>
 #include <chrono>
 #include <thread>
-#include <mutex>
+#include <atomic>
 #include <fstream>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -34,39 +34,42 @@
 
 #include "ProcessStatusListener.h"
 
+#include "Wakeup.hpp"
+
 using namespace affdex;
 
+// Tells whether the detector is still running. The flag is read on every
+// loop iteration, so it is an atomic rather than a lock; whoever waits for the
+// end of processing on a Wakeup is woken up when it changes.
 class StatusListener : public ProcessStatusListener
 {
 public:
 
-    StatusListener(): mIsRunning(true) {};
+    explicit StatusListener(std::shared_ptr<Wakeup> wakeup = std::shared_ptr<Wakeup>())
+            : mWakeup(wakeup), mIsRunning(true) {};
 
     void onProcessingException(AffdexException ex) {
         std::cerr << "Encountered an exception while processing: " << ex.what() << std::endl;
-        m.lock();
-        mIsRunning = false;
-        m.unlock();
+        finished();
     };
 
     void onProcessingFinished() {
         std::cerr << "Processing finished successfully" << std::endl;
-        m.lock();
-        mIsRunning = false;
-        m.unlock();
-
+        finished();
     };
 
-    bool isRunning() {
-        bool ret = true;
-        m.lock();
-        ret = mIsRunning;
-        m.unlock();
-        return ret;
+    bool isRunning() const {
+        return mIsRunning.load(std::memory_order_acquire);
     };
 
 private:
-    std::mutex m;
-    bool mIsRunning;
+
+    void finished() {
+        mIsRunning.store(false, std::memory_order_release);
+        if (mWakeup) mWakeup->notify();
+    }
+
+    std::shared_ptr<Wakeup> mWakeup;
+    std::atomic<bool> mIsRunning;
 
 };
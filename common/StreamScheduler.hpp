@@ -0,0 +1,114 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+//---------------------------------------------------------------------------
+// Shares the detector work between camera streams.
+// A stream takes a slot for each frame it hands to its detector and gives it
+// back when the result comes out, so the number of slots bounds the frames
+// being processed at once across the process. Each stream that asked for a
+// slot in the last second is entitled to an equal share; a stream may go
+// beyond its share only with slots no other active stream is owed, so a busy
+// camera cannot starve a quiet one. A frame that gets no slot is skipped:
+// live cameras are better served by fresh frames than by a backlog.
+class StreamScheduler {
+
+    struct Stream {
+        unsigned int inFlight;
+        std::chrono::steady_clock::time_point lastRequest;
+        uint64_t granted;
+        uint64_t denied;
+    };
+
+    const unsigned int mSlots;
+    const std::chrono::seconds mActiveWindow;
+
+    std::mutex mMutex;
+    std::vector<Stream> mStreams;
+    unsigned int mInFlight;
+
+public:
+
+    StreamScheduler(const size_t streams, const unsigned int slots)
+            : mSlots(std::max(slots, 1u)), mActiveWindow(1), mStreams(streams), mInFlight(0) {
+        for (Stream &s : mStreams) {
+            s.inFlight = 0;
+            s.granted = 0;
+            s.denied = 0;
+        }
+    }
+
+    // Returns true if the stream may submit a frame now; it must then release() it.
+    bool tryAcquire(const size_t stream) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        const auto now = std::chrono::steady_clock::now();
+        Stream &self = mStreams[stream];
+        self.lastRequest = now;
+
+        if (mInFlight >= mSlots) {
+            self.denied++;
+            return false;
+        }
+        unsigned int active = 0;
+        for (const Stream &s : mStreams) {
+            if (now - s.lastRequest < mActiveWindow) active++;
+        }
+        const unsigned int share = std::max(mSlots / active, 1u);
+        if (self.inFlight >= share) {
+            unsigned int owed = 0;
+            for (const Stream &s : mStreams) {
+                if (&s != &self && now - s.lastRequest < mActiveWindow && s.inFlight < share) {
+                    owed += share - s.inFlight;
+                }
+            }
+            if (mSlots - mInFlight <= owed) {
+                self.denied++;
+                return false;
+            }
+        }
+        self.inFlight++;
+        self.granted++;
+        mInFlight++;
+        return true;
+    }
+
+    void release(const size_t stream) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        Stream &s = mStreams[stream];
+        if (s.inFlight == 0) return;
+        s.inFlight--;
+        mInFlight--;
+    }
+
+    uint64_t getGranted(const size_t stream) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        return mStreams[stream].granted;
+    }
+
+    uint64_t getDenied(const size_t stream) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        return mStreams[stream].denied;
+    }
+};
@@ -0,0 +1,462 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+#include "FaceRecord.hpp"
+#include "HttpPublisher.hpp"
+#include "NumberFormat.hpp"
+
+
+enum class BatchFormat {
+    URLENCODED,    // key[i]=value pairs, one index per record
+    NDJSON,        // one JSON object per record, one record per line
+    COLUMNAR       // binary, see appendColumnar()
+};
+
+enum class Compression {
+    NONE,
+    GZIP,
+    DEFLATE
+};
+
+inline bool parseBatchFormat(const std::string &name, BatchFormat &format) {
+    if (name == "urlencoded") format = BatchFormat::URLENCODED;
+    else if (name == "ndjson") format = BatchFormat::NDJSON;
+    else if (name == "columnar") format = BatchFormat::COLUMNAR;
+    else return false;
+    return true;
+}
+
+inline bool parseCompression(const std::string &name, Compression &compression) {
+    if (name == "none") compression = Compression::NONE;
+    else if (name == "gzip") compression = Compression::GZIP;
+    else if (name == "deflate") compression = Compression::DEFLATE;
+    else return false;
+    return true;
+}
+
+struct BatchOptions {
+    unsigned int frames;        // flush after this many frames (0: no frame limit)
+    unsigned int lingerMs;      // flush this long after the first frame of a batch (0: no time limit)
+    BatchFormat format;
+    Compression compression;
+
+    bool enabled() const {
+        return frames > 0 || lingerMs > 0;
+    }
+};
+
+namespace batch {
+
+    inline void appendNumber(std::string &out, const double value) {
+        char buf[numfmt::MAX_CHARS];
+        out.append(buf, numfmt::formatG(buf, value));
+    }
+
+    inline void appendJsonNumber(std::string &out, const double value) {
+        if (std::isfinite(value)) appendNumber(out, value);
+        else out.append("null");
+    }
+
+    // text as a JSON string, quotes included
+    inline void appendJsonString(std::string &out, const std::string &text) {
+        static const char HEX[] = "0123456789abcdef";
+        out.push_back('"');
+        for (const char c : text) {
+            switch (c) {
+                case '"': out.append("\\\""); break;
+                case '\\': out.append("\\\\"); break;
+                case '\n': out.append("\\n"); break;
+                case '\r': out.append("\\r"); break;
+                case '\t': out.append("\\t"); break;
+                default:
+                    if ((unsigned char) c < 0x20) {
+                        out.append("\\u00").push_back(HEX[(unsigned char) c >> 4]);
+                        out.push_back(HEX[c & 0xf]);
+                    } else {
+                        out.push_back(c);
+                    }
+            }
+        }
+        out.push_back('"');
+    }
+
+    // Without allocating, but for a value the SDK added since
+    inline void appendEmoji(std::string &out, const Emoji emoji) {
+        const int i = dominantEmojiIndex(emoji);
+        if (i >= 0) out.append(dominantEmojiName(i));
+        else out.append(affdex::EmojiToString(emoji));
+    }
+
+    template<typename T>
+    inline void appendRaw(std::string &out, const T &value) {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    //---------------------------------------------------------------------------
+    // urlencoded: the per-face keys of the single-record format, indexed by the
+    // record position, e.g. "timeStamp[0]=1.2&faceId[0]=0&...&timeStamp[1]=1.3".
+    // PHP-style servers read every key back as an array. Like RecordSerializer,
+    // urlencoded and ndjson leave out what MetricSelection::active() does not select.
+    inline void appendUrlencoded(std::string &out, const std::vector<FaceRecord> &records) {
+        const MetricSelection &selection = MetricSelection::active();
+        char idx[16];
+        for (size_t i = 0; i < records.size(); i++) {
+            const FaceRecord &r = records[i];
+            const int n = snprintf(idx, sizeof(idx), "[%u]=", (unsigned int) i);
+            auto field = [&](const char *name) {
+                if (!out.empty()) out.push_back('&');
+                out.append(name);
+                out.append(idx, n);
+            };
+            field("timeStamp");
+            appendNumber(out, r.timeStamp);
+            field("faceId");
+            appendNumber(out, r.faceId);
+            if (r.streamId >= 0) {
+                field("streamId");
+                appendNumber(out, r.streamId);
+            }
+            field("interocularDistance");
+            appendNumber(out, r.interocularDistance);
+            if (selection.has(APPEARANCE_GLASSES)) {
+                field("glasses");
+                out.append(glassesName(r.glasses));
+            }
+            if (selection.has(APPEARANCE_AGE)) {
+                field("age");
+                out.append(ageName(r.age));
+            }
+            if (selection.has(APPEARANCE_ETHNICITY)) {
+                field("ethnicity");
+                out.append(ethnicityName(r.ethnicity));
+            }
+            if (selection.has(APPEARANCE_GENDER)) {
+                field("gender");
+                out.append(genderName(r.gender));
+            }
+            if (selection.hasGroup(EMOJIS)) {
+                field("dominantEmoji");
+                appendEmoji(out, r.dominantEmoji);
+            }
+            for (const int j : selection) {
+                field(METRICS[j].name);
+                appendNumber(out, r.metrics[j]);
+            }
+        }
+    }
+
+    inline void appendNdjson(std::string &out, const std::vector<FaceRecord> &records) {
+        const MetricSelection &selection = MetricSelection::active();
+        for (const FaceRecord &r : records) {
+            out.append("{\"timeStamp\":");
+            appendJsonNumber(out, r.timeStamp);
+            out.append(",\"faceId\":");
+            appendJsonNumber(out, r.faceId);
+            if (r.streamId >= 0) {
+                out.append(",\"streamId\":");
+                appendJsonNumber(out, r.streamId);
+            }
+            out.append(",\"interocularDistance\":");
+            appendJsonNumber(out, r.interocularDistance);
+            if (selection.has(APPEARANCE_GLASSES)) {
+                out.append(",\"glasses\":\"").append(glassesName(r.glasses)).append("\"");
+            }
+            if (selection.has(APPEARANCE_AGE)) out.append(",\"age\":\"").append(ageName(r.age)).append("\"");
+            if (selection.has(APPEARANCE_ETHNICITY)) {
+                out.append(",\"ethnicity\":\"").append(ethnicityName(r.ethnicity)).append("\"");
+            }
+            if (selection.has(APPEARANCE_GENDER)) {
+                out.append(",\"gender\":\"").append(genderName(r.gender)).append("\"");
+            }
+            if (selection.hasGroup(EMOJIS)) {
+                out.append(",\"dominantEmoji\":\"");
+                appendEmoji(out, r.dominantEmoji);
+                out.push_back('"');
+            }
+            for (const int j : selection) {
+                out.append(",\"").append(METRICS[j].name).append("\":");
+                appendJsonNumber(out, r.metrics[j]);
+            }
+            out.append("}\n");
+        }
+    }
+
+    //---------------------------------------------------------------------------
+    // Columnar layout, all values little-endian:
+    //   "EMJC"  u16 version (1 or 2)  u16 metric columns (45)  u32 record count (n)
+    //   f64[n] timeStamp   i32[n] faceId   (version 2 only: i32[n] streamId)
+    //   f32[n] interocularDistance
+    //   u8[n] glasses   u8[n] age   u8[n] ethnicity   u8[n] gender
+    //   u32[n] dominantEmoji (unicode code point)
+    //   f32[n] per metric, in headAngles, emotions, expressions, emojis order
+    // Appearance columns carry the numeric SDK enum values. Version 2 is only
+    // used when the batch holds records of a multi-stream run. Columns are read
+    // by position, so all of them are sent whatever metrics are selected; the
+    // values of a classifier that is off mean nothing.
+    inline void appendColumnar(std::string &out, const std::vector<FaceRecord> &records) {
+        bool tagged = false;
+        for (const FaceRecord &r : records) tagged = tagged || r.streamId >= 0;
+        const uint16_t version = tagged ? 2 : 1;
+        const uint16_t metrics = NUM_METRICS;
+        const uint32_t n = records.size();
+        out.append("EMJC", 4);
+        appendRaw(out, version);
+        appendRaw(out, metrics);
+        appendRaw(out, n);
+        for (const FaceRecord &r : records) appendRaw(out, r.timeStamp);
+        for (const FaceRecord &r : records) appendRaw(out, (int32_t) r.faceId);
+        if (tagged) for (const FaceRecord &r : records) appendRaw(out, (int32_t) r.streamId);
+        for (const FaceRecord &r : records) appendRaw(out, r.interocularDistance);
+        for (const FaceRecord &r : records) appendRaw(out, (uint8_t) r.glasses);
+        for (const FaceRecord &r : records) appendRaw(out, (uint8_t) r.age);
+        for (const FaceRecord &r : records) appendRaw(out, (uint8_t) r.ethnicity);
+        for (const FaceRecord &r : records) appendRaw(out, (uint8_t) r.gender);
+        for (const FaceRecord &r : records) appendRaw(out, (uint32_t) r.dominantEmoji);
+        for (int j = 0; j < NUM_METRICS; j++) for (const FaceRecord &r : records) appendRaw(out, r.metrics[j]);
+    }
+
+    // gzip and deflate both use zlib; "deflate" is the zlib-wrapped stream HTTP expects.
+    inline bool compress(const std::string &in, const Compression compression, std::string &out) {
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        const int windowBits = compression == Compression::GZIP ? 15 + 16 : 15;
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        out.resize(deflateBound(&zs, in.size()));
+        zs.next_in = (Bytef *) in.data();
+        zs.avail_in = in.size();
+        zs.next_out = (Bytef *) &out[0];
+        zs.avail_out = out.size();
+        const int rc = deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+        return rc == Z_STREAM_END;
+    }
+
+} // namespace batch
+
+struct BatcherStats {
+    uint64_t batches;
+    uint64_t records;
+    uint64_t rawBytes;     // encoded size before compression
+    uint64_t wireBytes;    // size handed to the publisher
+};
+
+//---------------------------------------------------------------------------
+// Groups the face records of several frames into one request body.
+// A batch is flushed when it holds options.frames frames, or options.lingerMs
+// after its first frame arrived, whichever comes first. Batches are encoded
+// outside of the lock, possibly by two threads at once (a frame and the
+// linger timer), and handed to the publisher in the order they were cut.
+class TelemetryBatcher {
+
+    std::shared_ptr<HttpPublisher> mPublisher;
+    const BatchOptions mOptions;
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::vector<FaceRecord> mRecords;
+    unsigned int mFrames;
+    std::string mUrl;
+    std::chrono::steady_clock::time_point mDeadline;
+    bool mStopping;
+    std::thread mLingerThread;
+
+    uint64_t mNextBatch;         // sequence number of the next batch cut, under mMutex
+    std::mutex mPublishMutex;
+    std::condition_variable mPublishCond;
+    uint64_t mPublishedBatches;  // batches handed to the publisher, under mPublishMutex
+
+    std::atomic<uint64_t> mBatches;
+    std::atomic<uint64_t> mRecordCount;
+    std::atomic<uint64_t> mRawBytes;
+    std::atomic<uint64_t> mWireBytes;
+
+public:
+
+    TelemetryBatcher(std::shared_ptr<HttpPublisher> publisher, const BatchOptions &options)
+            : mPublisher(publisher), mOptions(options), mFrames(0), mStopping(false), mNextBatch(0),
+              mPublishedBatches(0), mBatches(0), mRecordCount(0), mRawBytes(0), mWireBytes(0) {
+        if (mOptions.lingerMs > 0) {
+            mLingerThread = std::thread(&TelemetryBatcher::lingerLoop, this);
+        }
+    }
+
+    ~TelemetryBatcher() {
+        stop();
+    }
+
+    TelemetryBatcher(const TelemetryBatcher &) = delete;
+
+    TelemetryBatcher &operator=(const TelemetryBatcher &) = delete;
+
+    void add(const std::map<FaceId, Face> &faces, const double timeStamp, const std::string &urlBase,
+             const int streamId = -1) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        beginFrameLocked(lk, urlBase);
+        for (auto &face_id_pair : faces) {
+            mRecords.push_back(FaceRecord::fromFace(face_id_pair.second, timeStamp, streamId));
+        }
+        endFrameLocked(lk);
+    }
+
+    // Adds one frame worth of records that were already extracted
+    void add(const std::vector<FaceRecord> &records, const std::string &urlBase) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        beginFrameLocked(lk, urlBase);
+        mRecords.insert(mRecords.end(), records.begin(), records.end());
+        endFrameLocked(lk);
+    }
+
+    void flush() {
+        std::unique_lock<std::mutex> lk(mMutex);
+        flushLocked(lk);
+    }
+
+    // Flush what is pending and stop the linger timer.
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lk(mMutex);
+            mStopping = true;
+            flushLocked(lk);
+        }
+        mCond.notify_all();
+        if (mLingerThread.joinable()) mLingerThread.join();
+    }
+
+    BatcherStats getStats() const {
+        BatcherStats stats;
+        stats.batches = mBatches;
+        stats.records = mRecordCount;
+        stats.rawBytes = mRawBytes;
+        stats.wireBytes = mWireBytes;
+        return stats;
+    }
+
+private:
+
+    void beginFrameLocked(std::unique_lock<std::mutex> &lk, const std::string &urlBase) {
+        if (mFrames > 0 && urlBase != mUrl) {
+            flushLocked(lk);
+        }
+        if (mFrames == 0) {
+            mUrl = urlBase;
+            mDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(mOptions.lingerMs);
+            mCond.notify_one();
+        }
+    }
+
+    void endFrameLocked(std::unique_lock<std::mutex> &lk) {
+        mFrames++;
+        if (mOptions.frames > 0 && mFrames >= mOptions.frames) {
+            flushLocked(lk);
+        }
+    }
+
+    // Called with lk held; encodes and publishes outside of it.
+    void flushLocked(std::unique_lock<std::mutex> &lk) {
+        mFrames = 0;
+        if (mRecords.empty()) return;
+        std::vector<FaceRecord> records;
+        records.reserve(mRecords.capacity());
+        records.swap(mRecords);
+        const std::string url = mUrl;
+        const uint64_t sequence = mNextBatch++;
+        lk.unlock();
+
+        std::string body;
+        std::string contentType;
+        switch (mOptions.format) {
+            case BatchFormat::URLENCODED:
+                batch::appendUrlencoded(body, records);
+                break;
+            case BatchFormat::NDJSON:
+                batch::appendNdjson(body, records);
+                contentType = "application/x-ndjson";
+                break;
+            case BatchFormat::COLUMNAR:
+                batch::appendColumnar(body, records);
+                contentType = "application/x-emoj-columnar";
+                break;
+        }
+
+        const uint64_t rawSize = body.size();
+        std::string contentEncoding;
+        if (mOptions.compression != Compression::NONE) {
+            std::string compressed;
+            if (batch::compress(body, mOptions.compression, compressed)) {
+                body.swap(compressed);
+                contentEncoding = mOptions.compression == Compression::GZIP ? "gzip" : "deflate";
+            } else {
+                std::cout << "ERROR\tUnable to compress a telemetry batch, sending it uncompressed" << std::endl;
+            }
+        }
+
+        mBatches++;
+        mRecordCount += records.size();
+        mRawBytes += rawSize;
+        mWireBytes += body.size();
+        double firstFrame = records.front().timeStamp, lastFrame = firstFrame;
+        for (const FaceRecord &r : records) {
+            firstFrame = std::min(firstFrame, r.timeStamp);
+            lastFrame = std::max(lastFrame, r.timeStamp);
+        }
+        {
+            // A batch cut earlier may still be encoding: wait for its turn
+            std::unique_lock<std::mutex> pl(mPublishMutex);
+            mPublishCond.wait(pl, [&] { return mPublishedBatches == sequence; });
+            mPublisher->publish(url, std::move(body), std::move(contentType), std::move(contentEncoding),
+                                (float) firstFrame, (float) lastFrame);
+            mPublishedBatches++;
+        }
+        mPublishCond.notify_all();
+
+        lk.lock();
+    }
+
+    void lingerLoop() {
+        std::unique_lock<std::mutex> lk(mMutex);
+        while (!mStopping) {
+            if (mFrames == 0) {
+                mCond.wait(lk);
+            } else {
+                mCond.wait_until(lk, mDeadline);
+                if (mFrames > 0 && std::chrono::steady_clock::now() >= mDeadline) flushLocked(lk);
+            }
+        }
+    }
+};
@@ -0,0 +1,487 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+struct SpoolOptions {
+    std::string directory;
+    uint64_t segmentBytes;    // size of one segment file
+    uint64_t maxBytes;        // segments on disk; the oldest is discarded beyond it
+};
+
+struct SpoolStats {
+    uint64_t appended;
+    uint64_t acked;
+    uint64_t recovered;    // pending records found on disk at startup
+    uint64_t evicted;      // discarded unsent because of maxBytes
+    uint64_t rejected;     // larger than a segment, or the disk failed
+    uint64_t pending;
+    uint64_t diskBytes;
+};
+
+// One post, as stored in the spool
+struct SpoolRecord {
+    uint64_t sequence;
+    std::string url;
+    std::string body;
+    std::string contentType;
+    std::string contentEncoding;
+    float firstFrame;
+    float lastFrame;
+};
+
+//---------------------------------------------------------------------------
+// Write-ahead spool of telemetry posts.
+// Posts are appended to memory-mapped segment files in a directory, each
+// with a sequence number that keeps increasing across restarts. A single
+// drainer takes them in order with next() and calls ack() once the server
+// accepted one; a segment is deleted when all of its posts were acked.
+//
+// Appending is a memcpy into the mapping under a short lock: a slow or
+// unreachable server never slows the producers down, and the pages belong
+// to the file, not to the heap. When the segments reach maxBytes the oldest
+// one is discarded, sent or not.
+//
+// The page cache outlives a crash of the process. On startup every segment
+// is scanned; records are checked by CRC, so a torn last write ends the
+// segment, and posts up to the last acked sequence (kept in a small file)
+// are skipped. A post acked by the server but not in that file yet is sent
+// again: delivery is at least once, and the server deduplicates by spool ID
+// and sequence number.
+class TelemetrySpool {
+
+    struct Header {
+        uint32_t magic;       // written last
+        uint32_t length;      // of the payload
+        uint64_t sequence;
+        uint32_t crc;         // of the payload
+        float firstFrame;
+        float lastFrame;
+        uint32_t reserved;
+    };
+
+    struct Segment {
+        std::string path;
+        char *base;
+        size_t size;
+        size_t end;       // bytes holding records
+        bool sealed;      // no more appends: recovered, or full
+    };
+
+    static const uint32_t MAGIC = 0x314c5053;    // "SPL1"
+
+    const SpoolOptions mOptions;
+    std::string mId;
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::deque<Segment> mSegments;    // oldest first; the drainer reads the front
+    size_t mReadOffset;               // next record to send, in the front segment
+    uint64_t mNextSequence;
+    uint64_t mAcked;
+    int mAckFd;
+    bool mOpened;
+
+    std::atomic<uint64_t> mAppended;
+    std::atomic<uint64_t> mAckedCount;
+    std::atomic<uint64_t> mRecovered;
+    std::atomic<uint64_t> mEvicted;
+    std::atomic<uint64_t> mRejected;
+    std::atomic<uint64_t> mPending;
+    std::atomic<uint64_t> mDiskBytes;
+
+public:
+
+    explicit TelemetrySpool(const SpoolOptions &options)
+            : mOptions(options), mReadOffset(0), mNextSequence(1), mAcked(0), mAckFd(-1), mOpened(false),
+              mAppended(0), mAckedCount(0), mRecovered(0), mEvicted(0), mRejected(0), mPending(0), mDiskBytes(0) {
+    }
+
+    ~TelemetrySpool() {
+        std::lock_guard<std::mutex> lg(mMutex);
+        for (Segment &s : mSegments) unmap(s);
+#ifndef _WIN32
+        if (mAckFd >= 0) close(mAckFd);
+#endif
+    }
+
+    TelemetrySpool(const TelemetrySpool &) = delete;
+
+    TelemetrySpool &operator=(const TelemetrySpool &) = delete;
+
+    // Creates the directory or recovers what a previous run left in it
+    bool open() {
+#ifdef _WIN32
+        std::cerr << "ERROR\tThe telemetry spool is not available on Windows" << std::endl;
+        return false;
+#else
+        std::lock_guard<std::mutex> lg(mMutex);
+        namespace fs = boost::filesystem;
+        boost::system::error_code ec;
+        fs::create_directories(mOptions.directory, ec);
+        if (!fs::is_directory(mOptions.directory)) {
+            std::cerr << "ERROR\tUnable to create the spool directory " << mOptions.directory << std::endl;
+            return false;
+        }
+        if (!readOrCreateId()) return false;
+
+        const std::string ackPath = (fs::path(mOptions.directory) / "acked").string();
+        mAckFd = ::open(ackPath.c_str(), O_RDWR | O_CREAT, 0644);
+        if (mAckFd < 0) {
+            std::cerr << "ERROR\tUnable to open " << ackPath << std::endl;
+            return false;
+        }
+        uint64_t acked = 0;
+        if (pread(mAckFd, &acked, sizeof(acked), 0) == (ssize_t) sizeof(acked)) mAcked = acked;
+
+        std::vector<std::string> paths;
+        for (fs::directory_iterator it(mOptions.directory), end; it != end; ++it) {
+            if (it->path().extension() == ".spool") paths.push_back(it->path().string());
+        }
+        std::sort(paths.begin(), paths.end());    // zero-padded first sequence numbers
+        uint64_t last = mAcked;
+        for (const std::string &path : paths) recover(path, last);
+        mNextSequence = last + 1;
+
+        // Skip what was acked in the first segment
+        if (!mSegments.empty()) {
+            const Segment &front = mSegments.front();
+            while (mReadOffset < front.end && headerAt(front, mReadOffset).sequence <= mAcked) {
+                mReadOffset += recordSize(headerAt(front, mReadOffset).length);
+            }
+        }
+        mRecovered = mPending.load();
+        mOpened = true;
+        return true;
+#endif
+    }
+
+    const std::string &getId() const {
+        return mId;
+    }
+
+    // Returns false if the post could not be stored
+    bool append(const std::string &url, const std::string &body, const std::string &contentType,
+                const std::string &contentEncoding, const float firstFrame, const float lastFrame) {
+        const size_t length = 3 * sizeof(uint32_t) + url.size() + contentType.size() + contentEncoding.size() +
+                              body.size();
+        const size_t size = recordSize(length);
+        std::unique_lock<std::mutex> lk(mMutex);
+        if (!mOpened || size > mOptions.segmentBytes) {
+            mRejected++;
+            return false;
+        }
+        if (mSegments.empty() || mSegments.back().sealed || mSegments.back().end + size > mSegments.back().size) {
+            if (!mSegments.empty()) mSegments.back().sealed = true;
+            if (!addSegment()) {
+                mRejected++;
+                return false;
+            }
+        }
+
+        Segment &s = mSegments.back();
+        char *record = s.base + s.end;
+        char *p = record + sizeof(Header);
+        putString(p, url);
+        putString(p, contentType);
+        putString(p, contentEncoding);
+        memcpy(p, body.data(), body.size());
+
+        Header h;
+        h.magic = 0;
+        h.length = (uint32_t) length;
+        h.sequence = mNextSequence++;
+        h.crc = (uint32_t) crc32(0L, (const Bytef *) record + sizeof(Header), (uInt) length);
+        h.firstFrame = firstFrame;
+        h.lastFrame = lastFrame;
+        h.reserved = 0;
+        memcpy(record, &h, sizeof(h));
+        // The magic goes in last: a record is only valid once it is complete
+        const uint32_t magic = MAGIC;
+        memcpy(record, &magic, sizeof(magic));
+        s.end += size;
+
+        mAppended++;
+        mPending++;
+        lk.unlock();
+        mCond.notify_one();
+        return true;
+    }
+
+    // Copies the oldest unacked post into record. Waits up to `wait` for one.
+    bool next(SpoolRecord &record, const std::chrono::milliseconds wait) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        const auto deadline = std::chrono::steady_clock::now() + wait;
+        for (;;) {
+            while (!mSegments.empty()) {
+                const Segment &front = mSegments.front();
+                if (mReadOffset < front.end) {
+                    decode(front, mReadOffset, record);
+                    return true;
+                }
+                if (!front.sealed) break;
+                removeFront();    // fully acked
+            }
+            if (mCond.wait_until(lk, deadline) == std::cv_status::timeout) return false;
+        }
+    }
+
+    // The server accepted the post with this sequence number
+    void ack(const uint64_t sequence) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        if (mSegments.empty() || mReadOffset >= mSegments.front().end) return;
+        const Segment &front = mSegments.front();
+        const Header h = headerAt(front, mReadOffset);
+        if (h.sequence != sequence) return;    // evicted meanwhile
+        mReadOffset += recordSize(h.length);
+        mAcked = sequence;
+        mAckedCount++;
+        mPending--;
+#ifndef _WIN32
+        if (pwrite(mAckFd, &mAcked, sizeof(mAcked), 0) != (ssize_t) sizeof(mAcked)) {
+            std::cerr << "WARN\tUnable to record the acked spool position" << std::endl;
+        }
+#endif
+        if (mReadOffset >= front.end && front.sealed) removeFront();
+    }
+
+    // Wakes up a drainer waiting in next()
+    void interrupt() {
+        mCond.notify_all();
+    }
+
+    SpoolStats getStats() const {
+        SpoolStats stats;
+        stats.appended = mAppended;
+        stats.acked = mAckedCount;
+        stats.recovered = mRecovered;
+        stats.evicted = mEvicted;
+        stats.rejected = mRejected;
+        stats.pending = mPending;
+        stats.diskBytes = mDiskBytes;
+        return stats;
+    }
+
+private:
+
+    static size_t recordSize(const size_t length) {
+        return (sizeof(Header) + length + 7) & ~(size_t) 7;
+    }
+
+    static Header headerAt(const Segment &s, const size_t offset) {
+        Header h;
+        memcpy(&h, s.base + offset, sizeof(h));
+        return h;
+    }
+
+    static void putString(char *&p, const std::string &value) {
+        const uint32_t size = (uint32_t) value.size();
+        memcpy(p, &size, sizeof(size));
+        memcpy(p + sizeof(size), value.data(), size);
+        p += sizeof(size) + size;
+    }
+
+    static bool getString(const char *&p, const char *end, std::string &value) {
+        uint32_t size;
+        if (end - p < (ptrdiff_t) sizeof(size)) return false;
+        memcpy(&size, p, sizeof(size));
+        p += sizeof(size);
+        if (end - p < (ptrdiff_t) size) return false;
+        value.assign(p, size);
+        p += size;
+        return true;
+    }
+
+    static bool decode(const Segment &s, const size_t offset, SpoolRecord &record) {
+        const Header h = headerAt(s, offset);
+        const char *p = s.base + offset + sizeof(Header);
+        const char *end = p + h.length;
+        record.sequence = h.sequence;
+        record.firstFrame = h.firstFrame;
+        record.lastFrame = h.lastFrame;
+        if (!getString(p, end, record.url) || !getString(p, end, record.contentType) ||
+            !getString(p, end, record.contentEncoding)) {
+            return false;
+        }
+        record.body.assign(p, end);
+        return true;
+    }
+
+#ifndef _WIN32
+
+    bool readOrCreateId() {
+        const std::string path = (boost::filesystem::path(mOptions.directory) / "spool.id").string();
+        std::ifstream in(path.c_str());
+        if (in >> mId && !mId.empty()) return true;
+        std::random_device rd;
+        char id[17];
+        snprintf(id, sizeof(id), "%08x%08x", rd(), rd());
+        mId = id;
+        std::ofstream out(path.c_str(), std::ios::out | std::ios::trunc);
+        out << mId << std::endl;
+        if (!out.good()) {
+            std::cerr << "ERROR\tUnable to write " << path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    static bool map(const std::string &path, const size_t size, const bool create, Segment &s) {
+        const int fd = ::open(path.c_str(), O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+        if (fd < 0) return false;
+        if (create && ftruncate(fd, (off_t) size) != 0) {
+            close(fd);
+            unlink(path.c_str());
+            return false;
+        }
+        void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);    // the mapping keeps the file open
+        if (base == MAP_FAILED) return false;
+        s.path = path;
+        s.base = (char *) base;
+        s.size = size;
+        s.end = 0;
+        s.sealed = !create;
+        return true;
+    }
+
+    // Maps a segment left by a previous run and finds where its valid records end
+    void recover(const std::string &path, uint64_t &last) {
+        boost::system::error_code ec;
+        const uint64_t size = boost::filesystem::file_size(path, ec);
+        Segment s;
+        if (ec || size < sizeof(Header) || !map(path, (size_t) size, false, s)) {
+            std::cerr << "WARN\tIgnoring unreadable spool segment " << path << std::endl;
+            return;
+        }
+        uint64_t pending = 0;
+        uint64_t lastInSegment = 0;
+        while (s.end + sizeof(Header) <= s.size) {
+            const Header h = headerAt(s, s.end);
+            if (h.magic != MAGIC || h.length > s.size - s.end - sizeof(Header) || h.sequence <= lastInSegment ||
+                crc32(0L, (const Bytef *) s.base + s.end + sizeof(Header), (uInt) h.length) != h.crc) {
+                break;    // never written, or torn by a crash
+            }
+            lastInSegment = h.sequence;
+            if (h.sequence > mAcked) pending++;
+            s.end += recordSize(h.length);
+        }
+        if (pending == 0) {
+            munmap(s.base, s.size);
+            unlink(path.c_str());
+            return;
+        }
+        last = std::max(last, lastInSegment);
+        mPending += pending;
+        mDiskBytes += s.size;
+        mSegments.push_back(s);
+    }
+
+    bool addSegment() {
+        // Make room first: the oldest segments go, sent or not
+        while (!mSegments.empty() && mDiskBytes + mOptions.segmentBytes > mOptions.maxBytes) {
+            evictFront();
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu.spool", (unsigned long long) mNextSequence);
+        const std::string path = (boost::filesystem::path(mOptions.directory) / name).string();
+        Segment s;
+        if (!map(path, (size_t) mOptions.segmentBytes, true, s)) {
+            std::cerr << "ERROR\tUnable to create spool segment " << path << std::endl;
+            return false;
+        }
+        mDiskBytes += s.size;
+        mSegments.push_back(s);
+        return true;
+    }
+
+    void evictFront() {
+        const Segment &front = mSegments.front();
+        uint64_t lost = 0;
+        for (size_t offset = mReadOffset; offset < front.end; offset += recordSize(headerAt(front, offset).length)) {
+            lost++;
+        }
+        if (lost > 0) {
+            std::cerr << "WARN\tSpool full, discarding " << lost << " unsent posts" << std::endl;
+        }
+        mEvicted += lost;
+        mPending -= lost;
+        removeFront();
+    }
+
+    void removeFront() {
+        Segment &front = mSegments.front();
+        unmap(front);
+        unlink(front.path.c_str());
+        mDiskBytes -= front.size;
+        mSegments.pop_front();
+        mReadOffset = 0;
+    }
+
+    static void unmap(Segment &s) {
+        if (s.base) munmap(s.base, s.size);
+        s.base = nullptr;
+    }
+
+#else
+
+    bool readOrCreateId() {
+        return false;
+    }
+
+    void recover(const std::string &, uint64_t &) {
+    }
+
+    bool addSegment() {
+        return false;
+    }
+
+    void removeFront() {
+        mSegments.pop_front();
+        mReadOffset = 0;
+    }
+
+    static void unmap(Segment &) {
+    }
+
+#endif
+};
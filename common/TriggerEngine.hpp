@@ -0,0 +1,453 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Face.h"
+
+#include "FaceRecord.hpp"
+#include "TelemetryBatcher.hpp"
+
+using namespace affdex;
+
+enum class RuleKind {
+    ABOVE,       // metric > threshold for duration
+    BELOW,       // metric < threshold for duration
+    CHANGE,      // max - min of metric over the last `duration` > threshold
+    NEW_FACE     // a face is found
+};
+
+// One rule, as compiled into the evaluation plan
+struct TriggerRule {
+    std::string text;
+    RuleKind kind;
+    int metric;          // index into METRICS
+    float threshold;
+    float clear;         // the rule re-arms once the value is back past this
+    double duration;     // seconds
+};
+
+namespace trigger {
+
+    // Hysteresis when a rule gives none: metrics mostly range over 0-100
+    // and values under 5 are noise (drawValues does not even show them)
+    const float DEFAULT_HYSTERESIS = 5.0f;
+    // Samples kept per face for a change rule; at 30 fps that covers 4 s
+    const size_t CHANGE_SAMPLES = 128;
+    // Frame rate the pre-event context is sized for
+    const double MAX_FPS = 60;
+
+    // Rules read:
+    //   <metric> > <value> [for <ms>] [clear <value>]
+    //   <metric> < <value> [for <ms>] [clear <value>]
+    //   <metric> change <value> within <ms> [clear <value>]
+    //   newface
+    inline bool parseRule(const std::string &text, TriggerRule &rule, std::string &error) {
+        std::istringstream in(text);
+        std::vector<std::string> tokens;
+        std::string token;
+        rule.text.clear();
+        while (in >> token) {
+            if (!rule.text.empty()) rule.text.push_back(' ');
+            rule.text.append(token);
+            tokens.push_back(token);
+        }
+        rule.metric = -1;
+        rule.threshold = 0;
+        rule.duration = 0;
+        if (tokens.size() == 1 && tokens[0] == "newface") {
+            rule.kind = RuleKind::NEW_FACE;
+            rule.clear = 0;
+            return true;
+        }
+        if (tokens.size() < 3) {
+            error = "expected <metric> >|<|change <value> ...";
+            return false;
+        }
+        rule.metric = findMetric(tokens[0].c_str());
+        if (rule.metric < 0) {
+            error = rule.metric == -2 ? "ambiguous metric " + tokens[0] + ", qualify it with its group"
+                                      : "unknown metric " + tokens[0];
+            return false;
+        }
+        if (tokens[1] == ">") rule.kind = RuleKind::ABOVE;
+        else if (tokens[1] == "<") rule.kind = RuleKind::BELOW;
+        else if (tokens[1] == "change") rule.kind = RuleKind::CHANGE;
+        else {
+            error = "unknown comparison " + tokens[1];
+            return false;
+        }
+        char *end;
+        rule.threshold = strtof(tokens[2].c_str(), &end);
+        if (*end) {
+            error = "not a number: " + tokens[2];
+            return false;
+        }
+        bool hasClear = false;
+        for (size_t i = 3; i < tokens.size(); i += 2) {
+            if (i + 1 >= tokens.size()) {
+                error = "missing value after " + tokens[i];
+                return false;
+            }
+            const double value = strtod(tokens[i + 1].c_str(), &end);
+            if (*end) {
+                error = "not a number: " + tokens[i + 1];
+                return false;
+            }
+            if ((tokens[i] == "for" && rule.kind != RuleKind::CHANGE) ||
+                (tokens[i] == "within" && rule.kind == RuleKind::CHANGE)) {
+                rule.duration = value / 1000.0;
+            } else if (tokens[i] == "clear") {
+                rule.clear = (float) value;
+                hasClear = true;
+            } else {
+                error = "unexpected " + tokens[i];
+                return false;
+            }
+        }
+        if (rule.kind == RuleKind::CHANGE && !(rule.duration > 0)) {
+            error = "a change rule needs \"within <ms>\"";
+            return false;
+        }
+        if (!hasClear) {
+            if (rule.kind == RuleKind::ABOVE) rule.clear = rule.threshold - DEFAULT_HYSTERESIS;
+            else if (rule.kind == RuleKind::BELOW) rule.clear = rule.threshold + DEFAULT_HYSTERESIS;
+            else rule.clear = rule.threshold / 2;
+        }
+        return true;
+    }
+
+} // namespace trigger
+
+struct TriggerStats {
+    uint64_t frames;
+    uint64_t records;            // face records seen
+    uint64_t events;
+    uint64_t publishedRecords;   // records sent as event context
+};
+
+//---------------------------------------------------------------------------
+// Publishes only the moments the rules pick out. Every face record is
+// checked against the rules; when one fires, an event is posted with the
+// records of that face from preSeconds before to postSeconds after it, as
+// NDJSON: a header line
+//   {"event":"joy > 50 for 500","rule":0,"faceId":3,"timeStamp":12.3,"records":40}
+// then the records in the per-frame format.
+//
+// Rules fire once when their condition starts to hold and re-arm only once
+// the value is back past the clear threshold (hysteresis), so a value
+// hovering around the threshold does not fire again and again.
+//
+// The rules are parsed once into a flat plan walked for every face. The
+// state of a face (rule states, change samples, recent records) lives in a
+// slot sized when the engine is built, and slots and events are reused, so
+// checking a frame does not allocate once the engine has seen as many faces
+// at once as it will. Building the body of an event does.
+//
+// A face is lost when a result of its stream no longer has it. add() is
+// called with the results of a stream in timestamp order; streams share one
+// engine and their faces are told apart by stream.
+class TriggerEngine {
+
+    struct RuleState {
+        bool active;
+        double since;    // when the condition started to hold, -1 when it does not
+        size_t head;     // change rules: ring of (timeStamp, value) samples
+        size_t count;
+    };
+
+    struct Sample {
+        double timeStamp;
+        float value;
+    };
+
+    struct Slot {
+        bool used;
+        bool seen;
+        FaceId faceId;
+        int streamId;
+        std::vector<RuleState> rules;
+        std::vector<Sample> samples;        // CHANGE_SAMPLES per rule
+        std::vector<FaceRecord> history;    // ring of the latest records
+        size_t historyHead;
+        size_t historyCount;
+    };
+
+    struct Event {
+        bool used;
+        size_t rule;
+        FaceId faceId;
+        int streamId;
+        double timeStamp;
+        std::vector<FaceRecord> records;
+    };
+
+    const std::vector<TriggerRule> mPlan;
+    const double mPreSeconds;
+    const double mPostSeconds;
+    const size_t mHistoryCapacity;
+    const std::function<void(const std::string &)> mEmit;
+
+    std::mutex mMutex;
+    std::vector<Slot> mSlots;
+    std::vector<Event> mEvents;
+    std::vector<FaceRecord> mRecords;
+    std::string mBody;
+
+    std::atomic<uint64_t> mFrames;
+    std::atomic<uint64_t> mRecordCount;
+    std::atomic<uint64_t> mEventCount;
+    std::atomic<uint64_t> mPublished;
+
+public:
+
+    // emit is called with the lock held, from add() or flush()
+    TriggerEngine(const std::vector<TriggerRule> &rules, const double preSeconds, const double postSeconds,
+                  std::function<void(const std::string &)> emit)
+            : mPlan(rules), mPreSeconds(std::max(preSeconds, 0.0)), mPostSeconds(std::max(postSeconds, 0.0)),
+              mHistoryCapacity((size_t) std::ceil(std::max(preSeconds, 0.0) * trigger::MAX_FPS) + 1),
+              mEmit(emit), mFrames(0), mRecordCount(0), mEventCount(0), mPublished(0) {
+    }
+
+    void add(const std::map<FaceId, Face> &faces, const double timeStamp, const int streamId = -1) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        mRecords.clear();
+        for (auto &face_id_pair : faces) {
+            mRecords.push_back(FaceRecord::fromFace(face_id_pair.second, timeStamp, streamId));
+        }
+        check(mRecords, streamId);
+    }
+
+    // The records of one frame of a stream
+    void add(const std::vector<FaceRecord> &records, const int streamId = -1) {
+        std::lock_guard<std::mutex> lg(mMutex);
+        check(records, streamId);
+    }
+
+    // Posts the events still collecting context and forgets every face
+    void flush() {
+        std::lock_guard<std::mutex> lg(mMutex);
+        for (Event &e : mEvents) {
+            if (e.used) publish(e);
+        }
+        for (Slot &s : mSlots) s.used = false;
+    }
+
+    TriggerStats getStats() const {
+        TriggerStats stats;
+        stats.frames = mFrames;
+        stats.records = mRecordCount;
+        stats.events = mEventCount;
+        stats.publishedRecords = mPublished;
+        return stats;
+    }
+
+private:
+
+    // Called with mMutex held
+    void check(const std::vector<FaceRecord> &records, const int streamId) {
+        mFrames++;
+        mRecordCount += records.size();
+        for (Slot &s : mSlots) s.seen = false;
+
+        for (const FaceRecord &r : records) {
+            bool found = false;
+            Slot &s = slot(r.faceId, streamId, found);
+            s.seen = true;
+            remember(s, r);
+
+            // Events of this face still collecting the records after them
+            for (Event &e : mEvents) {
+                if (!e.used || e.faceId != r.faceId || e.streamId != streamId) continue;
+                if (r.timeStamp - e.timeStamp > mPostSeconds) publish(e);
+                else e.records.push_back(r);
+            }
+
+            for (size_t k = 0; k < mPlan.size(); k++) {
+                const TriggerRule &rule = mPlan[k];
+                RuleState &state = s.rules[k];
+                bool fire = false;
+                switch (rule.kind) {
+                    case RuleKind::NEW_FACE:
+                        fire = !found;
+                        break;
+                    case RuleKind::ABOVE:
+                    case RuleKind::BELOW: {
+                        const float v = r.metrics[rule.metric];
+                        const bool above = rule.kind == RuleKind::ABOVE;
+                        if (state.active) {
+                            if (above ? v < rule.clear : v > rule.clear) state.active = false;
+                            break;
+                        }
+                        if (above ? v > rule.threshold : v < rule.threshold) {
+                            if (state.since < 0) state.since = r.timeStamp;
+                            fire = r.timeStamp - state.since >= rule.duration;
+                        } else {
+                            state.since = -1;
+                        }
+                        break;
+                    }
+                    case RuleKind::CHANGE: {
+                        const float range = change(s, k, r.timeStamp, r.metrics[rule.metric]);
+                        if (state.active) {
+                            if (range < rule.clear) state.active = false;
+                            break;
+                        }
+                        fire = range > rule.threshold;
+                        break;
+                    }
+                }
+                if (fire) {
+                    state.active = rule.kind != RuleKind::NEW_FACE;
+                    state.since = -1;
+                    open(s, k, r);
+                }
+            }
+        }
+
+        // Faces of this stream the result no longer has are gone
+        for (Slot &s : mSlots) {
+            if (!s.used || s.seen || s.streamId != streamId) continue;
+            for (Event &e : mEvents) {
+                if (e.used && e.faceId == s.faceId && e.streamId == streamId) publish(e);
+            }
+            s.used = false;
+        }
+    }
+
+    Slot &slot(const FaceId faceId, const int streamId, bool &found) {
+        Slot *free = nullptr;
+        for (Slot &s : mSlots) {
+            if (s.used && s.faceId == faceId && s.streamId == streamId) {
+                found = true;
+                return s;
+            }
+            if (!s.used && !free) free = &s;
+        }
+        if (!free) {
+            mSlots.push_back(Slot());
+            free = &mSlots.back();
+            free->rules.resize(mPlan.size());
+            free->samples.resize(mPlan.size() * trigger::CHANGE_SAMPLES);
+            free->history.resize(mHistoryCapacity);
+        }
+        free->used = true;
+        free->faceId = faceId;
+        free->streamId = streamId;
+        free->historyHead = 0;
+        free->historyCount = 0;
+        for (RuleState &state : free->rules) {
+            state.active = false;
+            state.since = -1;
+            state.head = 0;
+            state.count = 0;
+        }
+        found = false;
+        return *free;
+    }
+
+    void remember(Slot &s, const FaceRecord &r) {
+        s.history[(s.historyHead + s.historyCount) % mHistoryCapacity] = r;
+        if (s.historyCount < mHistoryCapacity) s.historyCount++;
+        else s.historyHead = (s.historyHead + 1) % mHistoryCapacity;
+    }
+
+    // Adds a sample to the ring of a change rule and returns max - min over its window
+    float change(Slot &s, const size_t k, const double timeStamp, const float value) {
+        RuleState &state = s.rules[k];
+        Sample *ring = &s.samples[k * trigger::CHANGE_SAMPLES];
+        const size_t capacity = trigger::CHANGE_SAMPLES;
+        ring[(state.head + state.count) % capacity] = Sample{timeStamp, value};
+        if (state.count < capacity) state.count++;
+        else state.head = (state.head + 1) % capacity;
+        while (state.count > 1 && timeStamp - ring[state.head].timeStamp > mPlan[k].duration) {
+            state.head = (state.head + 1) % capacity;
+            state.count--;
+        }
+        float lo = value, hi = value;
+        for (size_t i = 0; i < state.count; i++) {
+            const float v = ring[(state.head + i) % capacity].value;
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+        }
+        return hi - lo;
+    }
+
+    // Starts an event with the records of the face from preSeconds before r
+    void open(const Slot &s, const size_t k, const FaceRecord &r) {
+        Event *e = nullptr;
+        for (Event &candidate : mEvents) {
+            if (!candidate.used) {
+                e = &candidate;
+                break;
+            }
+        }
+        if (!e) {
+            mEvents.push_back(Event());
+            e = &mEvents.back();
+        }
+        e->used = true;
+        e->rule = k;
+        e->faceId = s.faceId;
+        e->streamId = s.streamId;
+        e->timeStamp = r.timeStamp;
+        e->records.clear();
+        for (size_t i = 0; i < s.historyCount; i++) {
+            const FaceRecord &past = s.history[(s.historyHead + i) % mHistoryCapacity];
+            if (r.timeStamp - past.timeStamp <= mPreSeconds) e->records.push_back(past);
+        }
+        mEventCount++;
+        if (mPostSeconds <= 0) publish(*e);
+    }
+
+    void publish(Event &e) {
+        mBody.clear();
+        mBody.append("{\"event\":");
+        batch::appendJsonString(mBody, mPlan[e.rule].text);
+        mBody.append(",\"rule\":");
+        batch::appendNumber(mBody, (double) e.rule);
+        mBody.append(",\"faceId\":");
+        batch::appendNumber(mBody, e.faceId);
+        if (e.streamId >= 0) {
+            mBody.append(",\"streamId\":");
+            batch::appendNumber(mBody, e.streamId);
+        }
+        mBody.append(",\"timeStamp\":");
+        batch::appendJsonNumber(mBody, e.timeStamp);
+        mBody.append(",\"records\":");
+        batch::appendNumber(mBody, (double) e.records.size());
+        mBody.append("}\n");
+        batch::appendNdjson(mBody, e.records);
+        mPublished += e.records.size();
+        e.used = false;
+        mEmit(mBody);
+    }
+};
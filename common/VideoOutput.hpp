@@ -0,0 +1,391 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#ifndef _WIN32
+#include <csignal>
+#endif
+
+#include "Face.h"
+
+#include "HttpPublisher.hpp"
+#include "OverlayRenderer.hpp"
+#include "PlottingImageListener.hpp"
+
+using namespace affdex;
+
+struct VideoOutputOptions {
+    std::string target;         // a video file, or pipe:<command> reading raw BGR frames on stdin
+    double fps;                 // frame rate written in the file
+    std::string codec;          // four character code, for files
+    double segmentSeconds;      // start a new file this often, 0: one file
+    size_t queueLength;         // frames waiting to be encoded
+    OverflowPolicy policy;      // when the queue is full
+    bool clips;                 // only write clips around faces found or lost
+    double preSeconds;          // of a clip, before the event
+    double postSeconds;         // and after it
+
+    VideoOutputOptions() : fps(30), codec("mp4v"), segmentSeconds(0), queueLength(8),
+                           policy(OverflowPolicy::DROP_OLDEST), clips(false), preSeconds(1), postSeconds(2) {
+    }
+};
+
+struct VideoOutputStats {
+    uint64_t written;    // frames encoded
+    uint64_t dropped;    // frames discarded by the overflow policy
+    uint64_t files;      // files (segments, clips) or encoder processes opened
+    uint64_t failed;     // files or encoders that could not be opened or written
+};
+
+//---------------------------------------------------------------------------
+// Writes the annotated frames (the overlay of --draw) to a video file, a
+// series of segment files or an encoder process, on a thread of its own.
+// submit() only queues the capture buffer of a result; the copy, the overlay
+// and the encoding happen on the writer thread, which returns the buffer to
+// the pool as soon as it has copied it. The queue is bounded and handled by
+// an OverflowPolicy, so a slow encoder costs frames of the video, not frames
+// of the detector (unless the policy is BLOCK).
+//
+// With clips, frames are only written from preSeconds before to postSeconds
+// after a face is found or lost, one numbered file per clip. The latest
+// preSeconds of annotated frames are kept in memory for that.
+//
+// Frames are written as they are processed, one per result: the detector
+// rate, not the file's fps, sets the pace of the video.
+class VideoOutput {
+
+    struct Item {
+        double timestamp;
+        std::map<FaceId, Face> faces;
+        std::shared_ptr<cv::Mat> pixels;
+    };
+
+    const VideoOutputOptions mOptions;
+    std::shared_ptr<PlottingImageListener> mListener;    // draws the overlay
+    std::unique_ptr<OverlayRenderer> mOverlay;           // of the writer thread
+
+    std::mutex mMutex;
+    std::condition_variable mNotEmpty;
+    std::condition_variable mNotFull;
+    std::deque<Item> mQueue;
+    std::vector<float> mEvents;    // faces found or lost, not yet seen by the writer
+    bool mStopping;
+    std::thread mThread;
+
+    // Writer thread only
+    cv::VideoWriter mWriter;
+    FILE *mPipe;
+    bool mOpen;
+    cv::Size mSize;                 // of the open output
+    cv::Mat mResized;               // frames of another size are scaled to mSize
+    uint64_t mFileNumber;
+    double mOutputStart;            // timestamp of the first frame of the open file, -1: none
+    double mClipEnd;
+    std::deque<std::pair<double, cv::Mat> > mPreRoll;
+    std::vector<cv::Mat> mSpare;    // recycled frame buffers
+
+    std::atomic<uint64_t> mWritten;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<uint64_t> mFiles;
+    std::atomic<uint64_t> mFailed;
+
+public:
+
+    VideoOutput(const VideoOutputOptions &options, std::shared_ptr<PlottingImageListener> listener)
+            : mOptions(options), mListener(listener), mOverlay(listener->newOverlayRenderer()), mStopping(false),
+              mPipe(nullptr), mOpen(false), mFileNumber(0), mOutputStart(-1), mClipEnd(-1),
+              mWritten(0), mDropped(0), mFiles(0), mFailed(0) {
+#ifndef _WIN32
+        // An encoder that exits must not take the process down with it
+        if (isPipe()) signal(SIGPIPE, SIG_IGN);
+#endif
+        mThread = std::thread(&VideoOutput::run, this);
+    }
+
+    ~VideoOutput() {
+        stop();
+    }
+
+    VideoOutput(const VideoOutput &) = delete;
+
+    VideoOutput &operator=(const VideoOutput &) = delete;
+
+    // Queues the capture buffer of a result; the overlay is drawn on a copy.
+    // Returns false if the frame was dropped.
+    bool submit(const double timestamp, const std::map<FaceId, Face> &faces, std::shared_ptr<cv::Mat> pixels) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        if (mStopping) {
+            mDropped++;
+            return false;
+        }
+        if (mQueue.size() >= std::max<size_t>(mOptions.queueLength, 1)) {
+            switch (mOptions.policy) {
+                case OverflowPolicy::DROP_NEWEST:
+                    mDropped++;
+                    return false;
+                case OverflowPolicy::DROP_OLDEST:
+                    mQueue.pop_front();
+                    mDropped++;
+                    break;
+                case OverflowPolicy::BLOCK:
+                    mNotFull.wait(lk, [this] {
+                        return mStopping || mQueue.size() < std::max<size_t>(mOptions.queueLength, 1);
+                    });
+                    if (mStopping) {
+                        mDropped++;
+                        return false;
+                    }
+                    break;
+            }
+        }
+        Item item;
+        item.timestamp = timestamp;
+        item.faces = faces;
+        item.pixels = std::move(pixels);
+        mQueue.push_back(std::move(item));
+        lk.unlock();
+        mNotEmpty.notify_one();
+        return true;
+    }
+
+    // A face was found or lost at this frame timestamp; starts or extends a clip.
+    // Called on the SDK thread.
+    void faceEvent(const float timestamp) {
+        if (!mOptions.clips) return;
+        std::lock_guard<std::mutex> lg(mMutex);
+        mEvents.push_back(timestamp);
+    }
+
+    // Writes what is queued, closes the output and joins the writer thread
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            mStopping = true;
+        }
+        mNotEmpty.notify_all();
+        mNotFull.notify_all();
+        if (mThread.joinable()) mThread.join();
+    }
+
+    VideoOutputStats getStats() const {
+        VideoOutputStats stats;
+        stats.written = mWritten;
+        stats.dropped = mDropped;
+        stats.files = mFiles;
+        stats.failed = mFailed;
+        return stats;
+    }
+
+private:
+
+    bool isPipe() const {
+        return mOptions.target.compare(0, 5, "pipe:") == 0;
+    }
+
+    void run() {
+        for (;;) {
+            Item item;
+            {
+                std::unique_lock<std::mutex> lk(mMutex);
+                mNotEmpty.wait(lk, [this] { return mStopping || !mQueue.empty(); });
+                if (mQueue.empty()) break;    // stopping and drained
+                item = std::move(mQueue.front());
+                mQueue.pop_front();
+            }
+            mNotFull.notify_one();
+
+            cv::Mat img;
+            if (!mSpare.empty()) {
+                img = mSpare.back();
+                mSpare.pop_back();
+            }
+            item.pixels->copyTo(img);    // reuses the spare buffer when the size matches
+            item.pixels.reset();         // back to the frame pool
+            mListener->drawOverlay(item.faces, img, *mOverlay);
+
+            if (mOptions.clips) {
+                clip(item.timestamp, img);
+            } else {
+                record(item.timestamp, img);
+                mSpare.push_back(img);
+            }
+        }
+        close();
+    }
+
+    // Everything, in segments if asked to
+    void record(const double timestamp, const cv::Mat &img) {
+        if (mOutputStart < 0 ||
+            (mOptions.segmentSeconds > 0 && timestamp - mOutputStart >= mOptions.segmentSeconds)) {
+            close();
+            mOutputStart = timestamp;
+            open(img.size());
+        }
+        write(img);
+    }
+
+    // Only the frames around face events
+    void clip(const double timestamp, const cv::Mat &img) {
+        std::vector<float> events;
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            // Events of frames not written yet wait until their pre-roll starts
+            auto due = std::partition(mEvents.begin(), mEvents.end(), [&](const float t) {
+                return t - mOptions.preSeconds > timestamp;
+            });
+            events.assign(due, mEvents.end());
+            mEvents.erase(due, mEvents.end());
+        }
+        for (const float event : events) {
+            if (mOutputStart < 0) {
+                mOutputStart = timestamp;
+                open(img.size());
+                for (auto &frame : mPreRoll) {
+                    if (frame.first >= event - mOptions.preSeconds) write(frame.second);
+                }
+            }
+            mClipEnd = std::max(mClipEnd, event + mOptions.postSeconds);
+        }
+
+        if (mOutputStart >= 0) {
+            while (!mPreRoll.empty()) {
+                mSpare.push_back(mPreRoll.front().second);
+                mPreRoll.pop_front();
+            }
+            write(img);
+            mSpare.push_back(img);
+            if (timestamp >= mClipEnd) {
+                close();
+                mOutputStart = -1;
+            }
+        } else {
+            mPreRoll.push_back(std::make_pair(timestamp, img));
+            while (mPreRoll.front().first < timestamp - mOptions.preSeconds) {
+                mSpare.push_back(mPreRoll.front().second);
+                mPreRoll.pop_front();
+            }
+        }
+    }
+
+    // The target, numbered when there are several files
+    std::string outputName() const {
+        char numbered[24];
+        snprintf(numbered, sizeof(numbered), "%04llu", (unsigned long long) mFileNumber);
+        std::string name = isPipe() ? mOptions.target.substr(5) : mOptions.target;
+        if (isPipe()) {
+            replaceAll(name, "{size}", std::to_string(mSize.width) + "x" + std::to_string(mSize.height));
+            std::ostringstream fps;
+            fps << mOptions.fps;
+            replaceAll(name, "{fps}", fps.str());
+            replaceAll(name, "{n}", numbered);
+        } else if (mOptions.clips || mOptions.segmentSeconds > 0) {
+            const size_t slash = name.find_last_of("/\\");
+            size_t dot = name.rfind('.');
+            if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = name.size();
+            name.insert(dot, std::string("-") + numbered);
+        }
+        return name;
+    }
+
+    static void replaceAll(std::string &text, const std::string &from, const std::string &to) {
+        for (size_t pos = text.find(from); pos != std::string::npos; pos = text.find(from, pos + to.size())) {
+            text.replace(pos, from.size(), to);
+        }
+    }
+
+    void open(const cv::Size size) {
+        mSize = size;
+        mFileNumber++;
+        const std::string name = outputName();
+        if (isPipe()) {
+#ifdef _WIN32
+            mPipe = _popen(name.c_str(), "wb");
+#else
+            mPipe = popen(name.c_str(), "w");
+#endif
+            mOpen = mPipe != nullptr;
+        } else {
+            const std::string &c = mOptions.codec;
+            mOpen = mWriter.open(name, cv::VideoWriter::fourcc(c[0], c[1], c[2], c[3]), mOptions.fps, size, true);
+        }
+        if (mOpen) {
+            mFiles++;
+            std::cerr << "INFO\tWriting the annotated video to " << name << std::endl;
+        } else {
+            mFailed++;
+            std::cerr << "ERROR\tUnable to open the video output: " << name << std::endl;
+        }
+    }
+
+    void write(const cv::Mat &img) {
+        if (!mOpen) return;
+        const cv::Mat *frame = &img;
+        if (img.size() != mSize) {
+            cv::resize(img, mResized, mSize);
+            frame = &mResized;
+        }
+        if (mPipe) {
+            const size_t rowBytes = (size_t) frame->cols * frame->elemSize();
+            for (int y = 0; y < frame->rows; y++) {
+                if (fwrite(frame->ptr(y), 1, rowBytes, mPipe) != rowBytes) {
+                    std::cerr << "ERROR\tThe video encoder stopped reading frames" << std::endl;
+                    mFailed++;
+                    close();
+                    return;
+                }
+            }
+        } else {
+            mWriter.write(*frame);
+        }
+        mWritten++;
+    }
+
+    void close() {
+        if (mPipe) {
+#ifdef _WIN32
+            const int status = _pclose(mPipe);
+#else
+            const int status = pclose(mPipe);
+#endif
+            if (status != 0) std::cerr << "WARN\tThe video encoder exited with status " << status << std::endl;
+            mPipe = nullptr;
+        } else if (mOpen) {
+            mWriter.release();
+        }
+        mOpen = false;
+    }
+};
@@ -0,0 +1,64 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+//---------------------------------------------------------------------------
+// Lets a loop sleep until one of the threads feeding it has something new,
+// instead of polling. Producers call notify() after handing something over.
+// The loop takes a ticket() before it looks for work and waits with that
+// ticket, so a notify() that comes between the look and the wait is not lost.
+class Wakeup {
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    uint64_t mTicket;
+
+public:
+
+    Wakeup() : mTicket(0) {
+    }
+
+    Wakeup(const Wakeup &) = delete;
+
+    Wakeup &operator=(const Wakeup &) = delete;
+
+    void notify() {
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            mTicket++;
+        }
+        mCond.notify_all();
+    }
+
+    uint64_t ticket() {
+        std::lock_guard<std::mutex> lg(mMutex);
+        return mTicket;
+    }
+
+    // Returns true once notify() was called after ticket was taken, false at the deadline
+    bool waitUntil(const uint64_t ticket, const std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        return mCond.wait_until(lk, deadline, [&] { return mTicket != ticket; });
+    }
+};
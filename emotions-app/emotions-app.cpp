@@ -18,9 +18,14 @@
 
 #include <iostream>
 #include <memory>
+#include <atomic>
 #include <chrono>
+#include <csignal>
 #include <fstream>
+#include <functional>
 #include <map>
+#include <deque>
+#include <set>
 #include <boost/filesystem.hpp>
 #include <boost/timer/timer.hpp>
 #include <boost/program_options.hpp>
@@ -30,79 +35,44 @@
 #include "Face.h"
 #include "FrameDetector.h"
 
+#include "AdmissionController.hpp"
 #include "AFaceListener.hpp"
+#include "CaptureThread.hpp"
+#include "CameraStream.hpp"
+#include "ClassifierProfiler.hpp"
+#include "ConfigStore.hpp"
+#include "FaceAggregator.hpp"
+#include "FaceRecorder.hpp"
+#include "FaceTrackStore.hpp"
+#include "FramePool.hpp"
+#include "FramePreprocessor.hpp"
+#include "FrameSource.hpp"
+#include "FrameTracer.hpp"
+#include "MetricsServer.hpp"
 #include "PlottingImageListener.hpp"
+#include "RenderStage.hpp"
+#include "ResultWriter.hpp"
+#include "ShardedRunner.hpp"
+#include "ShutdownSignal.hpp"
 #include "StatusListener.hpp"
+#include "StreamScheduler.hpp"
+#include "TelemetryBatcher.hpp"
+#include "TelemetrySpool.hpp"
+#include "TriggerEngine.hpp"
+#include "VideoOutput.hpp"
+#include "Wakeup.hpp"
 
 using namespace std;
 using namespace affdex;
 
-namespace configuration {
-    //---------------------------------------------------------------------------
-    // The configuration::data is a simple map string (key, value) pairs.
-    // The file is stored as a simple listing of those pairs, one per line.
-    // The key is separated from the value by an equal sign '='.
-    // Commentary begins with the first non-space character on the line a hash or
-    // semi-colon ('#' or ';').
-    struct data : std::map<std::string, std::string> {
-        // Here is a little convenience method...
-        bool iskey(const std::string &s) const {
-            return count(s) != 0;
-        }
-    };
-
-    //---------------------------------------------------------------------------
-    // The extraction operator reads configuration::data until EOF.
-    // Invalid data is ignored.
-    //
-    std::istream &operator>>(std::istream &ins, data &d) {
-        std::string s, key, value;
-
-        // For each (key, value) pair in the file
-        while (std::getline(ins, s)) {
-            std::string::size_type begin = s.find_first_not_of(" \f\t\v");
-
-            // Skip blank lines
-            if (begin == std::string::npos) continue;
-
-            // Skip commentary
-            if (std::string("#;").find(s[begin]) != std::string::npos) continue;
-
-            // Extract the key value
-            std::string::size_type end = s.find('=', begin);
-            key = s.substr(begin, end - begin);
-
-            // (No leading or trailing whitespace allowed)
-            key.erase(key.find_last_not_of(" \f\t\v") + 1);
-
-            // No blank keys allowed
-            if (key.empty()) continue;
-
-            // Extract the value (no leading or trailing whitespace allowed)
-            begin = s.find_first_not_of(" \f\n\r\t\v", end + 1);
-            end = s.find_last_not_of(" \f\n\r\t\v") + 1;
-
-            value = s.substr(begin, end - begin);
-
-            // Insert the properly extracted (key, value) pair into the map
-            d[key] = value;
-        }
-
-        return ins;
-    }
-
-    //---------------------------------------------------------------------------
-    // The insertion operator writes all configuration::data to stream.
-    //
-    std::ostream &operator<<(std::ostream &outs, const data &d) {
-        data::const_iterator iter;
-        for (iter = d.begin(); iter != d.end(); iter++)
-            outs << iter->first << " = " << iter->second << endl;
-        return outs;
-    }
-
-} // namespace configuration
+// Set by SIGUSR1: write the Chrome trace of the latest frames to --traceFile
+static std::atomic<bool> traceDumpRequested(false);
 
+#ifndef _WIN32
+static void requestTraceDump(int) {
+    traceDumpRequested = true;
+}
+#endif
 
 int main(int argsc, char **argsv) {
     namespace po = boost::program_options; // abbreviate namespace
@@ -123,6 +93,48 @@ int main(int argsc, char **argsv) {
         unsigned int nFaces = 1;
         bool draw_display = true;
         int faceDetectorMode = (int) FaceDetectorMode::LARGE_FACES;
+        unsigned int publisher_workers = 2;
+        unsigned int publisher_queue = 256;
+        std::string publisher_overflow;
+        long publisher_connect_timeout_ms = PUBLISH_CONNECT_TIMEOUT_MS;
+        long publisher_timeout_ms = PUBLISH_TIMEOUT_MS;
+        BatchOptions batchOptions;
+        std::string batch_format;
+        std::string compression;
+        std::string config_path;
+        unsigned int config_poll_ms = 1000;
+        unsigned int result_queue_length = 64;
+        unsigned int render_framerate = 30;
+        std::string input_spec;
+        double input_framerate = 30;
+        uint64_t input_frames = 0;
+        bool realtime = false;
+        std::string output_path;
+        std::string record_path;
+        unsigned int shards = 1;
+        double shard_overlap = 2.0;
+        std::vector<std::string> stream_sources;
+        std::vector<double> aggregate_windows;
+        std::vector<std::string> rule_texts;
+        double event_pre_ms = 1000;
+        double event_post_ms = 1000;
+        unsigned int stream_slots = 0;
+        double latency_target = 0;
+        float min_scale = 0.5f;
+        PreprocessOptions preprocessOptions;
+        std::string trace_path;
+        unsigned int trace_frames = 1024;
+        size_t track_history = 90;
+        unsigned int track_memory_mb = 16;
+        unsigned int metrics_port = 0;
+        std::string spool_dir;
+        unsigned int spool_segment_mb = 16;
+        unsigned int spool_max_mb = 1024;
+        std::string metrics_address;
+        VideoOutputOptions videoOptions;
+        std::string video_overflow;
+        std::string metrics_spec;
+        bool profile_classifiers = false;
 
         float last_timestamp = -1.0f;
         float capture_fps = -1.0f;
@@ -149,10 +161,123 @@ int main(int argsc, char **argsv) {
                 ("cfps", po::value<int>(&camera_framerate)->default_value(30), "Camera capture framerate.")
                 ("bufferLen", po::value<int>(&buffer_length)->default_value(30), "process buffer size.")
                 ("cid", po::value<int>(&camera_id)->default_value(0), "Camera ID.")
+                ("latencyTarget", po::value<double>(&latency_target)->default_value(0),
+                 "Skip or downscale camera frames to keep capture-to-result latency under this many ms (0: off).")
+                ("minScale", po::value<float>(&min_scale)->default_value(0.5f),
+                 "Smallest downscale factor --latencyTarget may use.")
+                ("workWidth", po::value<int>(&preprocessOptions.workWidth)->default_value(0),
+                 "Downscale frames wider than this before detection (0: full resolution).")
+                ("roi", po::bool_switch(&preprocessOptions.roi)->default_value(false),
+                 "Only pass the region around the faces already found to the detector.")
+                ("roiMargin", po::value<float>(&preprocessOptions.roiMargin)->default_value(0.5f),
+                 "Margin around the faces for --roi, as a fraction of their size.")
+                ("roiRescan", po::value<unsigned int>(&preprocessOptions.rescanInterval)->default_value(30),
+                 "Scan the full frame for new faces every this many frames with --roi.")
+                ("streams", po::value<std::vector<std::string> >(&stream_sources)->multitoken(),
+                 "Process several cameras at once: camera IDs or --input sources, each with its own detector.")
+                ("streamSlots", po::value<unsigned int>(&stream_slots)->default_value(0),
+                 "Frames processed at once across all --streams (0: one per core).")
+                ("input,i", po::value<std::string>(&input_spec),
+                 "Process a recording instead of the camera: a video file, a directory of images or a glob. "
+                 "Also camera:<id>, synthetic (a test pattern at --resolution), replay:<recording> (looped "
+                 "from memory) or yuv:<file> (raw I420 frames at --resolution, - for stdin).")
+                ("inputFps", po::value<double>(&input_framerate)->default_value(30),
+                 "Frame rate of image sequences, raw and synthetic frames given with --input.")
+                ("inputFrames", po::value<uint64_t>(&input_frames)->default_value(0),
+                 "Stop synthetic and replayed input after this many frames (0: never); also the frames "
+                 "--profileClassifiers processes.")
+                ("realtime", po::bool_switch(&realtime)->default_value(false),
+                 "Play --input at its own frame rate instead of as fast as possible.")
+                ("shards", po::value<unsigned int>(&shards)->default_value(1),
+                 "Split --input into this many time segments processed in parallel (0: one per core).")
+                ("shardOverlap", po::value<double>(&shard_overlap)->default_value(2.0),
+                 "Seconds processed before each segment to warm up the tracker and match face IDs.")
+                ("output,o", po::value<std::string>(&output_path),
+                 "Also write every face of every processed frame to this file, one JSON object per line.")
+                ("record", po::value<std::string>(&record_path),
+                 "Also record every face of every processed frame to this file in a compact columnar format.")
+                ("traceFile", po::value<std::string>(&trace_path),
+                 "Write a Chrome trace of the latest frames to this file at exit and on SIGUSR1.")
+                ("traceFrames", po::value<unsigned int>(&trace_frames)->default_value(1024),
+                 "Number of latest frames whose per-stage timings are kept for the trace.")
+                ("metricsPort", po::value<unsigned int>(&metrics_port)->default_value(0),
+                 "Serve Prometheus metrics at http://<metricsAddress>:<port>/metrics (0: off).")
+                ("metricsAddress", po::value<std::string>(&metrics_address)->default_value("127.0.0.1"),
+                 "Address the metrics endpoint listens on.")
                 ("faceMode", po::value<int>(&faceDetectorMode)->default_value((int) FaceDetectorMode::LARGE_FACES),
                  "Face detector mode (large faces vs small faces).")
                 ("numFaces", po::value<unsigned int>(&nFaces)->default_value(1), "Number of faces to be tracked.")
-                ("draw", po::value<bool>(&draw_display)->default_value(false), "Draw metrics on screen.");
+                ("metrics", po::value<std::string>(&metrics_spec)->default_value("all"),
+                 "Only run the classifiers of these metrics and only report them, e.g. valence,engagement,joy. "
+                 "Also takes emotions, expressions, emojis, headAngles, appearance, gender, age, ethnicity "
+                 "and glasses.")
+                ("profileClassifiers", po::bool_switch(&profile_classifiers)->default_value(false),
+                 "Process --input once per classifier group and report the fps and CPU time each one costs.")
+                ("trackHistory", po::value<size_t>(&track_history)->default_value(90),
+                 "Latest results whose metrics are kept per face.")
+                ("trackMemoryMB", po::value<unsigned int>(&track_memory_mb)->default_value(16),
+                 "Memory for per-face history; the faces updated least recently are dropped beyond it (0: off).")
+                ("draw", po::value<bool>(&draw_display)->default_value(false), "Draw metrics on screen.")
+                ("renderFps", po::value<unsigned int>(&render_framerate)->default_value(30),
+                 "Maximum rate at which results are drawn on screen.")
+                ("video", po::value<std::string>(&videoOptions.target),
+                 "Write the frames with the metrics drawn on them to this video file, or to the standard input "
+                 "of pipe:<command> as raw BGR frames ({size}, {fps} and {n} are replaced in the command).")
+                ("videoFps", po::value<double>(&videoOptions.fps)->default_value(0),
+                 "Frame rate written in the video (0: --pfps).")
+                ("videoCodec", po::value<std::string>(&videoOptions.codec)->default_value("mp4v"),
+                 "Four character code of the video codec.")
+                ("videoSegment", po::value<double>(&videoOptions.segmentSeconds)->default_value(0),
+                 "Start a new, numbered video file every this many seconds (0: one file).")
+                ("videoQueue", po::value<size_t>(&videoOptions.queueLength)->default_value(8),
+                 "Frames waiting to be encoded.")
+                ("videoOverflow", po::value<std::string>(&video_overflow)->default_value("drop-oldest"),
+                 "What to do when the video queue is full: drop-oldest, drop-newest or block.")
+                ("videoClips", po::bool_switch(&videoOptions.clips)->default_value(false),
+                 "Only write clips around faces being found or lost, one numbered file each.")
+                ("clipPreMs", po::value<double>(&videoOptions.preSeconds)->default_value(1000),
+                 "Video written before a face is found or lost.")
+                ("clipPostMs", po::value<double>(&videoOptions.postSeconds)->default_value(2000),
+                 "Video written after a face is found or lost.")
+                ("pubWorkers", po::value<unsigned int>(&publisher_workers)->default_value(2),
+                 "Number of HTTP publisher workers (one keep-alive connection each).")
+                ("pubQueue", po::value<unsigned int>(&publisher_queue)->default_value(256),
+                 "Maximum number of posts waiting to be sent.")
+                ("pubOverflow", po::value<std::string>(&publisher_overflow)->default_value("drop-oldest"),
+                 "What to do when the post queue is full: drop-oldest, drop-newest or block.")
+                ("pubConnectTimeoutMs", po::value<long>(&publisher_connect_timeout_ms)->default_value(
+                        PUBLISH_CONNECT_TIMEOUT_MS), "Time a post may take to connect before it fails.")
+                ("pubTimeoutMs", po::value<long>(&publisher_timeout_ms)->default_value(PUBLISH_TIMEOUT_MS),
+                 "Time a post may take in all, connecting included, before it fails.")
+                ("spoolDir", po::value<std::string>(&spool_dir),
+                 "Spool posts to this directory and send them in order until the server accepts them.")
+                ("spoolSegmentMB", po::value<unsigned int>(&spool_segment_mb)->default_value(16),
+                 "Size of one spool segment file.")
+                ("spoolMaxMB", po::value<unsigned int>(&spool_max_mb)->default_value(1024),
+                 "Disk space the spool may use; the oldest posts are discarded beyond it.")
+                ("batchFrames", po::value<unsigned int>(&batchOptions.frames)->default_value(0),
+                 "Send the faces of this many frames in one request (0: one request per face).")
+                ("batchLingerMs", po::value<unsigned int>(&batchOptions.lingerMs)->default_value(0),
+                 "Send a partial batch this many milliseconds after its first frame (0: wait for batchFrames).")
+                ("batchFormat", po::value<std::string>(&batch_format)->default_value("urlencoded"),
+                 "Batch body format: urlencoded, ndjson or columnar.")
+                ("compression", po::value<std::string>(&compression)->default_value("none"),
+                 "Batch body compression: none, gzip or deflate.")
+                ("config", po::value<std::string>(&config_path)->default_value(ConfigStore::defaultPath()),
+                 "Configuration file, reloaded when it changes.")
+                ("configPollMs", po::value<unsigned int>(&config_poll_ms)->default_value(1000),
+                 "How often to check the configuration file for changes (0: never).")
+                ("aggregate", po::value<std::vector<double> >(&aggregate_windows)->multitoken(),
+                 "Post per-face summaries over windows of these lengths in seconds (e.g. 1 10 60) "
+                 "instead of every frame.")
+                ("rule", po::value<std::vector<std::string> >(&rule_texts)->composing(),
+                 "Only post the moments this rule picks out, e.g. \"joy > 50 for 500\" (may be repeated).")
+                ("eventPreMs", po::value<double>(&event_pre_ms)->default_value(1000),
+                 "Records posted with an event from before it fired.")
+                ("eventPostMs", po::value<double>(&event_post_ms)->default_value(1000),
+                 "Records posted with an event from after it fired.")
+                ("resultQueue", po::value<unsigned int>(&result_queue_length)->default_value(64),
+                 "Detector results waiting to be drawn and published; newer results are dropped when full.");
         po::variables_map args;
         try {
             po::store(po::command_line_parser(argsc, argsv).options(description).run(), args);
@@ -184,108 +309,863 @@ int main(int argsc, char **argsv) {
             return 1;
         }
 
+        if (!stream_sources.empty() && !input_spec.empty()) {
+            std::cerr << "ERROR\t--streams and --input cannot be used together." << std::endl;
+            return 1;
+        }
+        std::string input_path;
+        if (shards != 1 && (input_spec.empty() || !frameSourceScheme(input_spec, input_path).empty())) {
+            std::cerr << "ERROR\tSharding needs a video file or image sequence given with --input." << std::endl;
+            return 1;
+        }
+
+        if (!videoOptions.target.empty()) {
+            if (shards != 1 || !stream_sources.empty()) {
+                std::cerr << "ERROR\t--video cannot be used with --shards or --streams." << std::endl;
+                return 1;
+            }
+            if (videoOptions.codec.size() != 4) {
+                std::cerr << "ERROR\tThe video codec must be a four character code." << std::endl;
+                return 1;
+            }
+            if (!parseOverflowPolicy(video_overflow, videoOptions.policy)) {
+                std::cerr << "ERROR\tUnknown video overflow policy: " << video_overflow << std::endl;
+                return 1;
+            }
+            if (videoOptions.fps <= 0) videoOptions.fps = process_framerate;
+            videoOptions.preSeconds = std::max(videoOptions.preSeconds, 0.0) / 1000.0;
+            videoOptions.postSeconds = std::max(videoOptions.postSeconds, 0.0) / 1000.0;
+        }
+
+        for (const double window : aggregate_windows) {
+            if (!(window > 0)) {
+                std::cerr << "ERROR\tAggregation windows must be positive numbers of seconds." << std::endl;
+                return 1;
+            }
+        }
+
+        std::vector<TriggerRule> rules;
+        for (const std::string &text : rule_texts) {
+            TriggerRule rule;
+            std::string error;
+            if (!trigger::parseRule(text, rule, error)) {
+                std::cerr << "ERROR\tInvalid rule \"" << text << "\": " << error << std::endl;
+                return 1;
+            }
+            rules.push_back(rule);
+        }
+
+        if (!parseBatchFormat(batch_format, batchOptions.format)) {
+            std::cerr << "ERROR\tUnknown batch format: " << batch_format << std::endl;
+            return 1;
+        }
+        if (!parseCompression(compression, batchOptions.compression)) {
+            std::cerr << "ERROR\tUnknown compression: " << compression << std::endl;
+            return 1;
+        }
+
+        // Results, frames, the end of processing and shutdown requests wake the main loop up through this
+        shared_ptr<Wakeup> wakeup = make_shared<Wakeup>();
+        // SIGINT and SIGTERM finish the frames in flight and flush the posts before exiting. Created
+        // before any thread is started, so the signals go to it and not to a worker.
+        unique_ptr<ShutdownSignal> shutdown;
+        if (shards == 1 && !profile_classifiers) shutdown.reset(new ShutdownSignal([wakeup] { wakeup->notify(); }));
+
+        // The configuration file is read once here and then only when it changes.
+        // Options given on the command line take precedence over it.
+        AppConfig cliConfig;
+        cliConfig.processFramerate = process_framerate;
+        cliConfig.bufferLength = buffer_length;
+        cliConfig.faceDetectorMode = faceDetectorMode;
+        cliConfig.batch = batchOptions;
+        cliConfig.metrics = metrics_spec;
+        const std::map<std::string, std::string> configKeys{
+                {"pfps",          "PFPS"},
+                {"bufferLen",     "BUFFER_LEN"},
+                {"faceMode",      "FACE_MODE"},
+                {"batchFrames",   "BATCH_FRAMES"},
+                {"batchLingerMs", "BATCH_LINGER_MS"},
+                {"batchFormat",   "BATCH_FORMAT"},
+                {"compression",   "COMPRESSION"},
+                {"metrics",       "METRICS"}
+        };
+        std::set<std::string> pinned;
+        for (auto &option_key_pair : configKeys) {
+            if (!args[option_key_pair.first].defaulted()) pinned.insert(option_key_pair.second);
+        }
+        ConfigStore configStore(config_path, cliConfig, pinned);
+        if (config_poll_ms > 0) configStore.watch(config_poll_ms);
+        const AppConfig *config = configStore.current();
+        batchOptions = config->batch;
+
+        // Only the classifiers of the selected metrics run, and only those metrics are reported
+        std::string selection_error;
+        if (!MetricSelection::init(config->metrics, selection_error)) {
+            std::cerr << "ERROR\tInvalid --metrics: " << selection_error << std::endl;
+            return 1;
+        }
+        const MetricSelection &selection = MetricSelection::active();
+        std::cerr << "INFO\tMetrics: " << selection.str() << std::endl;
+        for (const TriggerRule &rule : rules) {
+            if (rule.kind != RuleKind::NEW_FACE && !selection.has(rule.metric)) {
+                std::cerr << "ERROR\tRule \"" << rule.text << "\" uses " << METRICS[rule.metric].qualifiedName
+                        << ", which --metrics leaves out." << std::endl;
+                return 1;
+            }
+        }
+
+        // Process rate of a detector that must not skip any frame it is given
+        const float UNTHROTTLED_PROCESS_FRAMERATE = 1000.0f;
+
+        if (profile_classifiers) {
+            std::string input_rest;
+            const std::string input_scheme = input_spec.empty() ? "camera" : frameSourceScheme(input_spec, input_rest);
+            if (input_scheme == "camera" || input_spec.find("://") != std::string::npos ||
+                (input_scheme == "yuv" && input_rest == "-") || shards != 1) {
+                std::cerr << "ERROR\t--profileClassifiers needs a recording given with --input, and no --shards."
+                        << std::endl;
+                return 1;
+            }
+            if ((input_scheme == "synthetic" || input_scheme == "replay") && input_frames == 0) {
+                std::cerr << "ERROR\t--profileClassifiers needs --inputFrames with " << input_scheme << " input."
+                        << std::endl;
+                return 1;
+            }
+            FrameSourceOptions profileSourceOptions;
+            profileSourceOptions.width = resolution[0];
+            profileSourceOptions.height = resolution[1];
+            profileSourceOptions.cameraFps = camera_framerate;
+            profileSourceOptions.fps = input_framerate;
+            profileSourceOptions.frames = input_frames;
+            profileSourceOptions.epoch = std::chrono::steady_clock::now();
+            const AppConfig startConfig = *config;
+            ClassifierProfiler profiler(
+                    [&] { return openFrameSource(input_spec, profileSourceOptions); },
+                    [&] {
+                        shared_ptr<FrameDetector> detector = make_shared<FrameDetector>(
+                                startConfig.bufferLength, UNTHROTTLED_PROCESS_FRAMERATE, nFaces,
+                                (affdex::FaceDetectorMode) startConfig.faceDetectorMode);
+                        detector->setClassifierPath(DATA_FOLDER);
+                        return detector;
+                    },
+                    std::min((unsigned int) std::max(startConfig.bufferLength, 1), result_queue_length),
+                    input_frames);
+            std::cerr << "INFO\tProfiling the classifiers on " << input_spec << std::endl;
+            const bool completed = profiler.run(selection);
+            profiler.report();
+            return completed ? 0 : 1;
+        }
+
+        OverflowPolicy overflowPolicy;
+        if (!parseOverflowPolicy(publisher_overflow, overflowPolicy)) {
+            std::cerr << "ERROR\tUnknown publisher overflow policy: " << publisher_overflow << std::endl;
+            return 1;
+        }
+
+        // Per-frame stage timings, for the single detector loop
+        shared_ptr<FrameTracer> tracer;
+        if (shards == 1 && stream_sources.empty()) {
+            tracer = make_shared<FrameTracer>(trace_frames);
+#ifndef _WIN32
+            if (!trace_path.empty()) signal(SIGUSR1, requestTraceDump);
+#endif
+        }
+        auto writeTrace = [&]() {
+            if (tracer->writeChromeTrace(trace_path)) {
+                std::cerr << "INFO\tWrote the trace of the latest frames to " << trace_path << std::endl;
+            } else {
+                std::cerr << "ERROR\tUnable to write the trace to " << trace_path << std::endl;
+            }
+        };
+
+        shared_ptr<TelemetrySpool> spool;
+        if (!spool_dir.empty()) {
+            if (spool_segment_mb == 0 || spool_max_mb < 2 * spool_segment_mb) {
+                std::cerr << "ERROR\t--spoolMaxMB must hold at least two segments of --spoolSegmentMB" << std::endl;
+                return 1;
+            }
+            SpoolOptions spoolOptions;
+            spoolOptions.directory = spool_dir;
+            spoolOptions.segmentBytes = (uint64_t) spool_segment_mb << 20;
+            spoolOptions.maxBytes = (uint64_t) spool_max_mb << 20;
+            spool = make_shared<TelemetrySpool>(spoolOptions);
+            if (!spool->open()) return 1;
+            std::cerr << "INFO\tSpooling posts to " << spool_dir << " (" << spool->getStats().recovered
+                    << " unsent from a previous run)" << std::endl;
+        }
+
+        if (publisher_connect_timeout_ms <= 0 || publisher_timeout_ms <= 0) {
+            std::cerr << "ERROR\t--pubConnectTimeoutMs and --pubTimeoutMs must be positive" << std::endl;
+            return 1;
+        }
+        shared_ptr<HttpPublisher> publisher = make_shared<HttpPublisher>(publisher_workers, publisher_queue,
+                                                                         overflowPolicy, tracer, spool,
+                                                                         publisher_connect_timeout_ms,
+                                                                         publisher_timeout_ms);
+        shared_ptr<TelemetryBatcher> batcher;
+        if (batchOptions.enabled()) {
+            batcher = make_shared<TelemetryBatcher>(publisher, batchOptions);
+        }
+        // Summaries replace the per-frame posts; they are few enough not to need batching
+        shared_ptr<FaceAggregator> aggregator;
+        if (!aggregate_windows.empty()) {
+            shared_ptr<SummarySerializer> summarySerializer = make_shared<SummarySerializer>();
+            aggregator = make_shared<FaceAggregator>(aggregate_windows, [&configStore, publisher, summarySerializer](
+                    const FaceSummary &summary) {
+                publisher->publish(configStore.current()->urlBase, summarySerializer->serialize(summary),
+                                   "application/json");
+            });
+        }
+        // Events replace the per-frame posts too
+        shared_ptr<TriggerEngine> triggers;
+        if (!rules.empty()) {
+            triggers = make_shared<TriggerEngine>(rules, event_pre_ms / 1000.0, event_post_ms / 1000.0,
+                                                  [&configStore, publisher](const std::string &body) {
+                                                      publisher->publish(configStore.current()->urlBase, body,
+                                                                         "application/x-ndjson");
+                                                  });
+        }
+
+        // Per-face history, lifetime and appearance votes, read by the overlay and the metrics
+        shared_ptr<FaceTrackStore> tracks;
+        if (shards == 1 && track_memory_mb > 0) {
+            tracks = make_shared<FaceTrackStore>(track_history, (size_t) track_memory_mb << 20);
+        }
+
         std::cerr << "INFO\tInitializing Affdex FrameDetector" << endl;
-        shared_ptr<FaceListener> faceListenPtr(new AFaceListener());
+        shared_ptr<AFaceListener> faceListenPtr(new AFaceListener());
+        faceListenPtr->setAggregator(aggregator);
+        faceListenPtr->setTrackStore(tracks);
+        // Instanciate the ImageListener class
         shared_ptr<PlottingImageListener> listenPtr(
-                new PlottingImageListener(draw_display));    // Instanciate the ImageListener class
-        shared_ptr<StatusListener> videoListenPtr(new StatusListener());
-        frameDetector = make_shared<FrameDetector>(buffer_length, process_framerate, nFaces,
-                                                   (affdex::FaceDetectorMode) faceDetectorMode);        // Init the FrameDetector Class
-
-        //Initialize detectors
-        frameDetector->setDetectAllEmotions(true);
-        frameDetector->setDetectAllExpressions(true);
-        frameDetector->setDetectAllEmojis(true);
-        frameDetector->setDetectAllAppearances(true);
-        frameDetector->setClassifierPath(DATA_FOLDER);
-        frameDetector->setImageListener(listenPtr.get());
-        frameDetector->setFaceListener(faceListenPtr.get());
-        frameDetector->setProcessStatusListener(videoListenPtr.get());
-
-        cv::VideoCapture webcam(camera_id);    //Connect to the first webcam
-        webcam.set(CV_CAP_PROP_FPS, camera_framerate);    //Set webcam framerate.
-        webcam.set(CV_CAP_PROP_FRAME_WIDTH, resolution[0]);
-        webcam.set(CV_CAP_PROP_FRAME_HEIGHT, resolution[1]);
-        std::cerr << "INFO\tSetting the webcam frame rate to: " << camera_framerate << std::endl;
-        auto start_time = std::chrono::system_clock::now();
-        if (!webcam.isOpened()) {
-            std::cerr << "ERROR\tError opening webcam!" << std::endl;
-            return 1;
+                new PlottingImageListener(draw_display, publisher, result_queue_length));
+        listenPtr->setTracer(tracer);
+        listenPtr->setWakeup(wakeup);
+        listenPtr->setTrackStore(tracks);
+        shared_ptr<StatusListener> videoListenPtr;
+        unique_ptr<RenderStage> renderer;
+        if (draw_display) {
+            renderer.reset(new RenderStage(listenPtr, render_framerate, tracer));
+        }
+        // The same overlay, encoded on a thread of its own; needs no display
+        shared_ptr<VideoOutput> video;
+        if (!videoOptions.target.empty()) {
+            video = make_shared<VideoOutput>(videoOptions, listenPtr);
+            if (videoOptions.clips) faceListenPtr->setVideoOutput(video);
         }
 
-        std::cout << "INFO\tMax num of faces set to: " << frameDetector->getMaxNumberFaces() << std::endl;
-        std::string mode;
-        switch (frameDetector->getFaceDetectorMode()) {
-            case FaceDetectorMode::LARGE_FACES:
-                mode = "LARGE_FACES";
-                break;
-            case FaceDetectorMode::SMALL_FACES:
-                mode = "SMALL_FACES";
-                break;
-            default:
-                break;
-        }
-        std::cout << "INFO\tFace detector mode set to: " << mode << std::endl;
-
-        //Start the frame detector thread.
-        frameDetector->start();
-
-        do {
-            cv::Mat img;
-            if (!webcam.read(img))    //Capture an image from the camera
-            {
-                std::cerr << "ERROR\tFailed to read frame from webcam! " << std::endl;
-                break;
+        // Live frames are stamped with the seconds since start_time
+        const auto start_time = std::chrono::steady_clock::now();
+        FrameSourceOptions sourceOptions;
+        sourceOptions.width = resolution[0];
+        sourceOptions.height = resolution[1];
+        sourceOptions.cameraFps = camera_framerate;
+        sourceOptions.fps = input_framerate;
+        sourceOptions.frames = input_frames;
+        sourceOptions.epoch = start_time;
+
+        // Frames come from the camera, a recording or one of the other sources
+        unique_ptr<FrameSource> frameSource;
+        if (shards == 1 && stream_sources.empty()) {
+            frameSource = openFrameSource(input_spec.empty() ? "camera:" + std::to_string(camera_id) : input_spec,
+                                     sourceOptions);
+            if (frameSource->isLive()) {
+                std::cerr << "INFO\tSetting the webcam frame rate to: " << camera_framerate << std::endl;
+                if (!frameSource->isOpened()) {
+                    std::cerr << "ERROR\tError opening webcam!" << std::endl;
+                    return 1;
+                }
+            } else {
+                if (!frameSource->isOpened()) {
+                    std::cerr << "ERROR\tUnable to open input: " << input_spec << std::endl;
+                    return 1;
+                }
+                std::cerr << "INFO\tReading " << input_spec << " (" << frameSource->getFrameCount() << " frames at "
+                        << frameSource->getFrameRate() << " fps)" << std::endl;
+            }
+        }
+
+        unique_ptr<ResultWriter> resultWriter;
+        if (!output_path.empty()) {
+            resultWriter.reset(new ResultWriter(output_path));
+            if (!resultWriter->isOpened()) {
+                std::cerr << "ERROR\tUnable to open output file: " << output_path << std::endl;
+                return 1;
+            }
+        }
+        unique_ptr<FaceRecorder> recorder;
+        if (!record_path.empty()) {
+            recorder.reset(new FaceRecorder(record_path));
+            if (!recorder->isOpened()) {
+                std::cerr << "ERROR\tUnable to open recording file: " << record_path << std::endl;
+                return 1;
             }
+        }
 
-            //Calculate the Image timestamp and the capture frame rate;
-            const auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    std::chrono::system_clock::now() - start_time);
-            const double seconds = milliseconds.count() / 1000.f;
+        // Prometheus endpoint; each mode below starts it with what it has to report.
+        // Everything read here is an atomic counter, so scrapes never wait on the pipeline.
+        unique_ptr<MetricsServer> metrics;
+        if (metrics_port > 0) metrics.reset(new MetricsServer(metrics_address, metrics_port));
 
-            // Create a frame
-            Frame f(img.size().width, img.size().height, img.data, Frame::COLOR_FORMAT::BGR, seconds);
-            capture_fps = 1.0f / (seconds - last_timestamp);
-            last_timestamp = seconds;
-            frameDetector->process(f);  //Pass the frame to detector
+        auto collectDetector = [&](MetricsWriter &w, PlottingImageListener &listener, const AFaceListener &faces,
+                                   const std::string &labels) {
+            w.gauge("emotions_capture_fps", "Rate of frames reaching the detector.",
+                    listener.getCaptureFrameRate(), labels);
+            w.gauge("emotions_process_fps", "Rate of detector results.", listener.getProcessingFrameRate(), labels);
+            w.counter("emotions_frames_captured_total", "Frames that reached the detector.",
+                      listener.getCapturedFrames(), labels);
+            w.counter("emotions_frames_processed_total", "Frames the detector returned results for.",
+                      listener.getProcessedFrames(), labels);
+            w.gauge("emotions_result_queue_depth", "Detector results waiting to be consumed.",
+                    listener.getDataSize(), labels);
+            w.counter("emotions_frames_dropped_total", "Frames dropped, by the stage that dropped them.",
+                      listener.getDroppedResults(), labels + (labels.empty() ? "" : ",") + "stage=\"result_queue\"");
+            w.gauge("emotions_faces_tracked", "Faces currently tracked.", faces.getFacesTracked(), labels);
+            w.counter("emotions_faces_found_total", "Faces found by the tracker.", faces.getFacesFound(), labels);
+            w.counter("emotions_faces_lost_total", "Faces lost by the tracker.", faces.getFacesLost(), labels);
+        };
+
+        auto collectPublishing = [&](MetricsWriter &w) {
+            const PublisherStats p = publisher->getStats();
+            w.gauge("emotions_publisher_queue_depth", "Posts waiting to be sent.", p.queueDepth);
+            w.counter("emotions_posts_total", "Posts by outcome.", p.sent, "result=\"sent\"");
+            w.counter("emotions_posts_total", "Posts by outcome.", p.failed, "result=\"failed\"");
+            w.counter("emotions_posts_total", "Posts by outcome.", p.dropped, "result=\"dropped\"");
+            w.summary("emotions_post_latency_seconds", "Time taken by the posts that were sent or failed.",
+                      p.latencyTotalUs / 1e6, p.sent + p.failed);
+            w.gauge("emotions_post_latency_max_seconds", "Longest post so far.", p.latencyMaxUs / 1e6);
+            if (spool) {
+                const SpoolStats s = spool->getStats();
+                w.gauge("emotions_spool_pending", "Spooled posts not acknowledged yet.", s.pending);
+                w.gauge("emotions_spool_disk_bytes", "Disk space used by the spool.", s.diskBytes);
+                w.counter("emotions_spool_discarded_total", "Posts discarded unsent because the spool was full.",
+                          s.evicted + s.rejected);
+            }
+            if (batcher) {
+                const BatcherStats b = batcher->getStats();
+                w.counter("emotions_batches_total", "Telemetry batches sent.", b.batches);
+                w.counter("emotions_batch_records_total", "Face records sent in batches.", b.records);
+            }
+            if (aggregator) {
+                w.counter("emotions_aggregated_samples_total", "Face samples rolled up into summaries.",
+                          aggregator->getSamples());
+                w.counter("emotions_summaries_total", "Per-face window summaries posted.",
+                          aggregator->getSummaries());
+            }
+            if (tracks) {
+                w.gauge("emotions_face_tracks", "Faces with a track in the store, lost ones included.",
+                        tracks->getTracks());
+                w.counter("emotions_face_tracks_evicted_total", "Tracks dropped to stay within --trackMemoryMB.",
+                          tracks->getEvicted());
+                double dwell = 0;
+                for (const FaceTrackSummary &track : tracks->snapshot()->tracks) {
+                    if (!track.lost) dwell = std::max(dwell, track.dwell());
+                }
+                w.gauge("emotions_face_dwell_max_seconds", "Longest time a face in view has been tracked.", dwell);
+            }
+            if (triggers) {
+                const TriggerStats t = triggers->getStats();
+                w.counter("emotions_events_total", "Events fired by the rules.", t.events);
+                w.counter("emotions_event_records_total", "Face records posted as event context.",
+                          t.publishedRecords);
+            }
+        };
+
+        // With a recording (or any source that is not live), frames are decimated to --pfps
+        // here, in timestamp order, and the detector itself must not skip any: that keeps
+        // the results repeatable. Camera streams and the admission controller pace
+        // themselves the same way.
+        const bool self_paced = (frameSource && !frameSource->isLive()) || !stream_sources.empty() ||
+                                latency_target > 0;
+
+        auto newDetector = [&](const AppConfig &c) {
+            shared_ptr<FrameDetector> detector = make_shared<FrameDetector>(
+                    c.bufferLength,
+                    self_paced ? UNTHROTTLED_PROCESS_FRAMERATE : c.processFramerate, nFaces,
+                    (affdex::FaceDetectorMode) c.faceDetectorMode);        // Init the FrameDetector Class
+
+            //Initialize detectors
+            enableClassifiers(*detector, MetricSelection::active());
+            detector->setClassifierPath(DATA_FOLDER);
+            return detector;
+        };
+
+        // Detector settings can change at run time, so the detector may be rebuilt
+        auto createDetector = [&](const AppConfig &c) {
+            videoListenPtr = make_shared<StatusListener>(wakeup);
+            frameDetector = newDetector(c);
+            frameDetector->setImageListener(listenPtr.get());
+            frameDetector->setFaceListener(faceListenPtr.get());
+            frameDetector->setProcessStatusListener(videoListenPtr.get());
+        };
+
+        if (shards != 1) {
+            // Each shard runs a detector of its own; results come back in timestamp order
+            if (shards == 0) shards = std::max(1u, std::thread::hardware_concurrency());
+            std::cerr << "INFO\tProcessing " << input_spec << " in " << shards << " shards" << std::endl;
+            const AppConfig startConfig = *config;
+            ShardedRunner runner(input_spec, input_framerate, shards, shard_overlap,
+                                 (unsigned int) startConfig.processFramerate,
+                                 std::min((unsigned int) startConfig.bufferLength, result_queue_length),
+                                 [&] { return newDetector(startConfig); });
+            if (metrics) metrics->start(collectPublishing);
+            const bool completed = runner.run([&](const std::vector<FaceRecord> &records, const double) {
+                if (resultWriter) {
+                    resultWriter->write(records);
+                }
+                if (recorder) {
+                    recorder->write(records);
+                }
+                if (aggregator || triggers) {
+                    if (aggregator) aggregator->add(records);
+                    if (triggers) triggers->add(records);
+                } else if (batcher) {
+                    batcher->add(records, startConfig.urlBase);
+                } else {
+                    listenPtr->outputToServer(records, startConfig.urlBase);
+                }
+            });
+            if (metrics) metrics->stop();
+            runner.report();
+            if (!completed) {
+                std::cerr << "ERROR\tSome shards failed, their results are incomplete" << std::endl;
+            }
+        } else if (!stream_sources.empty()) {
+            // One capture thread, detector and listener set per camera; the
+            // publisher, batcher and configuration are shared.
+            if (stream_slots == 0) stream_slots = std::max(1u, std::thread::hardware_concurrency());
+            StreamScheduler scheduler(stream_sources.size(), stream_slots);
+            StreamContext context;
+            context.configStore = &configStore;
+            context.scheduler = &scheduler;
+            context.publisher = publisher;
+            context.batcher = batcher;
+            context.resultWriter = resultWriter.get();
+            context.recorder = recorder.get();
+            context.aggregator = aggregator;
+            context.triggers = triggers;
+            context.tracks = tracks;
+            context.resultQueueLength = result_queue_length;
+            context.newDetector = newDetector;
+            context.sourceOptions = sourceOptions;
+            context.wakeup = wakeup;
+
+            std::vector<std::unique_ptr<CameraStream> > streams;
+            for (const std::string &source : stream_sources) {
+                streams.push_back(std::unique_ptr<CameraStream>(new CameraStream(streams.size(), source, context)));
+                if (!streams.back()->isOpened()) {
+                    std::cerr << "ERROR\tError opening stream " << streams.size() - 1 << ": " << source << std::endl;
+                    return 1;
+                }
+            }
+            std::cerr << "INFO\tStarting " << streams.size() << " streams sharing " << stream_slots
+                    << " processing slots" << std::endl;
+            for (auto &stream : streams) stream->start();
+            if (metrics) {
+                metrics->start([&](MetricsWriter &w) {
+                    for (auto &stream : streams) {
+                        collectDetector(w, stream->getListener(), stream->getFaceListener(),
+                                        "stream=\"" + std::to_string(stream->getId()) + "\"");
+                    }
+                    collectPublishing(w);
+                });
+            }
+
+            for (;;) {
+                const uint64_t ticket = wakeup->ticket();
+                bool running = false;
+                for (auto &stream : streams) running = running || stream->isRunning();
+                if (!running || shutdown->requested()) break;
+                wakeup->waitUntil(ticket, std::chrono::steady_clock::now() + std::chrono::seconds(1));
+            }
+            if (metrics) metrics->stop();
+
+            for (auto &stream : streams) {
+                stream->stop();
+                std::cerr << "INFO\tStream " << stream->getId() << " (" << stream->getSource() << ") captured: "
+                        << stream->getCaptured() << " (" << stream->getCaptureFrameRate() << " fps)\tprocessed: "
+                        << stream->getProcessed() << " (" << stream->getProcessingFrameRate() << " fps)"
+                        << "\tskipped by scheduler: " << scheduler.getDenied(stream->getId())
+                        << "\tresults dropped: " << stream->getDroppedResults() << std::endl;
+            }
+        } else {
+            createDetector(*config);
+
+            std::cout << "INFO\tMax num of faces set to: " << frameDetector->getMaxNumberFaces() << std::endl;
+            std::string mode;
+            switch (frameDetector->getFaceDetectorMode()) {
+                case FaceDetectorMode::LARGE_FACES:
+                    mode = "LARGE_FACES";
+                    break;
+                case FaceDetectorMode::SMALL_FACES:
+                    mode = "SMALL_FACES";
+                    break;
+                default:
+                    break;
+            }
+            std::cout << "INFO\tFace detector mode set to: " << mode << std::endl;
+
+            //Start the frame detector thread.
+            frameDetector->start();
+
+            if (metrics) {
+                metrics->start([&](MetricsWriter &w) {
+                    collectDetector(w, *listenPtr, *faceListenPtr, std::string());
+                    if (renderer) {
+                        w.counter("emotions_frames_dropped_total", "Frames dropped, by the stage that dropped them.",
+                                  renderer->getSkipped(), "stage=\"render\"");
+                    }
+                    if (video) {
+                        w.counter("emotions_frames_dropped_total", "Frames dropped, by the stage that dropped them.",
+                                  video->getStats().dropped, "stage=\"video\"");
+                    }
+                    collectPublishing(w);
+                });
+            }
+
+            uint64_t submitted = 0;
+            uint64_t consumed = 0;
+            float last_submitted = -1.0f;    // timestamp of the latest frame given to the detector
+            float last_result = -1.0f;       // and of the latest result
+            const bool live = frameSource->isLive();
+
+            // A source that is not live is fed as fast as the detector accepts frames: never more
+            // than its buffer (or the result queue) can hold, so none is dropped.
+            const uint64_t in_flight_limit = std::max(1u, std::min((unsigned int) config->bufferLength,
+                                                                   result_queue_length));
+
+            // Capture buffers are recycled. Only the renderer and the video output keep one
+            // past process(): they draw on the buffer of the frame the result belongs to.
+            // A live source holds two more: the one being read and the one waiting to be taken.
+            FramePool framePool(in_flight_limit + (live ? 4 : 2) + (video ? videoOptions.queueLength + 2 : 0));
+            std::deque<std::pair<float, std::shared_ptr<cv::Mat> > > awaitingResults;
+
+            // Seconds since start, the time base of the camera frame timestamps
+            auto now_seconds = [&]() {
+                return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+            };
+            unique_ptr<AdmissionController> admission;
+            if (latency_target > 0 && live) {
+                AdmissionOptions admissionOptions;
+                admissionOptions.targetMs = latency_target;
+                admissionOptions.maxFps = config->processFramerate;
+                admissionOptions.minScale = std::min(std::max(min_scale, 0.1f), 1.0f);
+                admissionOptions.maxInFlight = in_flight_limit;
+                admission.reset(new AdmissionController(admissionOptions));
+            }
+            FramePreprocessor preprocessor(preprocessOptions);
+            std::deque<std::pair<float, FrameTransform> > transforms;    // of the frames in flight
 
             // For each frame processed
-            if (listenPtr->getDataSize() > 0) {
+            auto handleResult = [&](std::pair<Frame, std::map<FaceId, Face> > &dataPoint) {
+                consumed++;
+                Frame &frame = dataPoint.first;
+                std::map<FaceId, Face> &faces = dataPoint.second;
+                last_result = frame.getTimestamp();
+                if (tracer) tracer->mark(frame.getTimestamp(), TRACE_DEQUEUE);
+
+                if (admission) {
+                    admission->completed(frame.getTimestamp(), now_seconds());
+                }
+
+                // Bring the results of a cropped or downscaled frame back to capture coordinates
+                while (!transforms.empty() && transforms.front().first < frame.getTimestamp()) {
+                    transforms.pop_front();
+                }
+                if (!transforms.empty() && transforms.front().first == frame.getTimestamp()) {
+                    transforms.front().second.toCaptured(faces);
+                    transforms.pop_front();
+                }
+                preprocessor.observe(faces);
 
-                std::pair<Frame, std::map<FaceId, Face> > dataPoint = listenPtr->getData();
-                Frame frame = dataPoint.first;
-                std::map<FaceId, Face> faces = dataPoint.second;
+                // Draw metrics to the GUI and the video
+                if (renderer || video) {
+                    // Frames the detector skipped have no result; let their buffers go
+                    while (!awaitingResults.empty() && awaitingResults.front().first < frame.getTimestamp()) {
+                        awaitingResults.pop_front();
+                    }
+                    std::shared_ptr<cv::Mat> pixels;
+                    if (!awaitingResults.empty() && awaitingResults.front().first == frame.getTimestamp()) {
+                        pixels.swap(awaitingResults.front().second);
+                        awaitingResults.pop_front();
+                    }
+                    if (video && pixels) {
+                        if (renderer) {
+                            // Both draw on the buffer they get, so the window gets a copy
+                            std::shared_ptr<cv::Mat> copy = framePool.acquire();
+                            pixels->copyTo(*copy);
+                            framePool.addCopied(copy->total() * copy->elemSize());
+                            renderer->submit(frame, faces, std::move(copy));
+                        }
+                        video->submit(frame.getTimestamp(), faces, std::move(pixels));
+                    } else if (renderer) {
+                        renderer->submit(frame, faces, std::move(pixels));
+                    }
+                }
 
-                // Draw metrics to the GUI
-                if (draw_display) {
-                    listenPtr->draw(faces, frame);
+                if (resultWriter) {
+                    resultWriter->write(faces, frame.getTimestamp());
+                }
+                if (recorder) {
+                    recorder->write(faces, frame.getTimestamp());
                 }
 
                 // Output metrics to the db server
-                // Read data from configuration file
+                const std::string &urlBase = config->urlBase;
+
+                if (aggregator || triggers) {
+                    if (aggregator) aggregator->add(faces, frame.getTimestamp());
+                    if (triggers) triggers->add(faces, frame.getTimestamp());
+                } else if (batcher) {
+                    batcher->add(faces, frame.getTimestamp(), urlBase);
+                } else {
+                    listenPtr->outputToServer(faces, frame.getTimestamp(), urlBase);
+                }
+            };
 
-                std::string urlBase;
-                bool debugMode;
+            // Escape on Windows, SIGINT or SIGTERM
+            auto stopRequested = [&]() {
+#ifdef _WIN32
+                if (GetAsyncKeyState(VK_ESCAPE)) return true;
+#endif
+                return shutdown->requested();
+            };
 
-                configuration::data myconfigdata;
-                std::ifstream f(std::string(getenv("HOME")) + "/.emoj/emoj.conf");
-                f >> myconfigdata;
-                f.close();
+            // Handles results as they come in until ready() holds, the deadline passes or a stop
+            // is requested, sleeping in between. Returns ready().
+            auto serviceUntil = [&](const std::function<bool()> &ready,
+                                    const std::chrono::steady_clock::time_point deadline) {
+                for (;;) {
+                    const uint64_t ticket = wakeup->ticket();
+                    while (listenPtr->tryGetData(handleResult));
+                    if (ready()) return true;
+                    const auto now = std::chrono::steady_clock::now();
+                    if (now >= deadline || stopRequested() || !videoListenPtr->isRunning()) return false;
+                    // Escape is polled, so wake up now and then even when nothing comes in
+                    wakeup->waitUntil(ticket, std::min(deadline, now + std::chrono::milliseconds(250)));
+                }
+            };
 
-                urlBase = myconfigdata["URLBASE"];
+            // Handles results until done() holds. Returns false if none came in for `patience`.
+            auto drainResults = [&](const std::function<bool()> &done, const std::chrono::milliseconds patience) {
+                auto last_progress = std::chrono::steady_clock::now();
+                while (!done() && videoListenPtr->isRunning()) {
+                    const uint64_t ticket = wakeup->ticket();
+                    if (listenPtr->tryGetData(handleResult)) {
+                        last_progress = std::chrono::steady_clock::now();
+                    } else if (!wakeup->waitUntil(ticket, last_progress + patience)) {
+                        return false;
+                    }
+                }
+                return true;
+            };
 
-                listenPtr->outputToServer(faces, frame.getTimestamp(), urlBase);
+            // Consume results until at most `limit` submitted frames are still in flight.
+            // Gives up if the detector makes no progress for a while.
+            auto waitForResults = [&](const uint64_t limit) {
+                if (!drainResults([&] { return submitted - consumed <= limit; }, std::chrono::seconds(5))) {
+                    std::cerr << "WARN\tNo detector results for 5 seconds, " << submitted - consumed
+                            << " frames still in flight" << std::endl;
+                }
+            };
 
+            const auto replay_start = std::chrono::steady_clock::now();
+            double first_timestamp = -1.0;
+            double next_due = -1.0;
+
+            // A live source is read on a thread of its own; the loop sleeps until a frame or a result comes in
+            unique_ptr<CaptureThread> capture;
+            if (live) capture.reset(new CaptureThread(*frameSource, framePool, wakeup));
+
+            while (!stopRequested() && videoListenPtr->isRunning()) {
+                std::shared_ptr<cv::Mat> buffer;
+                double seconds;
+                std::chrono::steady_clock::time_point captured_at;
+                float scale = 1.0f;
+                if (live) {
+                    if (!serviceUntil([&] { return capture->take(buffer, seconds, captured_at) || capture->ended(); },
+                                      std::chrono::steady_clock::time_point::max())) {
+                        break;
+                    }
+                    if (!buffer) {
+                        std::cerr << "ERROR\tFailed to read frame from webcam! " << std::endl;
+                        break;
+                    }
+                    if (admission && !admission->admit(seconds, scale)) continue;
+                } else {
+                    buffer = framePool.acquire();
+                    if (!frameSource->read(*buffer, seconds)) {
+                        std::cerr << "INFO\tEnd of input reached" << std::endl;
+                        break;
+                    }
+                    if (first_timestamp < 0) first_timestamp = seconds;
+
+                    // Decimate to the processing frame rate, allowing half a source frame of jitter
+                    const double tolerance = 0.5 / frameSource->getFrameRate();
+                    if (next_due >= 0 && seconds < next_due - tolerance) continue;
+                    next_due = std::max(next_due, seconds - tolerance) + 1.0 / config->processFramerate;
+
+                    if (realtime) {
+                        serviceUntil([] { return false; }, replay_start + std::chrono::microseconds(
+                                (int64_t) ((seconds - first_timestamp) * 1e6)));
+                        if (stopRequested()) break;
+                    }
+                    waitForResults(in_flight_limit - 1);
+                    captured_at = std::chrono::steady_clock::now();    // when the frame is released, not read
+                }
+                cv::Mat &img = *buffer;
+
+                // Crop and scale as configured, then create a frame
+                FrameTransform transform;
+                const cv::Mat &input = preprocessor.prepare(img, transform, scale);
+                Frame f(input.size().width, input.size().height, input.data, Frame::COLOR_FORMAT::BGR, seconds);
+                capture_fps = 1.0f / (seconds - last_timestamp);
+                last_timestamp = seconds;
+                if (tracer) {
+                    tracer->begin(f.getTimestamp(), captured_at);
+                    tracer->mark(f.getTimestamp(), TRACE_SUBMIT);
+                }
+                frameDetector->process(f);  //Pass the frame to detector
+                framePool.addCopied(input.total() * input.elemSize());    // Frame keeps a copy of the pixels
+                submitted++;
+                last_submitted = f.getTimestamp();
+                if (admission) admission->submitted(f.getTimestamp(), scale);
+                transforms.push_back(std::make_pair(f.getTimestamp(), transform));
+                if (transforms.size() > in_flight_limit) transforms.pop_front();
+                if (renderer || video) {
+                    awaitingResults.push_back(std::make_pair(f.getTimestamp(), std::move(buffer)));
+                    if (awaitingResults.size() > in_flight_limit) awaitingResults.pop_front();
+                }
+
+                // Pick up configuration changes
+                const AppConfig *latest = configStore.current();
+                if (latest != config) {
+                    if (!latest->sameDetectorSettings(*config)) {
+                        std::cerr << "INFO\tRestarting FrameDetector with the new configuration" << endl;
+                        if (!live) waitForResults(0);
+                        frameDetector->stop();
+                        frameDetector.reset();
+                        createDetector(*latest);
+                        frameDetector->start();
+                    }
+                    config = latest;
+                }
+
+                if (traceDumpRequested.exchange(false) && tracer) writeTrace();
+
+                while (listenPtr->tryGetData(handleResult));
+            }
+
+            // Collect the results of the frames still in the detector before stopping it, so
+            // that none of their records is lost. The detector may skip live frames, so for
+            // those wait for the latest frame, or until results stop coming in.
+            if (capture) {
+                capture->stop();
+                drainResults([&] { return last_result >= last_submitted; }, std::chrono::seconds(1));
+                std::cerr << "INFO\tCamera frames dropped before the loop took them: " << capture->getDropped()
+                        << std::endl;
+            } else {
+                waitForResults(0);
+                const double elapsed = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - replay_start).count();
+                std::cerr << "INFO\tProcessed " << consumed << " frames in " << elapsed << " s ("
+                        << (elapsed > 0 ? consumed / elapsed : 0) << " fps)" << std::endl;
+            }
+            if (preprocessor.enabled()) {
+                const PreprocessStats &p = preprocessor.getStats();
+                std::cerr << "INFO\tPreprocessing frames: " << p.frames << "\tcropped: " << p.cropped
+                        << "\trescans: " << p.rescans << "\tpixels passed on: "
+                        << (p.pixelsIn ? 100.0 * p.pixelsOut / p.pixelsIn : 100.0) << "%" << std::endl;
             }
+            if (admission) {
+                const AdmissionStats &a = admission->getStats();
+                std::cerr << "INFO\tAdmission captured: " << a.captured << "\tsubmitted: " << a.submitted
+                        << "\tskipped: " << a.skipped << "\tdownscaled: " << a.downscaled
+                        << "\tscale changes: " << a.scaleChanges << "\tlatency ms: " << a.latencyMs
+                        << "\tms per frame: " << a.serviceMs << std::endl;
+            }
+            if (metrics) metrics->stop();
+            std::cerr << "INFO\tStopping FrameDetector Thread" << endl;
+            frameDetector->stop();    //Stop frame detector thread
+
+            const FramePoolStats poolStats = framePool.getStats();
+            const double frames = std::max<uint64_t>(poolStats.frames, 1);
+            std::cerr << "INFO\tFrame buffers: " << poolStats.buffers << " pooled, " << poolStats.overflows
+                    << " overflows\tbytes allocated per frame: " << poolStats.bytesAllocated / frames
+                    << "\tbytes copied per frame: " << poolStats.bytesCopied / frames << std::endl;
         }
 
-#ifdef _WIN32
-            while (!GetAsyncKeyState(VK_ESCAPE) && videoListenPtr->isRunning());
-#else //  _WIN32
-        while (videoListenPtr->isRunning());
-#endif
-        std::cerr << "INFO\tStopping FrameDetector Thread" << endl;
-        frameDetector->stop();    //Stop frame detector thread
+        if (resultWriter) {
+            resultWriter->close();
+            std::cerr << "INFO\tWrote " << resultWriter->getRecordCount() << " face records to " << output_path
+                    << std::endl;
+        }
+        if (recorder) {
+            recorder->close();
+            const RecorderStats recorderStats = recorder->getStats();
+            std::cerr << "INFO\tRecorded " << recorderStats.rows << " faces in " << recorderStats.chunks
+                    << " chunks to " << record_path << "\t" << recorderStats.fileBytes << " bytes on disk for "
+                    << recorderStats.rawBytes << " bytes of columns" << std::endl;
+        }
+
+        if (video) {
+            video->stop();
+            const VideoOutputStats v = video->getStats();
+            std::cerr << "INFO\tVideo frames written: " << v.written << "\tdropped: " << v.dropped
+                    << "\tfiles: " << v.files << "\tfailed: " << v.failed << std::endl;
+        }
+        if (renderer) {
+            renderer->stop();
+            std::cerr << "INFO\tFrames drawn: " << renderer->getRendered()
+                    << "\tskipped: " << renderer->getSkipped() << std::endl;
+        }
+
+        std::cerr << "INFO\tResults dropped: " << listenPtr->getDroppedResults()
+                << "\tresult queue high-water mark: " << listenPtr->getResultHighWaterMark()
+                << "/" << result_queue_length << std::endl;
+
+        if (tracks) {
+            std::cerr << "INFO\tFace tracks held: " << tracks->getTracks() << " of " << tracks->getMaxTracks()
+                    << "\tevicted: " << tracks->getEvicted() << std::endl;
+        }
+        if (aggregator) {
+            aggregator->flush();
+            std::cerr << "INFO\tAggregated " << aggregator->getSamples() << " face samples into "
+                    << aggregator->getSummaries() << " summaries" << std::endl;
+        }
+        if (triggers) {
+            triggers->flush();
+            const TriggerStats t = triggers->getStats();
+            std::cerr << "INFO\tRules fired " << t.events << " events, posting " << t.publishedRecords << " of "
+                    << t.records << " face records" << std::endl;
+        }
+
+        std::cerr << "INFO\tFlushing pending posts" << endl;
+        if (batcher) {
+            batcher->stop();
+            BatcherStats batchStats = batcher->getStats();
+            std::cerr << "INFO\tBatcher batches: " << batchStats.batches << "\trecords: " << batchStats.records
+                    << "\tencoded bytes: " << batchStats.rawBytes << "\twire bytes: " << batchStats.wireBytes
+                    << std::endl;
+        }
+        publisher->stop();
+        PublisherStats stats = publisher->getStats();
+        const uint64_t requests = stats.sent + stats.failed;
+        std::cerr << "INFO\tPublisher sent: " << stats.sent << "\tfailed: " << stats.failed
+                << "\tdropped: " << stats.dropped
+                << "\tavg latency ms: " << (requests ? stats.latencyTotalUs / 1000.0 / requests : 0.0)
+                << "\tmax latency ms: " << stats.latencyMaxUs / 1000.0 << std::endl;
+        if (spool) {
+            const SpoolStats s = spool->getStats();
+            std::cerr << "INFO\tSpool appended: " << s.appended << "\tacked: " << s.acked
+                    << "\tdiscarded: " << s.evicted + s.rejected << "\tleft for the next run: " << s.pending
+                    << std::endl;
+        }
+
+        if (tracer) {
+            tracer->report();
+            if (!trace_path.empty()) writeTrace();
+        }
     }
     catch (AffdexException
            ex) {
@@ -0,0 +1,161 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <boost/program_options.hpp>
+
+#include "RecordingReader.hpp"
+
+static const char *typeName(const uint8_t type) {
+    switch (type) {
+        case recording::F32:
+            return "f32";
+        case recording::F64:
+            return "f64";
+        case recording::I32:
+            return "i32";
+        case recording::U8:
+            return "u8";
+        case recording::U32:
+            return "u32";
+        default:
+            return "?";
+    }
+}
+
+// Prints one column of a recording made with emotions-app --record, e.g.
+//   recording-query session.emjr -c joy --face 3 --from 10 --to 20
+int main(int argsc, char **argsv) {
+    namespace po = boost::program_options; // abbreviate namespace
+
+    std::string path;
+    std::string column_name;
+    int face_id = -1;
+    int stream_id = -1;
+    double from = -std::numeric_limits<double>::infinity();
+    double to = std::numeric_limits<double>::infinity();
+    unsigned int element = 0;
+    bool list = false;
+    bool summary = false;
+
+    po::options_description description("Query a face recording written by emotions-app --record");
+    description.add_options()
+            ("help,h", po::bool_switch()->default_value(false), "Display this help message.")
+            ("file,f", po::value<std::string>(&path), "Recording to read.")
+            ("list,l", po::bool_switch(&list)->default_value(false), "List the columns and chunks and exit.")
+            ("column,c", po::value<std::string>(&column_name),
+             "Column to print, e.g. emotions.joy, or joy when the name is unambiguous.")
+            ("face", po::value<int>(&face_id)->default_value(-1), "Only this face (-1: every face).")
+            ("stream", po::value<int>(&stream_id)->default_value(-1), "Only this stream (-1: every stream).")
+            ("from", po::value<double>(&from), "First timestamp, in seconds.")
+            ("to", po::value<double>(&to), "Last timestamp, in seconds.")
+            ("element", po::value<unsigned int>(&element)->default_value(0),
+             "Value to print of a multi-value column such as points.x.")
+            ("summary", po::bool_switch(&summary)->default_value(false),
+             "Print the count, mean, min and max instead of the values.");
+    po::positional_options_description positional;
+    positional.add("file", 1);
+
+    po::variables_map args;
+    try {
+        po::store(po::command_line_parser(argsc, argsv).options(description).positional(positional).run(), args);
+        if (args["help"].as<bool>()) {
+            std::cout << description << std::endl;
+            return 0;
+        }
+        po::notify(args);
+    }
+    catch (po::error &e) {
+        std::cerr << "ERROR\t" << e.what() << std::endl << std::endl;
+        std::cerr << "INFO\tFor help, use the -h option." << std::endl << std::endl;
+        return 1;
+    }
+    if (path.empty()) {
+        std::cerr << "ERROR\tNo recording given." << std::endl;
+        return 1;
+    }
+
+    RecordingReader reader;
+    if (!reader.open(path)) return 1;
+
+    if (list || column_name.empty()) {
+        std::cout << "column,type,width" << std::endl;
+        for (const recording::ColumnInfo &c : reader.getColumns()) {
+            std::cout << c.name << "," << typeName(c.type) << "," << c.width << std::endl;
+        }
+        uint64_t rows = 0;
+        for (const RecordingChunk &c : reader.getChunks()) rows += c.rows;
+        std::cerr << "INFO\t" << reader.getChunks().size() << " chunks, " << rows << " rows";
+        if (!reader.getChunks().empty()) {
+            std::cerr << ", " << reader.getChunks().front().minTime << "s to " << reader.getChunks().back().maxTime
+                    << "s";
+        }
+        std::cerr << std::endl;
+        return 0;
+    }
+
+    const int column = reader.findColumn(column_name);
+    if (column < 0) {
+        std::cerr << "ERROR\tNo such column, or more than one: " << column_name << std::endl;
+        return 1;
+    }
+    const recording::ColumnInfo &info = reader.getColumns()[column];
+    if (element >= info.width) {
+        std::cerr << "ERROR\t" << info.name << " has " << info.width << " values per row" << std::endl;
+        return 1;
+    }
+
+    double sum = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    if (!summary) std::cout << "timeStamp,faceId," << info.name << std::endl;
+
+    const auto start = std::chrono::steady_clock::now();
+    const ScanStats stats = reader.scan(column, from, to, face_id, stream_id, element,
+                                        [&](const double ts, const int face, const double value) {
+                                            if (summary) {
+                                                sum += value;
+                                                if (value < min) min = value;
+                                                if (value > max) max = value;
+                                            } else {
+                                                printf("%.3f,%d,%.9g\n", ts, face, value);
+                                            }
+                                        });
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (summary) {
+        std::cout << "count,mean,min,max" << std::endl;
+        if (stats.rows > 0) {
+            printf("%llu,%.9g,%.9g,%.9g\n", (unsigned long long) stats.rows, sum / stats.rows, min, max);
+        } else {
+            printf("0,,,\n");
+        }
+    }
+    fflush(stdout);
+
+    std::cerr << "INFO\tScanned " << stats.chunksScanned << " chunks (" << stats.chunksSkipped << " skipped), "
+            << stats.rows << " rows, " << stats.bytesRead << " bytes read, " << stats.bytesDecoded
+            << " bytes decoded in " << seconds * 1000 << " ms";
+    if (seconds > 0) std::cerr << " (" << stats.bytesDecoded / seconds / 1e9 << " GB/s decoded)";
+    std::cerr << std::endl;
+    return 0;
+}
@@ -0,0 +1,327 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+
+// Posts through HttpPublisher to a stand-in server on the loopback interface
+// and checks what arrives, how the sent, failed and dropped counters add up,
+// and that a server which never answers cannot hold the publisher.
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "HttpPublisher.hpp"
+
+static int failures = 0;
+
+#define CHECK(condition) \
+        do { \
+            if (!(condition)) { \
+                std::cerr << "FAIL\t" << __FILE__ << ":" << __LINE__ << ": " << #condition << std::endl; \
+                failures++; \
+            } \
+        } while (0)
+
+struct Request {
+    std::string path;
+    std::string contentType;
+    std::string body;
+};
+
+//---------------------------------------------------------------------------
+// Answers POST /ok with 200 and anything else with 500, one connection at a
+// time. While held, it reads a request and keeps the answer back until
+// release(), which keeps the publisher's worker busy.
+class StandInServer {
+
+    int mSocket;
+    uint16_t mPort;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::vector<Request> mRequests;
+    bool mHold;
+    bool mStopping;
+    std::thread mThread;
+
+public:
+
+    StandInServer() : mSocket(-1), mPort(0), mHold(false), mStopping(false) {
+        mSocket = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(addr);
+        if (mSocket < 0 || bind(mSocket, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(mSocket, 16) != 0 ||
+            getsockname(mSocket, (sockaddr *) &addr, &length) != 0) {
+            std::cerr << "ERROR\tUnable to listen on the loopback interface: " << strerror(errno) << std::endl;
+            std::exit(1);
+        }
+        mPort = ntohs(addr.sin_port);
+        mThread = std::thread(&StandInServer::run, this);
+    }
+
+    ~StandInServer() {
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            mStopping = true;
+        }
+        mCond.notify_all();
+        mThread.join();
+        close(mSocket);
+    }
+
+    std::string url(const std::string &path) const {
+        return "http://127.0.0.1:" + std::to_string(mPort) + path;
+    }
+
+    void hold() {
+        std::lock_guard<std::mutex> lg(mMutex);
+        mHold = true;
+    }
+
+    void release() {
+        {
+            std::lock_guard<std::mutex> lg(mMutex);
+            mHold = false;
+        }
+        mCond.notify_all();
+    }
+
+    // Waits up to 5 s for the server to have read count requests
+    bool waitForRequests(const size_t count) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        return mCond.wait_for(lk, std::chrono::seconds(5), [&] { return mRequests.size() >= count; });
+    }
+
+    std::vector<Request> requests() {
+        std::lock_guard<std::mutex> lg(mMutex);
+        return mRequests;
+    }
+
+private:
+
+    void run() {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lg(mMutex);
+                if (mStopping) return;
+            }
+            pollfd pfd = {mSocket, POLLIN, 0};
+            if (poll(&pfd, 1, 50) <= 0) continue;
+            const int client = accept(mSocket, nullptr, nullptr);
+            if (client < 0) continue;
+            serve(client);
+            close(client);
+        }
+    }
+
+    void serve(const int client) {
+        timeval timeout = {5, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::string data;
+        char buf[4096];
+        size_t headerEnd;
+        while ((headerEnd = data.find("\r\n\r\n")) == std::string::npos) {
+            const ssize_t n = recv(client, buf, sizeof(buf), 0);
+            if (n <= 0) return;
+            data.append(buf, n);
+        }
+        const std::string headers = data.substr(0, headerEnd);
+        const size_t contentLength = std::strtoul(header(headers, "Content-Length").c_str(), nullptr, 10);
+        while (data.size() < headerEnd + 4 + contentLength) {
+            const ssize_t n = recv(client, buf, sizeof(buf), 0);
+            if (n <= 0) return;
+            data.append(buf, n);
+        }
+
+        Request request;
+        const size_t pathBegin = headers.find(' ') + 1;
+        request.path = headers.substr(pathBegin, headers.find(' ', pathBegin) - pathBegin);
+        request.contentType = header(headers, "Content-Type");
+        request.body = data.substr(headerEnd + 4, contentLength);
+        const bool ok = request.path == "/ok";
+        {
+            std::unique_lock<std::mutex> lk(mMutex);
+            mRequests.push_back(request);
+            mCond.notify_all();
+            mCond.wait(lk, [this] { return !mHold || mStopping; });
+        }
+        const std::string response = std::string(ok ? "HTTP/1.1 200 OK" : "HTTP/1.1 500 Internal Server Error") +
+                                     "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send(client, response.data(), response.size(), MSG_NOSIGNAL);
+    }
+
+    static std::string header(const std::string &headers, const std::string &name) {
+        const std::string key = "\r\n" + name + ": ";
+        const size_t begin = headers.find(key);
+        if (begin == std::string::npos) return std::string();
+        const size_t end = headers.find("\r\n", begin + key.size());
+        return headers.substr(begin + key.size(), end - begin - key.size());
+    }
+};
+
+// A port nothing listens on
+static uint16_t closedPort() {
+    const int s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    bind(s, (sockaddr *) &addr, sizeof(addr));
+    getsockname(s, (sockaddr *) &addr, &length);
+    close(s);
+    return ntohs(addr.sin_port);
+}
+
+static void testSentAndFailed() {
+    StandInServer server;
+    HttpPublisher publisher(2, 16, OverflowPolicy::DROP_OLDEST);
+    for (int i = 0; i < 5; i++) CHECK(publisher.publish(server.url("/ok"), "n=" + std::to_string(i)));
+    CHECK(publisher.publish(server.url("/ok"), "{\"n\":5}\n", "application/x-ndjson"));
+    CHECK(publisher.publish(server.url("/fail"), "n=6"));
+    CHECK(publisher.publish(server.url("/fail"), "n=7"));
+    CHECK(publisher.publish("http://127.0.0.1:" + std::to_string(closedPort()) + "/ok", "n=8"));
+    publisher.stop();
+
+    const PublisherStats stats = publisher.getStats();
+    CHECK(stats.sent == 6);
+    CHECK(stats.failed == 3);
+    CHECK(stats.dropped == 0);
+    CHECK(stats.queueDepth == 0);
+
+    std::vector<Request> requests = server.requests();
+    CHECK(requests.size() == 8);
+    std::vector<std::string> bodies;
+    for (const Request &r : requests) {
+        bodies.push_back(r.body);
+        if (r.body == "{\"n\":5}\n") CHECK(r.contentType == "application/x-ndjson");
+        else CHECK(r.contentType == "application/x-www-form-urlencoded");
+    }
+    std::sort(bodies.begin(), bodies.end());
+    CHECK(bodies == std::vector<std::string>({"n=0", "n=1", "n=2", "n=3", "n=4", "n=6", "n=7", "{\"n\":5}\n"}));
+}
+
+// One worker held by the server and a queue of two: the posts past those
+// are handled by the overflow policy.
+static void testOverflow(const OverflowPolicy policy, const std::vector<std::string> &expected) {
+    StandInServer server;
+    server.hold();
+    HttpPublisher publisher(1, 2, policy);
+    CHECK(publisher.publish(server.url("/ok"), "n=0"));
+    CHECK(server.waitForRequests(1));
+    for (int i = 1; i <= 4; i++) {
+        const bool queued = publisher.publish(server.url("/ok"), "n=" + std::to_string(i));
+        CHECK(queued == (policy == OverflowPolicy::DROP_OLDEST || i <= 2));
+    }
+    CHECK(publisher.getStats().dropped == 2);
+    CHECK(publisher.getStats().queueDepth == 2);
+    server.release();
+    publisher.stop();
+
+    const PublisherStats stats = publisher.getStats();
+    CHECK(stats.sent == 3);
+    CHECK(stats.failed == 0);
+    CHECK(stats.dropped == 2);
+    std::vector<std::string> bodies;
+    for (const Request &r : server.requests()) bodies.push_back(r.body);
+    CHECK(bodies == expected);
+}
+
+// As above, with BLOCK: the post past the queue waits for a slot, and none is dropped
+static void testOverflowBlock() {
+    StandInServer server;
+    server.hold();
+    HttpPublisher publisher(1, 2, OverflowPolicy::BLOCK);
+    CHECK(publisher.publish(server.url("/ok"), "n=0"));
+    CHECK(server.waitForRequests(1));
+    CHECK(publisher.publish(server.url("/ok"), "n=1"));
+    CHECK(publisher.publish(server.url("/ok"), "n=2"));
+    std::atomic<bool> returned(false);
+    bool queued = false;
+    std::thread blocked([&] {
+        queued = publisher.publish(server.url("/ok"), "n=3");
+        returned = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    CHECK(!returned);
+    CHECK(publisher.getStats().queueDepth == 2);
+    server.release();
+    blocked.join();
+    CHECK(queued);
+    publisher.stop();
+
+    const PublisherStats stats = publisher.getStats();
+    CHECK(stats.sent == 4);
+    CHECK(stats.failed == 0);
+    CHECK(stats.dropped == 0);
+    std::vector<std::string> bodies;
+    for (const Request &r : server.requests()) bodies.push_back(r.body);
+    CHECK(bodies == std::vector<std::string>({"n=0", "n=1", "n=2", "n=3"}));
+}
+
+// A server that accepts and never answers: the post fails once the timeout
+// is up, and stop() does not wait for the server.
+static void testTimeout() {
+    StandInServer server;
+    server.hold();
+    const long TIMEOUT_MS = 300;
+    HttpPublisher publisher(1, 4, OverflowPolicy::DROP_NEWEST, nullptr, nullptr, TIMEOUT_MS, TIMEOUT_MS);
+    const auto start = std::chrono::steady_clock::now();
+    CHECK(publisher.publish(server.url("/ok"), "n=0"));
+    CHECK(server.waitForRequests(1));
+    publisher.stop();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    CHECK(elapsed < std::chrono::milliseconds(TIMEOUT_MS + 1000));
+
+    const PublisherStats stats = publisher.getStats();
+    CHECK(stats.sent == 0);
+    CHECK(stats.failed == 1);
+    server.release();
+}
+
+int main() {
+    testSentAndFailed();
+    testOverflow(OverflowPolicy::DROP_NEWEST, {"n=0", "n=1", "n=2"});
+    testOverflow(OverflowPolicy::DROP_OLDEST, {"n=0", "n=3", "n=4"});
+    testOverflowBlock();
+    testTimeout();
+    if (failures > 0) {
+        std::cerr << "ERROR\t" << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cerr << "INFO\tAll checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,155 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+// Scrapes MetricsServer over the loopback interface: which paths it answers
+// and how long a slow client can hold the next scrape up.
+
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "MetricsServer.hpp"
+
+static int failures = 0;
+
+#define CHECK(condition) \
+        do { \
+            if (!(condition)) { \
+                std::cerr << "FAIL\t" << __FILE__ << ":" << __LINE__ << ": " << #condition << std::endl; \
+                failures++; \
+            } \
+        } while (0)
+
+// A port free at the time of the call
+static uint16_t freePort() {
+    const int s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    bind(s, (sockaddr *) &addr, sizeof(addr));
+    getsockname(s, (sockaddr *) &addr, &length);
+    close(s);
+    return ntohs(addr.sin_port);
+}
+
+static int connectTo(const uint16_t port) {
+    const int s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(s, (sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+// Sends the request line and returns the whole response
+static std::string get(const uint16_t port, const std::string &target) {
+    const int s = connectTo(port);
+    if (s < 0) return std::string();
+    const std::string request = "GET " + target + " HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    send(s, request.data(), request.size(), MSG_NOSIGNAL);
+    std::string response;
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(s, buf, sizeof(buf), 0)) > 0) response.append(buf, n);
+    close(s);
+    return response;
+}
+
+static bool startsWith(const std::string &s, const std::string &prefix) {
+    return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+static void collect(MetricsWriter &w) {
+    w.counter("emotions_test_total", "Test counter.", 42);
+}
+
+static void testPaths() {
+    const uint16_t port = freePort();
+    MetricsServer server("127.0.0.1", port);
+    CHECK(server.start(collect));
+
+    std::string response = get(port, "/metrics");
+    CHECK(startsWith(response, "HTTP/1.1 200 OK\r\n"));
+    CHECK(response.find("\nemotions_test_total 42\n") != std::string::npos);
+
+    // Prometheus adds parameters to the path
+    response = get(port, "/metrics?name[]=emotions_test_total");
+    CHECK(startsWith(response, "HTTP/1.1 200 OK\r\n"));
+    CHECK(response.find("\nemotions_test_total 42\n") != std::string::npos);
+
+    CHECK(startsWith(get(port, "/"), "HTTP/1.1 404 Not Found\r\n"));
+    CHECK(startsWith(get(port, "/metricsx"), "HTTP/1.1 404 Not Found\r\n"));
+    CHECK(server.getScrapes() == 2);
+    server.stop();
+}
+
+// A client trickling its request line one byte at a time must not keep a
+// scrape behind it waiting for longer than the time allowed per request
+static void testSlowClient() {
+    const uint16_t port = freePort();
+    MetricsServer server("127.0.0.1", port);
+    CHECK(server.start(collect));
+
+    std::atomic<bool> stop(false);
+    std::thread slow([port, &stop] {
+        const int s = connectTo(port);
+        const std::string request = "GET /metrics HTTP/1.1\r\n";
+        for (size_t i = 0; i < request.size() && !stop; i++) {
+            if (send(s, request.data() + i, 1, MSG_NOSIGNAL) <= 0) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+        close(s);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    const auto start = std::chrono::steady_clock::now();
+    const std::string response = get(port, "/metrics");
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    CHECK(startsWith(response, "HTTP/1.1 200 OK\r\n"));
+    CHECK(seconds < 2.0);
+    stop = true;
+    slow.join();
+    server.stop();
+}
+
+int main() {
+    testPaths();
+    testSlowClient();
+    if (failures > 0) {
+        std::cerr << "ERROR\t" << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cerr << "INFO\tAll checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,260 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+// Encodes and decodes columns with the recording codecs, then writes faces
+// with FaceRecorder and reads them back with RecordingReader: every value of
+// a one-value and of a multi-value column, a file whose index was never
+// written, and a scan of a time range of one face.
+
+#include <iostream>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Face.h"
+
+#include "FaceRecorder.hpp"
+#include "RecordingReader.hpp"
+
+static int failures = 0;
+
+#define CHECK(condition) \
+        do { \
+            if (!(condition)) { \
+                std::cerr << "FAIL\t" << __FILE__ << ":" << __LINE__ << ": " << #condition << std::endl; \
+                failures++; \
+            } \
+        } while (0)
+
+const int FRAMES = 1000;
+const uint32_t ROWS_PER_CHUNK = 256;
+const uint16_t POINTS = 34;
+
+// What was written, one entry per row
+struct Row {
+    double timeStamp;
+    int faceId;
+    float joy;
+    float x[POINTS];
+};
+
+static bool sameFloat(const float a, const float b) {
+    return std::memcmp(&a, &b, sizeof(a)) == 0;    // NaNs included
+}
+
+// count values of a type, a row being stride of them, through the encoder and back
+template<typename T>
+static uint8_t roundTrip(const std::vector<T> &values, const size_t stride) {
+    recording::ColumnEncoder encoder;
+    recording::ColumnDecoder decoder;
+    std::string encoded;
+    const uint8_t codec = encoder.encode((const char *) values.data(), values.size(), sizeof(T), stride, encoded);
+    std::vector<T> decoded(values.size());
+    CHECK(decoder.decode(codec, encoded.data(), encoded.size(), values.size(), sizeof(T), stride,
+                         (char *) decoded.data()));
+    CHECK(std::memcmp(decoded.data(), values.data(), values.size() * sizeof(T)) == 0);
+    return codec;
+}
+
+static void testCodec() {
+    std::mt19937 rng(5);
+    std::normal_distribution<float> noise(0, 0.01f);
+    std::vector<float> slow(4096), rows(4096), random(4096);
+    std::vector<double> times(4096);
+    float value = 50;
+    for (size_t i = 0; i < slow.size(); i++) {
+        value += noise(rng);
+        slow[i] = i % 3 == 0 ? value : std::round(value);
+        rows[i] = 100.0f + (float) (i % POINTS) * 3 + (i / POINTS) * 0.001f;
+        const uint32_t bits = (uint32_t) rng();
+        std::memcpy(&random[i], &bits, sizeof(bits));    // nothing to compress
+        times[i] = i / 30.0;
+    }
+    CHECK(roundTrip(slow, 1) == recording::XOR_SHUFFLE_DEFLATE);
+    CHECK(roundTrip(rows, POINTS) == recording::XOR_SHUFFLE_DEFLATE);
+    CHECK(roundTrip(times, 1) == recording::XOR_SHUFFLE_DEFLATE);
+    CHECK(roundTrip(random, 1) == recording::RAW);
+    CHECK(roundTrip(std::vector<float>(1000, 7.0f), 1) == recording::XOR_SHUFFLE_DEFLATE);
+    roundTrip(std::vector<float>(3, 1.0f), 1);
+}
+
+// Face 0 has every point, face 1 only the first ten: the others are NaN
+static std::vector<Row> writeRecording(const std::string &path) {
+    std::vector<Row> rows;
+    FaceRecorder recorder(path, ROWS_PER_CHUNK, POINTS);
+    CHECK(recorder.isOpened());
+    std::map<FaceId, Face> faces;
+    for (int id = 0; id < 2; id++) {
+        Face f;
+        std::memset(&f.emotions, 0, sizeof(f.emotions));
+        std::memset(&f.expressions, 0, sizeof(f.expressions));
+        std::memset(&f.emojis, 0, sizeof(f.emojis));
+        std::memset(&f.measurements, 0, sizeof(f.measurements));
+        f.id = id;
+        f.emojis.dominantEmoji = Emoji::Unknown;
+        f.featurePoints.resize(id == 0 ? POINTS : 10);
+        faces[id] = f;
+    }
+    for (int i = 0; i < FRAMES; i++) {
+        const double timeStamp = i / 30.0;
+        for (auto &face_id_pair : faces) {
+            Face &f = face_id_pair.second;
+            Row row;
+            row.timeStamp = timeStamp;
+            row.faceId = f.id;
+            f.emotions.joy = row.joy = 50 + 40 * (float) std::sin(i * 0.01 + f.id);
+            for (size_t k = 0; k < POINTS; k++) {
+                const bool known = k < f.featurePoints.size();
+                row.x[k] = known ? 200 + k * 3 + 0.5f * (float) std::sin(i * 0.1 + k) : NAN;
+                if (known) {
+                    f.featurePoints[k].x = row.x[k];
+                    f.featurePoints[k].y = 100.0f + k;
+                }
+            }
+            rows.push_back(row);
+        }
+        recorder.write(faces, timeStamp);
+    }
+    recorder.close();
+    const RecorderStats stats = recorder.getStats();
+    CHECK(stats.rows == rows.size());
+    CHECK(stats.chunks == (rows.size() + ROWS_PER_CHUNK - 1) / ROWS_PER_CHUNK);
+    CHECK(stats.fileBytes < stats.rawBytes);
+    return rows;
+}
+
+// Every value of the timeStamp, faceId, joy and points.x columns, chunk by chunk
+static void checkColumns(RecordingReader &reader, const std::vector<Row> &rows) {
+    const int time = reader.findColumn("timeStamp");
+    const int face = reader.findColumn("faceId");
+    const int joy = reader.findColumn("joy");
+    const int x = reader.findColumn("points.x");
+    CHECK(time >= 0 && face >= 0 && joy >= 0 && x >= 0);
+    if (time < 0 || face < 0 || joy < 0 || x < 0) return;
+    CHECK(reader.getColumns()[x].width == POINTS);
+    CHECK(reader.getChunks().size() == (rows.size() + ROWS_PER_CHUNK - 1) / ROWS_PER_CHUNK);
+
+    std::vector<char> times, faces, joys, xs;
+    size_t first = 0;
+    int mismatches = 0;
+    for (size_t k = 0; k < reader.getChunks().size(); k++) {
+        const RecordingChunk &c = reader.getChunks()[k];
+        CHECK(reader.readColumn(k, time, times) && reader.readColumn(k, face, faces) &&
+              reader.readColumn(k, joy, joys) && reader.readColumn(k, x, xs));
+        CHECK(c.minTime == rows[first].timeStamp && c.maxTime == rows[first + c.rows - 1].timeStamp);
+        for (size_t r = 0; r < c.rows; r++) {
+            const Row &expected = rows[first + r];
+            if (recording::valueAt(recording::F64, times.data(), r) != expected.timeStamp ||
+                recording::valueAt(recording::I32, faces.data(), r) != expected.faceId ||
+                !sameFloat((float) recording::valueAt(recording::F32, joys.data(), r), expected.joy)) {
+                mismatches++;
+            }
+            for (size_t p = 0; p < POINTS; p++) {
+                const float value = (float) recording::valueAt(recording::F32, xs.data(), r * POINTS + p);
+                if (!sameFloat(value, expected.x[p])) mismatches++;
+            }
+        }
+        first += c.rows;
+    }
+    CHECK(first == rows.size());
+    CHECK(mismatches == 0);
+}
+
+static void testRoundTrip(const std::string &path) {
+    const std::vector<Row> rows = writeRecording(path);
+    RecordingReader reader;
+    CHECK(reader.open(path));
+    CHECK(reader.isIndexed());
+    checkColumns(reader, rows);
+}
+
+// The writer stopped before the index: the file ends in the middle of it
+static void testNoIndex(const std::string &path) {
+    const std::vector<Row> rows = writeRecording(path);
+    std::string data;
+    {
+        std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    uint64_t indexOffset = 0;
+    std::memcpy(&indexOffset, data.data() + data.size() - 12, sizeof(indexOffset));
+    CHECK(indexOffset < data.size());
+    {
+        std::ofstream out(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        out.write(data.data(), (std::streamsize) (indexOffset + 10));
+    }
+    RecordingReader reader;
+    CHECK(reader.open(path));
+    CHECK(!reader.isIndexed());
+    checkColumns(reader, rows);
+}
+
+// 5 s of face 1 from the middle: only the chunks holding them are read
+static void testRangeScan(const std::string &path) {
+    const std::vector<Row> rows = writeRecording(path);
+    RecordingReader reader;
+    CHECK(reader.open(path));
+    const double from = 10, to = 15;
+    std::vector<const Row *> expected;
+    for (const Row &row : rows) {
+        if (row.faceId == 1 && row.timeStamp >= from && row.timeStamp <= to) expected.push_back(&row);
+    }
+
+    size_t next = 0;
+    int mismatches = 0;
+    const ScanStats stats = reader.scan(reader.findColumn("joy"), from, to, 1, -1, 0,
+                                        [&](const double timeStamp, const int faceId, const double value) {
+        if (next >= expected.size() || timeStamp != expected[next]->timeStamp || faceId != 1 ||
+            !sameFloat((float) value, expected[next]->joy)) {
+            mismatches++;
+        }
+        next++;
+    });
+    CHECK(mismatches == 0);
+    CHECK(stats.rows == expected.size());
+    CHECK(stats.chunksScanned == 2);
+    CHECK(stats.chunksSkipped == reader.getChunks().size() - 2);
+
+    // One element of the multi-value column, where face 1 has no point
+    int nans = 0;
+    reader.scan(reader.findColumn("points.x"), from, to, 1, -1, POINTS - 1, [&nans](double, int, double value) {
+        if (std::isnan(value)) nans++;
+    });
+    CHECK(nans == (int) expected.size());
+}
+
+int main() {
+    const std::string path = "recording-test.emjr";
+    testCodec();
+    testRoundTrip(path);
+    testNoIndex(path);
+    testRangeScan(path);
+    std::remove(path.c_str());
+    if (failures > 0) {
+        std::cerr << "ERROR\t" << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cerr << "INFO\tAll checks passed" << std::endl;
+    return 0;
+}
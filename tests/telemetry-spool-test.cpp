@@ -0,0 +1,203 @@
+// emotions-app
+//
+// Copyright (C) 2017 Daniele Liciotti
+//
+// Authors: Daniele Liciotti <danielelic@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 3 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see: http://www.gnu.org/licenses/gpl-3.0.txt
+
+// Appends to a TelemetrySpool in a temporary directory, reopens it as a
+// restarted process would, and checks what is recovered: the pending posts
+// in order, a torn last record cut off, acked posts not sent again, sequence
+// numbers that keep increasing, and the posts evicted beyond maxBytes.
+
+#include <iostream>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#include "TelemetrySpool.hpp"
+
+static int failures = 0;
+
+#define CHECK(condition) \
+        do { \
+            if (!(condition)) { \
+                std::cerr << "FAIL\t" << __FILE__ << ":" << __LINE__ << ": " << #condition << std::endl; \
+                failures++; \
+            } \
+        } while (0)
+
+namespace fs = boost::filesystem;
+
+// A spool directory removed with the object
+struct TempDir {
+    fs::path path;
+
+    TempDir() : path(fs::temp_directory_path() / fs::unique_path("telemetry-spool-test-%%%%-%%%%")) {
+    }
+
+    ~TempDir() {
+        boost::system::error_code ec;
+        fs::remove_all(path, ec);
+    }
+};
+
+static std::unique_ptr<TelemetrySpool> openSpool(const TempDir &dir, const uint64_t segmentBytes = 4096,
+                                                 const uint64_t maxBytes = 1 << 20) {
+    SpoolOptions options;
+    options.directory = dir.path.string();
+    options.segmentBytes = segmentBytes;
+    options.maxBytes = maxBytes;
+    std::unique_ptr<TelemetrySpool> spool(new TelemetrySpool(options));
+    CHECK(spool->open());
+    return spool;
+}
+
+static bool append(TelemetrySpool &spool, const std::string &body) {
+    return spool.append("http://127.0.0.1/ok", body, "application/x-ndjson", "gzip", 1.5f, 2.5f);
+}
+
+// The sequence numbers next() and ack() go through, acking each when ack is set
+static std::vector<uint64_t> drain(TelemetrySpool &spool, const bool ack) {
+    std::vector<uint64_t> sequences;
+    SpoolRecord record;
+    while (spool.next(record, std::chrono::milliseconds(10))) {
+        sequences.push_back(record.sequence);
+        if (!ack) break;
+        spool.ack(record.sequence);
+    }
+    return sequences;
+}
+
+static void testRecovery() {
+    TempDir dir;
+    {
+        std::unique_ptr<TelemetrySpool> spool = openSpool(dir);
+        for (int i = 0; i < 5; i++) CHECK(append(*spool, "body " + std::to_string(i)));
+        CHECK(spool->getStats().pending == 5);
+    }
+    std::unique_ptr<TelemetrySpool> spool = openSpool(dir);
+    SpoolStats stats = spool->getStats();
+    CHECK(stats.recovered == 5);
+    CHECK(stats.pending == 5);
+    SpoolRecord record;
+    for (int i = 0; i < 5; i++) {
+        CHECK(spool->next(record, std::chrono::milliseconds(10)));
+        CHECK(record.sequence == (uint64_t) i + 1);
+        CHECK(record.url == "http://127.0.0.1/ok");
+        CHECK(record.body == "body " + std::to_string(i));
+        CHECK(record.contentType == "application/x-ndjson");
+        CHECK(record.contentEncoding == "gzip");
+        CHECK(record.firstFrame == 1.5f && record.lastFrame == 2.5f);
+        spool->ack(record.sequence);
+    }
+    CHECK(!spool->next(record, std::chrono::milliseconds(10)));
+    CHECK(append(*spool, "after the restart"));
+    CHECK(spool->next(record, std::chrono::milliseconds(10)));
+    CHECK(record.sequence == 6);
+}
+
+// A crash in the middle of the last append: its CRC no longer matches
+static void testTornWrite() {
+    TempDir dir;
+    {
+        std::unique_ptr<TelemetrySpool> spool = openSpool(dir);
+        CHECK(append(*spool, "first"));
+        CHECK(append(*spool, "second"));
+        CHECK(append(*spool, "torn record"));
+    }
+    std::vector<fs::path> segments;
+    for (fs::directory_iterator it(dir.path), end; it != end; ++it) {
+        if (it->path().extension() == ".spool") segments.push_back(it->path());
+    }
+    CHECK(segments.size() == 1);
+    if (segments.size() != 1) return;
+    {
+        std::fstream file(segments[0].string().c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        const std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        const size_t torn = data.find("torn record");
+        CHECK(torn != std::string::npos);
+        file.clear();
+        file.seekp((std::streamoff) torn);
+        file.put('T');
+    }
+
+    std::unique_ptr<TelemetrySpool> spool = openSpool(dir);
+    CHECK(spool->getStats().recovered == 2);
+    SpoolRecord record;
+    CHECK(spool->next(record, std::chrono::milliseconds(10)));
+    CHECK(record.body == "first");
+    CHECK(drain(*spool, true) == std::vector<uint64_t>({1, 2}));
+}
+
+// Acked posts are not sent again after a restart, and new ones follow them
+static void testAcked() {
+    TempDir dir;
+    {
+        std::unique_ptr<TelemetrySpool> spool = openSpool(dir);
+        for (int i = 0; i < 4; i++) CHECK(append(*spool, "body " + std::to_string(i)));
+        SpoolRecord record;
+        for (int i = 0; i < 2; i++) {
+            CHECK(spool->next(record, std::chrono::milliseconds(10)));
+            spool->ack(record.sequence);
+        }
+        CHECK(spool->getStats().acked == 2);
+    }
+    {
+        std::unique_ptr<TelemetrySpool> spool = openSpool(dir);
+        CHECK(spool->getStats().recovered == 2);
+        CHECK(drain(*spool, true) == std::vector<uint64_t>({3, 4}));
+    }
+    std::unique_ptr<TelemetrySpool> spool = openSpool(dir);
+    CHECK(spool->getStats().recovered == 0);
+    CHECK(append(*spool, "after two restarts"));
+    CHECK(drain(*spool, true) == std::vector<uint64_t>({5}));
+}
+
+// Segments of four records and room for two: the third evicts the first, unsent
+static void testEviction() {
+    TempDir dir;
+    const uint64_t SEGMENT_BYTES = 1024;
+    std::unique_ptr<TelemetrySpool> spool = openSpool(dir, SEGMENT_BYTES, 2 * SEGMENT_BYTES);
+    const std::string body(160, 'x');    // 248 bytes with its header and fields
+    for (int i = 0; i < 12; i++) CHECK(append(*spool, body));
+    SpoolStats stats = spool->getStats();
+    CHECK(stats.appended == 12);
+    CHECK(stats.evicted == 4);
+    CHECK(stats.pending == 8);
+    CHECK(stats.diskBytes <= 2 * SEGMENT_BYTES);
+    std::vector<uint64_t> sequences = drain(*spool, true);
+    CHECK(sequences.size() == 8);
+    CHECK(!sequences.empty() && sequences.front() == 5 && sequences.back() == 12);
+
+    CHECK(!append(*spool, std::string(SEGMENT_BYTES, 'x')));
+    CHECK(spool->getStats().rejected == 1);
+}
+
+int main() {
+    testRecovery();
+    testTornWrite();
+    testAcked();
+    testEviction();
+    if (failures > 0) {
+        std::cerr << "ERROR\t" << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cerr << "INFO\tAll checks passed" << std::endl;
+    return 0;
+}